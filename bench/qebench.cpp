@@ -0,0 +1,470 @@
+/******************************************************************************
+** QE - qebench.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+// Throughput benchmarks for loading, saving, the OS/2 codecs, and search and
+// replace.  See qebench.pro for how to build and run them.
+//
+// The test files ("corpora") are generated on first use, in the directory
+// named by QE_BENCH_DIR (or qebench under the system temporary directory),
+// and kept for later runs.  QE_BENCH_SIZES lists the sizes to generate, in
+// MB (default "1,16"); e.g. "1,16,256,1024" for the full set.  Each corpus
+// is made of randomly chosen lines of one kind of text, each line with an
+// "id=" number, and ends with a line containing END_MARKER.
+//
+// Results are named <benchmark>:<corpus>/<size>, so QTestLib's XML output
+// (-xml) can be compared directly between releases.
+//
+
+#include <QtTest>
+#include <QtGui>
+#include "mainwindow.h"
+#include "threads.h"
+#include "os2codec.h"
+#include "fileview.h"
+
+
+#define END_MARKER          "QEBENCH-END-MARKER"
+#define DEFAULT_SIZES       "1,16"
+#define LONG_LINE_MIN       0x100000    // lengths of the lines in the long-line corpus
+#define LONG_LINE_MAX       0x800000
+#define CODEC_SAMPLE_SIZE   0x100000
+
+
+// ============================================================================
+// Corpus
+//
+// One kind of test file: the encoding it's written in, and the lines it's
+// made of.  {n} in a line is replaced by a random number.
+//
+
+struct Corpus
+{
+    const char *name;
+    const char *encoding;       // as known to QE (see Codepage_Mappings)
+    const char *lines[ 6 ];
+};
+
+static const Corpus corpora[] = {
+    { "ascii-log", "UTF-8", {
+        "2018-01-05 22:44:{n} [worker-{n}] INFO  request id={n} handled in {n} ms",
+        "2018-01-05 22:44:{n} [worker-{n}] DEBUG cache lookup id={n} hit=true size={n}",
+        "2018-01-05 22:44:{n} [worker-{n}] WARN  slow query id={n} took {n} ms: SELECT * FROM items WHERE owner = {n}",
+        "2018-01-05 22:44:{n} [worker-{n}] ERROR connection id={n} reset by peer (errno {n})",
+        0 }},
+    { "utf8", "UTF-8", {
+        "\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82, \xD0\xBC\xD0\xB8\xD1\x80! id={n} \xCE\x9A\xCE\xB1\xCE\xBB\xCE\xB7\xCE\xBC\xCE\xAD\xCF\x81\xCE\xB1 \xCE\xBA\xCF\x8C\xCF\x83\xCE\xBC\xCE\xB5",
+        "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E\xE3\x81\xAE\xE3\x83\x86\xE3\x82\xAD\xE3\x82\xB9\xE3\x83\x88 id={n} \xED\x95\x9C\xEA\xB5\xAD\xEC\x96\xB4 \xE4\xB8\xAD\xE6\x96\x87 {n}",
+        "Stra\xC3\x9F" "e, na\xC3\xAFve caf\xC3\xA9 id={n} \xF0\x9F\x98\x80\xF0\x9F\x9A\x80 \xE2\x82\xAC{n}",
+        "\xD7\xA9\xD7\x9C\xD7\x95\xD7\x9D id={n} \xD9\x85\xD8\xB1\xD8\xAD\xD8\xA8\xD8\xA7 {n} \xE0\xA4\xA8\xE0\xA4\xAE\xE0\xA4\xB8\xE0\xA5\x8D\xE0\xA4\xA4\xE0\xA5\x87",
+        0 }},
+    { "cp850", "IBM-850", {
+        "Gr\xC3\xBC\xC3\x9F" "e aus M\xC3\xBCnchen id={n}, \xC3\xA0 bient\xC3\xB4t \xC3\xA7" "a va {n}",
+        "Se\xC3\xB1or Mu\xC3\xB1oz pag\xC3\xB3 {n} \xC2\xA3 id={n} \xC2\xBD \xC2\xB1{n}",
+        "\xE2\x94\x82 total id={n} \xE2\x94\x82 {n} \xE2\x94\x82 \xC3\x86\xC3\x98\xC3\x85 \xE2\x94\x82",
+        0 }},
+    { "cp437", "IBM-437", {
+        "\xE2\x95\x94\xE2\x95\x90\xE2\x95\x90\xE2\x95\x97 id={n} \xE2\x96\x91\xE2\x96\x92\xE2\x96\x93 {n} \xE2\x95\x9A\xE2\x95\x90\xE2\x95\x9D",
+        "\xC3\x89t\xC3\xA9 \xC3\xA0 Gen\xC3\xA8ve id={n}: {n}\xC2\xB0 \xCE\xB1\xCE\xB2 \xE2\x88\x9E",
+        "Men\xC3\xBC {n} \xC2\xA5 id={n} \xE2\x94\x80\xE2\x94\x80\xE2\x94\xBC\xE2\x94\x80\xE2\x94\x80",
+        0 }},
+    { "shift-jis", "Shift-JIS", {
+        "\xE3\x81\x93\xE3\x82\x8C\xE3\x81\xAF\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E\xE3\x81\xAE\xE6\x96\x87\xE7\xAB\xA0\xE3\x81\xA7\xE3\x81\x99 id={n}",
+        "\xE3\x82\xAB\xE3\x82\xBF\xE3\x82\xAB\xE3\x83\x8A\xE3\x81\xA8\xE6\xBC\xA2\xE5\xAD\x97 {n} id={n} \xEF\xBD\xB6\xEF\xBE\x80\xEF\xBD\xB6\xEF\xBE\x85",
+        "\xE6\x9D\xB1\xE4\xBA\xAC\xE9\x83\xBD\xE5\x8D\x83\xE4\xBB\xA3\xE7\x94\xB0\xE5\x8C\xBA {n}\xE7\x95\xAA\xE5\x9C\xB0 id={n}",
+        0 }},
+    { "long-lines", "UTF-8", {
+        "{\"id={n}\":[{n},{n},{n}],\"name\":\"item {n}\",\"tags\":[\"a\",\"b\"]},",
+        "<td class=\"c{n}\">id={n}</td><td>{n}</td>",
+        0 }}
+};
+
+#define NUM_CORPORA  ((int)( sizeof( corpora ) / sizeof( corpora[ 0 ] )))
+
+
+// ============================================================================
+// QeBenchmark
+//
+
+class QeBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void load_data();
+    void load();
+    void save_data();
+    void save();
+    void codecRoundTrip_data();
+    void codecRoundTrip();
+    void findNext_data();
+    void findNext();
+    void findNextRegExp_data();
+    void findNextRegExp();
+    void replaceAll_data();
+    void replaceAll();
+    void replaceAllRegExp_data();
+    void replaceAllRegExp();
+
+private:
+    void        addCorpusRows( qint64 sizeLimit = -1 );
+    QString     corpusFile( int corpus, int megabytes );
+    bool        generate( const QString &fileName, int corpus, qint64 size );
+    QString     readText( const QString &fileName, QTextCodec *codec );
+    MainWindow *openWindow( const QString &fileName, const QString &encoding );
+
+    QDir        dir;
+    QList<int>  sizes;
+    MainWindow *window;         // used by each search benchmark
+};
+
+
+// ----------------------------------------------------------------------------
+void QeBenchmark::initTestCase()
+{
+    QByteArray path = qgetenv("QE_BENCH_DIR");
+    dir = QDir( path.isEmpty() ? QDir::temp().filePath("qebench") : QFile::decodeName( path ));
+    QVERIFY( dir.mkpath(".") );
+
+    QByteArray list = qgetenv("QE_BENCH_SIZES");
+    QStringList items = QString::fromLatin1( list.isEmpty() ? DEFAULT_SIZES : list.constData() ).split(',', QString::SkipEmptyParts );
+    for ( int i = 0; i < items.size(); i++ ) {
+        int megabytes = items.at( i ).trimmed().toInt();
+        if ( megabytes > 0 )
+            sizes << megabytes;
+    }
+    QVERIFY( !sizes.isEmpty() );
+
+    window = new MainWindow;
+}
+
+
+void QeBenchmark::cleanupTestCase()
+{
+    delete window;
+}
+
+
+// ----------------------------------------------------------------------------
+// Add a row for every corpus in every size (up to sizeLimit bytes, if given).
+// Each row has the file name and its encoding.
+//
+void QeBenchmark::addCorpusRows( qint64 sizeLimit )
+{
+    QTest::addColumn<QString>("fileName");
+    QTest::addColumn<QString>("encoding");
+    for ( int c = 0; c < NUM_CORPORA; c++ ) {
+        for ( int s = 0; s < sizes.size(); s++ ) {
+            if (( sizeLimit >= 0 ) && (((qint64) sizes.at( s ) << 20 ) >= sizeLimit ))
+                continue;
+            QString tag = QString("%1/%2MB").arg( corpora[ c ].name ).arg( sizes.at( s ));
+            QTest::newRow( tag.toLatin1().constData() ) << corpusFile( c, sizes.at( s ))
+                                                        << QString( corpora[ c ].encoding );
+        }
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the name of the given corpus file, generating it if it's not there.
+//
+QString QeBenchmark::corpusFile( int corpus, int megabytes )
+{
+    QString fileName = dir.filePath( QString("%1-%2MB.txt").arg( corpora[ corpus ].name ).arg( megabytes ));
+    qint64 size = (qint64) megabytes << 20;
+    QFileInfo info( fileName );
+    if ( !info.exists() || ( info.size() < size )) {
+        if ( !generate( fileName, corpus, size ))
+            qWarning("Could not create %s", qPrintable( fileName ));
+    }
+    return fileName;
+}
+
+
+// ----------------------------------------------------------------------------
+// Write at least size bytes of the corpus to a file.  The random numbers are
+// from a fixed seed, so the same corpus always has the same contents.
+//
+bool QeBenchmark::generate( const QString &fileName, int corpus, qint64 size )
+{
+    const Corpus &c = corpora[ corpus ];
+    QTextCodec *codec = QeOS2Codec::codecForName( c.encoding );
+    if ( !codec )
+        return false;
+    bool longLines = !strcmp( c.name, "long-lines");
+
+    QStringList lines;
+    for ( int i = 0; c.lines[ i ]; i++ )
+        lines << QString::fromUtf8( c.lines[ i ] );
+
+    QFile file( fileName );
+    if ( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ))
+        return false;
+
+    qsrand( 1 + corpus );
+    qint64 written = 0;
+    qint64 lineEnd = longLines ? LONG_LINE_MIN + qrand() % ( LONG_LINE_MAX - LONG_LINE_MIN ) : 0;
+    QString text;
+    while ( written < size ) {
+        // Build up about a block's worth of text before encoding it
+        text.clear();
+        while ( text.size() < FILE_CHUNK_SIZE / 4 ) {
+            QString line = lines.at( qrand() % lines.size() );
+            int n;
+            while (( n = line.indexOf("{n}")) >= 0 )
+                line.replace( n, 3, QString::number( qrand() % 100000 ));
+            text += line;
+            if ( !longLines )
+                text += QLatin1Char('\n');
+        }
+        QByteArray bytes = codec->fromUnicode( text );
+        if ( longLines ) {
+            // Break the run of records into lines of a few MB each
+            while ( written + bytes.size() > lineEnd ) {
+                int at = (int)( lineEnd - written );
+                bytes.insert( at, '\n');
+                lineEnd += 1 + LONG_LINE_MIN + qrand() % ( LONG_LINE_MAX - LONG_LINE_MIN );
+            }
+        }
+        if ( file.write( bytes ) != bytes.size() )
+            return false;
+        written += bytes.size();
+    }
+    QByteArray marker = codec->fromUnicode( QString("\n" END_MARKER "\n"));
+    return ( file.write( marker ) == marker.size() );
+}
+
+
+// ----------------------------------------------------------------------------
+QString QeBenchmark::readText( const QString &fileName, QTextCodec *codec )
+{
+    QFile file( fileName );
+    if ( !file.open( QIODevice::ReadOnly ))
+        return QString();
+    return codec->toUnicode( file.readAll() );
+}
+
+
+// ----------------------------------------------------------------------------
+// Load a file into the main window, with the given encoding, and wait until
+// it's finished.
+//
+MainWindow *QeBenchmark::openWindow( const QString &fileName, const QString &encoding )
+{
+    window->openAsEncoding( fileName, false, encoding );
+    while ( !window->menuBar()->isEnabled() )
+        QTest::qWait( 10 );
+    return window;
+}
+
+
+// ----------------------------------------------------------------------------
+// QeOpenThread, from file to finished document.
+//
+void QeBenchmark::load_data()
+{
+    addCorpusRows();
+}
+
+
+void QeBenchmark::load()
+{
+    QFETCH( QString, fileName );
+    QFETCH( QString, encoding );
+    QTextCodec *codec = QeOS2Codec::codecForName( encoding.toLatin1() );
+    QVERIFY( codec != 0 );
+
+    QeOpenThread thread;
+    QTextDocument *document = 0;
+    QBENCHMARK_ONCE {
+        QFile *file = new QFile( fileName );
+        QVERIFY( file->open( QIODevice::ReadOnly | QFile::Text ));
+        thread.setFile( file, codec, fileName );
+        thread.setDocumentDefaults( QFont(), QTextOption() );
+        thread.start();
+        thread.wait();
+        document = thread.takeDocument();
+    }
+    QVERIFY( document != 0 );
+    QVERIFY( document->lastBlock().text() == END_MARKER ||
+             document->lastBlock().previous().text() == END_MARKER );
+    delete document;
+}
+
+
+// ----------------------------------------------------------------------------
+// QeSaveThread, from text to file.
+//
+void QeBenchmark::save_data()
+{
+    addCorpusRows();
+}
+
+
+void QeBenchmark::save()
+{
+    QFETCH( QString, fileName );
+    QFETCH( QString, encoding );
+    QTextCodec *codec = QeOS2Codec::codecForName( encoding.toLatin1() );
+    QVERIFY( codec != 0 );
+
+    QString text = readText( fileName, codec );
+    QString outputName = dir.filePath("save.out");
+    QeSaveThread thread;
+    QBENCHMARK_ONCE {
+        QFile *file = new QFile( outputName );
+        QVERIFY( file->open( QIODevice::ReadWrite | QIODevice::Truncate | QFile::Text ));
+        thread.setFile( file, codec, outputName, true );
+        thread.setText( text );
+        thread.start();
+        thread.wait();
+    }
+    QVERIFY( QFileInfo( outputName ).size() > 0 );
+    QFile::remove( outputName );
+}
+
+
+// ----------------------------------------------------------------------------
+// QeOS2Codec, decoding and re-encoding a sample of every byte value.
+//
+void QeBenchmark::codecRoundTrip_data()
+{
+    QTest::addColumn<int>("codec");
+    QTest::newRow("IBM-437")  << (int) QeOS2Codec::IBM437;
+    QTest::newRow("IBM-852")  << (int) QeOS2Codec::IBM852;
+    QTest::newRow("IBM-867")  << (int) QeOS2Codec::IBM867;
+    QTest::newRow("IBM-1125") << (int) QeOS2Codec::IBM1125;
+    QTest::newRow("MEMJA")    << (int) QeOS2Codec::MEMJA;
+}
+
+
+void QeBenchmark::codecRoundTrip()
+{
+    QFETCH( int, codec );
+    QeOS2Codec os2Codec( codec );
+
+    QByteArray bytes( CODEC_SAMPLE_SIZE, 0 );
+    qsrand( 1 );
+    for ( int i = 0; i < bytes.size(); i++ )
+        bytes[ i ] = (char)( 32 + qrand() % 224 );
+
+    QString text;
+    QByteArray encoded;
+    QBENCHMARK {
+        text    = os2Codec.toUnicode( bytes );
+        encoded = os2Codec.fromUnicode( text );
+    }
+    QCOMPARE( encoded.size(), bytes.size() );
+}
+
+
+// ----------------------------------------------------------------------------
+// MainWindow's search and replace, on the whole of a loaded file.  (Only for
+// files small enough to be loaded into the editor.)
+//
+void QeBenchmark::findNext_data()
+{
+    addCorpusRows( VIEW_SIZE_THRESHOLD );
+}
+
+
+void QeBenchmark::findNext()
+{
+    QFETCH( QString, fileName );
+    QFETCH( QString, encoding );
+    MainWindow *w = openWindow( fileName, encoding );
+
+    // The marker is at the very end, so this searches everything
+    QBENCHMARK {
+        QMetaObject::invokeMethod( w, "findNext", Qt::DirectConnection,
+                                   Q_ARG( QString, END_MARKER ), Q_ARG( bool, true ),
+                                   Q_ARG( bool, false ), Q_ARG( bool, true ));
+    }
+}
+
+
+void QeBenchmark::findNextRegExp_data()
+{
+    addCorpusRows( VIEW_SIZE_THRESHOLD );
+}
+
+
+void QeBenchmark::findNextRegExp()
+{
+    QFETCH( QString, fileName );
+    QFETCH( QString, encoding );
+    MainWindow *w = openWindow( fileName, encoding );
+
+    QBENCHMARK {
+        QMetaObject::invokeMethod( w, "findNextRegExp", Qt::DirectConnection,
+                                   Q_ARG( QString, "QEBENCH-[A-Z]+-MARKER$"), Q_ARG( bool, true ),
+                                   Q_ARG( bool, true ));
+    }
+}
+
+
+void QeBenchmark::replaceAll_data()
+{
+    addCorpusRows( VIEW_SIZE_THRESHOLD );
+}
+
+
+void QeBenchmark::replaceAll()
+{
+    QFETCH( QString, fileName );
+    QFETCH( QString, encoding );
+    MainWindow *w = openWindow( fileName, encoding );
+
+    // Every line has one match
+    QBENCHMARK_ONCE {
+        QMetaObject::invokeMethod( w, "replaceAll", Qt::DirectConnection,
+                                   Q_ARG( QString, "id="), Q_ARG( QString, "ID:"),
+                                   Q_ARG( bool, true ), Q_ARG( bool, false ), Q_ARG( bool, true ),
+                                   Q_ARG( bool, false ), Q_ARG( bool, false ));
+    }
+}
+
+
+void QeBenchmark::replaceAllRegExp_data()
+{
+    addCorpusRows( VIEW_SIZE_THRESHOLD );
+}
+
+
+void QeBenchmark::replaceAllRegExp()
+{
+    QFETCH( QString, fileName );
+    QFETCH( QString, encoding );
+    MainWindow *w = openWindow( fileName, encoding );
+
+    QBENCHMARK_ONCE {
+        QMetaObject::invokeMethod( w, "replaceAllRegExp", Qt::DirectConnection,
+                                   Q_ARG( QString, "id=([0-9]+)"), Q_ARG( QString, "ID:\\1"),
+                                   Q_ARG( bool, true ), Q_ARG( bool, true ),
+                                   Q_ARG( bool, false ), Q_ARG( bool, false ));
+    }
+}
+
+
+QTEST_MAIN( QeBenchmark )
+#include "qebench.moc"
@@ -0,0 +1,34 @@
+# Throughput benchmarks (QTestLib); not part of the normal build.
+# Build with "qmake && make" in this directory, then run e.g.
+#   qebench -xml -o results.xml
+# to get machine-readable results.  QE_BENCH_SIZES and QE_BENCH_DIR control
+# the generated test files; see qebench.cpp.
+TEMPLATE = app
+TARGET = qebench
+CONFIG += qtestlib console
+CONFIG -= app_bundle
+INCLUDEPATH += ..
+os2:QMAKE_CXXFLAGS += -Wno-unused-local-typedefs -Wno-literal-suffix 
+
+# Everything in qe.pro except main.cpp
+HEADERS += ../finddialog.h ../replacedialog.h ../gotolinedialog.h ../eastring.h ../os2codec.h ../os2codecdata.h ../os2codectables.h ../mainwindow.h ../qetextedit.h ../ctlutils.h ../threads.h ../simdcodec.h ../encodingdetector.h ../fileview.h ../filefollower.h ../linediff.h ../decodepipeline.h ../compression.h ../tracing.h ../journal.h
+FORMS += ../finddialog.ui ../replacedialog.ui ../gotolinedialog.ui
+SOURCES += qebench.cpp ../eastring.cpp ../os2codec.cpp ../finddialog.cpp ../replacedialog.cpp ../gotolinedialog.cpp ../mainwindow.cpp ../qetextedit.cpp ../ctlutils.cpp ../threads.cpp ../simdcodec.cpp ../encodingdetector.cpp ../fileview.cpp ../filefollower.cpp ../linediff.cpp ../decodepipeline.cpp ../compression.cpp ../tracing.cpp ../journal.cpp
+RESOURCES += ../qe.qrc
+# As in qe.pro
+zlib {
+    DEFINES += QE_USE_ZLIB
+    LIBS    += -lz
+}
+zstd {
+    DEFINES += QE_USE_ZSTD
+    LIBS    += -lzstd
+}
+xz {
+    DEFINES += QE_USE_XZ
+    LIBS    += -llzma
+}
+
+os2:HEADERS += ../os2native.h
+os2:SOURCES += ../os2native.cpp
+win32:LIBS += -lpsapi
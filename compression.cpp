@@ -0,0 +1,507 @@
+/******************************************************************************
+** QE - compression.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#include <string.h>
+#include "compression.h"
+
+#ifdef QE_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef QE_USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef QE_USE_XZ
+#include <lzma.h>
+#endif
+
+// Compression levels used when saving
+#define GZIP_LEVEL      6
+#define ZSTD_LEVEL      3
+#define XZ_PRESET       6
+
+
+// ============================================================================
+// QeCompression
+//
+
+// ----------------------------------------------------------------------------
+// Recognize a compressed format from the first few bytes of a file.
+//
+QeCompression::Format QeCompression::detect( const QByteArray &header )
+{
+    const uchar *data = (const uchar *) header.constData();
+    int length = header.size();
+
+    if (( length >= 2 ) && ( data[ 0 ] == 0x1F ) && ( data[ 1 ] == 0x8B ))
+        return Gzip;
+    if (( length >= 4 ) && !memcmp( data, "\x28\xB5\x2F\xFD", 4 ))
+        return Zstd;
+    if (( length >= 6 ) && !memcmp( data, "\xFD" "7zXZ\0", 6 ))
+        return Xz;
+    return None;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the format implied by a file name's extension, for new files.
+//
+QeCompression::Format QeCompression::formatForFileName( const QString &fileName )
+{
+    if ( fileName.endsWith(".gz", Qt::CaseInsensitive ))
+        return Gzip;
+    if ( fileName.endsWith(".zst", Qt::CaseInsensitive ))
+        return Zstd;
+    if ( fileName.endsWith(".xz", Qt::CaseInsensitive ))
+        return Xz;
+    return None;
+}
+
+
+// ----------------------------------------------------------------------------
+bool QeCompression::isSupported( Format format )
+{
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case Gzip: return true;
+#endif
+#ifdef QE_USE_ZSTD
+        case Zstd: return true;
+#endif
+#ifdef QE_USE_XZ
+        case Xz:   return true;
+#endif
+        default:   return false;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+QString QeCompression::formatName( Format format )
+{
+    switch ( format ) {
+        case Gzip: return QString("gzip");
+        case Zstd: return QString("zstd");
+        case Xz:   return QString("xz");
+        default:   return QString();
+    }
+}
+
+
+// ============================================================================
+// QeDecompressor
+//
+
+// ----------------------------------------------------------------------------
+QeDecompressor::QeDecompressor( QeCompression::Format compression )
+{
+    format      = compression;
+    stream      = NULL;
+    streamEnded = false;
+    finished    = false;
+
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case QeCompression::Gzip: {
+            z_stream *z = new z_stream;
+            memset( z, 0, sizeof( z_stream ));
+            // 15 + 32: maximum window size, and look for a gzip or zlib header
+            if ( inflateInit2( z, 15 + 32 ) == Z_OK )
+                stream = z;
+            else
+                delete z;
+            break;
+        }
+#endif
+#ifdef QE_USE_ZSTD
+        case QeCompression::Zstd:
+            stream = ZSTD_createDStream();
+            if ( stream && ZSTD_isError( ZSTD_initDStream( (ZSTD_DStream *) stream ))) {
+                ZSTD_freeDStream( (ZSTD_DStream *) stream );
+                stream = NULL;
+            }
+            break;
+#endif
+#ifdef QE_USE_XZ
+        case QeCompression::Xz: {
+            lzma_stream *s = new lzma_stream;
+            memset( s, 0, sizeof( lzma_stream ));
+            if ( lzma_stream_decoder( s, UINT64_MAX, LZMA_CONCATENATED ) == LZMA_OK )
+                stream = s;
+            else
+                delete s;
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+QeDecompressor::~QeDecompressor()
+{
+    if ( !stream )
+        return;
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case QeCompression::Gzip:
+            inflateEnd( (z_stream *) stream );
+            delete (z_stream *) stream;
+            break;
+#endif
+#ifdef QE_USE_ZSTD
+        case QeCompression::Zstd:
+            ZSTD_freeDStream( (ZSTD_DStream *) stream );
+            break;
+#endif
+#ifdef QE_USE_XZ
+        case QeCompression::Xz:
+            lzma_end( (lzma_stream *) stream );
+            delete (lzma_stream *) stream;
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns false if the format isn't supported (or the library failed).
+//
+bool QeDecompressor::isValid() const
+{
+    return ( stream != NULL );
+}
+
+
+// ----------------------------------------------------------------------------
+// Decompress as much of the input as possible into the output buffer.  Sets
+// the number of input bytes used and output bytes produced; if the output
+// buffer fills up, call again with the rest of the input.  lastInput says
+// there's no more input to come after this.  Returns false if the data is
+// corrupt.
+//
+// Once all the input has been given and decompressed, atEnd() says whether
+// the data was complete; if not, it was truncated.
+//
+bool QeDecompressor::decompress( const char *in, int inLength, int *used,
+                                 char *out, int outSize, int *produced, bool lastInput )
+{
+    *used     = 0;
+    *produced = 0;
+    if ( !stream || finished )
+        return ( stream != NULL );
+    if (( inLength == 0 ) && streamEnded ) {
+        finished = lastInput;
+        return true;
+    }
+
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case QeCompression::Gzip: {
+            z_stream *z = (z_stream *) stream;
+            z->next_in   = (Bytef *) in;
+            z->avail_in  = inLength;
+            z->next_out  = (Bytef *) out;
+            z->avail_out = outSize;
+            int rc = inflate( z, Z_NO_FLUSH );
+            *used     = inLength - z->avail_in;
+            *produced = outSize - z->avail_out;
+            if ( rc == Z_STREAM_END ) {
+                // Another gzip member may follow
+                streamEnded = true;
+                inflateReset( z );
+            }
+            else if (( rc == Z_OK ) || ( rc == Z_BUF_ERROR )) {
+                if ( *used )
+                    streamEnded = false;
+            }
+            else if ( streamEnded && ( *produced == 0 )) {
+                // Not another member, just trailing padding: ignore the rest
+                *used = inLength;
+                finished = true;
+                return true;
+            }
+            else
+                return false;
+            break;
+        }
+#endif
+#ifdef QE_USE_ZSTD
+        case QeCompression::Zstd: {
+            ZSTD_inBuffer  input  = { in, (size_t) inLength, 0 };
+            ZSTD_outBuffer output = { out, (size_t) outSize, 0 };
+            size_t rc = ZSTD_decompressStream( (ZSTD_DStream *) stream, &output, &input );
+            if ( ZSTD_isError( rc ))
+                return false;
+            *used     = (int) input.pos;
+            *produced = (int) output.pos;
+            // 0 means a frame is complete and flushed; another may follow
+            streamEnded = ( rc == 0 );
+            break;
+        }
+#endif
+#ifdef QE_USE_XZ
+        case QeCompression::Xz: {
+            lzma_stream *s = (lzma_stream *) stream;
+            s->next_in   = (const uint8_t *) in;
+            s->avail_in  = inLength;
+            s->next_out  = (uint8_t *) out;
+            s->avail_out = outSize;
+            // LZMA_CONCATENATED only reports the end once told there's no more
+            lzma_ret rc = lzma_code( s, lastInput ? LZMA_FINISH : LZMA_RUN );
+            *used     = inLength - (int) s->avail_in;
+            *produced = outSize - (int) s->avail_out;
+            if ( rc == LZMA_STREAM_END )
+                streamEnded = finished = true;
+            else if (( rc != LZMA_OK ) && ( rc != LZMA_BUF_ERROR ))
+                return false;
+            break;
+        }
+#endif
+        default:
+            return false;
+    }
+
+    if ( lastInput && streamEnded && ( *used == inLength ) && ( *produced < outSize ))
+        finished = true;
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+bool QeDecompressor::atEnd() const
+{
+    return finished;
+}
+
+
+// ============================================================================
+// QeCompressor
+//
+
+// ----------------------------------------------------------------------------
+QeCompressor::QeCompressor( QeCompression::Format compression )
+{
+    format = compression;
+    stream = NULL;
+    buffer.resize( COMPRESSION_BUFFER_SIZE );
+
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case QeCompression::Gzip: {
+            z_stream *z = new z_stream;
+            memset( z, 0, sizeof( z_stream ));
+            // 15 + 16: maximum window size, with a gzip header
+            if ( deflateInit2( z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) == Z_OK )
+                stream = z;
+            else
+                delete z;
+            break;
+        }
+#endif
+#ifdef QE_USE_ZSTD
+        case QeCompression::Zstd:
+            stream = ZSTD_createCStream();
+            if ( stream && ZSTD_isError( ZSTD_initCStream( (ZSTD_CStream *) stream, ZSTD_LEVEL ))) {
+                ZSTD_freeCStream( (ZSTD_CStream *) stream );
+                stream = NULL;
+            }
+            break;
+#endif
+#ifdef QE_USE_XZ
+        case QeCompression::Xz: {
+            lzma_stream *s = new lzma_stream;
+            memset( s, 0, sizeof( lzma_stream ));
+            if ( lzma_easy_encoder( s, XZ_PRESET, LZMA_CHECK_CRC64 ) == LZMA_OK )
+                stream = s;
+            else
+                delete s;
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+QeCompressor::~QeCompressor()
+{
+    if ( !stream )
+        return;
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case QeCompression::Gzip:
+            deflateEnd( (z_stream *) stream );
+            delete (z_stream *) stream;
+            break;
+#endif
+#ifdef QE_USE_ZSTD
+        case QeCompression::Zstd:
+            ZSTD_freeCStream( (ZSTD_CStream *) stream );
+            break;
+#endif
+#ifdef QE_USE_XZ
+        case QeCompression::Xz:
+            lzma_end( (lzma_stream *) stream );
+            delete (lzma_stream *) stream;
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+bool QeCompressor::isValid() const
+{
+    return ( stream != NULL );
+}
+
+
+// ----------------------------------------------------------------------------
+// Compress the given data, appending whatever output is ready to 'out'.
+// Returns false on failure.
+//
+bool QeCompressor::compress( const char *in, int length, QByteArray &out )
+{
+    if ( !stream )
+        return false;
+    char *next = buffer.data();
+    int   size = buffer.size();
+
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case QeCompression::Gzip: {
+            z_stream *z = (z_stream *) stream;
+            z->next_in  = (Bytef *) in;
+            z->avail_in = length;
+            do {
+                z->next_out  = (Bytef *) next;
+                z->avail_out = size;
+                if ( deflate( z, Z_NO_FLUSH ) == Z_STREAM_ERROR )
+                    return false;
+                out.append( next, size - z->avail_out );
+            } while (( z->avail_in > 0 ) || ( z->avail_out == 0 ));
+            return true;
+        }
+#endif
+#ifdef QE_USE_ZSTD
+        case QeCompression::Zstd: {
+            ZSTD_inBuffer input = { in, (size_t) length, 0 };
+            while ( input.pos < input.size ) {
+                ZSTD_outBuffer output = { next, (size_t) size, 0 };
+                if ( ZSTD_isError( ZSTD_compressStream( (ZSTD_CStream *) stream, &output, &input )))
+                    return false;
+                out.append( next, (int) output.pos );
+            }
+            return true;
+        }
+#endif
+#ifdef QE_USE_XZ
+        case QeCompression::Xz: {
+            lzma_stream *s = (lzma_stream *) stream;
+            s->next_in  = (const uint8_t *) in;
+            s->avail_in = length;
+            do {
+                s->next_out  = (uint8_t *) next;
+                s->avail_out = size;
+                lzma_ret rc = lzma_code( s, LZMA_RUN );
+                if (( rc != LZMA_OK ) && ( rc != LZMA_BUF_ERROR ))
+                    return false;
+                out.append( next, size - (int) s->avail_out );
+            } while (( s->avail_in > 0 ) || ( s->avail_out == 0 ));
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Flush the rest of the compressed data (including any trailer) to 'out'.
+//
+bool QeCompressor::finish( QByteArray &out )
+{
+    if ( !stream )
+        return false;
+    char *next = buffer.data();
+    int   size = buffer.size();
+
+    switch ( format ) {
+#ifdef QE_USE_ZLIB
+        case QeCompression::Gzip: {
+            z_stream *z = (z_stream *) stream;
+            z->next_in  = NULL;
+            z->avail_in = 0;
+            int rc;
+            do {
+                z->next_out  = (Bytef *) next;
+                z->avail_out = size;
+                rc = deflate( z, Z_FINISH );
+                if ( rc == Z_STREAM_ERROR )
+                    return false;
+                out.append( next, size - z->avail_out );
+            } while ( rc != Z_STREAM_END );
+            return true;
+        }
+#endif
+#ifdef QE_USE_ZSTD
+        case QeCompression::Zstd: {
+            size_t remaining;
+            do {
+                ZSTD_outBuffer output = { next, (size_t) size, 0 };
+                remaining = ZSTD_endStream( (ZSTD_CStream *) stream, &output );
+                if ( ZSTD_isError( remaining ))
+                    return false;
+                out.append( next, (int) output.pos );
+            } while ( remaining > 0 );
+            return true;
+        }
+#endif
+#ifdef QE_USE_XZ
+        case QeCompression::Xz: {
+            lzma_stream *s = (lzma_stream *) stream;
+            s->next_in  = NULL;
+            s->avail_in = 0;
+            lzma_ret rc;
+            do {
+                s->next_out  = (uint8_t *) next;
+                s->avail_out = size;
+                rc = lzma_code( s, LZMA_FINISH );
+                if (( rc != LZMA_OK ) && ( rc != LZMA_STREAM_END ))
+                    return false;
+                out.append( next, size - (int) s->avail_out );
+            } while ( rc != LZMA_STREAM_END );
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
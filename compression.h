@@ -0,0 +1,109 @@
+/******************************************************************************
+** QE - compression.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#ifndef QE_COMPRESSION_H
+#define QE_COMPRESSION_H
+
+#include <QString>
+#include <QByteArray>
+
+
+#define COMPRESSION_HEADER_SIZE     6       // bytes needed to recognize a format
+#define COMPRESSION_BUFFER_SIZE     0x10000 // compressor output is produced this much at a time
+
+
+// ============================================================================
+// QeCompression
+//
+// The compressed file formats we know about.  Each is only supported if QE
+// was built with the library for it (QE_USE_ZLIB, QE_USE_ZSTD, QE_USE_XZ; see
+// qe.pro); files in other formats are treated as plain data.
+//
+
+class QeCompression
+{
+public:
+    enum Format {
+        None = 0,
+        Gzip,
+        Zstd,
+        Xz
+    };
+
+    static Format  detect( const QByteArray &header );
+    static Format  formatForFileName( const QString &fileName );
+    static bool    isSupported( Format format );
+    static QString formatName( Format format );
+};
+
+
+// ============================================================================
+// QeDecompressor
+//
+// Streaming decompression: input is fed in and output taken out a buffer at
+// a time, so neither the whole compressed nor the whole decompressed data
+// need ever be in memory.  Concatenated streams (as produced by appending to
+// a .gz file, say) are decompressed one after the other.
+//
+
+class QeDecompressor
+{
+public:
+    QeDecompressor( QeCompression::Format format );
+    ~QeDecompressor();
+
+    bool    isValid() const;
+    bool    decompress( const char *in, int inLength, int *used,
+                        char *out, int outSize, int *produced, bool lastInput );
+    bool    atEnd() const;
+
+private:
+    QeCompression::Format format;
+    void   *stream;
+    bool    streamEnded;    // the last stream so far is complete
+    bool    finished;       // ...and there's no more input
+};
+
+
+// ============================================================================
+// QeCompressor
+//
+// Streaming compression, the reverse of the above.  The compressed output of
+// each call is appended to the given byte array.
+//
+
+class QeCompressor
+{
+public:
+    QeCompressor( QeCompression::Format format );
+    ~QeCompressor();
+
+    bool    isValid() const;
+    bool    compress( const char *in, int length, QByteArray &out );
+    bool    finish( QByteArray &out );
+
+private:
+    QeCompression::Format format;
+    void   *stream;
+    QByteArray buffer;
+};
+
+#endif      // QE_COMPRESSION_H
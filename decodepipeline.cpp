@@ -0,0 +1,255 @@
+/******************************************************************************
+** QE - decodepipeline.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#include <QRunnable>
+#include "decodepipeline.h"
+#include "tracing.h"
+#include "threads.h"
+
+
+// ============================================================================
+// QeDecodePipeline::Task
+//
+// Decodes one chunk, on one of the pool's threads.
+//
+
+class QeDecodePipeline::Task : public QRunnable
+{
+public:
+    Task( QeDecodePipeline *owner, int index, bool first )
+        : pipeline( owner ), chunk( index ), isFirst( first ) {}
+
+    void run() { pipeline->decode( chunk, isFirst ); }
+
+private:
+    QeDecodePipeline *pipeline;
+    int               chunk;
+    bool              isFirst;
+};
+
+
+// ============================================================================
+// QeDecodePipeline
+//
+
+// ----------------------------------------------------------------------------
+QeDecodePipeline::QeDecodePipeline( QTextCodec *textCodec, QeUnicodeConverter::Format unicodeFormat, int threads )
+{
+    codec      = textCodec;
+    format     = unicodeFormat;
+    submitted  = 0;
+    taken      = 0;
+    bomFound   = false;
+    chunkCount = qMax( threads, 1 ) * PIPELINE_CHUNKS_PER_THREAD;
+    chunks     = new Chunk[ chunkCount ];
+    buffers    = new QByteArray[ chunkCount ];
+    for ( int i = 0; i < chunkCount; i++ )
+        chunks[ i ].done = false;
+    pool.setMaxThreadCount( qMax( threads, 1 ));
+}
+
+
+// ----------------------------------------------------------------------------
+QeDecodePipeline::~QeDecodePipeline()
+{
+    // Anything still being decoded refers to the chunks and buffers
+    pool.waitForDone();
+    delete [] chunks;
+    delete [] buffers;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if text in the given codec (or Unicode format) can be decoded
+// in independent pieces.  For codecs other than UTF-8/16 that means every
+// byte has to decode to exactly one character by itself, without leaving
+// anything in the converter state; multi-byte and shifting encodings fail.
+//
+bool QeDecodePipeline::isSplittable( QTextCodec *codec, QeUnicodeConverter::Format format )
+{
+    if ( format != QeUnicodeConverter::Unsupported )
+        return true;
+    if ( codec == NULL )
+        return false;
+
+    for ( int i = 0; i < 256; i++ ) {
+        char byte = (char) i;
+        QTextCodec::ConverterState state;
+        QString text = codec->toUnicode( &byte, 1, &state );
+        if (( text.size() != 1 ) || state.remainingChars )
+            return false;
+    }
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns how much of the given data can be decoded as a chunk, without
+// splitting a character between it and the next one: all of it, apart from
+// an incomplete UTF-8 sequence, or a UTF-16 high surrogate (or odd byte), at
+// the end.
+//
+int QeDecodePipeline::splitPoint( const char *bytes, int length ) const
+{
+    const uchar *data = (const uchar *) bytes;
+    int split = length;
+
+    switch ( format ) {
+        case QeUnicodeConverter::Utf8:
+            for ( int back = 1; ( back <= 3 ) && ( back <= length ); back++ ) {
+                uchar c = data[ length - back ];
+                if (( c & 0xC0 ) == 0x80 )
+                    continue;               // a continuation byte
+                if ( c >= 0xC0 ) {
+                    int needed = ( c >= 0xF0 ) ? 4 : ( c >= 0xE0 ) ? 3 : 2;
+                    if ( needed > back )
+                        split = length - back;
+                }
+                break;
+            }
+            break;
+
+        case QeUnicodeConverter::Utf16LE:
+        case QeUnicodeConverter::Utf16BE:
+            split = length & ~1;
+            if ( split >= 2 ) {
+                ushort unit = ( format == QeUnicodeConverter::Utf16BE ) ?
+                                ( data[ split - 2 ] << 8 ) | data[ split - 1 ] :
+                                ( data[ split - 1 ] << 8 ) | data[ split - 2 ];
+                if (( unit >= 0xD800 ) && ( unit < 0xDC00 ))
+                    split -= 2;
+            }
+            break;
+
+        default:
+            break;
+    }
+    return split;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the maximum number of chunks which can be submitted but not yet
+// taken.
+//
+int QeDecodePipeline::capacity() const
+{
+    return chunkCount;
+}
+
+
+// ----------------------------------------------------------------------------
+int QeDecodePipeline::pending() const
+{
+    return (int)( submitted - taken );
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns a buffer of FILE_CHUNK_SIZE bytes for the next chunk to be
+// submitted, which stays valid until the chunk's text has been taken.
+// (Only while pending() < capacity().)
+//
+char *QeDecodePipeline::nextBuffer()
+{
+    QByteArray &buffer = buffers[ submitted % chunkCount ];
+    if ( buffer.size() < FILE_CHUNK_SIZE )
+        buffer.resize( FILE_CHUNK_SIZE );
+    return buffer.data();
+}
+
+
+// ----------------------------------------------------------------------------
+// Queue a chunk for decoding.  (Only while pending() < capacity().)
+//
+void QeDecodePipeline::submit( const char *bytes, int length )
+{
+    int index = (int)( submitted % chunkCount );
+    chunks[ index ].bytes  = bytes;
+    chunks[ index ].length = length;
+    chunks[ index ].done   = false;
+    pool.start( new Task( this, index, submitted == 0 ));
+    submitted++;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the text of the oldest chunk not yet taken, waiting for it to be
+// decoded if necessary.
+//
+QString QeDecodePipeline::take()
+{
+    int index = (int)( taken % chunkCount );
+    QMutexLocker lock( &mutex );
+    while ( !chunks[ index ].done )
+        chunkDone.wait( &mutex );
+
+    QString text = chunks[ index ].text;
+    chunks[ index ].text = QString();
+    chunks[ index ].done = false;
+    taken++;
+    return text;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if the first chunk started with a Unicode byte-order mark
+// (which is not included in its text).
+//
+bool QeDecodePipeline::hasByteOrderMark() const
+{
+    QMutexLocker lock( &mutex );
+    return bomFound;
+}
+
+
+// ----------------------------------------------------------------------------
+// Decode one chunk (on a pool thread).  Every chunk but the first starts in
+// the middle of the file, so only the first can have a byte-order mark.
+//
+void QeDecodePipeline::decode( int index, bool first )
+{
+    const Chunk &chunk = chunks[ index ];
+    QString text;
+    bool bom = false;
+    QeTraceSpan span("decode");
+    span.setCount("bytes", chunk.length );
+
+    if ( format != QeUnicodeConverter::Unsupported ) {
+        QeUnicodeConverter converter( format );
+        if ( !first )
+            converter.ignoreHeader();
+        text = converter.toUnicode( chunk.bytes, chunk.length );
+        text += converter.finishDecoding();
+        bom = converter.hasByteOrderMark();
+    }
+    else {
+        QTextCodec::ConverterState state( first ? QTextCodec::DefaultConversion : QTextCodec::IgnoreHeader );
+        text = codec->toUnicode( chunk.bytes, chunk.length, &state );
+    }
+
+    QMutexLocker lock( &mutex );
+    chunks[ index ].text = text;
+    chunks[ index ].done = true;
+    if ( first )
+        bomFound = bom;
+    chunkDone.wakeAll();
+}
@@ -0,0 +1,101 @@
+/******************************************************************************
+** QE - decodepipeline.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#ifndef QE_DECODEPIPELINE_H
+#define QE_DECODEPIPELINE_H
+
+#include <QTextCodec>
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include "simdcodec.h"
+
+
+#define PIPELINE_CHUNKS_PER_THREAD  2       // chunks in flight for each decoder thread
+
+
+// ============================================================================
+// QeDecodePipeline
+//
+// Decodes a series of chunks of a file on several threads at once, and hands
+// the results back in their original order.  This only works for encodings in
+// which each chunk can be decoded without knowing what came before it, i.e.
+// single-byte codepages and UTF-8/UTF-16 split between characters (see
+// isSplittable and splitPoint); stateful encodings such as ISO-2022-JP have
+// to be decoded in sequence as usual.
+//
+// The caller (QeOpenThread) is both the reading and the assembling stage: it
+// submits chunks as it reads or maps them, up to capacity() ahead, and takes
+// the decoded text of the oldest one whenever it needs room for more.  Idle
+// decoder threads pick up the next waiting chunk, so a slow chunk only holds
+// up the thread working on it.  Chunk data must stay valid until its text has
+// been taken; for files that are read rather than mapped, nextBuffer() gives
+// a reusable buffer which does.
+//
+// The waiting chunks are simply queued in QThreadPool, rather than each thread
+// having its own queue to steal from.  A chunk is FILE_CHUNK_SIZE bytes, which
+// takes far longer to decode than taking it from a shared queue does, and no
+// more than capacity() are ever queued; so there is nothing worth balancing.
+//
+
+class QeDecodePipeline
+{
+public:
+    QeDecodePipeline( QTextCodec *codec, QeUnicodeConverter::Format format, int threads );
+    ~QeDecodePipeline();
+
+    static bool isSplittable( QTextCodec *codec, QeUnicodeConverter::Format format );
+
+    int     splitPoint( const char *bytes, int length ) const;
+    int     capacity() const;
+    int     pending() const;
+    char   *nextBuffer();
+    void    submit( const char *bytes, int length );
+    QString take();
+    bool    hasByteOrderMark() const;
+
+private:
+    class Task;
+    friend class Task;
+
+    struct Chunk {
+        const char *bytes;
+        int         length;
+        bool        done;
+        QString     text;
+    };
+
+    void    decode( int index, bool first );
+
+    QTextCodec     *codec;
+    QeUnicodeConverter::Format format;
+    QThreadPool     pool;
+    Chunk          *chunks;         // ring of capacity() chunks
+    QByteArray     *buffers;        // likewise, created as needed
+    int             chunkCount;
+    qint64          submitted;
+    qint64          taken;
+    bool            bomFound;
+    mutable QMutex  mutex;          // protects done, text and bomFound
+    QWaitCondition  chunkDone;
+};
+
+#endif      // QE_DECODEPIPELINE_H
@@ -0,0 +1,465 @@
+/******************************************************************************
+** QE - encodingdetector.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+#include <QVector>
+#include "encodingdetector.h"
+#include "simdcodec.h"
+#include "os2codec.h"
+
+// Average per-character score of perfectly plausible text (see scoreText)
+#define SCORE_MAX           4.0
+// Bonus for the locale's own encoding, which wins any close call
+#define SCORE_LOCALE_BONUS  0.25
+
+// Scripts, as distinguished by scoreText
+#define SCRIPT_NONE             0
+#define SCRIPT_ASCII            1
+#define SCRIPT_LATIN            2
+#define SCRIPT_KANA             3
+#define SCRIPT_HALFWIDTH_KANA   4
+#define SCRIPT_HANGUL           5
+#define SCRIPT_HAN              6
+#define SCRIPT_OTHER            7
+
+
+// ---------------------------------------------------------------------------
+// Constructor
+//
+
+QeEncodingDetector::QeEncodingDetector( const QStringList &encodings )
+{
+    localeCodec = QTextCodec::codecForLocale();
+
+    for ( int i = 0; i < encodings.size(); i++ ) {
+        QTextCodec *codec = QeOS2Codec::codecForName( encodings.at( i ).toLatin1() );
+        if ( !codec ) continue;
+
+        // Some encodings are listed more than once, and some are aliases
+        bool bDuplicate = false;
+        for ( int j = 0; j < candidates.size() && !bDuplicate; j++ )
+            bDuplicate = ( candidates.at( j ).codec == codec );
+        if ( bDuplicate ) continue;
+
+        Candidate candidate;
+        candidate.name     = encodings.at( i );
+        candidate.codec    = codec;
+        candidate.language = AnyLanguage;
+        QByteArray codecName = codec->name().toUpper();
+        if ( codecName.contains("JIS") || codecName.contains("EUC-JP"))
+            candidate.language = Japanese;
+        else if ( codecName.contains("EUC-KR") || codecName.contains("949"))
+            candidate.language = Korean;
+        else if ( codecName.startsWith("GB") || codecName.startsWith("BIG5"))
+            candidate.language = Chinese;
+        candidates.append( candidate );
+    }
+
+    // The commonest letters of the main non-Latin alphabets (Cyrillic, Greek,
+    // Hebrew, Arabic and Thai)
+    static const ushort frequent[] = {
+        0x043E, 0x0435, 0x0430, 0x0438, 0x043D, 0x0442, 0x0441, 0x0440, 0x0432, 0x043B,
+        0x043A, 0x043C, 0x0434, 0x043F, 0x0443, 0x044F, 0x044B, 0x0456, 0x044C,
+        0x041E, 0x0415, 0x0410, 0x0418, 0x041D, 0x0422, 0x0421, 0x0420, 0x0412, 0x041B,
+        0x041A, 0x041C, 0x0414, 0x041F, 0x0423,
+        0x03B1, 0x03BF, 0x03B9, 0x03B5, 0x03C4, 0x03C3, 0x03BD, 0x03B7, 0x03C5, 0x03C1,
+        0x03C0, 0x03BA, 0x03BC, 0x03BB, 0x03AC, 0x03AD, 0x03AF, 0x03CC, 0x03AE, 0x03CD,
+        0x05D9, 0x05D5, 0x05D4, 0x05DC, 0x05D0, 0x05E8, 0x05DE, 0x05D1, 0x05E0, 0x05EA, 0x05E9,
+        0x0627, 0x064A, 0x0644, 0x0645, 0x0646, 0x0648, 0x0647, 0x0631, 0x0628,
+        0x0E32, 0x0E19, 0x0E23, 0x0E2D, 0x0E01, 0x0E40, 0x0E07, 0x0E21, 0x0E22, 0x0E25,
+        0x0E27, 0x0E14, 0x0E17
+    };
+    for ( unsigned int i = 0; i < sizeof( frequent ) / sizeof( frequent[ 0 ] ); i++ )
+        frequentLetters.insert( QChar( frequent[ i ] ));
+}
+
+
+// ---------------------------------------------------------------------------
+// Public methods
+//
+
+// Read the samples to check from the given device: its start, middle and end,
+// or the whole thing if it's small enough.  The device is left positioned at
+// the start.  Sequential devices can't be sampled without losing data, so
+// nothing is returned for those.
+//
+QList<QByteArray> QeEncodingDetector::readSamples( QIODevice *device )
+{
+    QList<QByteArray> samples;
+    if ( device->isSequential() )
+        return samples;
+
+    qint64 size = device->size();
+    if ( size <= DETECT_SAMPLE_SIZE * 3 ) {
+        if ( device->seek( 0 ))
+            samples << device->read( size );
+    }
+    else {
+        // Keep the offsets even, so as not to split UTF-16 units
+        qint64 offsets[ 3 ] = { 0,
+                                (( size - DETECT_SAMPLE_SIZE ) / 2 ) & ~1,
+                                ( size - DETECT_SAMPLE_SIZE ) & ~1 };
+        for ( int i = 0; i < 3; i++ ) {
+            if ( device->seek( offsets[ i ] ))
+                samples << device->read( DETECT_SAMPLE_SIZE );
+        }
+    }
+    device->seek( 0 );
+    return samples;
+}
+
+
+QString QeEncodingDetector::detect( QIODevice *device, int *confidence, QTextCodec **codec ) const
+{
+    return detect( readSamples( device ), confidence, codec );
+}
+
+
+// Work out the most likely encoding of the given samples.  Returns the name of
+// the encoding (as it was given to the constructor), with its codec and our
+// confidence in it (0-100).  An empty string is returned if the samples are
+// plain ASCII, or too short to tell anything from.
+//
+QString QeEncodingDetector::detect( const QList<QByteArray> &samples, int *confidence, QTextCodec **codec ) const
+{
+    if ( confidence ) *confidence = 0;
+    if ( codec )      *codec = 0;
+    if ( samples.isEmpty() || samples.first().isEmpty() )
+        return QString();
+
+    // Byte-order marks
+    const QByteArray &head = samples.first();
+    if ( head.startsWith("\xEF\xBB\xBF"))
+        return result("UTF-8", 100, confidence, codec );
+    if ( head.startsWith("\xFF\xFE"))
+        return result("UTF-16LE", 100, confidence, codec );
+    if ( head.startsWith("\xFE\xFF"))
+        return result("UTF-16BE", 100, confidence, codec );
+
+    // UTF-16 without a BOM: most text is in the lower ranges of Unicode, so one
+    // byte of most pairs (and always the same one) is zero.
+    int pairs = head.size() / 2;
+    if ( pairs >= 8 ) {
+        const uchar *bytes = (const uchar *) head.constData();
+        int evenZeros = 0,
+            oddZeros  = 0;
+        for ( int i = 0; i < pairs * 2; i += 2 ) {
+            if ( !bytes[ i ] )     evenZeros++;
+            if ( !bytes[ i + 1 ] ) oddZeros++;
+        }
+        if (( oddZeros > pairs * 3 / 10 ) && ( evenZeros < pairs / 20 ))
+            return result("UTF-16LE", 50 + ( 50 * oddZeros / pairs ), confidence, codec );
+        if (( evenZeros > pairs * 3 / 10 ) && ( oddZeros < pairs / 20 ))
+            return result("UTF-16BE", 50 + ( 50 * evenZeros / pairs ), confidence, codec );
+    }
+
+    // Plain ASCII is valid in everything, except that it might be ISO-2022-JP
+    bool bAscii   = true,
+         bEscapes = false;
+    for ( int i = 0; i < samples.size(); i++ ) {
+        const QByteArray &sample = samples.at( i );
+        for ( int j = 0; ( j < sample.size() ) && bAscii; j++ )
+            bAscii = !( sample.at( j ) & 0x80 );
+        if ( sample.contains("\x1B$B") || sample.contains("\x1B$@"))
+            bEscapes = true;
+    }
+    if ( bAscii ) {
+        if ( bEscapes )
+            return result("ISO-2022-JP", 90, confidence, codec );
+        if ( confidence ) *confidence = 100;
+        return QString();
+    }
+
+    // UTF-8 is very unlikely to validate by accident
+    bool bValid = true;
+    QVector<ushort> buffer( DETECT_SAMPLE_SIZE * 3 );
+    for ( int i = 0; ( i < samples.size() ) && bValid; i++ ) {
+        const uchar *bytes  = (const uchar *) samples.at( i ).constData();
+        int          length = samples.at( i ).size();
+        // Samples after the first may start part way through a character
+        for ( int skip = 0; i && ( skip < 3 ) && length && (( *bytes & 0xC0 ) == 0x80 ); skip++ ) {
+            bytes++;
+            length--;
+        }
+        int used, invalid;
+        buffer.resize( length );
+        qeDecodeUtf8( bytes, length, buffer.data(), &used, &invalid );
+        // (Anything left unused is an incomplete sequence cut off at the end)
+        if ( invalid || ( length - used > 3 ))
+            bValid = false;
+    }
+    if ( bValid )
+        return result("UTF-8", 100, confidence, codec );
+
+    // Otherwise, see which of the other encodings makes the most sense of it
+    QByteArray context = nonAsciiContext( samples );
+    QVector<double>  scores;
+    QVector<QString> texts;
+    int best = -1;
+    for ( int i = 0; i < candidates.size(); i++ ) {
+        QTextCodec *candidate = candidates.at( i ).codec;
+        // Unicode has already been ruled out above, and ISO-2022-JP is 7-bit
+        if (( QeUnicodeConverter::formatForCodec( candidate ) != QeUnicodeConverter::Unsupported ) ||
+            ( candidate->mibEnum() == 39 ))
+        {
+            scores.append( -1000 );
+            texts.append( QString() );
+            continue;
+        }
+        QTextCodec::ConverterState state;
+        QString text = candidate->toUnicode( context.constData(), context.size(), &state );
+        int kana, hangul;
+        double score = scoreText( text, &kana, &hangul );
+        if ( candidate == localeCodec )
+            score += SCORE_LOCALE_BONUS;
+        // Japanese text always has some kana, and Korean text is mostly Hangul;
+        // Chinese text has neither
+        switch ( candidates.at( i ).language ) {
+            case Japanese: if ( !kana )             score -= 1; break;
+            case Korean:   if ( !hangul )           score -= 1; break;
+            case Chinese:  if ( kana || hangul )    score -= 1; break;
+            default:                                            break;
+        }
+        scores.append( score );
+        texts.append( text );
+        if (( best < 0 ) || ( score > scores.at( best )))
+            best = i;
+    }
+    if (( best < 0 ) || ( scores.at( best ) <= 0 ))
+        return QString();
+
+    // Our confidence depends on how plausible the best result is, and on how
+    // far ahead of the next one it is.  Encodings which decode the samples to
+    // the same text (there are several near-identical ones) don't count.
+    double second = 0;
+    for ( int i = 0; i < candidates.size(); i++ ) {
+        if (( i != best ) && ( scores.at( i ) > second ) && ( texts.at( i ) != texts.at( best )))
+            second = scores.at( i );
+    }
+    double quality = qBound( 0.0, scores.at( best ) / SCORE_MAX, 1.0 );
+    double margin  = qMin( 1.0, scores.at( best ) - second );
+    return result( candidates.at( best ).name, (int)( 100 * quality * ( 0.5 + 0.5 * margin )),
+                   confidence, codec );
+}
+
+
+// ---------------------------------------------------------------------------
+// Private methods
+//
+
+// Fill in the results for the named encoding.  Names not among the candidates
+// (e.g. the Unicode encodings, if they weren't given) are looked up directly.
+//
+QString QeEncodingDetector::result( const QString &name, int score, int *confidence, QTextCodec **codec ) const
+{
+    QTextCodec *found = 0;
+    for ( int i = 0; i < candidates.size() && !found; i++ ) {
+        if ( candidates.at( i ).name == name )
+            found = candidates.at( i ).codec;
+    }
+    if ( !found )
+        found = QeOS2Codec::codecForName( name.toLatin1() );
+    if ( !found )
+        return QString();
+
+    if ( confidence ) *confidence = qBound( 0, score, 100 );
+    if ( codec )      *codec = found;
+    return name;
+}
+
+
+// Collect the non-ASCII bytes from the samples, along with a few bytes of
+// context either side of each (needed to judge things like whether letters
+// are part of words, and for the trail bytes of double-byte encodings).
+// Separate stretches are joined with line breaks.  This is usually a small
+// fraction of the samples, which keeps trying every candidate fast.
+//
+QByteArray QeEncodingDetector::nonAsciiContext( const QList<QByteArray> &samples ) const
+{
+    QByteArray context;
+    for ( int i = 0; ( i < samples.size() ) && ( context.size() < DETECT_CONTEXT_SIZE ); i++ ) {
+        const QByteArray &sample = samples.at( i );
+        int length = sample.size();
+        int start  = -1,
+            end    = -1;
+        for ( int j = 0; j < length; j++ ) {
+            if ( !( sample.at( j ) & 0x80 ))
+                continue;
+            if (( start < 0 ) || ( j - 3 > end )) {
+                // Not within the current stretch, so start a new one
+                if ( start >= 0 )
+                    context.append( sample.constData() + start, end - start ).append('\n');
+                start = qMax( 0, j - 3 );
+            }
+            end = qMin( length, j + 4 );
+            if ( context.size() + ( end - start ) >= DETECT_CONTEXT_SIZE )
+                break;
+        }
+        if ( start >= 0 )
+            context.append( sample.constData() + start, end - start ).append('\n');
+    }
+    return context;
+}
+
+
+// Classify a character by script, as far as scoreText needs to know.
+//
+static int scriptOf( ushort c )
+{
+    if ( c < 0x80 )                                 return SCRIPT_ASCII;
+    if ( c < 0x250 )                                return SCRIPT_LATIN;
+    if (( c >= 0x3040 ) && ( c < 0x3100 ))          return SCRIPT_KANA;
+    if ((( c >= 0xAC00 ) && ( c < 0xD7B0 )) ||
+        (( c >= 0x1100 ) && ( c < 0x1200 )) ||
+        (( c >= 0x3130 ) && ( c < 0x3190 )))        return SCRIPT_HANGUL;
+    if ((( c >= 0x4E00 ) && ( c < 0xA000 )) ||
+        (( c >= 0x3400 ) && ( c < 0x4DC0 )) ||
+        (( c >= 0xF900 ) && ( c < 0xFB00 )))        return SCRIPT_HAN;
+    if (( c >= 0xFF61 ) && ( c < 0xFFA0 ))          return SCRIPT_HALFWIDTH_KANA;
+    // Anything else: its 128-character block is close enough
+    return SCRIPT_OTHER + ( c >> 7 );
+}
+
+
+// Score how much the non-ASCII characters in the given text look like the
+// real thing.  Returns their average score, which is around SCORE_MAX for
+// plausible text, and the number of kana and Hangul characters found.
+//
+// Roughly: letters score well when they form words in a single script, and
+// badly when scripts are mixed within a word (which is what decoding with the
+// wrong codepage mostly produces); accented Latin letters should be part of
+// words that are mostly ASCII; capitals rarely follow small letters; box
+// drawing characters come in runs; unmapped and control characters score very
+// badly.  A few of the commonest letters of each non-Latin alphabet get a
+// little extra, to tell apart codepages for the same script.
+//
+double QeEncodingDetector::scoreText( const QString &text, int *kana, int *hangul ) const
+{
+    const QChar *chars = text.constData();
+    int length = text.size();
+    int count  = 0,
+        score  = 0;
+
+    *kana   = 0;
+    *hangul = 0;
+    for ( int i = 0; i < length; i++ ) {
+        QChar c = chars[ i ];
+        ushort u = c.unicode();
+        if ( u < 0x80 )
+            continue;
+        count++;
+        QChar previous = i ? chars[ i - 1 ] : QChar(' '),
+              next     = ( i + 1 < length ) ? chars[ i + 1 ] : QChar(' ');
+
+        if ( u == QChar::ReplacementCharacter ) {
+            score -= 20;
+            continue;
+        }
+        if ((( u >= 0x3000 ) && ( u < 0x3040 )) || (( u >= 0xFF01 ) && ( u < 0xFF61 ))) {
+            // CJK and full-width punctuation
+            score += 2;
+            continue;
+        }
+        if (( u >= 0x2500 ) && ( u < 0x25A0 )) {
+            // Box drawing and block elements
+            bool bRun = (( previous.unicode() >= 0x2500 ) && ( previous.unicode() < 0x25A0 )) ||
+                        (( next.unicode() >= 0x2500 ) && ( next.unicode() < 0x25A0 ));
+            score += bRun ? 4 : -1;
+            continue;
+        }
+
+        QChar::Category category = c.category();
+        if ( c.isLetter() ) {
+            int script       = scriptOf( u ),
+                beforeScript = previous.isLetter() ? scriptOf( previous.unicode() ) : SCRIPT_NONE,
+                afterScript  = next.isLetter() ? scriptOf( next.unicode() ) : SCRIPT_NONE;
+
+            if ( script == SCRIPT_LATIN ) {
+                // Find the whole word, and see if it has any plain ASCII letters
+                int start = i,
+                    end   = i + 1;
+                bool bAscii = false;
+                while (( start > 0 ) && chars[ start - 1 ].isLetter() ) start--;
+                while (( end < length ) && chars[ end ].isLetter() ) end++;
+                for ( int j = start; ( j < end ) && !bAscii; j++ )
+                    bAscii = ( chars[ j ].unicode() < 0x80 );
+                score += bAscii ? 4 : (( end - start == 1 ) ? 1 : -2 );
+            }
+            else if ( script == SCRIPT_KANA ) {
+                (*kana)++;
+                score += 5;
+            }
+            else if ( script == SCRIPT_HALFWIDTH_KANA ) {
+                score += (( beforeScript == script ) || ( afterScript == script )) ? 1 : -2;
+            }
+            else {
+                if ( script == SCRIPT_HANGUL )
+                    (*hangul)++;
+                if (( beforeScript == script ) || ( afterScript == script ))
+                    score += ( script == SCRIPT_HANGUL ) ? 5 : 4;
+                else if (( script == SCRIPT_HAN ) &&
+                         (( beforeScript == SCRIPT_KANA ) || ( afterScript == SCRIPT_KANA )))
+                    score += 3;
+                else if (( beforeScript != SCRIPT_NONE ) || ( afterScript != SCRIPT_NONE ))
+                    score -= 2;
+                else
+                    score += 1;
+                if ( frequentLetters.contains( c ))
+                    score += 1;
+            }
+
+            // Triple letters are rare, but repeated bytes (rules etc.) are not
+            if (( c == previous ) && ( c == next ))
+                score -= 5;
+            if ( category == QChar::Letter_Uppercase ) {
+                score -= 1;
+                // Capitals rarely follow small letters within a word
+                if ( previous.category() == QChar::Letter_Lowercase )
+                    score -= 3;
+            }
+            continue;
+        }
+
+        switch ( category ) {
+            case QChar::Mark_NonSpacing:
+            case QChar::Number_DecimalDigit:
+            case QChar::Number_Other:
+            case QChar::Punctuation_InitialQuote:
+            case QChar::Punctuation_FinalQuote:
+            case QChar::Symbol_Currency:
+            case QChar::Separator_Space:
+                score += 1;
+                break;
+            case QChar::Symbol_Other:
+                score += (( previous.category() == QChar::Symbol_Other ) ||
+                          ( next.category() == QChar::Symbol_Other )) ? 1 : -1;
+                break;
+            case QChar::Other_Control:
+            case QChar::Other_NotAssigned:
+            case QChar::Other_PrivateUse:
+            case QChar::Other_Surrogate:
+                score -= 10;
+                break;
+            default:
+                score -= 1;
+                break;
+        }
+    }
+    return count ? ( (double) score / count ) : 0;
+}
@@ -0,0 +1,83 @@
+/******************************************************************************
+** QE - encodingdetector.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+#ifndef QE_ENCODINGDETECTOR_H
+#define QE_ENCODINGDETECTOR_H
+
+#include <QIODevice>
+#include <QTextCodec>
+#include <QStringList>
+#include <QList>
+#include <QSet>
+
+
+#define DETECT_SAMPLE_SIZE      0x4000      // bytes read from each part of the file
+#define DETECT_CONTEXT_SIZE     0x2000      // max. bytes of non-ASCII context scored
+#define DETECT_MIN_CONFIDENCE   50          // below this, stay with the default
+
+
+// ============================================================================
+// QeEncodingDetector
+//
+// Guesses the encoding of a file from samples of its start, middle and end.
+// Unicode is recognized structurally (byte-order mark, valid UTF-8, or the
+// zero-byte pattern of BOM-less UTF-16).  Otherwise, the non-ASCII parts of
+// the samples are decoded with every candidate encoding, and each result is
+// scored on how much it looks like text (letters forming words, consistent
+// case, no unmapped or control characters); the best one wins.
+//
+// The candidate codecs are looked up when the detector is created, which
+// should be done on the GUI thread; after that detect() may be called from
+// any thread.
+//
+
+class QeEncodingDetector
+{
+public:
+    QeEncodingDetector( const QStringList &encodings );
+
+    QString detect( QIODevice *device, int *confidence, QTextCodec **codec ) const;
+    QString detect( const QList<QByteArray> &samples, int *confidence, QTextCodec **codec ) const;
+
+    static QList<QByteArray> readSamples( QIODevice *device );
+
+private:
+    enum Language {
+        AnyLanguage = 0,
+        Japanese,
+        Korean,
+        Chinese
+    };
+    struct Candidate {
+        QString     name;
+        QTextCodec *codec;
+        Language    language;   // for the CJK codecs
+    };
+
+    QString     result( const QString &name, int score, int *confidence, QTextCodec **codec ) const;
+    QByteArray  nonAsciiContext( const QList<QByteArray> &samples ) const;
+    double      scoreText( const QString &text, int *kana, int *hangul ) const;
+
+    QList<Candidate> candidates;
+    QTextCodec      *localeCodec;
+    QSet<QChar>      frequentLetters;
+};
+
+#endif      // QE_ENCODINGDETECTOR_H
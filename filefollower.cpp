@@ -0,0 +1,182 @@
+/******************************************************************************
+** QE - filefollower.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#include <QFile>
+#include <QFileSystemWatcher>
+#include <QTimer>
+#include "filefollower.h"
+#include "threads.h"
+
+
+// ---------------------------------------------------------------------------
+// Constructor/destructor
+//
+
+QeFileFollower::QeFileFollower( QObject *parent )
+    : QObject( parent )
+{
+    codec     = NULL;
+    state     = NULL;
+    knownSize = 0;
+    pendingCR = false;
+
+    watcher = new QFileSystemWatcher( this );
+    connect( watcher, SIGNAL( fileChanged( const QString & )), this, SLOT( fileChanged( const QString & )));
+
+    retryTimer = new QTimer( this );
+    retryTimer->setInterval( FOLLOW_RETRY_INTERVAL );
+    connect( retryTimer, SIGNAL( timeout() ), this, SLOT( checkReplaced() ));
+}
+
+
+QeFileFollower::~QeFileFollower()
+{
+    delete state;
+}
+
+
+// ---------------------------------------------------------------------------
+// Public methods
+//
+
+// Start following the given file, whose contents up to offset are already
+// known.  Anything beyond that is delivered straight away.
+//
+void QeFileFollower::start( const QString &name, QTextCodec *textCodec, qint64 offset )
+{
+    stop();
+
+    fileName  = name;
+    codec     = textCodec ? textCodec : QTextCodec::codecForLocale();
+    knownSize = offset;
+    pendingCR = false;
+    state     = new QTextCodec::ConverterState( QTextCodec::IgnoreHeader );
+    unicodeDecoder.setFormat( QeUnicodeConverter::formatForCodec( codec ));
+    if ( offset > 0 )
+        unicodeDecoder.ignoreHeader();    // a U+FEFF from here on is text
+
+    watcher->addPath( fileName );
+    readAppended();
+}
+
+
+void QeFileFollower::stop()
+{
+    retryTimer->stop();
+    if ( !watcher->files().isEmpty() )
+        watcher->removePaths( watcher->files() );
+    fileName.clear();
+    delete state;
+    state = NULL;
+}
+
+
+bool QeFileFollower::isActive() const
+{
+    return !fileName.isEmpty();
+}
+
+
+// Returns the size of the file as last read, i.e. the offset from which the
+// next text will come.
+//
+qint64 QeFileFollower::position() const
+{
+    return knownSize;
+}
+
+
+// ---------------------------------------------------------------------------
+// Private slots
+//
+
+void QeFileFollower::fileChanged( const QString &path )
+{
+    if ( path != fileName )
+        return;
+
+    // The watcher drops a file that's been deleted or renamed; whatever is
+    // (or will be) at the same path is a different file.
+    if ( !watcher->files().contains( fileName )) {
+        checkReplaced();
+        if ( isActive() )
+            retryTimer->start();
+        return;
+    }
+    readAppended();
+}
+
+
+// Called once the watched file has gone, until a new one appears in its
+// place.
+//
+void QeFileFollower::checkReplaced()
+{
+    if ( !QFile::exists( fileName ))
+        return;
+    stop();
+    emit fileReplaced();
+}
+
+
+// ---------------------------------------------------------------------------
+// Other methods
+//
+
+// Read and decode everything past the last known size.  The file is only read
+// as far as its size at the start; anything written after that will raise
+// another change notification.
+//
+void QeFileFollower::readAppended()
+{
+    QFile file( fileName );
+    if ( !file.open( QIODevice::ReadOnly ))
+        return;
+
+    qint64 size = file.size();
+    if ( size < knownSize ) {
+        // Truncated (or replaced by something smaller) while we kept watching
+        stop();
+        emit fileReplaced();
+        return;
+    }
+    if (( size == knownSize ) || !file.seek( knownSize ))
+        return;
+
+    QByteArray buffer;
+    buffer.resize( (int) qMin( (qint64) FILE_CHUNK_SIZE, size - knownSize ));
+    QString text;
+    while ( knownSize < size ) {
+        qint64 length = file.read( buffer.data(), qMin( (qint64) buffer.size(), size - knownSize ));
+        if ( length <= 0 )
+            break;
+        knownSize += length;
+        if ( unicodeDecoder.format() != QeUnicodeConverter::Unsupported )
+            text += unicodeDecoder.toUnicode( buffer.constData(), (int) length );
+        else
+            text += codec->toUnicode( buffer.constData(), (int) length, state );
+    }
+    file.close();
+
+    QeOpenThread::convertLineEnds( text, pendingCR );
+    if ( !text.isEmpty() )
+        emit textAppended( text );
+}
@@ -0,0 +1,86 @@
+/******************************************************************************
+** QE - filefollower.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#ifndef QE_FILEFOLLOWER_H
+#define QE_FILEFOLLOWER_H
+
+#include <QObject>
+#include <QTextCodec>
+#include "simdcodec.h"
+
+
+#define FOLLOW_RETRY_INTERVAL   1000    // ms between checks for a file that has gone
+
+class QFileSystemWatcher;
+class QTimer;
+
+
+// ============================================================================
+// QeFileFollower
+//
+// Watches a file which is being written to by another program (a log file,
+// typically) and delivers whatever text is appended to it.  Only the bytes
+// past the last known size are read and decoded, so each update costs in
+// proportion to the new data rather than the size of the file.  The decoder
+// state carries over from one update to the next, so a multi-byte character
+// or CR+LF pair split between two writes comes out whole.
+//
+// If the file gets shorter, or is deleted or renamed and another takes its
+// place (as when a log is rotated), fileReplaced() is emitted and following
+// stops; the text shown no longer matches the file, so the owner should load
+// it again.
+//
+
+class QeFileFollower : public QObject
+{
+    Q_OBJECT
+
+public:
+    QeFileFollower( QObject *parent = 0 );
+    ~QeFileFollower();
+
+    void    start( const QString &fileName, QTextCodec *codec, qint64 offset );
+    void    stop();
+    bool    isActive() const;
+    qint64  position() const;
+
+signals:
+    void    textAppended( const QString &text );
+    void    fileReplaced();
+
+private slots:
+    void    fileChanged( const QString &path );
+    void    checkReplaced();
+
+private:
+    void    readAppended();
+
+    QFileSystemWatcher *watcher;
+    QTimer         *retryTimer;     // polls for the file to reappear
+    QString         fileName;
+    QTextCodec     *codec;
+    QTextCodec::ConverterState *state;
+    QeUnicodeConverter unicodeDecoder;     // used instead of the codec for UTF-8/16
+    qint64          knownSize;      // bytes of the file read so far
+    bool            pendingCR;
+};
+
+#endif      // QE_FILEFOLLOWER_H
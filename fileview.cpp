@@ -0,0 +1,659 @@
+/******************************************************************************
+** QE - fileview.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+#include <QtGui>
+#include "fileview.h"
+#include "threads.h"
+
+// Space to the left of the text, in pixels
+#define VIEW_MARGIN     4
+
+
+// Expand tabs to spaces, for drawing (QPainter doesn't do it for us).
+//
+static QString expandTabs( const QString &text )
+{
+    if ( !text.contains( QLatin1Char('\t')))
+        return text;
+
+    QString expanded;
+    expanded.reserve( text.size() + VIEW_TAB_WIDTH );
+    for ( int i = 0; i < text.size(); i++ ) {
+        if ( text.at( i ) == QLatin1Char('\t'))
+            expanded.append( QString( VIEW_TAB_WIDTH - ( expanded.size() % VIEW_TAB_WIDTH ), QLatin1Char(' ')));
+        else
+            expanded.append( text.at( i ));
+    }
+    return expanded;
+}
+
+
+// ---------------------------------------------------------------------------
+// Constructor/destructor
+//
+
+QeFileView::QeFileView( QWidget *parent )
+    : QAbstractScrollArea( parent )
+{
+    codec       = NULL;
+    dataStart   = 0;
+    unitSize    = 1;
+    bigEndian   = false;
+    lines       = 1;
+    indexing    = false;
+    findId      = 0;
+    finding     = false;
+    hintLine    = 0;
+    hintOffset  = 0;
+    blockStart  = -1;
+    cacheFirst  = 0;
+    cursorLine  = 0;
+    matchStart  = 0;
+    matchLength = 0;
+    maxWidth    = 0;
+    scrollScale = 1;
+
+    indexer = new QeIndexThread();
+    connect( indexer, SIGNAL( indexUpdated() ), this, SLOT( readIndex() ));
+
+    finder = new QeFindThread();
+    connect( finder, SIGNAL( searchProgress( int )), this, SIGNAL( findProgress( int )));
+    connect( finder, SIGNAL( searchDone( int )), this, SLOT( readFindResult( int )));
+
+    setFocusPolicy( Qt::StrongFocus );
+    viewport()->setBackgroundRole( QPalette::Base );
+    viewport()->setAutoFillBackground( true );
+}
+
+
+QeFileView::~QeFileView()
+{
+    close();
+    delete finder;
+    delete indexer;
+}
+
+
+// ---------------------------------------------------------------------------
+// Public methods
+//
+
+bool QeFileView::open( const QString &fileName, QTextCodec *textCodec )
+{
+    close();
+    file.setFileName( fileName );
+    if ( !file.open( QIODevice::ReadOnly ))
+        return false;
+
+    codec = textCodec ? textCodec : QTextCodec::codecForLocale();
+    QeUnicodeConverter::Format format = QeUnicodeConverter::formatForCodec( codec );
+    unicodeDecoder.setFormat( format );
+    unitSize  = (( format == QeUnicodeConverter::Utf16LE ) ||
+                 ( format == QeUnicodeConverter::Utf16BE )) ? 2 : 1;
+    bigEndian = ( format == QeUnicodeConverter::Utf16BE );
+
+    // Skip any byte-order mark
+    QByteArray head = file.read( 3 );
+    dataStart = 0;
+    if (( format == QeUnicodeConverter::Utf8 ) && head.startsWith("\xEF\xBB\xBF"))
+        dataStart = 3;
+    else if (( unitSize == 2 ) && head.startsWith( bigEndian ? "\xFE\xFF" : "\xFF\xFE"))
+        dataStart = 2;
+
+    index.clear();
+    index.append( dataStart );
+    lines      = 1;
+    hintLine   = 0;
+    hintOffset = dataStart;
+    indexing   = true;
+
+    indexer->setFile( fileName, dataStart, unitSize, bigEndian );
+    indexer->start( QThread::LowPriority );
+    finder->setFile( fileName, codec, unitSize, bigEndian );
+
+    updateScrollBars();
+    setCurrentLine( 0, dataStart );
+    return true;
+}
+
+
+void QeFileView::close()
+{
+    cancelFind();
+    if ( indexer->isRunning() ) {
+        indexer->cancel();
+        indexer->wait();
+    }
+    file.close();
+    codec = NULL;
+    index.clear();
+    lines       = 1;
+    indexing    = false;
+    block.clear();
+    blockStart  = -1;
+    cacheLines.clear();
+    cacheFirst  = 0;
+    cursorLine  = 0;
+    matchLength = 0;
+    maxWidth    = 0;
+    horizontalScrollBar()->setValue( 0 );
+    verticalScrollBar()->setValue( 0 );
+    viewport()->update();
+}
+
+
+bool QeFileView::isOpen() const
+{
+    return file.isOpen();
+}
+
+
+bool QeFileView::isIndexing() const
+{
+    return indexing;
+}
+
+
+qint64 QeFileView::lineCount() const
+{
+    return lines;
+}
+
+
+qint64 QeFileView::currentLine() const
+{
+    return cursorLine;
+}
+
+
+int QeFileView::currentColumn() const
+{
+    return matchLength ? matchStart : 0;
+}
+
+
+// Return the text of the current find result, or failing that the whole of
+// the current line.
+//
+QString QeFileView::selectedText()
+{
+    QString text = lineText( cursorLine );
+    return matchLength ? text.mid( matchStart, matchLength ) : text;
+}
+
+
+// Return whether the current find result lies within the part of its line
+// which is shown (lines are truncated to VIEW_MAX_LINE_BYTES).
+//
+bool QeFileView::isMatchShown()
+{
+    return matchLength && ( matchStart + matchLength <= lineText( cursorLine ).size() );
+}
+
+
+bool QeFileView::isFinding() const
+{
+    return finding;
+}
+
+
+// Make the given line (counting from 0) current, and scroll it into the
+// middle of the view.
+//
+void QeFileView::goToLine( qint64 line )
+{
+    line = qBound( (qint64) 0, line, lines - 1 );
+    qint64 offset = lineOffset( line );
+    if ( offset < 0 )
+        return;
+    setCurrentLine( line, offset );
+    setTopLine( line - visibleLines() / 2 );
+}
+
+
+// Start looking for the next (or previous) match for the given pattern,
+// from the current position or from the start (or end) of the file.  The
+// search runs in another thread, which reads the file a line at a time, so it
+// works at the speed of the disk rather than being limited by memory; the
+// result comes back with findComplete().  Any search already running is
+// abandoned.  Matches never span lines.
+//
+void QeFileView::find( const QRegExp &pattern, bool backwards, bool fromEdge )
+{
+    if ( !isOpen() )
+        return;
+    cancelFind();
+
+    qint64 line;
+    int column;
+    if ( !backwards ) {
+        line   = fromEdge ? 0 : cursorLine;
+        column = ( fromEdge || !matchLength ) ? 0 : matchStart + matchLength;
+    }
+    else {
+        // The match must start before 'column' (-1 for anywhere)
+        line   = fromEdge ? lines - 1 : cursorLine;
+        column = ( fromEdge || !matchLength ) ? -1 : matchStart;
+        if ( !fromEdge && !matchLength ) {
+            // Nothing found yet on the current line, so start from the one before
+            line--;
+        }
+    }
+
+    finder->setSearch( ++findId, pattern, backwards, line, lineOffset( line ), column, index );
+    finding = true;
+    viewport()->setCursor( Qt::BusyCursor );
+    finder->start();
+}
+
+
+// Stop the search started by find(), if it is still running.  Returns whether
+// it was.
+//
+bool QeFileView::cancelFind()
+{
+    bool wasFinding = finding;
+    finder->cancel();
+    finder->wait();
+    findId++;       // (in case its result is already on the way)
+    finding = false;
+    viewport()->unsetCursor();
+    return wasFinding;
+}
+
+
+// ---------------------------------------------------------------------------
+// Overridden events
+//
+
+void QeFileView::paintEvent( QPaintEvent *event )
+{
+    Q_UNUSED( event );
+    if ( !isOpen() )
+        return;
+
+    QPainter painter( viewport() );
+    QFontMetrics metrics( font() );
+    int lineHeight = metrics.lineSpacing();
+    int x = VIEW_MARGIN - horizontalScrollBar()->value();
+    int count = visibleLines() + 1;
+    int widest = maxWidth;
+    qint64 top = topLine();
+
+    for ( int i = 0; ( i < count ) && ( top + i < lines ); i++ ) {
+        qint64 line = top + i;
+        QString raw  = lineText( line );
+        QString text = expandTabs( raw );
+        int y = i * lineHeight;
+
+        painter.setPen( palette().color( QPalette::Text ));
+        if ( line == cursorLine )
+            painter.fillRect( 0, y, viewport()->width(), lineHeight, palette().alternateBase() );
+        painter.drawText( x, y + metrics.ascent(), text );
+
+        if (( line == cursorLine ) && matchLength ) {
+            // Highlight the find result
+            QString before = expandTabs( raw.left( matchStart )),
+                    match  = expandTabs( raw.left( matchStart + matchLength )).mid( before.size() );
+            int start = metrics.width( before ),
+                width = metrics.width( match );
+            painter.fillRect( x + start, y, width, lineHeight, palette().highlight() );
+            painter.setPen( palette().color( QPalette::HighlightedText ));
+            painter.drawText( x + start, y + metrics.ascent(), match );
+        }
+        widest = qMax( widest, metrics.width( text ) + VIEW_MARGIN * 2 );
+    }
+
+    if ( widest > maxWidth ) {
+        maxWidth = widest;
+        QTimer::singleShot( 0, this, SLOT( updateScrollBars() ));
+    }
+}
+
+
+void QeFileView::resizeEvent( QResizeEvent *event )
+{
+    QAbstractScrollArea::resizeEvent( event );
+    updateScrollBars();
+}
+
+
+void QeFileView::keyPressEvent( QKeyEvent *event )
+{
+    qint64 line = cursorLine;
+    int page = qMax( 1, visibleLines() - 1 );
+    bool bControl = ( event->modifiers() & Qt::ControlModifier );
+
+    switch ( event->key() ) {
+        case Qt::Key_Up:        line--;         break;
+        case Qt::Key_Down:      line++;         break;
+        case Qt::Key_PageUp:    line -= page;   break;
+        case Qt::Key_PageDown:  line += page;   break;
+        case Qt::Key_Home:
+            if ( bControl ) line = 0;
+            horizontalScrollBar()->setValue( 0 );
+            break;
+        case Qt::Key_End:
+            if ( bControl ) line = lines - 1;
+            break;
+        case Qt::Key_Left:
+            horizontalScrollBar()->triggerAction( QAbstractSlider::SliderSingleStepSub );
+            return;
+        case Qt::Key_Right:
+            horizontalScrollBar()->triggerAction( QAbstractSlider::SliderSingleStepAdd );
+            return;
+        case Qt::Key_Escape:
+            if ( cancelFind() )
+                emit findCancelled();
+            else
+                QAbstractScrollArea::keyPressEvent( event );
+            return;
+        default:
+            if ( event->matches( QKeySequence::Copy ))
+                QApplication::clipboard()->setText( selectedText() );
+            else
+                QAbstractScrollArea::keyPressEvent( event );
+            return;
+    }
+
+    line = qBound( (qint64) 0, line, lines - 1 );
+    qint64 offset = lineOffset( line );
+    if ( offset < 0 )
+        return;
+    setCurrentLine( line, offset );
+    qint64 top = topLine();
+    if ( line < top )
+        setTopLine( line );
+    else if ( line >= top + visibleLines() )
+        setTopLine( line - visibleLines() + 1 );
+}
+
+
+void QeFileView::mousePressEvent( QMouseEvent *event )
+{
+    int lineHeight = QFontMetrics( font() ).lineSpacing();
+    qint64 line = topLine() + event->pos().y() / lineHeight;
+    if ( line >= lines )
+        return;
+    qint64 offset = lineOffset( line );
+    if ( offset >= 0 )
+        setCurrentLine( line, offset );
+}
+
+
+void QeFileView::scrollContentsBy( int dx, int dy )
+{
+    Q_UNUSED( dx );
+    Q_UNUSED( dy );
+    viewport()->update();
+}
+
+
+// ---------------------------------------------------------------------------
+// Private slots
+//
+
+// Collect the latest entries from the index thread.
+//
+void QeFileView::readIndex()
+{
+    if ( !isOpen() )
+        return;
+
+    bool bComplete;
+    qint64 found = indexer->readIndex( index, &bComplete );
+    // (find() may have gone beyond what the index has reached so far)
+    lines = bComplete ? found : qMax( lines, found );
+    updateScrollBars();
+    viewport()->update();
+
+    if ( !indexing )
+        return;
+    if ( bComplete ) {
+        indexing = false;
+        emit indexComplete( lines );
+    }
+    else
+        emit indexProgress( indexer->progress() );
+}
+
+
+// Show the result of the search started by find(), unless it has since been
+// cancelled or superseded.
+//
+void QeFileView::readFindResult( int id )
+{
+    if ( !finding || ( id != findId ))
+        return;
+
+    // (it has finished, but must be out of run() before it can be restarted)
+    finder->wait();
+    finding = false;
+    viewport()->unsetCursor();
+
+    qint64 line, offset;
+    int start, length;
+    bool bFound = finder->result( &line, &offset, &start, &length );
+    if ( bFound )
+        setMatch( line, offset, start, length );
+    emit findComplete( bFound );
+}
+
+
+void QeFileView::updateScrollBars()
+{
+    int visible = visibleLines();
+
+    // The scroll bar's range is only an int, so very large files scroll by
+    // more than one line per step
+    scrollScale = ( lines / 0x40000000 ) + 1;
+    QScrollBar *bar = verticalScrollBar();
+    bar->setRange( 0, (int)( qMax( (qint64) 0, lines - visible ) / scrollScale ));
+    bar->setPageStep( qMax( 1, (int)( visible / scrollScale )));
+    bar->setSingleStep( 1 );
+
+    bar = horizontalScrollBar();
+    bar->setRange( 0, qMax( 0, maxWidth - viewport()->width() ));
+    bar->setPageStep( viewport()->width() );
+    bar->setSingleStep( QFontMetrics( font() ).averageCharWidth() * 4 );
+}
+
+
+// ---------------------------------------------------------------------------
+// Private methods
+//
+
+// Return the byte offset at which the given line starts, or -1 if there is
+// no such line.  This starts from the nearest known position (an index entry
+// or the last line located) and reads forward, so it is cheap for any line up
+// to where the index has reached.
+//
+qint64 QeFileView::lineOffset( qint64 line )
+{
+    if ( index.isEmpty() || ( line < 0 ))
+        return -1;
+
+    qint64 entry = qMin( line / INDEX_INTERVAL, (qint64) index.size() - 1 );
+    qint64 known = entry * INDEX_INTERVAL;
+    qint64 pos   = index.at( entry );
+    if (( hintLine <= line ) && ( hintLine > known )) {
+        known = hintLine;
+        pos   = hintOffset;
+    }
+    while (( known < line ) && ( pos >= 0 )) {
+        pos = readLine( pos, NULL );
+        known++;
+    }
+    if ( pos < 0 )
+        return -1;
+
+    hintLine   = line;
+    hintOffset = pos;
+    return pos;
+}
+
+
+// Read the line which starts at the given offset into 'bytes' (if given), not
+// including the line end, and truncated to VIEW_MAX_LINE_BYTES.  Returns the
+// offset of the next line, or -1 if this was the last.
+//
+qint64 QeFileView::readLine( qint64 pos, QByteArray *bytes )
+{
+    if ( bytes )
+        bytes->clear();
+
+    qint64 total = file.size();
+    while (( pos < total ) && loadBlock( pos )) {
+        int offset = (int)( pos - blockStart );
+        const char *data = block.constData() + offset;
+        int available = block.size() - offset;
+        int found = QeIndexThread::findNewline( data, available, unitSize, bigEndian );
+        int count = ( found < 0 ) ? available : found;
+        if ( bytes && ( bytes->size() < VIEW_MAX_LINE_BYTES ))
+            bytes->append( data, qMin( count, VIEW_MAX_LINE_BYTES - bytes->size() ));
+        if ( found >= 0 )
+            return pos + found + unitSize;
+        pos += available;
+    }
+    return -1;
+}
+
+
+// Make sure the block buffer contains the given offset.
+//
+bool QeFileView::loadBlock( qint64 pos )
+{
+    if (( blockStart >= 0 ) && ( pos >= blockStart ) && ( pos < blockStart + block.size() ))
+        return true;
+
+    block.clear();
+    if ( file.seek( pos ))
+        block = file.read( VIEW_BLOCK_SIZE );
+    blockStart = block.isEmpty() ? -1 : pos;
+    return ( blockStart >= 0 );
+}
+
+
+QString QeFileView::decodeLine( const QByteArray &bytes )
+{
+    QString text;
+    if ( unicodeDecoder.format() != QeUnicodeConverter::Unsupported ) {
+        unicodeDecoder.reset();
+        text = unicodeDecoder.toUnicode( bytes.constData(), bytes.size() );
+        text += unicodeDecoder.finishDecoding();
+    }
+    else
+        text = codec->toUnicode( bytes );
+
+    if ( text.endsWith( QLatin1Char('\r')))
+        text.chop( 1 );
+    return text;
+}
+
+
+// Return the decoded text of the given line, from the cache if possible.
+//
+QString QeFileView::lineText( qint64 line )
+{
+    if (( line < cacheFirst ) || ( line >= cacheFirst + cacheLines.size() ))
+        fillCache( qMax( (qint64) 0, line - VIEW_CACHE_LINES / 4 ));
+    if (( line < cacheFirst ) || ( line >= cacheFirst + cacheLines.size() ))
+        return QString();
+    return cacheLines.at( (int)( line - cacheFirst ));
+}
+
+
+// Decode VIEW_CACHE_LINES lines starting from the given one, replacing the
+// previous contents of the cache.
+//
+void QeFileView::fillCache( qint64 first )
+{
+    cacheLines.clear();
+    cacheFirst = first;
+
+    qint64 pos = lineOffset( first );
+    QByteArray bytes;
+    while (( pos >= 0 ) && ( cacheLines.size() < VIEW_CACHE_LINES )) {
+        pos = readLine( pos, &bytes );
+        cacheLines.append( decodeLine( bytes ));
+    }
+}
+
+
+qint64 QeFileView::topLine() const
+{
+    return (qint64) verticalScrollBar()->value() * scrollScale;
+}
+
+
+void QeFileView::setTopLine( qint64 line )
+{
+    verticalScrollBar()->setValue( (int)( qMax( (qint64) 0, line ) / scrollScale ));
+}
+
+
+int QeFileView::visibleLines() const
+{
+    return qMax( 1, viewport()->height() / QFontMetrics( font() ).lineSpacing() );
+}
+
+
+void QeFileView::setCurrentLine( qint64 line, qint64 offset )
+{
+    cursorLine  = line;
+    hintLine    = line;
+    hintOffset  = offset;
+    matchLength = 0;
+    viewport()->update();
+    emit positionChanged( cursorLine, 0 );
+}
+
+
+void QeFileView::setMatch( qint64 line, qint64 offset, int start, int length )
+{
+    if ( line >= lines ) {
+        // Beyond what the index has reached so far
+        lines = line + 1;
+        updateScrollBars();
+    }
+    setCurrentLine( line, offset );
+    matchStart  = start;
+    matchLength = length;
+    emit positionChanged( cursorLine, matchStart );
+
+    qint64 top = topLine();
+    if (( line < top ) || ( line >= top + visibleLines() ))
+        setTopLine( line - visibleLines() / 2 );
+    else
+        viewport()->update();
+
+    // Scroll sideways if needed to show the match
+    QFontMetrics metrics( font() );
+    QString text = lineText( line );
+    int x = metrics.width( expandTabs( text.left( start ))),
+        right = metrics.width( expandTabs( text.left( start + length )));
+    if ( right + VIEW_MARGIN * 2 > maxWidth ) {
+        maxWidth = right + VIEW_MARGIN * 2;
+        updateScrollBars();
+    }
+    QScrollBar *bar = horizontalScrollBar();
+    if (( x < bar->value() ) || ( right > bar->value() + viewport()->width() - VIEW_MARGIN * 2 ))
+        bar->setValue( qMax( 0, x - viewport()->width() / 4 ));
+}
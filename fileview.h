@@ -0,0 +1,143 @@
+/******************************************************************************
+** QE - fileview.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+#ifndef QE_FILEVIEW_H
+#define QE_FILEVIEW_H
+
+#include <QAbstractScrollArea>
+#include <QFile>
+#include <QTextCodec>
+#include <QStringList>
+#include <QRegExp>
+#include "simdcodec.h"
+
+
+#define VIEW_SIZE_THRESHOLD  ((qint64) 0x10000000)  // files larger than this are offered the viewer
+#define VIEW_BLOCK_SIZE      0x100000               // bytes read from the file at a time
+#define VIEW_CACHE_LINES     512                    // decoded lines kept around the viewport
+#define VIEW_MAX_LINE_BYTES  0x10000                // longer lines are shown truncated
+#define VIEW_TAB_WIDTH       8
+
+class QeIndexThread;
+class QeFindThread;
+
+
+// ============================================================================
+// QeFileView
+//
+// A read-only view of a file of any size.  The file stays on disk and is read
+// on demand a block at a time (without mapping it); a QeIndexThread builds a
+// sparse line index in the background; and only the lines around the viewport
+// are decoded and kept.  Memory use is therefore fixed, apart from
+// the index itself (8 bytes per INDEX_INTERVAL lines).
+//
+// There is no text cursor as such, only a current line, which follows the
+// keyboard, mouse clicks, goToLine() and find().  find() runs in a
+// QeFindThread and reports back with findComplete().
+//
+
+class QeFileView : public QAbstractScrollArea
+{
+    Q_OBJECT
+
+public:
+    QeFileView( QWidget *parent = 0 );
+    ~QeFileView();
+
+    bool    open( const QString &fileName, QTextCodec *codec );
+    void    close();
+    bool    isOpen() const;
+    bool    isIndexing() const;
+    qint64  lineCount() const;
+    qint64  currentLine() const;
+    int     currentColumn() const;
+    QString selectedText();
+    bool    isMatchShown();
+    bool    isFinding() const;
+
+    void    goToLine( qint64 line );
+    void    find( const QRegExp &pattern, bool backwards, bool fromEdge );
+    bool    cancelFind();
+
+signals:
+    void    positionChanged( qint64 line, int column );
+    void    indexProgress( int percentage );
+    void    indexComplete( qint64 lines );
+    void    findProgress( int percentage );
+    void    findComplete( bool found );
+    void    findCancelled();
+
+protected:
+    void    paintEvent( QPaintEvent *event );
+    void    resizeEvent( QResizeEvent *event );
+    void    keyPressEvent( QKeyEvent *event );
+    void    mousePressEvent( QMouseEvent *event );
+    void    scrollContentsBy( int dx, int dy );
+
+private slots:
+    void    readIndex();
+    void    readFindResult( int id );
+    void    updateScrollBars();
+
+private:
+    qint64  lineOffset( qint64 line );
+    qint64  readLine( qint64 pos, QByteArray *bytes );
+    bool    loadBlock( qint64 pos );
+    QString decodeLine( const QByteArray &bytes );
+    QString lineText( qint64 line );
+    void    fillCache( qint64 first );
+    qint64  topLine() const;
+    void    setTopLine( qint64 line );
+    int     visibleLines() const;
+    void    setCurrentLine( qint64 line, qint64 offset );
+    void    setMatch( qint64 line, qint64 offset, int start, int length );
+
+    QFile           file;
+    QTextCodec     *codec;
+    QeUnicodeConverter unicodeDecoder;     // used instead of the codec for UTF-8/16
+    qint64          dataStart;      // offset of the first line (after any BOM)
+    int             unitSize;       // size of a line end: 1, or 2 for UTF-16
+    bool            bigEndian;
+
+    QeIndexThread  *indexer;
+    QVector<qint64> index;          // offset of every INDEX_INTERVAL'th line
+    qint64          lines;          // lines known so far
+    bool            indexing;
+
+    QeFindThread   *finder;
+    int             findId;         // the search whose result is wanted
+    bool            finding;
+
+    qint64          hintLine;       // the last line located, to save rescanning
+    qint64          hintOffset;
+    QByteArray      block;          // the last block read from the file
+    qint64          blockStart;
+
+    qint64          cacheFirst;     // line number of cacheLines[ 0 ]
+    QStringList     cacheLines;
+
+    qint64          cursorLine;
+    int             matchStart;     // find result in the current line, if any
+    int             matchLength;
+    int             maxWidth;       // widest line drawn so far, in pixels
+    qint64          scrollScale;    // lines per vertical scroll bar step
+};
+
+#endif      // QE_FILEVIEW_H
@@ -0,0 +1,164 @@
+/******************************************************************************
+** QE - instance.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QDataStream>
+#include "instance.h"
+#include "mainwindow.h"
+
+
+// ----------------------------------------------------------------------------
+QeInstanceServer::QeInstanceServer( QObject *parent )
+    : QObject( parent )
+{
+    server = new QLocalServer( this );
+    connect( server, SIGNAL( newConnection() ), this, SLOT( acceptConnection() ));
+}
+
+
+// ----------------------------------------------------------------------------
+// Start taking requests from other instances.  If the name is in use, it may
+// be a socket left over from an instance that crashed, which is replaced; but
+// only if nothing answers on it.  (forward() may also have given up on an
+// instance that's running but was slow to answer, which keeps its socket.)
+//
+bool QeInstanceServer::listen()
+{
+    QString name = serverName();
+    if ( server->listen( name ))
+        return true;
+    if ( server->serverError() == QAbstractSocket::AddressInUseError ) {
+        QLocalSocket probe;
+        probe.connectToServer( name );
+        probe.waitForConnected( INSTANCE_TIMEOUT );
+        if (( probe.error() == QLocalSocket::ServerNotFoundError ) ||
+            ( probe.error() == QLocalSocket::ConnectionRefusedError ))
+        {
+            QLocalServer::removeServer( name );
+            if ( server->listen( name ))
+                return true;
+        }
+        probe.abort();
+    }
+    qWarning("Could not listen for other instances: %s", qPrintable( server->errorString() ));
+    return false;
+}
+
+
+// ----------------------------------------------------------------------------
+// Hand a file over to a running instance.  Returns false if there isn't one,
+// or it didn't take up the request in time.
+//
+bool QeInstanceServer::forward( const QString &fileName, bool readOnly, bool useEncoding, const QString &encoding )
+{
+    QLocalSocket socket;
+    socket.connectToServer( serverName() );
+    if ( !socket.waitForConnected( INSTANCE_TIMEOUT ))
+        return false;
+
+    QByteArray request;
+    QDataStream out( &request, QIODevice::WriteOnly );
+    out.setVersion( QDataStream::Qt_4_6 );
+    out << (quint32) 0 << (quint32) INSTANCE_VERSION
+        << fileName << readOnly << useEncoding << encoding;
+    out.device()->seek( 0 );
+    out << (quint32)( request.size() - sizeof( quint32 ));
+
+    socket.write( request );
+    if ( !socket.waitForBytesWritten( INSTANCE_TIMEOUT ))
+        return false;
+    if ( !socket.waitForReadyRead( INSTANCE_TIMEOUT ))
+        return false;
+    return ( socket.read( 1 ) == "1");
+}
+
+
+// ----------------------------------------------------------------------------
+// One per user: a second user's instance mustn't open files in the first's
+// session (and under Windows, pipe names are global).
+//
+QString QeInstanceServer::serverName()
+{
+    QByteArray user = qgetenv("USER");
+    if ( user.isEmpty() )
+        user = qgetenv("USERNAME");
+    QString name( INSTANCE_SERVER_NAME );
+    if ( !user.isEmpty() )
+        name += QLatin1Char('-') + QString::fromLocal8Bit( user );
+    return name;
+}
+
+
+// ----------------------------------------------------------------------------
+void QeInstanceServer::acceptConnection()
+{
+    while ( server->hasPendingConnections() ) {
+        QLocalSocket *socket = server->nextPendingConnection();
+        connect( socket, SIGNAL( readyRead() ), this, SLOT( readRequest() ));
+        connect( socket, SIGNAL( disconnected() ), socket, SLOT( deleteLater() ));
+        if ( socket->bytesAvailable() )
+            QMetaObject::invokeMethod( this, "readRequest", Qt::QueuedConnection );
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Once a whole request has arrived, open a new window for it.  The request is
+// acknowledged first: opening the file may ask the user something (such as
+// whether to view a large file), and the client won't wait that long.
+//
+void QeInstanceServer::readRequest()
+{
+    QList<QLocalSocket *> sockets = server->findChildren<QLocalSocket *>();
+    for ( int i = 0; i < sockets.size(); i++ ) {
+        QLocalSocket *socket = sockets.at( i );
+        quint32 length;
+        if (( socket->bytesAvailable() < (qint64) sizeof( length )) ||
+            ( socket->peek( sizeof( length )).size() < (int) sizeof( length )))
+            continue;
+        QDataStream in( socket );
+        in.setVersion( QDataStream::Qt_4_6 );
+        QDataStream header( socket->peek( sizeof( length )));
+        header >> length;
+        if ( socket->bytesAvailable() < (qint64)( sizeof( length ) + length ))
+            continue;
+
+        quint32 version;
+        QString fileName, encoding;
+        bool    readOnly, useEncoding;
+        in >> length >> version;
+        if ( version != INSTANCE_VERSION ) {
+            socket->read( length - sizeof( version ));
+            socket->write("0");
+            continue;
+        }
+        in >> fileName >> readOnly >> useEncoding >> encoding;
+        socket->write("1");
+        socket->flush();
+
+        MainWindow *window = new MainWindow;
+        window->openFromCommandLine( fileName, readOnly, useEncoding, encoding );
+        window->show();
+        window->raise();
+        window->activateWindow();
+    }
+}
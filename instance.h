@@ -0,0 +1,72 @@
+/******************************************************************************
+** QE - instance.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#ifndef QE_INSTANCE_H
+#define QE_INSTANCE_H
+
+#include <QObject>
+#include <QString>
+
+class QLocalServer;
+
+
+#define INSTANCE_SERVER_NAME    "qe-instance"
+#define INSTANCE_TIMEOUT        5000    // ms to wait for the running instance to answer
+#define INSTANCE_VERSION        1       // of the request format
+
+
+// ============================================================================
+// QeInstanceServer
+//
+// Single-instance mode (the /single option).  The first QE started with it
+// listens on a local socket (named pipe under Windows), one per user; later
+// ones just send it their file name and options, with forward(), and exit.
+// Each file handed over is opened in a new window.
+//
+// A request is a length-prefixed QDataStream record: the format version,
+// file name, read-only flag, and encoding (if any).  The server answers with
+// a single '1' as soon as it has the request (before opening the window), so
+// that a client whose request isn't taken up can fall back to opening the
+// file itself.
+//
+
+class QeInstanceServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    QeInstanceServer( QObject *parent = 0 );
+
+    bool    listen();
+
+    static bool forward( const QString &fileName, bool readOnly, bool useEncoding, const QString &encoding );
+
+private slots:
+    void    acceptConnection();
+    void    readRequest();
+
+private:
+    static QString serverName();
+
+    QLocalServer *server;
+};
+
+#endif      // QE_INSTANCE_H
@@ -0,0 +1,597 @@
+/******************************************************************************
+** QE - journal.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDesktopServices>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTimer>
+#include "journal.h"
+#include "qetextedit.h"
+#if defined( Q_OS_WIN32 )
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <signal.h>
+#include <errno.h>
+#endif
+
+
+// ============================================================================
+// QeJournalWriter
+//
+
+QeJournalWriter::QeJournalWriter()
+{
+    busy = false;
+}
+
+
+// ----------------------------------------------------------------------------
+// Add bytes to the end of the given journal.
+//
+void QeJournalWriter::append( const QString &fileName, const QByteArray &bytes )
+{
+    queue( Append, fileName, bytes );
+}
+
+
+// ----------------------------------------------------------------------------
+// Replace the given journal (or create it) with the bytes given.  The new
+// contents are written to a temporary file first, so a crash part way through
+// leaves the old journal as it was.
+//
+void QeJournalWriter::replace( const QString &fileName, const QByteArray &bytes )
+{
+    queue( Replace, fileName, bytes );
+}
+
+
+// ----------------------------------------------------------------------------
+void QeJournalWriter::remove( const QString &fileName )
+{
+    queue( Remove, fileName, QByteArray() );
+}
+
+
+// ----------------------------------------------------------------------------
+void QeJournalWriter::queue( Operation operation, const QString &fileName, const QByteArray &bytes )
+{
+    QMutexLocker locker( &mutex );
+    Job job;
+    job.operation = operation;
+    job.fileName  = fileName;
+    job.bytes     = bytes;
+    jobs.append( job );
+    if ( !busy ) {
+        // (If the thread has only just run out of work, let it finish first)
+        busy = true;
+        wait();
+        start( QThread::LowPriority );
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+void QeJournalWriter::run()
+{
+    forever {
+        QMutexLocker locker( &mutex );
+        if ( jobs.isEmpty() ) {
+            busy = false;
+            return;
+        }
+        Job job = jobs.takeFirst();
+        locker.unlock();
+
+        switch ( job.operation ) {
+            case Append: {
+                QFile file( job.fileName );
+                if ( !file.open( QIODevice::WriteOnly | QIODevice::Append ) ||
+                     ( file.write( job.bytes ) != job.bytes.size() ))
+                    qWarning("Could not write journal %s", qPrintable( job.fileName ));
+                break;
+            }
+            case Replace: {
+                QDir().mkpath( QFileInfo( job.fileName ).absolutePath() );
+                QString tempName = job.fileName + JOURNAL_TEMP_SUFFIX;
+                QFile file( tempName );
+                if ( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) ||
+                     ( file.write( job.bytes ) != job.bytes.size() )) {
+                    qWarning("Could not write journal %s", qPrintable( tempName ));
+                    break;
+                }
+                file.close();
+                QFile::remove( job.fileName );
+                QFile::rename( tempName, job.fileName );
+                break;
+            }
+            case Remove:
+                QFile::remove( job.fileName );
+                break;
+        }
+    }
+}
+
+
+
+// ============================================================================
+// QeEditJournal
+//
+
+// ----------------------------------------------------------------------------
+QeEditJournal::QeEditJournal( QeTextEdit *textEdit, QObject *parent )
+    : QObject( parent )
+{
+    static int windows = 0;
+
+    editor        = textEdit;
+    active        = false;
+    suspended     = false;
+    written       = false;
+    rebasing      = false;
+    journalSize   = 0;
+    compactedSize = 0;
+    journalName   = directory() + "/" JOURNAL_PREFIX + QString::number( QCoreApplication::applicationPid() ) +
+                    QLatin1Char('-') + QString::number( ++windows ) + JOURNAL_SUFFIX;
+
+    flushTimer = new QTimer( this );
+    flushTimer->setSingleShot( true );
+    flushTimer->setInterval( JOURNAL_FLUSH_INTERVAL );
+    connect( flushTimer, SIGNAL( timeout() ), this, SLOT( flush() ));
+    connect( editor, SIGNAL( textChange( int, int, const QString & )),
+             this, SLOT( recordChange( int, int, const QString & )));
+}
+
+
+// ----------------------------------------------------------------------------
+QeEditJournal::~QeEditJournal()
+{
+    writer.wait();
+}
+
+
+// ----------------------------------------------------------------------------
+// Start a new journal for the editor's document, which is the given file as
+// it is on disk now (or a new file, if the name is empty).  Nothing is
+// written until the first change.
+//
+void QeEditJournal::start( const QString &fileName, const QString &encoding )
+{
+    stop();
+    setBase( fileName, encoding );
+    active    = true;
+    suspended = false;
+    editor->setTracking( true );
+}
+
+
+// ----------------------------------------------------------------------------
+// Stop recording, and remove the journal.
+//
+void QeEditJournal::stop()
+{
+    if ( !active )
+        return;
+    active = false;
+    flushTimer->stop();
+    editor->setTracking( false );
+    pending.clear();
+    regions.clear();
+    rebaseRegions.clear();
+    rebasing = false;
+    if ( written )
+        writer.remove( journalName );
+    written       = false;
+    journalSize   = 0;
+    compactedSize = 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// Stop, and wait until the journal is gone; for when the window is closing (and
+// the program may be about to end).
+//
+void QeEditJournal::finish()
+{
+    stop();
+    writer.wait();
+}
+
+
+// ----------------------------------------------------------------------------
+bool QeEditJournal::isActive() const
+{
+    return active;
+}
+
+
+// ----------------------------------------------------------------------------
+// The text is about to be saved, as it is now.  Until rebased() or
+// cancelRebase(), changes are tracked against both the base and this text.
+//
+void QeEditJournal::beginRebase()
+{
+    if ( !active )
+        return;
+    rebasing = true;
+    rebaseRegions.clear();
+}
+
+
+// ----------------------------------------------------------------------------
+// The save begun by beginRebase() has finished, as the given file; which is
+// the new base.  The journal is rewritten with what's been changed since, if
+// anything, or else removed.  Also used (with rebaseRegions empty) when the
+// base file has changed along with the text.
+//
+void QeEditJournal::rebased( const QString &fileName, const QString &encoding )
+{
+    if ( !active )
+        return;
+    if ( rebasing )
+        regions = rebaseRegions;
+    rebaseRegions.clear();
+    rebasing = false;
+    setBase( fileName, encoding );
+
+    // Everything pending is in the regions
+    pending.clear();
+    flushTimer->stop();
+    if ( !regions.isEmpty() )
+        compact();
+    else if ( written ) {
+        writer.remove( journalName );
+        written       = false;
+        journalSize   = 0;
+        compactedSize = 0;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+void QeEditJournal::cancelRebase()
+{
+    rebasing = false;
+    rebaseRegions.clear();
+}
+
+
+// ----------------------------------------------------------------------------
+// While suspended, changes aren't recorded.  This is for text appended to the
+// end of the document which has also been appended to the base file (see
+// MainWindow::followAppend); rebased() should be called afterwards.
+//
+void QeEditJournal::setSuspended( bool suspend )
+{
+    suspended = suspend;
+}
+
+
+// ----------------------------------------------------------------------------
+// Write the changes collected so far to the end of the journal, and compact
+// it if it's grown enough.
+//
+void QeEditJournal::flush()
+{
+    if ( !active || pending.isEmpty() )
+        return;
+
+    QByteArray bytes;
+    if ( !written )
+        bytes = headerBytes();
+    QDataStream out( &bytes, QIODevice::WriteOnly | QIODevice::Append );
+    out.setVersion( QDataStream::Qt_4_6 );
+    for ( int i = 0; i < pending.size(); i++ )
+        writeChange( out, pending.at( i ));
+    pending.clear();
+
+    if ( written )
+        writer.append( journalName, bytes );
+    else
+        writer.replace( journalName, bytes );
+    written = true;
+    journalSize += bytes.size();
+
+    if (( journalSize > JOURNAL_COMPACT_SIZE ) && ( journalSize > 2 * compactedSize ))
+        compact();
+}
+
+
+// ----------------------------------------------------------------------------
+// Add a change reported by the editor, merging it with the last one if it
+// carries on from it (more typing, or backspacing or deleting).
+//
+void QeEditJournal::recordChange( int position, int removed, const QString &added )
+{
+    if ( !active || suspended )
+        return;
+
+    updateRegions( regions, position, removed, added.size() );
+    if ( rebasing )
+        updateRegions( rebaseRegions, position, removed, added.size() );
+
+    if ( !flushTimer->isActive() )
+        flushTimer->start();
+    if ( !pending.isEmpty() ) {
+        QeTextChange &last = pending.last();
+        int lastEnd = last.position + last.text.size();
+        if ( !removed && ( position == lastEnd )) {
+            last.text += added;
+            return;
+        }
+        if ( added.isEmpty() ) {
+            if (( position + removed == lastEnd ) && ( removed <= last.text.size() )) {
+                last.text.chop( removed );
+                if ( !last.length && last.text.isEmpty() )
+                    pending.removeLast();
+                return;
+            }
+            if ( last.text.isEmpty() && ( position + removed == last.position )) {
+                last.position = position;
+                last.length  += removed;
+                return;
+            }
+            if ( last.text.isEmpty() && ( position == last.position )) {
+                last.length += removed;
+                return;
+            }
+        }
+    }
+    QeTextChange change;
+    change.position = position;
+    change.length   = removed;
+    change.text     = added;
+    pending.append( change );
+}
+
+
+// ----------------------------------------------------------------------------
+void QeEditJournal::setBase( const QString &fileName, const QString &encoding )
+{
+    QFileInfo info( fileName );
+    bool exists = !fileName.isEmpty() && info.exists();
+    header.baseFile     = fileName;
+    header.baseSize     = exists ? info.size() : -1;
+    header.baseModified = exists ? info.lastModified().toMSecsSinceEpoch() : 0;
+    header.encoding     = encoding;
+}
+
+
+// ----------------------------------------------------------------------------
+QByteArray QeEditJournal::headerBytes() const
+{
+    QByteArray bytes;
+    QDataStream out( &bytes, QIODevice::WriteOnly );
+    out.setVersion( QDataStream::Qt_4_6 );
+    out << (quint32) JOURNAL_MAGIC << (quint32) JOURNAL_VERSION
+        << header.baseFile << header.baseSize << header.baseModified << header.encoding;
+    return bytes;
+}
+
+
+// ----------------------------------------------------------------------------
+// Rewrite the journal as one change per region that differs from the base,
+// in order, with their text as it is now.  (Replayed in turn, each region's
+// position holds, as the text before it is by then as it is now.)
+//
+void QeEditJournal::compact()
+{
+    QByteArray bytes = headerBytes();
+    QDataStream out( &bytes, QIODevice::WriteOnly | QIODevice::Append );
+    out.setVersion( QDataStream::Qt_4_6 );
+    for ( int i = 0; i < regions.size(); i++ ) {
+        const Region &region = regions.at( i );
+        QeTextChange change;
+        change.position = region.position;
+        change.length   = region.removed;
+        change.text     = editor->textAt( region.position, region.length );
+        writeChange( out, change );
+    }
+    writer.replace( journalName, bytes );
+    written       = true;
+    journalSize   = bytes.size();
+    compactedSize = journalSize;
+}
+
+
+// ----------------------------------------------------------------------------
+// Bring a list of regions up to date with a change: every region it touches
+// is merged with it into one, and those after it are moved along.  (Regions
+// are in order and don't overlap, so both their starts and ends are sorted.)
+//
+void QeEditJournal::updateRegions( QVector<Region> &regions, int position, int removed, int added )
+{
+    int end = position + removed;
+    int first = 0, n = regions.size();
+    for ( int top = n; first < top; ) {
+        int middle = ( first + top ) / 2;
+        if ( regions.at( middle ).position + regions.at( middle ).length < position )
+            first = middle + 1;
+        else
+            top = middle;
+    }
+
+    Region merged;
+    int start = position, stop = end, covered = 0, baseRemoved = 0;
+    int last = first;
+    for ( ; ( last < n ) && ( regions.at( last ).position <= end ); last++ ) {
+        const Region &region = regions.at( last );
+        start        = qMin( start, region.position );
+        stop         = qMax( stop, region.position + region.length );
+        covered     += region.length;
+        baseRemoved += region.removed;
+    }
+    merged.position = start;
+    merged.removed  = baseRemoved + ( stop - start - covered );
+    merged.length   = stop - start - removed + added;
+
+    int i = first;
+    regions.remove( first, last - first );
+    if ( merged.length || merged.removed )
+        regions.insert( i++, merged );
+    for ( ; i < regions.size(); i++ )
+        regions[ i ].position += added - removed;
+}
+
+
+// ----------------------------------------------------------------------------
+void QeEditJournal::writeChange( QDataStream &out, const QeTextChange &change )
+{
+    out << (qint32) change.position << (qint32) change.length << change.text;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the directory journals are kept in.
+//
+QString QeEditJournal::directory()
+{
+    QString path = QDesktopServices::storageLocation( QDesktopServices::DataLocation );
+    if ( path.isEmpty() )
+        path = QDir::tempPath();
+    return QDir::cleanPath( path + "/qe-journal");
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if the process with the given ID is still running.
+//
+static bool processRunning( qint64 pid )
+{
+#if defined( Q_OS_WIN32 )
+    HANDLE process = OpenProcess( SYNCHRONIZE, FALSE, (DWORD) pid );
+    if ( !process )
+        return false;
+    bool running = ( WaitForSingleObject( process, 0 ) == WAIT_TIMEOUT );
+    CloseHandle( process );
+    return running;
+#else
+    return ( kill( (pid_t) pid, 0 ) == 0 ) || ( errno == EPERM );
+#endif
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if the journal of the given name (without its path) belongs to
+// an instance which is no longer running.
+//
+static bool isOrphan( const QString &name )
+{
+    bool ok;
+    qint64 pid = name.mid( qstrlen( JOURNAL_PREFIX )).section('-', 0, 0 ).toLongLong( &ok );
+    return ok && ( pid != QCoreApplication::applicationPid() ) && !processRunning( pid );
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the journals (full paths, newest first) left behind by instances
+// which are no longer running.
+//
+QStringList QeEditJournal::orphans()
+{
+    QDir dir( directory() );
+
+    // A crash while a journal was being replaced (see QeJournalWriter) can
+    // leave only the new copy, which is complete by then, under its temporary
+    // name; so finish the job.  (If the old copy is still there, the new one
+    // may not be complete, and is ignored.)
+    QStringList temps = dir.entryList( QStringList() << JOURNAL_PREFIX "*" JOURNAL_SUFFIX JOURNAL_TEMP_SUFFIX,
+                                       QDir::Files );
+    for ( int i = 0; i < temps.size(); i++ ) {
+        QString name = temps.at( i );
+        name.chop( qstrlen( JOURNAL_TEMP_SUFFIX ));
+        if ( !dir.exists( name ) && isOrphan( name ))
+            dir.rename( temps.at( i ), name );
+    }
+
+    QStringList names = dir.entryList( QStringList() << JOURNAL_PREFIX "*" JOURNAL_SUFFIX,
+                                       QDir::Files, QDir::Time );
+    QStringList found;
+    for ( int i = 0; i < names.size(); i++ ) {
+        if ( isOrphan( names.at( i )))
+            found.append( dir.absoluteFilePath( names.at( i )));
+    }
+    return found;
+}
+
+
+// ----------------------------------------------------------------------------
+// Read a journal.  Returns false if it isn't one; otherwise the changes are
+// every complete one found, in order (a crash may have left the last one
+// written only in part).
+//
+bool QeEditJournal::read( const QString &journalName, Header *header, QList<QeTextChange> *changes )
+{
+    QFile file( journalName );
+    if ( !file.open( QIODevice::ReadOnly ))
+        return false;
+    QDataStream in( &file );
+    in.setVersion( QDataStream::Qt_4_6 );
+
+    quint32 magic, version;
+    in >> magic >> version;
+    if (( in.status() != QDataStream::Ok ) || ( magic != JOURNAL_MAGIC ) || ( version != JOURNAL_VERSION ))
+        return false;
+    in >> header->baseFile >> header->baseSize >> header->baseModified >> header->encoding;
+    if ( in.status() != QDataStream::Ok )
+        return false;
+
+    changes->clear();
+    while ( !in.atEnd() ) {
+        qint32 position, length;
+        QeTextChange change;
+        in >> position >> length >> change.text;
+        if ( in.status() != QDataStream::Ok )
+            break;
+        change.position = position;
+        change.length   = length;
+        changes->append( change );
+    }
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if a journal's base file is still as it was, so that its
+// changes can be replayed on it.
+//
+bool QeEditJournal::matchesBase( const Header &header )
+{
+    if ( header.baseFile.isEmpty() )
+        return true;
+    QFileInfo info( header.baseFile );
+    if ( header.baseSize < 0 )
+        return !info.exists();
+    return info.exists() && ( info.size() == header.baseSize ) &&
+           ( info.lastModified().toMSecsSinceEpoch() == header.baseModified );
+}
+
+
+// ----------------------------------------------------------------------------
+void QeEditJournal::discard( const QString &journalName )
+{
+    QFile::remove( journalName );
+    QFile::remove( journalName + JOURNAL_TEMP_SUFFIX );
+}
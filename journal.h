@@ -0,0 +1,174 @@
+/******************************************************************************
+** QE - journal.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+#ifndef QE_JOURNAL_H
+#define QE_JOURNAL_H
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
+#include "linediff.h"
+
+
+#define JOURNAL_FLUSH_INTERVAL  2000        // ms between writes of the changes made
+#define JOURNAL_COMPACT_SIZE    0x100000    // journal size that's worth compacting
+#define JOURNAL_MAGIC           0x51454A31  // "QEJ1"
+#define JOURNAL_VERSION         1
+#define JOURNAL_PREFIX          "qe-"
+#define JOURNAL_SUFFIX          ".qej"
+#define JOURNAL_TEMP_SUFFIX     ".tmp"      // added to a journal being replaced
+
+class QTimer;
+class QeTextEdit;
+
+
+// ============================================================================
+// QeJournalWriter
+//
+// Appends to (or replaces, or removes) journal files on a thread of its own,
+// so that the editor never waits for the disk.  Requests are carried out in
+// the order made; the thread runs only while there are some waiting.
+//
+
+class QeJournalWriter : public QThread
+{
+    Q_OBJECT
+
+public:
+    QeJournalWriter();
+
+    void    append( const QString &fileName, const QByteArray &bytes );
+    void    replace( const QString &fileName, const QByteArray &bytes );
+    void    remove( const QString &fileName );
+
+protected:
+    void    run();
+
+private:
+    enum Operation { Append, Replace, Remove };
+    struct Job {
+        Operation   operation;
+        QString     fileName;
+        QByteArray  bytes;
+    };
+
+    void    queue( Operation operation, const QString &fileName, const QByteArray &bytes );
+
+    QMutex      mutex;
+    QList<Job>  jobs;
+    bool        busy;
+};
+
+
+// ============================================================================
+// QeEditJournal
+//
+// Autosave, as a journal of the edits made to a document since it was last
+// loaded or saved (the "base" file).  Each change reported by the editor (see
+// QeTextEdit::textChange) becomes a record of position, characters removed
+// and text added; records are collected for JOURNAL_FLUSH_INTERVAL, merging
+// runs of typing and backspacing, and the batch is then appended to the file
+// by QeJournalWriter.  So the cost goes with the amount typed, however large
+// the document.
+//
+// Alongside, the journal keeps the regions of the text that differ from the
+// base, merged as edits overlap.  When the file has grown past twice its size
+// after the last compaction (and JOURNAL_COMPACT_SIZE), it's rewritten with
+// one record per region instead, taking their text from the editor.
+//
+// Once the document is saved, rebased() starts over against the new file,
+// keeping only whatever was typed while the save was going on.  A journal is
+// removed when its window is closed (or the text replaced), so one that's
+// still around at startup, and whose process has gone, was left by a crash;
+// see orphans() and read().
+//
+
+class QeEditJournal : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Header {
+        QString baseFile;       // empty for a new (untitled) document
+        qint64  baseSize;
+        qint64  baseModified;   // ms since the epoch
+        QString encoding;
+    };
+
+    QeEditJournal( QeTextEdit *editor, QObject *parent = 0 );
+    ~QeEditJournal();
+
+    void    start( const QString &fileName, const QString &encoding );
+    void    stop();
+    void    finish();
+    bool    isActive() const;
+    void    beginRebase();
+    void    rebased( const QString &fileName, const QString &encoding );
+    void    cancelRebase();
+    void    setSuspended( bool suspend );
+
+    static QString      directory();
+    static QStringList  orphans();
+    static bool         read( const QString &journalName, Header *header, QList<QeTextChange> *changes );
+    static bool         matchesBase( const Header &header );
+    static void         discard( const QString &journalName );
+
+public slots:
+    void    flush();
+
+private slots:
+    void    recordChange( int position, int removed, const QString &added );
+
+private:
+    // A region of the text that differs from the base: 'length' characters at
+    // 'position' replace 'removed' characters of the base.
+    struct Region {
+        int position;
+        int length;
+        int removed;
+    };
+
+    void        setBase( const QString &fileName, const QString &encoding );
+    QByteArray  headerBytes() const;
+    void        compact();
+
+    static void updateRegions( QVector<Region> &regions, int position, int removed, int added );
+    static void writeChange( QDataStream &out, const QeTextChange &change );
+
+    QeTextEdit     *editor;
+    QeJournalWriter writer;
+    QTimer         *flushTimer;
+    QString         journalName;
+    Header          header;
+    bool            active;
+    bool            suspended;      // changes aren't recorded (see setSuspended)
+    bool            written;        // the journal file exists
+    qint64          journalSize;    // bytes written to it so far
+    qint64          compactedSize;  // ...and as of the last compaction
+
+    QList<QeTextChange> pending;    // changes not yet written
+    QVector<Region>     regions;    // differences from the base
+    QVector<Region>     rebaseRegions;  // ...and from the text being saved, if any
+    bool                rebasing;
+};
+
+#endif      // QE_JOURNAL_H
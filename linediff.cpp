@@ -0,0 +1,245 @@
+/******************************************************************************
+** QE - linediff.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#include <string.h>
+#include "linediff.h"
+
+// Characters compared at a time when skipping the common start and end
+#define DIFF_BLOCK_SIZE     0x1000
+
+
+// Return the number of characters the two strings have in common at the start.
+//
+static int commonHead( const QChar *a, const QChar *b, int length )
+{
+    int i = 0;
+    while (( i + DIFF_BLOCK_SIZE <= length ) && !memcmp( a + i, b + i, DIFF_BLOCK_SIZE * sizeof( QChar )))
+        i += DIFF_BLOCK_SIZE;
+    while (( i < length ) && ( a[ i ] == b[ i ] ))
+        i++;
+    return i;
+}
+
+
+// Return the number of characters the two strings have in common at the end.
+//
+static int commonTail( const QChar *a, int aLength, const QChar *b, int bLength )
+{
+    int length = qMin( aLength, bLength );
+    int i = 0;
+    while (( i + DIFF_BLOCK_SIZE <= length ) &&
+           !memcmp( a + aLength - i - DIFF_BLOCK_SIZE, b + bLength - i - DIFF_BLOCK_SIZE, DIFF_BLOCK_SIZE * sizeof( QChar )))
+        i += DIFF_BLOCK_SIZE;
+    while (( i < length ) && ( a[ aLength - i - 1 ] == b[ bLength - i - 1 ] ))
+        i++;
+    return i;
+}
+
+
+// ---------------------------------------------------------------------------
+// Public methods
+//
+
+// Return the changes needed to turn oldText into newText.
+//
+QList<QeTextChange> QeLineDiff::compare( const QString &oldText, const QString &newText )
+{
+    QeLineDiff diff( oldText, newText );
+    const QChar *oldData = oldText.constData();
+    const QChar *newData = newText.constData();
+    int oldSize = oldText.size();
+    int newSize = newText.size();
+
+    // Skip the lines the two have in common at the start...
+    int head = commonHead( oldData, newData, qMin( oldSize, newSize ));
+    if (( head == oldSize ) && ( head == newSize ))
+        return diff.changes;
+    while (( head > 0 ) && ( oldData[ head - 1 ] != QLatin1Char('\n')))
+        head--;
+
+    // ...and the end (without overlapping the start in either)
+    int tail = commonTail( oldData + head, oldSize - head, newData + head, newSize - head );
+    while (( tail > 0 ) && ( oldSize - tail > head ) && ( oldData[ oldSize - tail - 1 ] != QLatin1Char('\n')))
+        tail--;
+
+    diff.oldEnd = oldSize - tail;
+    diff.newEnd = newSize - tail;
+    if (( head == diff.oldEnd ) || ( head == diff.newEnd )) {
+        // Lines only added, or only removed
+        QeTextChange change;
+        change.position = head;
+        change.length   = diff.oldEnd - head;
+        change.text     = newText.mid( head, diff.newEnd - head );
+        diff.changes.append( change );
+        return diff.changes;
+    }
+
+    splitLines( oldData, head, diff.oldEnd, diff.oldLines );
+    splitLines( newData, head, diff.newEnd, diff.newLines );
+    diff.diffLines();
+    return diff.changes;
+}
+
+
+// ---------------------------------------------------------------------------
+// Private methods
+//
+
+QeLineDiff::QeLineDiff( const QString &oldString, const QString &newString )
+    : oldText( oldString ), newText( newString )
+{
+    oldEnd = 0;
+    newEnd = 0;
+}
+
+
+// Add the lines in text[ start .. end ) to the list, each with its line end
+// (if it has one) and a hash of its contents.
+//
+void QeLineDiff::splitLines( const QChar *text, int start, int end, QVector<Line> &lines )
+{
+    const ushort *data = (const ushort *) text;
+    Line line;
+    int i = start;
+    while ( i < end ) {
+        line.start = i;
+        uint hash = 2166136261u;            // FNV-1a
+        while ( i < end ) {
+            ushort c = data[ i++ ];
+            hash = ( hash ^ c ) * 16777619u;
+            if ( c == '\n')
+                break;
+        }
+        line.length = i - line.start;
+        line.hash   = hash;
+        lines.append( line );
+    }
+}
+
+
+inline bool QeLineDiff::sameLine( int oldLine, int newLine ) const
+{
+    const Line &a = oldLines.at( oldLine );
+    const Line &b = newLines.at( newLine );
+    return (( a.hash == b.hash ) && ( a.length == b.length ) &&
+            !memcmp( oldText.constData() + a.start, newText.constData() + b.start, a.length * sizeof( QChar )));
+}
+
+
+// Find the shortest series of line insertions and deletions which turns the
+// old lines into the new ones (see E. Myers, "An O(ND) Difference Algorithm
+// and Its Variations", 1986), and add a change for each run of them.
+//
+void QeLineDiff::diffLines()
+{
+    int n = oldLines.size();
+    int m = newLines.size();
+    int maxEdits = qMin( n + m, DIFF_MAX_EDITS );
+    int offset = maxEdits + 1;
+
+    // v[ offset + k ] is the furthest x reached on diagonal k (where y = x - k);
+    // a copy is kept for each number of edits, to trace the path back through.
+    QVector<int> v( 2 * offset + 1, 0 );
+    QList< QVector<int> > trace;
+    int edits = -1;
+    for ( int d = 0; ( d <= maxEdits ) && ( edits < 0 ); d++ ) {
+        trace.append( v );
+        for ( int k = -d; k <= d; k += 2 ) {
+            int x;
+            if (( k == -d ) || (( k != d ) && ( v[ offset + k - 1 ] < v[ offset + k + 1 ] )))
+                x = v[ offset + k + 1 ];            // insert a line
+            else
+                x = v[ offset + k - 1 ] + 1;        // delete a line
+            int y = x - k;
+            while (( x < n ) && ( y < m ) && sameLine( x, y )) {
+                x++;
+                y++;
+            }
+            v[ offset + k ] = x;
+            if (( x >= n ) && ( y >= m )) {
+                edits = d;
+                break;
+            }
+        }
+    }
+    if ( edits < 0 ) {
+        addChange( 0, n, 0, m );
+        return;
+    }
+
+    // Walk back from the end, collecting runs of edits between the matches
+    int x = n;
+    int y = m;
+    int lastX = -1;     // where the run being collected ends, if there is one
+    int lastY = -1;
+    for ( int d = edits; d >= 0; d-- ) {
+        const QVector<int> &w = trace.at( d );
+        int k = x - y;
+        int prevK;
+        if (( k == -d ) || (( k != d ) && ( w[ offset + k - 1 ] < w[ offset + k + 1 ] )))
+            prevK = k + 1;
+        else
+            prevK = k - 1;
+        int prevX = w[ offset + prevK ];
+        int prevY = prevX - prevK;
+
+        if (( x > prevX ) && ( y > prevY ) && ( lastX >= 0 )) {
+            addChange( x, lastX, y, lastY );
+            lastX = -1;
+        }
+        while (( x > prevX ) && ( y > prevY )) {
+            x--;
+            y--;
+        }
+        if ( d > 0 ) {
+            if ( lastX < 0 ) {
+                lastX = x;
+                lastY = y;
+            }
+            x = prevX;
+            y = prevY;
+        }
+    }
+    if ( lastX >= 0 )
+        addChange( x, lastX, y, lastY );
+
+    // They were found last first
+    for ( int i = 0; i < changes.size() / 2; i++ )
+        changes.swap( i, changes.size() - i - 1 );
+}
+
+
+// Add a change replacing old lines [ oldFirst, oldLast ) with new lines
+// [ newFirst, newLast ).
+//
+void QeLineDiff::addChange( int oldFirst, int oldLast, int newFirst, int newLast )
+{
+    int oldStart = ( oldFirst < oldLines.size() ) ? oldLines.at( oldFirst ).start : oldEnd;
+    int oldStop  = ( oldLast  < oldLines.size() ) ? oldLines.at( oldLast ).start  : oldEnd;
+    int newStart = ( newFirst < newLines.size() ) ? newLines.at( newFirst ).start : newEnd;
+    int newStop  = ( newLast  < newLines.size() ) ? newLines.at( newLast ).start  : newEnd;
+
+    QeTextChange change;
+    change.position = oldStart;
+    change.length   = oldStop - oldStart;
+    change.text     = newText.mid( newStart, newStop - newStart );
+    changes.append( change );
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+** QE - linediff.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#ifndef QE_LINEDIFF_H
+#define QE_LINEDIFF_H
+
+#include <QString>
+#include <QList>
+#include <QVector>
+
+
+#define DIFF_MAX_EDITS  1000    // beyond this many line edits, just replace the lot
+
+
+// One change to a text: replace length characters at position with text.
+//
+struct QeTextChange
+{
+    int     position;
+    int     length;
+    QString text;
+};
+
+
+// ============================================================================
+// QeLineDiff
+//
+// Works out the changes which turn one text into another, line by line, so
+// that an edited document can be brought into line with a new version of its
+// file without replacing all of it.
+//
+// The common start and end of the two texts are skipped with straight memory
+// comparisons, so only the part in between is split into lines and hashed.
+// Those lines are then matched up by Myers' O(ND) algorithm, and each run of
+// lines that differs becomes one QeTextChange.  If there are more than
+// DIFF_MAX_EDITS line insertions and deletions, the whole of the middle part
+// is returned as a single change instead.
+//
+// The changes are in order, and their positions refer to the old text; they
+// need to be applied from last to first.
+//
+
+class QeLineDiff
+{
+public:
+    static QList<QeTextChange> compare( const QString &oldText, const QString &newText );
+
+private:
+    struct Line {
+        int     start;
+        int     length;     // including the line end
+        uint    hash;
+    };
+
+    QeLineDiff( const QString &oldText, const QString &newText );
+
+    static void splitLines( const QChar *text, int start, int end, QVector<Line> &lines );
+    bool        sameLine( int oldLine, int newLine ) const;
+    void        diffLines();
+    void        addChange( int oldFirst, int oldLast, int newFirst, int newLast );
+
+    const QString  &oldText;
+    const QString  &newText;
+    QVector<Line>   oldLines;
+    QVector<Line>   newLines;
+    int             oldEnd;     // end of the part that differs, in each text
+    int             newEnd;
+    QList<QeTextChange> changes;
+};
+
+#endif      // QE_LINEDIFF_H
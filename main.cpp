@@ -21,22 +21,54 @@
 #include <QApplication>
 #include <QDir>
 #include <QFileInfo>
+#include <QFile>
+#include <QElapsedTimer>
 
 #include "mainwindow.h"
+#include "instance.h"
+#include "tracing.h"
 
 #ifdef Q_OS_WIN32
 #include <windows.h>
 #endif
 
-int main( int argc, char *argv[] )
+
+struct Arguments
 {
-    QApplication app( argc, argv );
-    MainWindow *qe = new MainWindow;
-    bool openReadOnly = false;
-    bool showUsage    = false;
-    bool openEncoding = false;
+    bool    readOnly;
+    bool    showUsage;
+    bool    singleInstance;
+    bool    openEncoding;
     QString encoding;
     QString fileName;
+    QString traceFile;      // from /trace, started once we know we're staying
+};
+
+
+// ----------------------------------------------------------------------------
+// Returns true if the given switch (without its / or -) is on the command line.
+//
+static bool hasSwitch( int argc, char *argv[], const char *name )
+{
+    for ( int a = 1; a < argc; a++ ) {
+        char *psz = argv[ a ];
+        if (( *psz == '/' || *psz == '-') && ( qstricmp( psz + 1, name ) == 0 ))
+            return true;
+    }
+    return false;
+}
+
+
+// ----------------------------------------------------------------------------
+static void parseArguments( int argc, char *argv[], Arguments &args )
+{
+    args.readOnly       = false;
+    args.showUsage      = false;
+    args.singleInstance = false;
+    args.openEncoding   = false;
+    args.encoding       = QString();
+    args.fileName       = QString();
+    args.traceFile      = QString();
 
     for ( int a = 1; a < argc; a++ ) {
         char *psz = argv[ a ];
@@ -45,25 +77,31 @@ int main( int argc, char *argv[] )
             if ( argStr.isEmpty() || argStr.isNull() )
                 continue;
             else if ( argStr.compare( QString("read"), Qt::CaseInsensitive ) == 0 )
-                openReadOnly = true;
+                args.readOnly = true;
             else if ( argStr.compare( QString("xxxx"), Qt::CaseInsensitive ) == 0 )
-                openReadOnly = true;
+                args.readOnly = true;
             else if ( argStr.startsWith( QString("cp:"), Qt::CaseInsensitive ) == 1 ) {
-                openEncoding = true;
-                encoding = argStr;
-                encoding.remove( 0, 3 );
+                args.openEncoding = true;
+                args.encoding = argStr;
+                args.encoding.remove( 0, 3 );
             }
             else if ( argStr.startsWith( QString("enc:"), Qt::CaseInsensitive ) == 1 ) {
-                openEncoding = true;
-                encoding = argStr;
-                encoding.remove( 0, 4 );
+                args.openEncoding = true;
+                args.encoding = argStr;
+                args.encoding.remove( 0, 4 );
             }
+            else if ( argStr.compare( QString("single"), Qt::CaseInsensitive ) == 0 )
+                args.singleInstance = true;
+            else if ( argStr.compare( QString("trace"), Qt::CaseInsensitive ) == 0 )
+                args.traceFile = QString( TRACE_DEFAULT_FILE );
+            else if ( argStr.startsWith( QString("trace:"), Qt::CaseInsensitive ) == 1 )
+                args.traceFile = argStr.mid( 6 );
             else if (( argStr.compare( QString("?")) == 0 ) ||
                      ( argStr.compare( QString("h"), Qt::CaseInsensitive ) == 0 ))
-                showUsage = true;
+                args.showUsage = true;
         }
         // Not a / switch, treat as a filename
-        else if ( fileName.isNull() ) {
+        else if ( args.fileName.isNull() ) {
 #ifdef Q_OS_WIN32
             int t;
             LPWSTR *wstr = CommandLineToArgvW( GetCommandLine(), &t );
@@ -73,30 +111,60 @@ int main( int argc, char *argv[] )
 #endif
             if ( fileinfo.canonicalFilePath().isEmpty() ) {
                 QDir dir( QDir::currentPath() );
-                fileName = QDir::cleanPath( dir.filePath( psz ));
+                args.fileName = QDir::cleanPath( dir.filePath( psz ));
             }
             else
-                fileName = fileinfo.canonicalFilePath();
+                args.fileName = fileinfo.canonicalFilePath();
         }
     }
+}
+
+
+int main( int argc, char *argv[] )
+{
+    QElapsedTimer startupClock;
+    startupClock.start();
+    Arguments args;
+
+    // In single-instance mode, hand the file over to a running instance if
+    // there is one.  This comes before QApplication, which is most of our
+    // startup time, so only a QCoreApplication is made for it.
+    if ( hasSwitch( argc, argv, "single")) {
+        QCoreApplication client( argc, argv );
+        parseArguments( argc, argv, args );
+        if ( !args.showUsage &&
+             QeInstanceServer::forward( args.fileName, args.readOnly, args.openEncoding, args.encoding ))
+            return 0;
+    }
 
-    if ( showUsage ) {
+    QApplication app( argc, argv );
+
+    // (Again if done above, as QApplication takes out any options of its own)
+    parseArguments( argc, argv, args );
+
+    // Tracing can be turned on from the environment, or with /trace
+    QByteArray traceFile = qgetenv( TRACE_ENV_VARIABLE );
+    if ( !traceFile.isEmpty() )
+        QeTrace::start( QFile::decodeName( traceFile ));
+    else if ( !args.traceFile.isEmpty() )
+        QeTrace::start( args.traceFile );
+
+    MainWindow *qe = new MainWindow;
+    if ( args.showUsage ) {
         qe->showUsage();
         return 0;
     }
 
-    if ( !fileName.isNull() ) {
-        if ( openEncoding )
-            qe->openAsEncoding( fileName, true, encoding );
-        else
-            qe->loadFile( fileName, true );
-    }
-    else if ( openEncoding && qe->mapNameToEncoding( encoding )) {
-        qe->setTextEncoding( encoding );
-    }
+    // This is the instance that others hand over to
+    QeInstanceServer instanceServer;
+    if ( args.singleInstance )
+        instanceServer.listen();
 
-    qe->setReadOnly( openReadOnly );
+    qe->openFromCommandLine( args.fileName, args.readOnly, args.openEncoding, args.encoding );
     qe->show();
+    qe->timeStartup( startupClock );
 
-    return app.exec();
+    int rc = app.exec();
+    QeTrace::finish();
+    return rc;
 }
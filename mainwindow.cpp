@@ -22,6 +22,14 @@
 
 #include <QtGui>
 #include <QPrinter>
+#include <limits.h>
+#if defined( Q_OS_LINUX )
+#include <stdio.h>
+#include <unistd.h>
+#elif defined( Q_OS_WIN )
+#include <windows.h>
+#include <psapi.h>
+#endif
 
 #include "finddialog.h"
 #include "replacedialog.h"
@@ -29,6 +37,13 @@
 #include "mainwindow.h"
 #include "qetextedit.h"
 #include "threads.h"
+#include "encodingdetector.h"
+#include "fileview.h"
+#include "filefollower.h"
+#include "journal.h"
+#include "linediff.h"
+#include "compression.h"
+#include "tracing.h"
 #include "os2codec.h"
 #ifdef __OS2__
 #include "os2native.h"
@@ -188,47 +203,7 @@ QString Codepage_Mappings[] = {
 
 MainWindow::MainWindow()
 {
-    // Instantiate our new text codecs (must be created on the heap; Qt takes
-    // over responsibility for these objects so we do nothing more with them).
-    //
-#ifndef DISABLE_NEW_CODECS
-    QeOS2Codec *codec437  = new QeOS2Codec( QeOS2Codec::IBM437 );
-    QeOS2Codec *codec852  = new QeOS2Codec( QeOS2Codec::IBM852 );
-    QeOS2Codec *codec855  = new QeOS2Codec( QeOS2Codec::IBM855 );
-    QeOS2Codec *codec857  = new QeOS2Codec( QeOS2Codec::IBM857 );
-    QeOS2Codec *codec858  = new QeOS2Codec( QeOS2Codec::IBM858 );
-    QeOS2Codec *codec859  = new QeOS2Codec( QeOS2Codec::IBM859 );
-    QeOS2Codec *codec860  = new QeOS2Codec( QeOS2Codec::IBM860 );
-    QeOS2Codec *codec861  = new QeOS2Codec( QeOS2Codec::IBM861 );
-    QeOS2Codec *codec863  = new QeOS2Codec( QeOS2Codec::IBM863 );
-    QeOS2Codec *codec864  = new QeOS2Codec( QeOS2Codec::IBM864 );
-    QeOS2Codec *codec865  = new QeOS2Codec( QeOS2Codec::IBM865 );
-    QeOS2Codec *codec867  = new QeOS2Codec( QeOS2Codec::IBM867 );
-    QeOS2Codec *codec869  = new QeOS2Codec( QeOS2Codec::IBM869 );
-    QeOS2Codec *codec922  = new QeOS2Codec( QeOS2Codec::IBM922 );
-    QeOS2Codec *codec1125 = new QeOS2Codec( QeOS2Codec::IBM1125 );
-    QeOS2Codec *codec1131 = new QeOS2Codec( QeOS2Codec::IBM1131 );
-    QeOS2Codec *codecmemj = new QeOS2Codec( QeOS2Codec::MEMJA );
-
-    // Keep the compiler happy
-    if ( codec437 ) {;}
-    if ( codec852 ) {;}
-    if ( codec855 ) {;}
-    if ( codec857 ) {;}
-    if ( codec858 ) {;}
-    if ( codec859 ) {;}
-    if ( codec860 ) {;}
-    if ( codec861 ) {;}
-    if ( codec863 ) {;}
-    if ( codec864 ) {;}
-    if ( codec865 ) {;}
-    if ( codec867 ) {;}
-    if ( codec869 ) {;}
-    if ( codec922 ) {;}
-    if ( codec1125) {;}
-    if ( codec1131) {;}
-    if ( codecmemj) {;}
-#endif
+    // (Our own text codecs are created as they're needed; see QeOS2Codec.)
 
     setAttribute( Qt::WA_DeleteOnClose );
 
@@ -240,7 +215,42 @@ MainWindow::MainWindow()
     p.setColor( QPalette::Background, QColor("#F0F0F0"));
     editor->setPalette(p);
 
-    setCentralWidget( editor );
+    // The large-file viewer takes the editor's place when it's in use
+    fileView = NULL;
+    centralStack = new QStackedWidget( this );
+    centralStack->addWidget( editor );
+    setCentralWidget( centralStack );
+
+    currentCompression = QeCompression::None;
+
+    // Follow mode: text appended to the file by others is added to the editor
+    currentFileSize = 0;
+    follower = new QeFileFollower( this );
+    connect( follower, SIGNAL( textAppended( const QString & )), this, SLOT( followAppend( const QString & )));
+    connect( follower, SIGNAL( fileReplaced() ), this, SLOT( followReplaced() ));
+
+    // Autosave: unsaved edits are journalled, to be recovered after a crash
+    journal = new QeEditJournal( editor, this );
+
+    openThread = 0;
+    saveThread = 0;
+    isReadThreadActive = false;
+    isSaveThreadActive = false;
+    hasByteOrderMark = false;
+    loadedCodec = NULL;
+    currentLineEnds = PLATFORM_NEWLINE;
+    mixedLineEnds = false;
+    safeSave = true;
+    saveSync = QeSaveThread::SyncData;
+    saveRevision = 0;
+    saveFailed = false;
+    saveFirstChange = INT_MAX;
+    saveLineCount = 0;
+    fileLineCount = -1;
+    encodingGroup = NULL;
+    loadMonitor = new QTimer( this );
+    loadMonitor->setInterval( 20 );
+    connect( loadMonitor, SIGNAL( timeout() ), this, SLOT( monitorLoad() ));
 
     createActions();
     createMenus();
@@ -249,15 +259,13 @@ MainWindow::MainWindow()
 
     readSettings();
 
-    openThread = 0;
-    isReadThreadActive = false;
     findDialog = 0;
     replaceDialog = 0;
     lastGoTo = 1;
 
     setAcceptDrops( true );
     connect( editor, SIGNAL( cursorPositionChanged() ), this, SLOT( updatePositionLabel() ));
-    connect( editor->document(), SIGNAL( contentsChanged() ), this, SLOT( updateModified() ));
+    connectDocument();
 
     setMinimumWidth( statusBar()->minimumWidth() + 20 );
     setWindowTitle( tr("Text Editor") );
@@ -278,8 +286,10 @@ MainWindow::MainWindow()
     createHelp();
 
     currentEncoding = "";
+    encodingDetector = NULL;
     currentDir = QDir::currentPath();
     setCurrentFile("");
+    startJournal();
 }
 
 
@@ -292,6 +302,7 @@ MainWindow::~MainWindow()
 #ifdef __OS2__
     if ( helpInstance ) OS2Native::destroyNativeHelp( helpInstance );
 #endif
+    delete encodingDetector;
 }
 
 
@@ -326,6 +337,7 @@ void MainWindow::closeEvent( QCloseEvent *event )
 {
     if ( okToContinue() ) {
         writeSettings();
+        journal->finish();
         event->accept();
     }
     else {
@@ -364,8 +376,16 @@ void MainWindow::dropEvent (QDropEvent *event )
 void MainWindow::newFile()
 {
     if ( okToContinue() && clearReadOnlyOnNew() ) {
+        closeView();
         editor->clear();
+        currentCompression = QeCompression::None;
         setCurrentFile("");
+#ifdef USE_IO_THREADS
+        hasByteOrderMark = false;
+        loadedCodec = NULL;
+        setLineEnds( PLATFORM_NEWLINE, false );
+#endif
+        startJournal();
     }
 }
 
@@ -446,6 +466,74 @@ bool MainWindow::saveAs()
 }
 
 
+// Bring the text up to date with the file.  Rather than loading it all over
+// again, only the lines which differ are replaced, all in one edit (which can
+// be undone); the cursor position, scroll position and undo history are kept.
+//
+void MainWindow::reload()
+{
+    if ( currentFile.isEmpty() || !finishSave() )
+        return;
+    if ( isViewing() ) {
+        // The viewer reads from the file anyway; it only needs a new index
+        loadFile( currentFile, false );
+        return;
+    }
+    if ( editor->document()->isModified() ) {
+        int r = QMessageBox::warning( this,
+                                      tr("Reload"),
+                                      tr("The text has been modified."
+                                         "<p>Replace your changes with the current contents of %1?").arg(
+                                            QDir::toNativeSeparators( currentFile )),
+                                      QMessageBox::Yes | QMessageBox::No,
+                                      QMessageBox::No
+                                    );
+        if ( r == QMessageBox::No )
+            return;
+    }
+
+    QFile *file = new QFile( currentFile );
+    if ( !file->open( QIODevice::ReadOnly | QFile::Text )) {
+        QMessageBox::critical( this, tr("Error"), tr("The file could not be opened."));
+        delete file;
+        return;
+    }
+    QTextCodec *codec = currentEncoding.isEmpty() ?
+                            QTextCodec::codecForLocale() :
+                            QeOS2Codec::codecForName( currentEncoding.toLatin1().data() );
+    follower->stop();
+    QApplication::setOverrideCursor( Qt::WaitCursor );
+
+#ifdef USE_IO_THREADS
+
+    // The thread compares the file with a copy of the text; finishLoad()
+    // then makes the changes.  The editor is left as it is until then.
+    showMessage( tr("Reloading %1").arg( QDir::toNativeSeparators( currentFile )));
+    menuBar()->setEnabled( false );
+    editor->setEnabled( false );
+    getOpenThread();
+    isReadThreadActive = true;
+    openThread->setFile( file, codec, currentFile );
+    openThread->setReloadText( editor->plainText() );
+    openThread->start();
+    startLoadMonitor();
+
+#else
+
+    QTextStream in( file );
+    in.setCodec( codec );
+    QString text = in.readAll();
+    file->close();
+    delete file;
+    applyChanges( QeLineDiff::compare( editor->plainText(), text ));
+    QApplication::restoreOverrideCursor();
+    showMessage( tr("Reloaded file: %1").arg( QDir::toNativeSeparators( currentFile )));
+    setCurrentFile( currentFile );
+
+#endif
+}
+
+
 void MainWindow::find()
 {
     if ( !findDialog ) {
@@ -480,7 +568,8 @@ void MainWindow::find()
         findDialog->raise();
         findDialog->activateWindow();
     }
-    QString selected = editor->textCursor().selectedText();
+    QString selected = isViewing() ? fileView->selectedText() :
+                                     editor->textCursor().selectedText();
     if ( recentFinds.count() > 0 )
         findDialog->populateHistory( recentFinds );
     if ( ! selected.trimmed().isEmpty() )
@@ -512,6 +601,7 @@ void MainWindow::findAgain()
 
 void MainWindow::replace()
 {
+    if ( isViewing() ) return;
     if ( !replaceDialog ) {
         replaceDialog = new ReplaceDialog( this );
 
@@ -582,13 +672,21 @@ void MainWindow::goToLine()
 {
     int min = 1;
     int max = editor->document()->blockCount();
+    if ( isViewing() ) {
+        max = (int) qMin( fileView->lineCount(), (qint64) INT_MAX );
+        lastGoTo = (int) qMin( fileView->currentLine() + 1, (qint64) INT_MAX );
+    }
     if (( lastGoTo < 1 ) || ( lastGoTo > max ))
         lastGoTo = 1;
     GoToLineDialog dialog( this, min, max, lastGoTo );
     if ( dialog.exec() ) {
         QString str = dialog.lineEdit->text();
         lastGoTo = str.toInt();
-        QTextCursor cursor( editor->document()->findBlockByLineNumber( lastGoTo - 1 ));
+        if ( isViewing() ) {
+            fileView->goToLine( lastGoTo - 1 );
+            return;
+        }
+        QTextCursor cursor( editor->lineBlock( lastGoTo - 1 ));
         editor->setTextCursor( cursor );
     }
 }
@@ -681,11 +779,61 @@ bool MainWindow::toggleReadOnly( bool readOnly )
 }
 
 
+void MainWindow::toggleFollow( bool follow )
+{
+    if ( !follow && follower->isActive() )
+        currentFileSize = follower->position();
+    followFile();
+}
+
+
+// Switch the line ends the file will be saved with.  This counts as a change
+// to every line, so the whole file gets rewritten (see saveFile).
+//
+void MainWindow::toggleLineEnds( bool crlf )
+{
+    int eol = crlf ? EOL_CRLF : EOL_LF;
+    if ( eol == currentLineEnds )
+        return;
+    setLineEnds( eol, false );
+    editor->markChanged( 0 );
+    updateModified( true );
+}
+
+
+// Turn autosave on or off.  If there are changes already, it only starts
+// once the file is next opened or saved, as there's nothing to journal them
+// against until then.
+//
+void MainWindow::toggleAutosave( bool autosave )
+{
+    if ( !autosave )
+        journal->stop();
+    else if ( !journal->isActive() && !isWindowModified() && !isViewing() )
+        startJournal();
+}
+
+
+// Set the line ends to save with (normally those found by the loader) and
+// bring the action and status bar up to date.
+//
+void MainWindow::setLineEnds( int eol, bool mixed )
+{
+    currentLineEnds = eol;
+    mixedLineEnds = mixed;
+    crlfAction->blockSignals( true );
+    crlfAction->setChecked( eol == EOL_CRLF );
+    crlfAction->blockSignals( false );
+    updateLineEndLabel();
+}
+
+
 void MainWindow::updateStatusBar()
 {
     updateModeLabel();
     updatePositionLabel();
     updateEncodingLabel();
+    updateLineEndLabel();
 }
 
 
@@ -698,6 +846,20 @@ void MainWindow::updateEncodingLabel()
 }
 
 
+void MainWindow::updateLineEndLabel()
+{
+    QString text = ( currentLineEnds == EOL_CRLF ) ? QString("CRLF") : QString("LF");
+    if ( mixedLineEnds ) {
+        lineEndButton->setText( tr("%1 (mixed)").arg( text ));
+        lineEndButton->setToolTip( tr("The file has both LF and CR+LF line ends; lines changed will be saved with %1").arg( text ));
+    }
+    else {
+        lineEndButton->setText( text );
+        lineEndButton->setToolTip( tr("Line ends (click to change)"));
+    }
+}
+
+
 void MainWindow::updateModeLabel()
 {
     if ( editor->isReadOnly() )
@@ -716,14 +878,18 @@ void MainWindow::updatePositionLabel()
         col = 0;
 
     cursor = editor->textCursor();
-    col = cursor.positionInBlock();
-    row = cursor.blockNumber() + 1;
+    col = editor->columnNumber( cursor );
+    row = editor->lineNumber( cursor.block() ) + 1;
     positionLabel->setText( QString("%1:%2").arg( row ).arg( col ));
 }
 
 
 void MainWindow::updateModified()
 {
+#ifdef USE_IO_THREADS
+    // Text being added by the file loader doesn't count as a modification
+    if ( isReadThreadActive ) return;
+#endif
     bool isModified = editor->document()->isModified();
     setWindowModified( isModified );
     modifiedLabel->setText( isModified? tr("Modified"): "");
@@ -744,12 +910,16 @@ void MainWindow::setEditorFont() {
     if ( fontSelected ) {
         editor->setFont( font );
         editor->adjustSize();
+        if ( fileView )
+            fileView->setFont( font );
     }
 }
 
 
 void MainWindow::findNext( const QString &str, bool cs, bool words, bool fromStart )
 {
+    QeTraceSpan span("MainWindow::findNext");
+    span.setCount("characters", editor->document()->characterCount() );
     lastFind.text      = str;
     lastFind.bCase     = cs;
     lastFind.bWords    = words;
@@ -758,6 +928,11 @@ void MainWindow::findNext( const QString &str, bool cs, bool words, bool fromSta
 
     updateFindHistory( str );
 
+    if ( isViewing() ) {
+        findInView( str, cs, words, false, false, fromStart );
+        return;
+    }
+
     QTextDocument::FindFlags flags = QTextDocument::FindFlags( 0 );
     if ( cs )
         flags |= QTextDocument::FindCaseSensitively;
@@ -766,12 +941,14 @@ void MainWindow::findNext( const QString &str, bool cs, bool words, bool fromSta
     int pos = fromStart ? 0 :
                           editor->textCursor().selectionEnd();
 
-    showFindResult( editor->document()->find( str, pos, flags ), str );
+    showFindResult( editor->findText( str, pos, flags ), str );
 }
 
 
 void MainWindow::findNextRegExp( const QString &str, bool cs, bool fromStart )
 {
+    QeTraceSpan span("MainWindow::findNextRegExp");
+    span.setCount("characters", editor->document()->characterCount() );
     lastFind.text      = str;
     lastFind.bCase     = cs;
     lastFind.bWords    = false;
@@ -780,18 +957,25 @@ void MainWindow::findNextRegExp( const QString &str, bool cs, bool fromStart )
 
     updateFindHistory( str );
 
+    if ( isViewing() ) {
+        findInView( str, cs, false, true, false, fromStart );
+        return;
+    }
+
     QRegExp regexp( str );
     regexp.setCaseSensitivity( cs? Qt::CaseSensitive: Qt::CaseInsensitive );
 
     QTextDocument::FindFlags flags = QTextDocument::FindFlags( 0 );
     int pos = fromStart ? 0 :
                           editor->textCursor().selectionEnd();
-    showFindResult( editor->document()->find( regexp, pos, flags ), str );
+    showFindResult( editor->findText( regexp, pos, flags ), str );
 }
 
 
 void MainWindow::findPrevious( const QString &str, bool cs, bool words, bool fromEnd )
 {
+    QeTraceSpan span("MainWindow::findPrevious");
+    span.setCount("characters", editor->document()->characterCount() );
     lastFind.text      = str;
     lastFind.bCase     = cs;
     lastFind.bWords    = words;
@@ -800,6 +984,11 @@ void MainWindow::findPrevious( const QString &str, bool cs, bool words, bool fro
 
     updateFindHistory( str );
 
+    if ( isViewing() ) {
+        findInView( str, cs, words, false, true, fromEnd );
+        return;
+    }
+
     QTextDocument::FindFlags flags = QTextDocument::FindBackward;
     if ( cs )
         flags |= QTextDocument::FindCaseSensitively;
@@ -807,12 +996,14 @@ void MainWindow::findPrevious( const QString &str, bool cs, bool words, bool fro
         flags |= QTextDocument::FindWholeWords;
     int pos = fromEnd ? editor->document()->characterCount() :
                         editor->textCursor().selectionStart();
-    showFindResult( editor->document()->find( str, pos, flags ), str );
+    showFindResult( editor->findText( str, pos, flags ), str );
 }
 
 
 void MainWindow::findPreviousRegExp( const QString &str, bool cs, bool fromEnd )
 {
+    QeTraceSpan span("MainWindow::findPreviousRegExp");
+    span.setCount("characters", editor->document()->characterCount() );
     lastFind.text      = str;
     lastFind.bCase     = cs;
     lastFind.bWords    = false;
@@ -821,18 +1012,25 @@ void MainWindow::findPreviousRegExp( const QString &str, bool cs, bool fromEnd )
 
     updateFindHistory( str );
 
+    if ( isViewing() ) {
+        findInView( str, cs, false, true, true, fromEnd );
+        return;
+    }
+
     QRegExp regexp( str );
     regexp.setCaseSensitivity( cs? Qt::CaseSensitive: Qt::CaseInsensitive );
 
     QTextDocument::FindFlags flags = QTextDocument::FindBackward;
     int pos = fromEnd ? editor->document()->characterCount() :
                         editor->textCursor().selectionStart();
-    showFindResult( editor->document()->find( regexp, pos, flags ), str );
+    showFindResult( editor->findText( regexp, pos, flags ), str );
 }
 
 
 void MainWindow::replaceNext( const QString &str, const QString &repl, bool cs, bool words, bool fromStart, bool confirm )
 {
+    QeTraceSpan span("MainWindow::replaceNext");
+    span.setCount("characters", editor->document()->characterCount() );
     updateFindHistory( str );
     updateReplaceHistory( repl );
     QTextDocument::FindFlags flags = QTextDocument::FindFlags( 0 );
@@ -842,7 +1040,7 @@ void MainWindow::replaceNext( const QString &str, const QString &repl, bool cs,
         flags |= QTextDocument::FindWholeWords;
     int pos = fromStart ? 0 :
                           editor->textCursor().selectionStart();
-    QTextCursor found = editor->document()->find( str, pos, flags );
+    QTextCursor found = editor->findText( str, pos, flags );
     if ( showFindResult( found, str )) {
         if ( ! replaceFindResult( editor->textCursor(), repl, confirm )) {
             // Clear selection but move the cursor position to its end
@@ -858,6 +1056,8 @@ void MainWindow::replaceNext( const QString &str, const QString &repl, bool cs,
 
 void MainWindow::replaceNextRegExp( const QString &str, const QString &repl, bool cs, bool fromStart, bool confirm )
 {
+    QeTraceSpan span("MainWindow::replaceNextRegExp");
+    span.setCount("characters", editor->document()->characterCount() );
     updateFindHistory( str );
     updateReplaceHistory( repl );
 
@@ -875,9 +1075,13 @@ void MainWindow::replaceNextRegExp( const QString &str, const QString &repl, boo
     QTextDocument::FindFlags flags = QTextDocument::FindFlags( 0 );
     int pos = fromStart ? 0 :
                           editor->textCursor().selectionStart();
-    QTextCursor found = editor->document()->find( regexp, pos, flags );
+    QTextCursor found = editor->findText( regexp, pos, flags );
     if ( showFindResult( found, str )) {
-        QString newText = found.selectedText();
+        // The match may span a segment break, which isn't part of the text;
+        // and out of context it may not match at all (e.g. with a lookahead)
+        QString newText = editor->selectionText( found );
+        if ( regexp.indexIn( newText ) < 0 )
+            return;
         newText.replace( regexp, replaceStr );
         if ( !replaceFindResult( editor->textCursor(), newText, confirm )) {
             // Clear selection but move the cursor position to its end
@@ -893,6 +1097,8 @@ void MainWindow::replaceNextRegExp( const QString &str, const QString &repl, boo
 
 void MainWindow::replacePrevious( const QString &str, const QString &repl, bool cs, bool words, bool fromEnd, bool confirm )
 {
+    QeTraceSpan span("MainWindow::replacePrevious");
+    span.setCount("characters", editor->document()->characterCount() );
     updateFindHistory( str );
     updateReplaceHistory( repl );
     QTextDocument::FindFlags flags = QTextDocument::FindBackward;
@@ -903,7 +1109,7 @@ void MainWindow::replacePrevious( const QString &str, const QString &repl, bool
     int pos = fromEnd ? editor->document()->characterCount() :
                         editor->textCursor().selectionEnd();
 
-    QTextCursor found = editor->document()->find( str, pos, flags );
+    QTextCursor found = editor->findText( str, pos, flags );
     if ( showFindResult( found, str )) {
         if ( ! replaceFindResult( editor->textCursor(), repl, confirm )) {
             // Move the cursor to the selection start, then clear the selection
@@ -919,6 +1125,8 @@ void MainWindow::replacePrevious( const QString &str, const QString &repl, bool
 
 void MainWindow::replacePreviousRegExp( const QString &str, const QString &repl, bool cs, bool fromEnd, bool confirm )
 {
+    QeTraceSpan span("MainWindow::replacePreviousRegExp");
+    span.setCount("characters", editor->document()->characterCount() );
     updateFindHistory( str );
     updateReplaceHistory( repl );
 
@@ -936,9 +1144,13 @@ void MainWindow::replacePreviousRegExp( const QString &str, const QString &repl,
     QTextDocument::FindFlags flags = QTextDocument::FindBackward;
     int pos = fromEnd ? editor->document()->characterCount() :
                         editor->textCursor().selectionEnd();
-    QTextCursor found = editor->document()->find( regexp, pos, flags );
+    QTextCursor found = editor->findText( regexp, pos, flags );
     if ( showFindResult( found, str )) {
-        QString newText = found.selectedText();
+        // The match may span a segment break, which isn't part of the text;
+        // and out of context it may not match at all (e.g. with a lookahead)
+        QString newText = editor->selectionText( found );
+        if ( regexp.indexIn( newText ) < 0 )
+            return;
         newText.replace( regexp, replaceStr );
         if ( !replaceFindResult( editor->textCursor(), newText, confirm )) {
             // Move the cursor to the selection start, then clear the selection
@@ -954,6 +1166,8 @@ void MainWindow::replacePreviousRegExp( const QString &str, const QString &repl,
 
 void MainWindow::replaceAll( const QString &str, const QString &repl, bool cs, bool words, bool fromStart, bool confirm, bool backwards )
 {
+    QeTraceSpan span("MainWindow::replaceAll");
+    span.setCount("characters", editor->document()->characterCount() );
     updateFindHistory( str );
     updateReplaceHistory( repl );
     QTextDocument::FindFlags flags = QTextDocument::FindFlags( 0 );
@@ -967,7 +1181,7 @@ void MainWindow::replaceAll( const QString &str, const QString &repl, bool cs, b
     int pos = fromStart ? 0 :
                           ( backwards? editor->textCursor().selectionEnd():
                                        editor->textCursor().selectionStart() );
-    QTextCursor found = editor->document()->find( str, pos, flags );
+    QTextCursor found = editor->findText( str, pos, flags );
 
     if ( found.isNull() ) {
         showMessage( tr("No matches found for: %1").arg( str ));
@@ -993,7 +1207,7 @@ void MainWindow::replaceAll( const QString &str, const QString &repl, bool cs, b
 
         QTextCursor temp( found );
         temp.setPosition( temp.selectionStart() );
-        showMessage( tr("Found match at %1:%2").arg( temp.blockNumber() + 1 ).arg( temp.positionInBlock() ));
+        showMessage( tr("Found match at %1:%2").arg( editor->lineNumber( temp.block() ) + 1 ).arg( editor->columnNumber( temp ) ));
         editor->setTextCursor( found );
 
         if ( confirm ) {
@@ -1007,9 +1221,9 @@ void MainWindow::replaceAll( const QString &str, const QString &repl, bool cs, b
             count++;
             found.insertText( repl );
         }
-        found = editor->document()->find( str,
-                                          (backwards? found.selectionStart(): found.selectionEnd()),
-                                          flags );
+        found = editor->findText( str,
+                                  (backwards? found.selectionStart(): found.selectionEnd()),
+                                  flags );
     }
     showMessage( tr("%1 occurences replaced.").arg( count ));
     found = editor->textCursor();
@@ -1022,6 +1236,8 @@ void MainWindow::replaceAll( const QString &str, const QString &repl, bool cs, b
 
 void MainWindow::replaceAllRegExp( const QString &str, const QString &repl, bool cs, bool fromStart, bool confirm, bool backwards )
 {
+    QeTraceSpan span("MainWindow::replaceAllRegExp");
+    span.setCount("characters", editor->document()->characterCount() );
     updateFindHistory( str );
     updateReplaceHistory( repl );
 
@@ -1044,7 +1260,7 @@ void MainWindow::replaceAllRegExp( const QString &str, const QString &repl, bool
     int pos = fromStart ? 0 :
                           ( backwards? editor->textCursor().selectionEnd():
                                        editor->textCursor().selectionStart() );
-    QTextCursor found = editor->document()->find( regexp, pos, flags );
+    QTextCursor found = editor->findText( regexp, pos, flags );
     if ( found.isNull() ) {
         showMessage( tr("No matches found for: %1").arg( str ));
         found = editor->textCursor();
@@ -1070,7 +1286,7 @@ void MainWindow::replaceAllRegExp( const QString &str, const QString &repl, bool
 
         QTextCursor temp( found );
         temp.setPosition( temp.selectionStart() );
-        showMessage( tr("Found match at %1:%2").arg( temp.blockNumber() + 1 ).arg( temp.positionInBlock() ));
+        showMessage( tr("Found match at %1:%2").arg( editor->lineNumber( temp.block() ) + 1 ).arg( editor->columnNumber( temp ) ));
         editor->setTextCursor( found );
 
         if ( confirm ) {
@@ -1081,14 +1297,17 @@ void MainWindow::replaceAllRegExp( const QString &str, const QString &repl, bool
             if ( r == btnAll )   confirm = false;
         }
         if ( !skip ) {
-            count++;
-            newText = found.selectedText();
-            newText.replace( regexp, replaceStr );
-            found.insertText( newText );
+            // (As in replaceNextRegExp)
+            newText = editor->selectionText( found );
+            if ( regexp.indexIn( newText ) >= 0 ) {
+                count++;
+                newText.replace( regexp, replaceStr );
+                found.insertText( newText );
+            }
         }
-        found = editor->document()->find( regexp,
-                                          (backwards? found.selectionStart(): found.selectionEnd()),
-                                          flags );
+        found = editor->findText( regexp,
+                                  (backwards? found.selectionStart(): found.selectionEnd()),
+                                  flags );
     }
     showMessage( tr("%1 occurences replaced.").arg( count ));
     found = editor->textCursor();
@@ -1123,6 +1342,7 @@ void MainWindow::setTextEncoding()
 {
     QAction *action = qobject_cast<QAction *>( sender() );
     QString newEncoding = action->data().toString();
+    finishSave();       // (it sets the codepage EA from currentEncoding)
     if ( newEncoding.compare( currentEncoding ) != 0 ) {
         currentEncoding = newEncoding;
 
@@ -1172,6 +1392,7 @@ void MainWindow::setTextEncoding()
 
 void MainWindow::setTextEncoding( QString newEncoding )
 {
+    finishSave();
     if ( newEncoding.compare( currentEncoding ) != 0 ) {
         currentEncoding = newEncoding;
 
@@ -1215,6 +1436,26 @@ void MainWindow::openAsEncoding( QString fileName, bool createIfNew, QString enc
 }
 
 
+// Open a file (if any) with the options given on the command line; either
+// ours, or one handed over by another instance (see QeInstanceServer).
+//
+void MainWindow::openFromCommandLine( const QString &fileName, bool readOnly, bool useEncoding, QString encoding )
+{
+    // (Set this first: in read-only mode, large files go straight to the viewer)
+    setReadOnly( readOnly );
+
+    if ( !fileName.isNull() ) {
+        if ( useEncoding )
+            openAsEncoding( fileName, true, encoding );
+        else
+            loadFile( fileName, true );
+    }
+    else if ( useEncoding && mapNameToEncoding( encoding )) {
+        setTextEncoding( encoding );
+    }
+}
+
+
 // ---------------------------------------------------------------------------
 // OTHER METHODS
 //
@@ -1255,6 +1496,11 @@ void MainWindow::createActions()
     saveAsAction->setStatusTip( tr("Save the current file under a new name") );
     connect( saveAsAction, SIGNAL( triggered() ), this, SLOT( saveAs() ));
 
+    reloadAction = new QAction( tr("&Reload"), this );
+    reloadAction->setShortcut( QKeySequence::Refresh );
+    reloadAction->setStatusTip( tr("Update the text with changes made to the file by other programs") );
+    connect( reloadAction, SIGNAL( triggered() ), this, SLOT( reload() ));
+
     printAction = new QAction( tr("&Print..."), this );
     printAction->setShortcut( QKeySequence::Print );
     printAction->setStatusTip( tr("Print the current file") );
@@ -1277,7 +1523,7 @@ void MainWindow::createActions()
     exitAction->setStatusTip( tr("Exit the program") );
     connect( exitAction, SIGNAL( triggered() ), this, SLOT( close() ));
 
-    createEncodingActions();
+    // (The encoding actions are created along with their menu; see createEncodingMenus)
 
 
     // Edit menu actions
@@ -1380,6 +1626,23 @@ void MainWindow::createActions()
     readOnlyAction->setStatusTip( tr("Toggle read-only mode") );
     connect( readOnlyAction, SIGNAL( toggled( bool )), this, SLOT( toggleReadOnly( bool )));
 
+    followAction = new QAction( tr("Fo&llow file changes"), this );
+    followAction->setCheckable( true );
+    followAction->setStatusTip( tr("Add text to the end as other programs write it to the file") );
+    connect( followAction, SIGNAL( toggled( bool )), this, SLOT( toggleFollow( bool )));
+
+    crlfAction = new QAction( tr("CR+LF &line ends"), this );
+    crlfAction->setCheckable( true );
+    crlfAction->setChecked( PLATFORM_NEWLINE == EOL_CRLF );
+    crlfAction->setStatusTip( tr("Save the file with CR+LF (DOS/Windows) line ends instead of LF") );
+    connect( crlfAction, SIGNAL( toggled( bool )), this, SLOT( toggleLineEnds( bool )));
+
+    autosaveAction = new QAction( tr("&Autosave"), this );
+    autosaveAction->setCheckable( true );
+    autosaveAction->setChecked( true );
+    autosaveAction->setStatusTip( tr("Keep a journal of unsaved changes, so that they can be recovered if QE stops unexpectedly") );
+    connect( autosaveAction, SIGNAL( toggled( bool )), this, SLOT( toggleAutosave( bool )));
+
     fontAction = new QAction( tr("&Font..."), this );
     fontAction->setStatusTip( tr("Change the edit window font") );
     connect( fontAction, SIGNAL( triggered() ), this, SLOT( setEditorFont() ));
@@ -1844,25 +2107,16 @@ void MainWindow::createEncodingActions()
 }
 
 
-void MainWindow::createMenus()
+// Create the encoding actions and fill in the encoding menu.  There are a lot
+// of them, and they're seldom used, so this waits until the File menu is first
+// shown (or an encoding is looked up by name).
+//
+void MainWindow::createEncodingMenus()
 {
-    fileMenu = menuBar()->addMenu( tr("&File"));
-    fileMenu->addAction( newAction );
-    fileMenu->addAction( openAction );
-    fileMenu->addAction( saveAction );
-    fileMenu->addAction( saveAsAction );
-    fileMenu->addSeparator();
-    fileMenu->addAction( printAction );
-    fileMenu->addSeparator();
-    encodingMenu = fileMenu->addMenu( tr("&Encoding"));
-    separatorAction = fileMenu->addSeparator();
-    for ( int i = 0; i < MaxRecentFiles; i++ )
-        fileMenu->addAction( recentFileActions[ i ] );
-    fileMenu->addAction( clearRecentAction );
-    fileMenu->addSeparator();
-    fileMenu->addAction( exitAction );
+    if ( encodingGroup )
+        return;
+    createEncodingActions();
 
-    // Encoding menu actions
     encodingMenu->addAction( localeAction );
     encodingMenu->addSeparator();
 
@@ -1966,6 +2220,33 @@ void MainWindow::createMenus()
     unicodeMenu->addAction( utf16beAction );
     unicodeMenu->addAction( utf8Action );
 
+    updateEncoding();
+}
+
+
+void MainWindow::createMenus()
+{
+    fileMenu = menuBar()->addMenu( tr("&File"));
+    fileMenu->addAction( newAction );
+    fileMenu->addAction( openAction );
+    fileMenu->addAction( saveAction );
+    fileMenu->addAction( saveAsAction );
+    fileMenu->addAction( reloadAction );
+    fileMenu->addSeparator();
+    fileMenu->addAction( printAction );
+    fileMenu->addSeparator();
+    encodingMenu = fileMenu->addMenu( tr("&Encoding"));
+    separatorAction = fileMenu->addSeparator();
+    for ( int i = 0; i < MaxRecentFiles; i++ )
+        fileMenu->addAction( recentFileActions[ i ] );
+    fileMenu->addAction( clearRecentAction );
+    fileMenu->addSeparator();
+    fileMenu->addAction( exitAction );
+
+    // The encoding menu isn't filled in until it's needed
+    connect( fileMenu, SIGNAL( aboutToShow() ), this, SLOT( createEncodingMenus() ));
+    connect( fileMenu, SIGNAL( aboutToShow() ), this, SLOT( checkRecentFiles() ));
+
     editMenu = menuBar()->addMenu( tr("&Edit"));
     editMenu->addAction( undoAction );
     editMenu->addAction( redoAction );
@@ -1987,6 +2268,9 @@ void MainWindow::createMenus()
     optionsMenu->addAction( wrapAction );
     optionsMenu->addAction( editModeAction );
     optionsMenu->addAction( readOnlyAction );
+    optionsMenu->addAction( followAction );
+    optionsMenu->addAction( crlfAction );
+    optionsMenu->addAction( autosaveAction );
     optionsMenu->addSeparator();
     optionsMenu->addAction( fontAction );
 
@@ -2027,10 +2311,18 @@ void MainWindow::createStatusBar()
     modifiedLabel->setAlignment( Qt::AlignHCenter );
     modifiedLabel->setMinimumSize( modifiedLabel->sizeHint() );
 
+    // Shows the line ends the file will be saved with; clicking it switches
+    lineEndButton = new QToolButton( this );
+    lineEndButton->setAutoRaise( true );
+    lineEndButton->setText( tr("CRLF (mixed)"));
+    lineEndButton->setMinimumSize( lineEndButton->sizeHint() );
+    connect( lineEndButton, SIGNAL( clicked() ), crlfAction, SLOT( trigger() ));
+
     statusBar()->addWidget( messagesLabel, 1 );
     statusBar()->addWidget( encodingLabel );
     statusBar()->addWidget( editModeLabel );
     statusBar()->addWidget( positionLabel );
+    statusBar()->addWidget( lineEndButton );
     statusBar()->addWidget( modifiedLabel );
     statusBar()->setMinimumSize( statusBar()->sizeHint() );
 
@@ -2062,6 +2354,7 @@ void MainWindow::readSettings()
 
     recentFiles = settings.value("recentFiles").toStringList();
     updateRecentFileActions();
+    checkRecentFiles();
 
     currentFilter = settings.value("lastFilter", tr("All files (*)")).toString();
     recentFinds = settings.value("recentFinds").toStringList();
@@ -2074,18 +2367,38 @@ void MainWindow::readSettings()
     toggleWordWrap( wrap );
     wrapAction->setChecked( wrap );
 
-    QString defaultFont;
-    QFontDatabase fontdb;
-    QStringList matching = fontdb.families().filter("Droid Sans Mono");
-    if ( !matching.isEmpty() )
-        defaultFont = matching.at( 0 );
-    else
-        defaultFont = "Courier";
+    // Only look for our preferred default font if there's no font saved, and
+    // then only for that one family; listing them all means loading the whole
+    // font database, which is slow.
+    QString fontName = settings.value("editorFont").toString();
+    if ( fontName.isEmpty() ) {
+        QFontInfo preferred( QFont("Droid Sans Mono"));
+        if ( preferred.family().contains("Droid Sans Mono", Qt::CaseInsensitive ))
+            fontName = preferred.family();
+        else
+            fontName = "Courier";
+    }
     QFont font("");
-    font.fromString( settings.value("editorFont", defaultFont ).toString() );
+    font.fromString( fontName );
     editor->setFont( font );
 
     readOnlyAction->setChecked( editor->isReadOnly() );
+
+    autosaveAction->setChecked( settings.value("autosave", true ).toBool() );
+
+#ifdef USE_IO_THREADS
+    // How files are saved: "safeSave" replaces an existing file with a newly
+    // written one, and "saveSync" is how much to flush to disk before the
+    // save counts as done ("none", "data" or "full")
+    safeSave = settings.value("safeSave", true ).toBool();
+    QString sync = settings.value("saveSync", "data").toString();
+    if ( sync == "none")
+        saveSync = QeSaveThread::SyncNever;
+    else if ( sync == "full")
+        saveSync = QeSaveThread::SyncFull;
+    else
+        saveSync = QeSaveThread::SyncData;
+#endif
 }
 
 
@@ -2104,6 +2417,12 @@ void MainWindow::writeSettings()
                       true: false
                      );
     settings.setValue("editorFont",     editor->font().toString() );
+    settings.setValue("autosave",       autosaveAction->isChecked() );
+#ifdef USE_IO_THREADS
+    settings.setValue("safeSave",       safeSave );
+    settings.setValue("saveSync",       ( saveSync == QeSaveThread::SyncNever ) ? "none" :
+                                        ( saveSync == QeSaveThread::SyncFull )  ? "full" : "data");
+#endif
 }
 
 
@@ -2133,12 +2452,15 @@ bool MainWindow::okToContinue()
         confirm.addButton( tr("&Discard"), QMessageBox::DestructiveRole );
         confirm.addButton( QMessageBox::Cancel );
         int r = confirm.exec();
-        if ( r == QMessageBox::Save )
-            return save();
+        if ( r == QMessageBox::Save ) {
+            if ( !save() )
+                return false;
+        }
         else if ( r == QMessageBox::Cancel )
             return false;
     }
-    return true;
+    // Whatever comes next replaces the text, so any save has to finish first
+    return finishSave();
 }
 
 
@@ -2148,7 +2470,9 @@ bool MainWindow::loadFile( const QString &fileName, bool createIfNew )
 
     if ( !file->open( QIODevice::ReadOnly | QFile::Text )) {
         if ( createIfNew ) {
+            journal->stop();
             editor->clear();
+            currentCompression = QeCompression::None;
             showMessage( tr("New file: %1").arg( QDir::toNativeSeparators( fileName )));
         }
         else {
@@ -2159,13 +2483,17 @@ bool MainWindow::loadFile( const QString &fileName, bool createIfNew )
     }
     else {
         QTextCodec *codec;
+        bool bDetect = false;
         // currentEncoding is always reset to "" when doing an explicit open
         if ( currentEncoding.isEmpty() ) {
             currentEncoding = getFileCodepage( fileName );
             if ( !currentEncoding.isEmpty() )
-                codec = QTextCodec::codecForName( currentEncoding.toLatin1().data() );
-            else
+                codec = QeOS2Codec::codecForName( currentEncoding.toLatin1().data() );
+            else {
+                // No encoding on record, so try to work it out from the contents
                 codec = QTextCodec::codecForLocale();
+                bDetect = true;
+            }
         }
         else {
             // This will only be used if we're doing a reload of the current file
@@ -2174,44 +2502,116 @@ bool MainWindow::loadFile( const QString &fileName, bool createIfNew )
                 currentEncoding = "";
             }
             else
-                codec = QTextCodec::codecForName( currentEncoding.toLatin1().data() );
+                codec = QeOS2Codec::codecForName( currentEncoding.toLatin1().data() );
         }
+
+        // Files too big to load comfortably can be shown in the viewer instead,
+        // which reads them from disk as needed.  (In read-only mode there's
+        // no reason to ask.)  The viewer can't read compressed files, which
+        // have to be decompressed from the start.
+        qint64 size = file->size();
+        QeCompression::Format compression = QeCompression::detect( file->peek( COMPRESSION_HEADER_SIZE ));
+        if (( size > VIEW_SIZE_THRESHOLD ) && !QeCompression::isSupported( compression ) &&
+            recoveryJournal.isEmpty() )
+        {
+            int r = QMessageBox::Yes;
+            if ( !readOnlyAction->isChecked() )
+                r = QMessageBox::question( this,
+                                           tr("Large File"),
+                                           tr("This file is %1 MB in size, and loading it for editing may take "
+                                              "a long time and a great deal of memory."
+                                              "<p>Open it in the read-only viewer instead?").arg( size >> 20 ),
+                                           QMessageBox::Yes | QMessageBox::No,
+                                           QMessageBox::Yes
+                                         );
+            if ( r == QMessageBox::Yes ) {
+                if ( bDetect ) {
+                    int confidence;
+                    QTextCodec *detected;
+                    QString name = getEncodingDetector()->detect( file, &confidence, &detected );
+                    if ( !name.isEmpty() && ( confidence >= DETECT_MIN_CONFIDENCE )) {
+                        codec = detected;
+                        currentEncoding = name;
+                    }
+                }
+                file->close();
+                delete file;
+                currentCompression = QeCompression::None;
+                return viewFile( fileName, codec );
+            }
+        }
+        closeView();
+        follower->stop();
+        journal->stop();
+
         QApplication::setOverrideCursor( Qt::WaitCursor );
 
 #ifdef USE_IO_THREADS
 
         showMessage( tr("Opening %1").arg( QDir::toNativeSeparators( fileName )));
         menuBar()->setEnabled( false );
-//        editor->document()->clear();
+
+        // The thread builds a complete new document, which replaces the
+        // current one when it's done (see finishLoad).  In the meantime the
+        // editor shows the start of the file (see readPreview), read-only.
+        editor->clear();
+        editor->document()->setUndoRedoEnabled( false );
+        editor->setTextInteractionFlags( Qt::TextSelectableByMouse | Qt::TextSelectableByKeyboard );
         editor->setEnabled( false );
-        if ( !openThread )
-            openThread = new QeOpenThread();
-        connect( openThread, SIGNAL( updateProgress( int )), this, SLOT( readProgress( int )));
-        connect( openThread, SIGNAL( finished() ), this, SLOT( readDone() ));
+        getOpenThread();
+        isReadThreadActive = true;
         openThread->setFile( file, codec, fileName );
+        if ( bDetect )
+            openThread->setEncodingDetector( getEncodingDetector() );
+        openThread->setDocumentDefaults( editor->document()->defaultFont(),
+                                         editor->document()->defaultTextOption() );
         openThread->start();
-        isReadThreadActive = true;
+        startLoadMonitor();
         return true;
 #else
 
+        if ( bDetect ) {
+            int confidence;
+            QTextCodec *detected;
+            QString name = getEncodingDetector()->detect( file, &confidence, &detected );
+            if ( !name.isEmpty() && ( confidence >= DETECT_MIN_CONFIDENCE )) {
+                codec = detected;
+                currentEncoding = name;
+                updateEncoding();
+            }
+        }
         QTextStream in( file );
         in.setCodec( codec );
-        QString text = in.readAll();
-        editor->setPlainText( text );
+        {
+            QeTraceSpan span("setPlainText");
+            editor->setPlainText( in.readAll() );
+            span.setCount("characters", editor->document()->characterCount() );
+        }
         file->close();
         delete file;
+        currentCompression = QeCompression::None;
         QApplication::restoreOverrideCursor();
         showMessage( tr("Opened file: %1").arg( QDir::toNativeSeparators( fileName )));
 #endif
 
     }
     setCurrentFile( fileName );
+    startJournal();
     return true;
 }
 
 
 bool MainWindow::saveFile( const QString &fileName )
 {
+#ifdef USE_IO_THREADS
+    // One save at a time.  Waiting here for the last one to finish would
+    // block the GUI for as long as it takes, so the user saves again later.
+    if ( isSaveThreadActive ) {
+        showMessage( tr("A save is already in progress; please try again when it has finished."));
+        return false;
+    }
+#endif
+
     if ( encodingChanged && ( !currentEncoding.startsWith("UTF-"))) {
         int r = QMessageBox::warning( this,
                                       tr("Encoding Changed"),
@@ -2228,8 +2628,7 @@ bool MainWindow::saveFile( const QString &fileName )
             return false;
     }
 
-    QFile *file = new QFile( fileName );
-    bool bExists = ( file->exists() );
+    bool bExists = QFile::exists( fileName );
 
     if ( bExists ) {
         QDateTime fileTime = QFileInfo( fileName ).lastModified();
@@ -2249,27 +2648,63 @@ bool MainWindow::saveFile( const QString &fileName )
         }
     }
 
-    // Always open in read/write mode, as it seems to preserve EAs on existing files.
-    if ( !file->open( QIODevice::ReadWrite | QFile::Text )) {
-        QMessageBox::critical( this, tr("Error"), tr("Error writing file"));
-        return false;
+    // Where possible, an existing file is saved by writing a new one which
+    // then replaces it, so that a failure part-way through loses nothing.
+    // Otherwise, open in read/write mode, as it seems to preserve EAs on
+    // existing files.
+    QFile *file = NULL;
+    QString replaceTarget;
+#ifdef USE_IO_THREADS
+    // If the file is just as it was when loaded or last saved, only the part
+    // from the first changed line on needs writing (see QeSaveThread::setTail).
+    // That's done in place, so no new file is made here; the thread makes one
+    // if it has to write the whole file after all.
+    int tailLine = 0;
+    int tailPosition = 0;
+    if ( bExists && ( fileName == currentFile ) && ( fileLineCount > 0 ) && !encodingChanged &&
+         ( currentCompression == QeCompression::None ))
+    {
+        QFileInfo info( fileName );
+        if (( info.size() == currentFileSize ) && ( info.lastModified() == currentModifyTime )) {
+            QTextDocument *document = editor->document();
+            int change = qMin( editor->firstChange(), document->characterCount() - 1 );
+            tailLine = editor->lineNumber( document->findBlock( change ));
+            tailPosition = editor->lineBlock( tailLine ).position();
+        }
+    }
+    if ( bExists && safeSave && !tailLine )
+        file = QeSaveThread::createTempFile( fileName, &replaceTarget );
+#endif
+    if ( !file ) {
+        file = new QFile( fileName );
+        if ( !file->open( QIODevice::ReadWrite | QFile::Text )) {
+            delete file;
+            QMessageBox::critical( this, tr("Error"), tr("Error writing file"));
+            return false;
+        }
     }
 
-    QApplication::setOverrideCursor( Qt::WaitCursor );
+    // Don't follow our own writes; setCurrentFile() picks up again afterwards
+    follower->stop();
 
 #ifndef USE_IO_THREADS
+    QApplication::setOverrideCursor( Qt::WaitCursor );
+
     QTextStream out( file );
-    out.setCodec( QTextCodec::codecForName( currentEncoding.toLatin1().data() ));
-    QString text = editor->toPlainText();
+    out.setCodec( QeOS2Codec::codecForName( currentEncoding.toLatin1().data() ));
+    QString text = editor->plainText();
     out << text;
     out.flush();
     qint64 iSize = out.pos();
     if ( iSize != -1 ) file->resize( iSize );
     file->flush();
     file->close();
+    currentCompression = QeCompression::None;
 
     showMessage( tr("Saved file: %1 (%2 bytes written)").arg( QDir::toNativeSeparators( fileName )).arg( iSize ));
     setCurrentFile( fileName );
+    journal->beginRebase();
+    journal->rebased( currentFile, currentEncoding );
 
     if ( !bExists ) {
 #ifdef __OS2__
@@ -2291,17 +2726,44 @@ bool MainWindow::saveFile( const QString &fileName )
 
 #else       // USE_IO_THREADS
 
-    menuBar()->setEnabled( false );
-    editor->setEnabled( false );
-
+    // The thread writes a copy of the text as it is now, and editing carries
+    // on meanwhile; saveDone() then leaves the document marked modified if it
+    // has changed since.  (The copy is the document's own text, segment breaks
+    // and all, which is the quickest one to take; the thread removes them.)
+    QApplication::setOverrideCursor( Qt::BusyCursor );
     showMessage( tr("Saving %1").arg( QDir::toNativeSeparators( fileName )));
-    if ( !saveThread )
+    if ( !saveThread ) {
         saveThread = new QeSaveThread();
-    connect( saveThread, SIGNAL( updateProgress( int )), this, SLOT( saveProgress( int )));
-    connect( saveThread, SIGNAL( saveComplete( qint64 )), this, SLOT( saveDone( qint64 )));
-    QTextCodec *codec = QTextCodec::codecForName( currentEncoding.toLatin1().data() );
+        connect( saveThread, SIGNAL( updateProgress( int )), this, SLOT( saveProgress( int )));
+        connect( saveThread, SIGNAL( saveComplete( qint64 )), this, SLOT( saveDone( qint64 )));
+    }
+    QTextCodec *codec = QeOS2Codec::codecForName( currentEncoding.toLatin1().data() );
     saveThread->setFile( file, codec, fileName, bExists );
-    saveThread->setText( editor->toPlainText() );
+    saveThread->setReplaceTarget( replaceTarget );
+    saveThread->setSyncPolicy( (QeSaveThread::SyncPolicy) saveSync );
+    saveThread->setLineEnds( currentLineEnds );
+    saveThread->setTail( tailPosition, tailLine, fileLineCount, bExists && safeSave );
+    QVector<int> breaks;
+    {
+        QeTraceSpan span("snapshot");
+        saveThread->setText( editor->snapshot( &breaks ), breaks );
+    }
+    saveRevision = editor->document()->revision();
+    saveFailed = false;
+    saveLineCount = editor->lineNumber( editor->document()->lastBlock() ) + 1;
+    saveFirstChange = editor->firstChange();
+    editor->clearChanges();
+    journal->beginRebase();
+    saveThread->setByteOrderMark( hasByteOrderMark );
+
+    // A file that was loaded compressed is saved the same way; otherwise the
+    // extension decides (so "Save As" foo.gz compresses).
+    QeCompression::Format compression = ( fileName == currentFile ) ?
+                                            (QeCompression::Format) currentCompression :
+                                            QeCompression::formatForFileName( fileName );
+    if ( !QeCompression::isSupported( compression ))
+        compression = QeCompression::None;
+    saveThread->setCompression( compression );
     saveThread->start();
     isSaveThreadActive = true;
 
@@ -2324,9 +2786,15 @@ bool MainWindow::print()
 }
 
 
-void MainWindow::setCurrentFile( const QString &fileName )
+// Make the given file current.  If loadedSize is given, it's how much of the
+// file the editor holds; otherwise that's assumed to be all of it.
+//
+void MainWindow::setCurrentFile( const QString &fileName, qint64 loadedSize )
 {
     currentFile = fileName;
+#ifdef USE_IO_THREADS
+    fileLineCount = -1;         // until finishLoad() or saveDone() says otherwise
+#endif
     updateModified( false );
     encodingChanged = false;
     QString shownName = tr("Untitled");
@@ -2339,21 +2807,21 @@ void MainWindow::setCurrentFile( const QString &fileName )
         recentFiles.prepend( currentFile );
         updateRecentFileActions();
     }
+    currentFileSize = loadedSize;
+    if (( currentFileSize < 0 ) && !currentFile.isEmpty() )
+        currentFileSize = QFileInfo( fileName ).size();
     updateEncoding();
     setWindowTitle( tr("Text Editor - %1 [*]").arg( shownName ));
+    followFile();
 }
 
 
+// Files which no longer exist are removed separately; see checkRecentFiles.
+//
 void MainWindow::updateRecentFileActions()
 {
-    QMutableStringListIterator i( recentFiles );
-    int fileCount = 0;
-    while ( i.hasNext() ) {
-        fileCount++;
-        if ( !QFile::exists( i.next() ) || ( fileCount > MaxRecentFiles )) {
-            i.remove();
-        }
-    }
+    while ( recentFiles.size() > MaxRecentFiles )
+        recentFiles.removeLast();
     for ( int j = 0; j < MaxRecentFiles; j++ ) {
         if ( j < recentFiles.count() ) {
             QString text = tr("&%1 %2").arg( j+1 ).arg( strippedName( recentFiles[ j ] ));
@@ -2371,6 +2839,30 @@ void MainWindow::updateRecentFileActions()
 }
 
 
+// Start checking, in the background, that the recent files all still exist
+// (unless that's already under way).  Any that don't are removed from the list
+// when the check is done.
+//
+void MainWindow::checkRecentFiles()
+{
+    if ( recentFileCheck || recentFiles.isEmpty() )
+        return;
+    // The thread isn't ours to delete, as it may outlive us if a check hangs
+    recentFileCheck = new QeFileCheckThread( recentFiles );
+    connect( recentFileCheck, SIGNAL( filesMissing( const QStringList & )), this, SLOT( removeRecentFiles( const QStringList & )));
+    connect( recentFileCheck, SIGNAL( finished() ), recentFileCheck, SLOT( deleteLater() ));
+    recentFileCheck->start( QThread::LowPriority );
+}
+
+
+void MainWindow::removeRecentFiles( const QStringList &missing )
+{
+    for ( int i = 0; i < missing.size(); i++ )
+        recentFiles.removeAll( missing.at( i ));
+    updateRecentFileActions();
+}
+
+
 QString MainWindow::strippedName( const QString &fullFileName )
 {
     return QFileInfo( fullFileName ).fileName();
@@ -2399,6 +2891,8 @@ void MainWindow::showUsage()
                                  "<table>"
                                   "<tr><td> &nbsp; %1read</td> <td style=\"padding-left: 1em;\">Read-only mode</td></tr>"
                                   "<tr><td> &nbsp; %1enc:&lt;encoding&gt;</td> <td style=\"padding-left: 1em;\">Use the specified encoding</td></tr>"
+                                  "<tr><td> &nbsp; %1single</td> <td style=\"padding-left: 1em;\">Open the file in a QE that is already running</td></tr>"
+                                  "<tr><td> &nbsp; %1trace[:&lt;file&gt;]</td> <td style=\"padding-left: 1em;\">Write a performance trace</td></tr>"
                                   "<tr><td> &nbsp; %1?   </td> <td style=\"padding-left: 1em;\">Show usage information</td></tr>"
                                   "</table>").arg( SWITCH_CHAR ),
                               QMessageBox::Ok
@@ -2408,6 +2902,11 @@ void MainWindow::showUsage()
 
 void MainWindow::setReadOnly( bool readOnly )
 {
+#ifdef USE_IO_THREADS
+    // The editor is kept read-only while a file is loading; finishLoad()
+    // applies the setting once it's done.
+    if ( !isReadThreadActive )
+#endif
     editor->setTextInteractionFlags( readOnly ?
                                         Qt::TextSelectableByMouse | Qt::TextSelectableByKeyboard :
                                         Qt::TextEditorInteraction
@@ -2422,6 +2921,11 @@ void MainWindow::setReadOnly( bool readOnly )
 
 void MainWindow::updateEncoding()
 {
+    if ( !encodingGroup ) {
+        // (createEncodingMenus() will do this)
+        updateEncodingLabel();
+        return;
+    }
     QList<QAction *> actions = encodingGroup->actions();
     for ( int i = 0; i < actions.size(); i++ ) {
         if ( QString::compare( actions.at( i )->data().toString(), currentEncoding ) == 0 ) {
@@ -2433,15 +2937,311 @@ void MainWindow::updateEncoding()
 }
 
 
+// (Re)connect the signals we use from the editor's document; needed whenever
+// the editor is given a new one.
+//
+void MainWindow::connectDocument()
+{
+    connect( editor->document(), SIGNAL( contentsChanged() ), this, SLOT( updateModified() ));
+}
+
+
+// Show the given file in the large-file viewer, in place of the editor.
+//
+bool MainWindow::viewFile( const QString &fileName, QTextCodec *codec )
+{
+    if ( !fileView ) {
+        fileView = new QeFileView( centralStack );
+        fileView->setFont( editor->font() );
+        centralStack->addWidget( fileView );
+        connect( fileView, SIGNAL( positionChanged( qint64, int )), this, SLOT( viewPosition( qint64, int )));
+        connect( fileView, SIGNAL( indexProgress( int )), this, SLOT( viewProgress( int )));
+        connect( fileView, SIGNAL( indexComplete( qint64 )), this, SLOT( viewIndexed( qint64 )));
+        connect( fileView, SIGNAL( findProgress( int )), this, SLOT( viewFindProgress( int )));
+        connect( fileView, SIGNAL( findComplete( bool )), this, SLOT( viewFindDone( bool )));
+        connect( fileView, SIGNAL( findCancelled() ), this, SLOT( viewFindCancelled() ));
+    }
+    if ( !fileView->open( fileName, codec )) {
+        QMessageBox::critical( this, tr("Error"), tr("The file could not be opened."));
+        closeView();
+        return false;
+    }
+
+    // Free whatever the editor was holding
+    journal->stop();
+    editor->clear();
+    centralStack->setCurrentWidget( fileView );
+    fileView->setFocus( Qt::OtherFocusReason );
+
+    QAction *editing[] = { saveAction, saveAsAction, printAction, undoAction, redoAction,
+                           cutAction, copyAction, pasteAction, selectAllAction, replaceAction,
+                           deleteLineAction, readOnlyAction, editModeAction, wrapAction,
+                           followAction, crlfAction };
+    for ( unsigned int i = 0; i < sizeof( editing ) / sizeof( editing[ 0 ] ); i++ )
+        editing[ i ]->setEnabled( false );
+    editModeLabel->setText(" RO ");
+
+    setCurrentFile( fileName );
+    showMessage( tr("Viewing %1 (indexing lines)").arg( QDir::toNativeSeparators( fileName )));
+    return true;
+}
+
+
+// Close the viewer (if it's in use) and go back to the editor.
+//
+void MainWindow::closeView()
+{
+    if ( !fileView || ( centralStack->currentWidget() != fileView ))
+        return;
+
+    fileView->close();
+    centralStack->setCurrentWidget( editor );
+
+    QAction *editing[] = { saveAction, saveAsAction, printAction, undoAction, redoAction,
+                           cutAction, copyAction, pasteAction, selectAllAction, replaceAction,
+                           deleteLineAction, readOnlyAction, editModeAction, wrapAction,
+                           followAction, crlfAction };
+    for ( unsigned int i = 0; i < sizeof( editing ) / sizeof( editing[ 0 ] ); i++ )
+        editing[ i ]->setEnabled( true );
+    updateModeLabel();
+    updatePositionLabel();
+}
+
+
+// Start a new journal of the changes to the current text, which is the current
+// file as it now is on disk (see QeEditJournal); if autosave is on.
+//
+void MainWindow::startJournal()
+{
+    if ( autosaveAction->isChecked() )
+        journal->start( currentFile, currentEncoding );
+    else
+        journal->stop();
+}
+
+
+// Offer to recover the changes in any journals left behind by a crash.  Each
+// one is replayed in a window of its own, unless this one isn't in use yet.
+//
+void MainWindow::recoverJournals()
+{
+    QStringList journals = QeEditJournal::orphans();
+    for ( int i = 0; i < journals.size(); i++ ) {
+        QeEditJournal::Header header;
+        QList<QeTextChange> changes;
+        if ( !QeEditJournal::read( journals.at( i ), &header, &changes ) || changes.isEmpty() ) {
+            QeEditJournal::discard( journals.at( i ));
+            continue;
+        }
+        QString shownName = header.baseFile.isEmpty() ? tr("Untitled") :
+                                                        QDir::toNativeSeparators( header.baseFile );
+        if ( !QeEditJournal::matchesBase( header )) {
+            QMessageBox::warning( this, tr("Recover Changes"),
+                                  tr("QE was not closed properly while there were unsaved changes to %1. "
+                                     "The file has been modified since, so they cannot be recovered.").arg( shownName ));
+            QeEditJournal::discard( journals.at( i ));
+            continue;
+        }
+        int r = QMessageBox::question( this, tr("Recover Changes"),
+                                       tr("QE was not closed properly while there were unsaved changes to %1."
+                                          "<p>Do you want to recover them?  (Cancel leaves them to be "
+                                          "recovered another time.)").arg( shownName ),
+                                       QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel,
+                                       QMessageBox::Yes
+                                     );
+        if ( r == QMessageBox::No )
+            QeEditJournal::discard( journals.at( i ));
+        if ( r != QMessageBox::Yes )
+            continue;
+
+        bool inUse = !currentFile.isEmpty() || isWindowModified() || isViewing() || !recoveryJournal.isEmpty();
+#ifdef USE_IO_THREADS
+        inUse = inUse || isReadThreadActive;
+#endif
+        MainWindow *window = this;
+        if ( inUse ) {
+            window = new MainWindow;
+            window->show();
+        }
+        window->recoverJournal( journals.at( i ), header.baseFile, header.encoding, changes );
+    }
+}
+
+
+// Load the base file of a journal (see recoverJournals), and replay the
+// journal's changes on it once it's loaded.
+//
+void MainWindow::recoverJournal( const QString &journalName, const QString &baseFile, const QString &encoding,
+                                 const QList<QeTextChange> &changes )
+{
+    recoveryJournal = journalName;
+    recoveryChanges = changes;
+    currentEncoding = encoding;
+    if ( baseFile.isEmpty() || !QFile::exists( baseFile )) {
+        // A new file, which was never saved
+        journal->stop();
+        editor->clear();
+        currentCompression = QeCompression::None;
+        setCurrentFile( baseFile );
+        startJournal();
+        replayJournal();
+        return;
+    }
+
+    // (As for reloading, "Default" stops loadFile() looking for the encoding)
+    if ( currentEncoding.isEmpty() )
+        currentEncoding = "Default";
+    if ( !loadFile( baseFile, false )) {
+        recoveryJournal.clear();
+        recoveryChanges.clear();
+        return;
+    }
+#ifndef USE_IO_THREADS
+    replayJournal();
+#endif
+}
+
+
+// Make the changes read from a journal to the text just loaded, as a single
+// edit, which leaves the text modified.  The changes are journalled afresh as
+// they're made, so the old journal can then go.
+//
+// Journal positions are in plainText(), so the segment breaks are needed to
+// find them in the document.  They're found once, and then kept up to date
+// change by change (as QeTextEdit::trackChange does), so that each change
+// costs in proportion to its own size.
+//
+void MainWindow::replayJournal()
+{
+    QList<QeTextChange> changes = recoveryChanges;
+    QString journalName = recoveryJournal;
+    recoveryChanges.clear();
+    recoveryJournal.clear();
+
+    QTextDocument *document = editor->document();
+    QVector<int> breaks = editor->segmentBreaks();
+    int length = document->characterCount() - 1 - breaks.size();
+    QTextCursor cursor( document );
+    cursor.beginEditBlock();
+    for ( int i = 0; i < changes.size(); i++ ) {
+        const QeTextChange &change = changes.at( i );
+        int start = qBound( 0, change.position, length );
+        int end = qBound( start, change.position + change.length, length );
+        cursor.setPosition( QeTextEdit::documentPosition( start, breaks ));
+        cursor.setPosition( QeTextEdit::documentPosition( end, breaks ), QTextCursor::KeepAnchor );
+        int documentStart = cursor.selectionStart();
+
+        // The breaks in the range replaced go with it, and those after it move
+        QVector<int>::iterator first = qLowerBound( breaks.begin(), breaks.end(), start );
+        QVector<int>::iterator last  = qLowerBound( first, breaks.end(), end );
+        int index = first - breaks.begin();
+        breaks.erase( first, last );
+        int delta = change.text.size() - ( end - start );
+        for ( int j = index; j < breaks.size(); j++ )
+            breaks[ j ] += delta;
+        length += delta;
+
+        cursor.removeSelectedText();
+        if ( change.text.isEmpty() )
+            continue;
+        // The text added may have been broken into segments itself
+        editor->insertText( cursor, change.text );
+        QVector<int> added;
+        for ( QTextBlock block = document->findBlock( documentStart ).next();
+              block.isValid() && ( block.position() <= cursor.position() );
+              block = block.next() )
+        {
+            if ( QeTextEdit::isSegment( block ))
+                added.append( block.position() - 1 - index - added.size() );
+        }
+        for ( int j = 0; j < added.size(); j++ )
+            breaks.insert( index + j, added.at( j ));
+    }
+    cursor.endEditBlock();
+
+    updateModified( true );
+    journal->flush();
+    QeEditJournal::discard( journalName );
+    showMessage( tr("Recovered the unsaved changes to %1").arg(
+                    currentFile.isEmpty() ? tr("Untitled") : QDir::toNativeSeparators( currentFile )));
+}
+
+
+// Start or stop following the current file, according to the follow option.
+// Anything written past currentFileSize is added to the editor straight away.
+// (Not done in the viewer, which has no document to add to, nor for compressed
+// files, which can't be read from the middle.)
+//
+void MainWindow::followFile()
+{
+    follower->stop();
+    if ( !followAction->isChecked() || currentFile.isEmpty() || isViewing() ||
+         ( currentCompression != QeCompression::None ))
+        return;
+#ifdef USE_IO_THREADS
+    if ( isSaveThreadActive ) return;   // saveDone() starts it again
+#endif
+
+    // Appended text is decoded the same way as the rest of the file was; a
+    // byte-order mark decides that without setting currentEncoding
+    QTextCodec *codec = NULL;
+    if ( !currentEncoding.isEmpty() )
+        codec = QeOS2Codec::codecForName( currentEncoding.toLatin1().data() );
+#ifdef USE_IO_THREADS
+    else if ( hasByteOrderMark )
+        codec = loadedCodec;
+#endif
+    follower->start( currentFile, codec, qMax( currentFileSize, (qint64) 0 ));
+}
+
+
+bool MainWindow::isViewing() const
+{
+    return ( fileView && ( centralStack->currentWidget() == fileView ));
+}
+
+
+// Search the file in the viewer.  Plain text and whole-word searches are
+// turned into the equivalent regular expressions.  The search runs in the
+// background, and viewFindDone() reports the result.
+//
+void MainWindow::findInView( const QString &str, bool cs, bool words, bool re, bool backward, bool fromEdge )
+{
+    QeTraceSpan span("MainWindow::findInView");
+    Qt::CaseSensitivity sensitivity = cs ? Qt::CaseSensitive : Qt::CaseInsensitive;
+    QRegExp pattern;
+    if ( re )
+        pattern = QRegExp( str, sensitivity );
+    else if ( words )
+        pattern = QRegExp("\\b" + QRegExp::escape( str ) + "\\b", sensitivity );
+    else
+        pattern = QRegExp( str, sensitivity, QRegExp::FixedString );
+
+    findAgainAction->setEnabled( true );
+    viewFindText = str;
+    fileView->find( pattern, backward, fromEdge );
+    showMessage( tr("Searching for: %1 (press Esc to cancel)").arg( str ));
+}
+
+
 void MainWindow::deleteLine()
 {
     QTextCursor cursor;
 
     cursor = editor->textCursor();
-    cursor.setPosition( cursor.block().position(), QTextCursor::MoveAnchor );
+
+    // A long line may be in several blocks (segments)
+    QTextBlock first = cursor.block();
+    while ( QeTextEdit::isSegment( first ))
+        first = first.previous();
+    QTextBlock last = first;
+    while ( QeTextEdit::isSegment( last.next() ))
+        last = last.next();
+    cursor.setPosition( first.position(), QTextCursor::MoveAnchor );
+    cursor.setPosition( last.position(), QTextCursor::KeepAnchor );
 
     // Need to handle the last line specially if it doesn't end in a newline
-    if ( 1 + cursor.blockNumber() == editor->blockCount() )
+    if ( 1 + last.blockNumber() == editor->blockCount() )
         // If last line, delete to end of document
         cursor.movePosition( QTextCursor::End, QTextCursor::KeepAnchor );
     else
@@ -2463,7 +3263,7 @@ bool MainWindow::showFindResult( QTextCursor found, const QString &str )
     else {
         QTextCursor temp( found );
         temp.setPosition( temp.selectionStart() );
-        showMessage( tr("Found match at %1:%2").arg( temp.blockNumber() + 1 ).arg( temp.positionInBlock() ));
+        showMessage( tr("Found match at %1:%2").arg( editor->lineNumber( temp.block() ) + 1 ).arg( editor->columnNumber( temp ) ));
         isFound = true;
     }
     editor->setCenterOnScroll( true );
@@ -2490,9 +3290,10 @@ bool MainWindow::replaceFindResult( QTextCursor found, const QString newText, bo
     }
     QTextCursor temp( found );
     temp.setPosition( temp.selectionStart() );
-    int column = temp.positionInBlock();
+    int column = editor->columnNumber( temp );
+    int line   = editor->lineNumber( temp.block() );
     found.insertText( newText );
-    showMessage( tr("Replaced text at %1:%2").arg( found.blockNumber() + 1 ).arg( column ));
+    showMessage( tr("Replaced text at %1:%2").arg( line + 1 ).arg( column ));
 
     return true;
 }
@@ -2516,6 +3317,7 @@ bool MainWindow::mapNameToEncoding( QString &encoding )
     }
     // If that didn't work, see if it matches one of our encoding names verbatim
     else {
+        createEncodingMenus();
         QList<QAction *> actions = encodingGroup->actions();
         for ( int i = 0; i < actions.size(); i++ ) {
             if ( QString::compare( actions.at( i )->data().toString(), encoding, Qt::CaseInsensitive ) == 0 ) {
@@ -2533,6 +3335,40 @@ bool MainWindow::mapNameToEncoding( QString &encoding )
 }
 
 
+#ifdef USE_IO_THREADS
+// Returns the thread used for loading files, creating it if necessary.
+//
+QeOpenThread *MainWindow::getOpenThread()
+{
+    if ( !openThread ) {
+        openThread = new QeOpenThread();
+        connect( openThread, SIGNAL( updateProgress( int )), this, SLOT( readProgress( int )));
+        connect( openThread, SIGNAL( previewAvailable( const QString & )), this, SLOT( readPreview( const QString & )));
+        connect( openThread, SIGNAL( encodingDetected( const QString &, int )), this, SLOT( readEncoding( const QString &, int )));
+        connect( openThread, SIGNAL( finished() ), this, SLOT( readDone() ));
+    }
+    return openThread;
+}
+#endif
+
+
+// Return the detector used to guess the encoding of files which don't have
+// one on record, creating it the first time.  It chooses between all the
+// encodings we know of.
+//
+QeEncodingDetector *MainWindow::getEncodingDetector()
+{
+    if ( !encodingDetector ) {
+        QStringList encodings;
+        int iMax = sizeof( Codepage_CCSIDs ) / sizeof ( int );
+        for ( int i = 0; i < iMax; i++ )
+            encodings << Codepage_Mappings[ i ];
+        encodingDetector = new QeEncodingDetector( encodings );
+    }
+    return encodingDetector;
+}
+
+
 QString MainWindow::getFileCodepage( const QString &fileName )
 {
     QString encoding("");
@@ -2596,6 +3432,124 @@ void MainWindow::setFileCodepage( const QString &fileName, const QString &encodi
 }
 
 
+void MainWindow::viewPosition( qint64 line, int column )
+{
+    positionLabel->setText( QString("%1:%2").arg( line + 1 ).arg( column ));
+}
+
+
+void MainWindow::viewProgress( int percent )
+{
+    // (a search in progress has the status bar)
+    if ( fileView->isFinding() ) return;
+    showMessage( tr("Viewing %1 (indexing lines: %2%)").arg( QDir::toNativeSeparators( currentFile )).arg( percent ));
+}
+
+
+void MainWindow::viewIndexed( qint64 lines )
+{
+    if ( fileView->isFinding() ) return;
+    showMessage( tr("Viewing %1 (%2 lines)").arg( QDir::toNativeSeparators( currentFile )).arg( lines ));
+}
+
+
+void MainWindow::viewFindProgress( int percent )
+{
+    if ( !fileView->isFinding() ) return;
+    showMessage( tr("Searching for: %1 (%2%; press Esc to cancel)").arg( viewFindText ).arg( percent ));
+}
+
+
+void MainWindow::viewFindDone( bool found )
+{
+    if ( !found )
+        showMessage( tr("No matches found for: %1").arg( viewFindText ));
+    else if ( fileView->isMatchShown() )
+        showMessage( tr("Found match at %1:%2").arg( fileView->currentLine() + 1 ).arg( fileView->currentColumn() ));
+    else
+        showMessage( tr("Found match at %1:%2 (beyond the part of the line which is shown)").arg( fileView->currentLine() + 1 ).arg( fileView->currentColumn() ));
+}
+
+
+void MainWindow::viewFindCancelled()
+{
+    showMessage( tr("Search cancelled."));
+}
+
+
+// Add text which has been appended to the file (in follow mode).  It doesn't
+// count as a modification, since the editor still matches the file.
+//
+void MainWindow::followAppend( const QString &text )
+{
+#ifdef USE_IO_THREADS
+    if ( isReadThreadActive || isSaveThreadActive ) return;
+#endif
+    // Like tail -f: stay at the end if that's where we were
+    QScrollBar *scrollBar = editor->verticalScrollBar();
+    bool atEnd = ( scrollBar->value() == scrollBar->maximum() );
+    bool wasModified = editor->document()->isModified();
+
+    // The file has this text too, so it isn't a change as far as the journal
+    // is concerned
+    QTextCursor cursor( editor->document() );
+    cursor.movePosition( QTextCursor::End );
+    journal->setSuspended( true );
+    cursor.beginEditBlock();
+    editor->insertText( cursor, text );
+    cursor.endEditBlock();
+    journal->setSuspended( false );
+
+    if ( !wasModified )
+        updateModified( false );
+    currentModifyTime = QFileInfo( currentFile ).lastModified();
+    currentFileSize = follower->position();
+    journal->rebased( currentFile, currentEncoding );
+#ifdef USE_IO_THREADS
+    if ( fileLineCount > 0 )
+        fileLineCount += text.count( QLatin1Char('\n'));
+#endif
+    if ( atEnd )
+        scrollBar->setValue( scrollBar->maximum() );
+}
+
+
+// The followed file was truncated, or replaced by a new one (e.g. a log being
+// rotated), so the editor no longer matches it.  Load it again unless that
+// would throw away changes.
+//
+void MainWindow::followReplaced()
+{
+    if ( editor->document()->isModified() ) {
+        followAction->setChecked( false );
+        showMessage( tr("%1 was truncated or replaced; no longer following it.").arg( QDir::toNativeSeparators( currentFile )));
+        return;
+    }
+    loadFile( currentFile, false );
+}
+
+
+// Trace how long startup took, from the given clock (started at the top of
+// main) until the window is up.  Call this just after show(): the timer fires
+// once the events that show and paint the window have been handled.
+//
+void MainWindow::timeStartup( const QElapsedTimer &clock )
+{
+    startupClock = clock;
+    QTimer::singleShot( 0, this, SLOT( startupDone() ));
+}
+
+
+void MainWindow::startupDone()
+{
+    // The span runs from when tracing started; the time from the top of
+    // main() (which includes creating the QApplication) goes with it
+    if ( QeTrace::isEnabled() )
+        QeTrace::record("startup", 0, "sinceMainMs", startupClock.elapsed() );
+    recoverJournals();
+}
+
+
 void MainWindow::readProgress( int percent )
 {
 #ifdef USE_IO_THREADS
@@ -2608,17 +3562,80 @@ void MainWindow::readProgress( int percent )
 }
 
 
+void MainWindow::readPreview( const QString &text )
+{
+#ifdef USE_IO_THREADS
+
+    if ( !isReadThreadActive ) return;
+
+    QTextCursor cursor( editor->document() );
+    cursor.insertText( text );
+    editor->setEnabled( true );
+    QApplication::changeOverrideCursor( QCursor( Qt::BusyCursor ));
+
+#endif
+}
+
+
+// The open thread has worked out the file's encoding, so show it as the
+// current one.  (The file is being decoded with it already.)
+//
+void MainWindow::readEncoding( const QString &encoding, int confidence )
+{
+#ifdef USE_IO_THREADS
+
+    if ( !isReadThreadActive ) return;
+
+    currentEncoding = encoding;
+    updateEncoding();
+    showMessage( tr("Opening %1 (detected encoding %2, %3% confidence)").arg(
+                    QDir::toNativeSeparators( openThread->inputFileName )).arg( encoding ).arg( confidence ));
+
+#else
+    // Keep the compiler happy
+    if ( encoding.isEmpty() ) {;}
+    if ( confidence ) {;}
+#endif
+}
+
+
 void MainWindow::readDone()
 {
 #ifdef USE_IO_THREADS
 
+    if ( !isReadThreadActive || !openThread ) return;
+    finishLoad();
+
+#endif
+}
+
+
+void MainWindow::finishLoad()
+{
+#ifdef USE_IO_THREADS
+
+    QeTraceSpan span("MainWindow::finishLoad");
     isReadThreadActive = false;
-    if ( !openThread ) return;
 
-    showMessage( tr("Opening %1 (100%)").arg( QDir::toNativeSeparators( openThread->inputFileName )));
-    editor->setUpdatesEnabled( false );
-    editor->setPlainText( openThread->getText() );
-    editor->setUpdatesEnabled( true );
+    // Swap in the finished document
+    {
+        QeTraceSpan swapSpan("swapDocument");
+        QTextDocument *document = openThread->takeDocument();
+        if ( document ) {
+            editor->swapDocument( document );
+            connectDocument();
+        }
+        else if ( openThread->isReload() )
+            applyChanges( openThread->takeChanges() );
+    }
+    hasByteOrderMark = openThread->hasByteOrderMark();
+    loadedCodec = openThread->codec();
+    currentCompression = openThread->compression();
+    if ( loadMonitor->isActive() )
+        monitorLoad();
+
+    editor->document()->setUndoRedoEnabled( true );
+    setReadOnly( readOnlyAction->isChecked() );
 
 //  TODO hide progress bar, once implemented
 
@@ -2626,11 +3643,128 @@ void MainWindow::readDone()
     editor->setEnabled( true );
 
     QApplication::restoreOverrideCursor();
-    showMessage( tr("Opened file: %1").arg( QDir::toNativeSeparators( openThread->inputFileName )));
-    setCurrentFile( openThread->inputFileName );
+    showMessage(( openThread->isReload() ? tr("Reloaded file: %1") : tr("Opened file: %1")).arg(
+                    QDir::toNativeSeparators( openThread->inputFileName )));
+    setCurrentFile( openThread->inputFileName, openThread->bytesRead() );
+    if ( currentCompression == QeCompression::None )
+        fileLineCount = editor->lineNumber( editor->document()->lastBlock() ) + 1;
+    editor->clearChanges();
+    setLineEnds( openThread->lineEnds(), openThread->hasMixedLineEnds() );
+    startJournal();
+    if ( !recoveryJournal.isEmpty() )
+        replayJournal();
 
     editor->setFocus( Qt::OtherFocusReason );
 
+    if ( loadMonitor->isActive() ) {
+        // The whole load, from loadFile() on, with the longest GUI stall
+        loadMonitor->stop();
+        qint64 start = QeTrace::now() - loadClock.nsecsElapsed() / 1000;
+        QeTrace::record("load", start, "maxStallMs", loadMaxStall );
+
+        // Memory growth per 100 bytes of file: ideally about 200 (one copy of
+        // the text as UTF-16) plus the layout
+        if (( loadStartMemory >= 0 ) && ( openThread->bytesRead() > 0 ))
+            QeTrace::record("loadMemory", start, "percentOfFile",
+                            ( loadPeakMemory - loadStartMemory ) * 100 / openThread->bytesRead() );
+    }
+
+#endif
+}
+
+
+// Make the changes found by a reload, as a single edit.  They're made from
+// last to first, so that the positions of the rest still hold.  (Positions are
+// in the editor's plainText(), so have to allow for any segment breaks.)
+//
+void MainWindow::applyChanges( const QList<QeTextChange> &changes )
+{
+    if ( changes.isEmpty() )
+        return;
+
+    int hScroll = editor->horizontalScrollBar()->value();
+    int vScroll = editor->verticalScrollBar()->value();
+
+    QVector<int> breaks = editor->segmentBreaks();
+    QTextCursor cursor( editor->document() );
+    cursor.beginEditBlock();
+    for ( int i = changes.size() - 1; i >= 0; i-- ) {
+        const QeTextChange &change = changes.at( i );
+        cursor.setPosition( QeTextEdit::documentPosition( change.position, breaks ));
+        cursor.setPosition( QeTextEdit::documentPosition( change.position + change.length, breaks ),
+                            QTextCursor::KeepAnchor );
+        editor->insertText( cursor, change.text );
+    }
+    cursor.endEditBlock();
+
+    editor->horizontalScrollBar()->setValue( hScroll );
+    editor->verticalScrollBar()->setValue( vScroll );
+}
+
+
+// Returns the amount of memory the process currently has resident, in bytes,
+// or -1 where we don't know how to find out.
+//
+static qint64 residentMemory()
+{
+#if defined( Q_OS_LINUX )
+    long pages = -1;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if ( statm ) {
+        if ( fscanf( statm, "%*ld %ld", &pages ) != 1 )
+            pages = -1;
+        fclose( statm );
+    }
+    return ( pages < 0 ) ? -1 : (qint64) pages * sysconf( _SC_PAGESIZE );
+#elif defined( Q_OS_WIN )
+    PROCESS_MEMORY_COUNTERS counters;
+    if ( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters )))
+        return -1;
+    return (qint64) counters.WorkingSetSize;
+#else
+    return -1;
+#endif
+}
+
+
+// Start keeping track of the GUI's responsiveness and the memory in use while
+// a file loads (see monitorLoad), if tracing is on to report them.
+//
+void MainWindow::startLoadMonitor()
+{
+#ifdef USE_IO_THREADS
+
+    if ( !QeTrace::isEnabled() )
+        return;
+    loadMaxStall    = 0;
+    loadLastTick    = 0;
+    loadStartMemory = residentMemory();
+    loadPeakMemory  = loadStartMemory;
+    loadClock.start();
+    loadMonitor->start();
+
+#endif
+}
+
+
+// Called at regular intervals while a file is loading, to keep track of the
+// longest time that the event loop went without running, and of the most
+// memory in use at any one time.
+//
+void MainWindow::monitorLoad()
+{
+#ifdef USE_IO_THREADS
+
+    qint64 now = loadClock.elapsed();
+    qint64 stall = now - loadLastTick - loadMonitor->interval();
+    if ( stall > loadMaxStall )
+        loadMaxStall = stall;
+    loadLastTick = now;
+
+    qint64 memory = residentMemory();
+    if ( memory > loadPeakMemory )
+        loadPeakMemory = memory;
+
 #endif
 }
 
@@ -2641,6 +3775,11 @@ void MainWindow::readCancel()
     if ( openThread )
         openThread->cancel();
 
+    isReadThreadActive = false;
+    loadMonitor->stop();
+    editor->document()->setUndoRedoEnabled( true );
+    setReadOnly( readOnlyAction->isChecked() );
+
     menuBar()->setEnabled( true );
     editor->setEnabled( true );
     QApplication::restoreOverrideCursor();
@@ -2664,15 +3803,62 @@ void MainWindow::saveDone( qint64 iSize )
     if ( !currentEncoding.isEmpty() ) {
         setFileCodepage( saveThread->outputFileName, currentEncoding );
     }
-    showMessage( tr("Saved file: %1 (%2 bytes written)").arg( QDir::toNativeSeparators( saveThread->outputFileName )).arg( iSize ));
+    QVector<qint64> invalid = saveThread->invalidPositions();
+    if ( iSize == -1 ) {
+        // The file on disk is unchanged (or partly written, if saved in place)
+        saveFailed = true;
+        editor->markChanged( saveFirstChange );
+        journal->cancelRebase();
+        fileLineCount = -1;
+        QApplication::restoreOverrideCursor();
+        followFile();
+        QMessageBox::critical( this, tr("Error"), tr("Error writing file %1").arg( QDir::toNativeSeparators( saveThread->outputFileName )));
+        return;
+    }
+    else if ( !invalid.isEmpty() ) {
+        int position = QeTextEdit::documentPosition( (int) invalid.first(), editor->segmentBreaks() );
+        int line = editor->lineNumber( editor->document()->findBlock( position )) + 1;
+        showMessage( tr("Saved file: %1 (%2 bytes written; %3 characters could not be encoded, the first on line %4)").arg( QDir::toNativeSeparators( saveThread->outputFileName )).arg( iSize ).arg( saveThread->invalidCount() ).arg( line ));
+    }
+    else if ( saveThread->invalidCount() )
+        showMessage( tr("Saved file: %1 (%2 bytes written; %3 characters could not be encoded)").arg( QDir::toNativeSeparators( saveThread->outputFileName )).arg( iSize ).arg( saveThread->invalidCount() ));
+    else if ( saveThread->tailOffset() )
+        showMessage( tr("Saved file: %1 (%2 bytes, of which the last %3 were written)").arg( QDir::toNativeSeparators( saveThread->outputFileName )).arg( iSize ).arg( iSize - saveThread->tailOffset() ));
+    else
+        showMessage( tr("Saved file: %1 (%2 bytes written)").arg( QDir::toNativeSeparators( saveThread->outputFileName )).arg( iSize ));
+    currentCompression = saveThread->compression();
     setCurrentFile( saveThread->outputFileName );
+    if ( currentCompression == QeCompression::None )
+        fileLineCount = saveLineCount;
+    journal->rebased( currentFile, currentEncoding );
+
+    // Anything typed while the file was being written isn't in it
+    if ( editor->document()->revision() != saveRevision )
+        updateModified( true );
 
-    menuBar()->setEnabled( true );
-    editor->setEnabled( true );
     QApplication::restoreOverrideCursor();
 
-    editor->setFocus( Qt::OtherFocusReason );
+#endif
+}
 
+
+// Wait for any save in progress to complete (and saveDone() to run).  Returns
+// false if it failed.
+//
+bool MainWindow::finishSave()
+{
+#ifdef USE_IO_THREADS
+
+    if ( !isSaveThreadActive || !saveThread )
+        return true;
+    QApplication::setOverrideCursor( Qt::WaitCursor );
+    saveThread->wait();
+    QApplication::restoreOverrideCursor();
+    QCoreApplication::sendPostedEvents( this, QEvent::MetaCall );
+    return !saveFailed;
+
+#else
+    return true;
 #endif
 }
 
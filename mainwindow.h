@@ -26,7 +26,9 @@
 
 #include <QMainWindow>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QProcess>
+#include <QPointer>
 #include "version.h"
 
 
@@ -56,6 +58,7 @@
     "Text files (*.txt readme*);;"                          \
     "Log files (*.log *.l? *.l? *.err);;"                   \
     "Command files (*.cmd *.bat *.rex *.orx *.sh *.vrx);;"  \
+    "Compressed files (*.gz *.zst *.xz);;"                  \
     "All files (*)"
 #else
 #define DEFAULT_FILENAME_FILTERS                            \
@@ -75,12 +78,21 @@
 class QAction;
 class QActionGroup;
 class QLabel;
+class QToolButton;
+class QTimer;
 class QeTextEdit;
 class QTextCursor;
 class FindDialog;
 class ReplaceDialog;
 class QeOpenThread;
 class QeSaveThread;
+class QeEncodingDetector;
+class QeFileView;
+class QStackedWidget;
+class QeFileFollower;
+class QeFileCheckThread;
+class QeEditJournal;
+struct QeTextChange;
 
 
 typedef struct _FindParams_t
@@ -103,9 +115,11 @@ public:
     bool loadFile( const QString &fileName, bool createIfNew );
     bool mapNameToEncoding( QString &encoding );
     void openAsEncoding( QString fileName, bool createIfNew, QString encoding );
+    void openFromCommandLine( const QString &fileName, bool readOnly, bool useEncoding, QString encoding );
     void showUsage();
     void setReadOnly( bool readonly );
     void setTextEncoding( QString newEncoding );
+    void timeStartup( const QElapsedTimer &clock );
 
 protected:
     void closeEvent( QCloseEvent *event );
@@ -117,6 +131,7 @@ private slots:
     void open();
     bool save();
     bool saveAs();
+    void reload();
     bool print();
     void find();
     void findAgain();
@@ -130,8 +145,12 @@ private slots:
     bool toggleEditMode( bool ovr );
     bool toggleReadOnly( bool readOnly );
     bool toggleWordWrap( bool bWrap );
+    void toggleFollow( bool follow );
+    void toggleLineEnds( bool crlf );
+    void toggleAutosave( bool autosave );
     void updateStatusBar();
     void updateEncodingLabel();
+    void updateLineEndLabel();
     void updateModeLabel();
     void updatePositionLabel();
     void updateModified();
@@ -152,10 +171,26 @@ private slots:
     void goToLine();
     void setTextEncoding();
     void readProgress( int percent );
+    void readPreview( const QString &text );
+    void readEncoding( const QString &encoding, int confidence );
     void readDone();
     void readCancel();
     void saveProgress( int percent );
     void saveDone( qint64 iSize );
+    void monitorLoad();
+    void viewPosition( qint64 line, int column );
+    void viewProgress( int percent );
+    void viewIndexed( qint64 lines );
+    void viewFindProgress( int percent );
+    void viewFindDone( bool found );
+    void viewFindCancelled();
+    void followAppend( const QString &text );
+    void followReplaced();
+    void createEncodingMenus();
+    void checkRecentFiles();
+    void removeRecentFiles( const QStringList &missing );
+    void startupDone();
+    void recoverJournals();
 
 
 private:
@@ -172,10 +207,12 @@ private:
     // Action methods
     bool okToContinue();
     bool saveFile( const QString &fileName );
+    bool finishSave();
 
     // Misc methods
     bool clearReadOnlyOnNew();
-    void setCurrentFile( const QString &fileName );
+    void setCurrentFile( const QString &fileName, qint64 loadedSize = -1 );
+    void startLoadMonitor();
     void updateRecentFileActions();
     QString strippedName( const QString &fullFileName );
     void showMessage( const QString &message );
@@ -183,11 +220,29 @@ private:
     bool replaceFindResult( QTextCursor found, const QString newText, bool confirm );
     QString getFileCodepage( const QString &fileName );
     void setFileCodepage( const QString &fileName, const QString &encodingName );
+    QeEncodingDetector *getEncodingDetector();
+    QeOpenThread *getOpenThread();
     void updateEncoding();
+    void setLineEnds( int eol, bool mixed );
+    void finishLoad();
+    void applyChanges( const QList<QeTextChange> &changes );
+    void connectDocument();
+    bool viewFile( const QString &fileName, QTextCodec *codec );
+    void closeView();
+    bool isViewing() const;
+    void findInView( const QString &str, bool cs, bool words, bool re, bool backward, bool fromEdge );
+    void followFile();
+    void startJournal();
+    void recoverJournal( const QString &journalName, const QString &baseFile, const QString &encoding,
+                         const QList<QeTextChange> &changes );
+    void replayJournal();
     void launchAssistant( const QString &panel );
 
     // GUI objects
     QeTextEdit    *editor;
+    QeFileView    *fileView;        // large-file viewer, created on first use
+    QString        viewFindText;    // what the viewer is searching for
+    QStackedWidget *centralStack;   // holds the editor and the viewer
     FindDialog    *findDialog;
     ReplaceDialog *replaceDialog;
 
@@ -196,6 +251,7 @@ private:
     QLabel *encodingLabel;
     QLabel *positionLabel;
     QLabel *modifiedLabel;
+    QToolButton *lineEndButton;
 
     enum { MaxRecentFiles = 5 };
 
@@ -204,6 +260,7 @@ private:
     QAction *openAction;
     QAction *saveAction;
     QAction *saveAsAction;
+    QAction *reloadAction;
     QAction *printAction;
     QAction *recentFileActions[ MaxRecentFiles ];
     QAction *clearRecentAction;
@@ -314,6 +371,8 @@ private:
     QAction *wrapAction;
     QAction *editModeAction;
     QAction *readOnlyAction;
+    QAction *followAction;
+    QAction *crlfAction;
     QAction *fontAction;
     QAction *coloursAction;
     QAction *autosaveAction;
@@ -341,16 +400,25 @@ private:
     enum { MaxRecentFinds = 10 };
 
     QStringList recentFiles;
+    QPointer<QeFileCheckThread> recentFileCheck;    // while checking recentFiles exist
     QString     currentFile;
     QString     currentDir;
     QString     currentEncoding;
+    QeEncodingDetector *encodingDetector;   // created on first use
     QString     currentFilter;
     QDateTime   currentModifyTime;
+    qint64      currentFileSize;    // bytes of the file the editor holds
+    int         currentCompression; // QeCompression::Format of the current file
+    QeFileFollower *follower;       // watches the file in follow mode
+    QeEditJournal  *journal;        // autosave (see QeEditJournal)
+    QString         recoveryJournal;    // journal to replay once the file is loaded
+    QList<QeTextChange> recoveryChanges;
     bool        encodingChanged;
     int         lastGoTo;
     FindParams  lastFind;
     QStringList recentFinds;
     QStringList recentReplaces;
+    QElapsedTimer startupClock;     // started in main()
 
 
 #ifdef USE_IO_THREADS
@@ -358,6 +426,26 @@ private:
     QeSaveThread *saveThread;
     bool         isReadThreadActive;
     bool         isSaveThreadActive;
+    bool         hasByteOrderMark;      // current file started with a BOM
+    QTextCodec  *loadedCodec;           // ...and the codec it was read with
+    int          currentLineEnds;       // line ends to save with, EOL_LF or EOL_CRLF
+    bool         mixedLineEnds;         // ...and whether the file had both kinds
+    bool         safeSave;              // save to a new file which replaces the old one
+    int          saveSync;              // QeSaveThread::SyncPolicy
+    int          saveRevision;          // document revision being saved
+    bool         saveFailed;
+    int          saveFirstChange;       // see QeTextEdit::firstChange()
+    int          saveLineCount;         // lines in the text being saved
+    int          fileLineCount;         // ...and in the file when last loaded or saved,
+                                        // or -1 if not known (see saveFile)
+
+    // For measuring how long the GUI goes unresponsive while loading
+    QTimer       *loadMonitor;
+    QElapsedTimer loadClock;
+    qint64        loadLastTick;
+    qint64        loadMaxStall;
+    qint64        loadStartMemory;  // resident memory (bytes) when the load started
+    qint64        loadPeakMemory;   // ...and the most seen since
 #endif
 
     // Program help (platform specific implementation)
@@ -25,8 +25,7 @@
 #define QEOS2CODEC_H
 
 #include <QTextCodec>
-
-template <typename T> class QAtomicPointer;
+#include <QVector>
 
 class QeOS2Codec : public QTextCodec
 {
@@ -39,11 +38,13 @@ class QeOS2Codec : public QTextCodec
         int mibEnum() const;
         QByteArray name() const;
         QByteArray convertFromUnicode( const QChar *, int, ConverterState * ) const;
+        QByteArray convertFromUnicode( const QChar *, int, ConverterState *, QVector<int> * ) const;
         QString convertToUnicode( const char *, int, ConverterState * ) const;
 
+        static QTextCodec *codecForName( const QByteArray &name );
+
     private:
         int forwardIndex;
-        mutable QAtomicPointer<QByteArray> reverseMap;
 };
 
 #endif
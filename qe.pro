@@ -5,18 +5,35 @@
 CONFIG += map
 
 TEMPLATE = app
+QT += network
 TARGET = qe
 DEPENDPATH += .
 INCLUDEPATH += .
 os2:QMAKE_CXXFLAGS += -Wno-unused-local-typedefs -Wno-literal-suffix 
 
 # Input
-HEADERS += finddialog.h replacedialog.h gotolinedialog.h eastring.h os2codec.h mainwindow.h qetextedit.h ctlutils.h threads.h
+HEADERS += finddialog.h replacedialog.h gotolinedialog.h eastring.h os2codec.h os2codecdata.h os2codectables.h mainwindow.h qetextedit.h ctlutils.h threads.h simdcodec.h encodingdetector.h fileview.h filefollower.h linediff.h decodepipeline.h compression.h tracing.h instance.h journal.h
 FORMS += finddialog.ui replacedialog.ui gotolinedialog.ui
-SOURCES += eastring.cpp os2codec.cpp finddialog.cpp replacedialog.cpp gotolinedialog.cpp main.cpp mainwindow.cpp qetextedit.cpp ctlutils.cpp threads.cpp
+SOURCES += eastring.cpp os2codec.cpp finddialog.cpp replacedialog.cpp gotolinedialog.cpp main.cpp mainwindow.cpp qetextedit.cpp ctlutils.cpp threads.cpp simdcodec.cpp encodingdetector.cpp fileview.cpp filefollower.cpp linediff.cpp decodepipeline.cpp compression.cpp tracing.cpp instance.cpp journal.cpp
 RESOURCES += qe.qrc
+# Compressed file support, for each library that's available; build with
+# e.g. CONFIG+="zlib zstd xz"
+zlib {
+    DEFINES += QE_USE_ZLIB
+    LIBS    += -lz
+}
+zstd {
+    DEFINES += QE_USE_ZSTD
+    LIBS    += -lzstd
+}
+xz {
+    DEFINES += QE_USE_XZ
+    LIBS    += -llzma
+}
+
 os2:HEADERS += os2native.h
 os2:SOURCES += os2native.cpp
 os2:RC_FILE = qe.rc
 win32:RC_FILE = qe_win.rc
+win32:LIBS += -lpsapi
 
@@ -18,6 +18,7 @@
 **
 ******************************************************************************/
 
+#include <limits.h>
 #include <QtGui>
 #include "qetextedit.h"
 
@@ -31,6 +32,8 @@
 // Finally, it doesn't paste the names of dropped files but lets the parent
 // handle them (e.g. by opening them).
 //
+// It also keeps very long lines in segments; see qetextedit.h.
+//
 
 // ---------------------------------------------------------------------------
 // Constructor
@@ -38,7 +41,17 @@
 QeTextEdit::QeTextEdit( QWidget *parent )
     : QPlainTextEdit( parent )
 {
-    isChording = false;
+    isChording      = false;
+    mayHaveSegments = false;
+    splitting       = false;
+    tracking        = false;
+
+    // Lines made too long by an edit are split once it's finished
+    splitTimer = new QTimer( this );
+    splitTimer->setSingleShot( true );
+    splitTimer->setInterval( 0 );
+    connect( splitTimer, SIGNAL( timeout() ), this, SLOT( splitLongBlocks() ));
+    connectDocument();
 }
 
 
@@ -144,6 +157,696 @@ void QeTextEdit::dropEvent( QDropEvent *event )
 }
 
 
+void QeTextEdit::keyPressEvent( QKeyEvent *event )
+{
+    if ( mayHaveSegments && stepOverBreak( event )) {
+        event->accept();
+        return;
+    }
+    QPlainTextEdit::keyPressEvent( event );
+    // Now rather than later, so that an over-long block is never painted
+    splitLongBlocks();
+}
+
+
+// Pasted and dropped text is broken into segments as it's inserted.
+//
+void QeTextEdit::insertFromMimeData( const QMimeData *source )
+{
+    if ( isReadOnly() || !source->hasText() ) {
+        QPlainTextEdit::insertFromMimeData( source );
+        return;
+    }
+    QTextCursor cursor = textCursor();
+    cursor.beginEditBlock();
+    cursor.removeSelectedText();
+    insertText( cursor, source->text() );
+    cursor.endEditBlock();
+    setTextCursor( cursor );
+    ensureCursorVisible();
+    splitLongBlocks();
+}
+
+
+// Copied text leaves out the segment breaks.
+//
+QMimeData *QeTextEdit::createMimeDataFromSelection() const
+{
+    QTextCursor cursor = textCursor();
+    if ( !cursor.hasSelection() || !hasSegments() )
+        return QPlainTextEdit::createMimeDataFromSelection();
+
+    QMimeData *data = new QMimeData();
+    data->setText( joinedText( cursor.selectionStart(), cursor.selectionEnd() ));
+    return data;
+}
+
+
+// ---------------------------------------------------------------------------
+// Public methods
+//
+
+// Replace the current document with one that was built elsewhere (e.g. by the
+// file loading thread).  The editor takes ownership of the new document, and
+// deletes the previous one if it was ours.  The new document must belong to
+// the GUI thread by now.
+//
+void QeTextEdit::swapDocument( QTextDocument *newDocument )
+{
+    QTextDocument *oldDocument = document();
+    bool ownsOld = ( oldDocument && ( oldDocument->parent() == this ));
+
+    newDocument->setDocumentLayout( new QPlainTextDocumentLayout( newDocument ));
+    newDocument->setParent( this );
+    setDocument( newDocument );
+
+    if ( ownsOld )
+        delete oldDocument;
+
+    // A loaded document may well have segments (see QeOpenThread)
+    mayHaveSegments = true;
+    connectDocument();
+}
+
+
+// Returns the text of the document, with long lines joined up again.  (Same
+// as toPlainText() otherwise.)
+//
+QString QeTextEdit::plainText() const
+{
+    if ( !hasSegments() )
+        return document()->toPlainText();
+    return joinedText( 0, document()->characterCount() - 1 );
+}
+
+
+// Returns the text of the document as it stands, segment breaks and all, and
+// the positions of those breaks; for a copy to be taken as cheaply as possible,
+// and joined up later on another thread (see QeSaveThread).
+//
+QString QeTextEdit::snapshot( QVector<int> *breaks ) const
+{
+    *breaks = segmentPositions();
+    return document()->toPlainText();
+}
+
+
+// Returns the number of the line (counting from 0) that the given block is
+// part of.
+//
+int QeTextEdit::lineNumber( const QTextBlock &block ) const
+{
+    int number = block.blockNumber();
+    if ( !hasSegments() )
+        return number;
+    return number - ( qUpperBound( segmentBlocks.constBegin(), segmentBlocks.constEnd(), number ) -
+                      segmentBlocks.constBegin() );
+}
+
+
+// Returns the cursor's position within its line.
+//
+int QeTextEdit::columnNumber( const QTextCursor &cursor ) const
+{
+    int column = cursor.positionInBlock();
+    for ( QTextBlock block = cursor.block(); isSegment( block ); ) {
+        block = block.previous();
+        column += block.length() - 1;
+    }
+    return column;
+}
+
+
+// Returns the first block of the given line (counting from 0).
+//
+QTextBlock QeTextEdit::lineBlock( int line ) const
+{
+    if ( !hasSegments() )
+        return document()->findBlockByNumber( line );
+
+    // The block number is the line number plus the segments before it; this
+    // settles on the lowest such number, which is never a segment itself
+    int number = line;
+    int segments = -1;
+    for ( ;; ) {
+        int count = qUpperBound( segmentBlocks.constBegin(), segmentBlocks.constEnd(), number ) -
+                    segmentBlocks.constBegin();
+        if ( count == segments )
+            break;
+        segments = count;
+        number   = line + count;
+    }
+    return document()->findBlockByNumber( number );
+}
+
+
+// Find text in the document, as QTextDocument::find() does but including
+// matches that span a segment break.
+//
+QTextCursor QeTextEdit::findText( const QString &text, int from, QTextDocument::FindFlags flags ) const
+{
+    QTextCursor found = document()->find( text, from, flags );
+    if ( text.isEmpty() || !hasSegments() )
+        return found;
+
+    QString pattern = QRegExp::escape( text );
+    if ( flags & QTextDocument::FindWholeWords )
+        pattern = "\\b" + pattern + "\\b";
+    QRegExp expression( pattern, ( flags & QTextDocument::FindCaseSensitively ) ?
+                                     Qt::CaseSensitive : Qt::CaseInsensitive );
+    return findAcross( expression, from, flags, found );
+}
+
+
+QTextCursor QeTextEdit::findText( const QRegExp &pattern, int from, QTextDocument::FindFlags flags ) const
+{
+    QTextCursor found = document()->find( pattern, from, flags );
+    if ( !hasSegments() )
+        return found;
+    return findAcross( pattern, from, flags, found );
+}
+
+
+QTextCursor QeTextEdit::findText( const QString &text, const QTextCursor &from, QTextDocument::FindFlags flags ) const
+{
+    int position = 0;
+    if ( !from.isNull() )
+        position = ( flags & QTextDocument::FindBackward ) ? from.selectionStart() : from.selectionEnd();
+    return findText( text, position, flags );
+}
+
+
+QTextCursor QeTextEdit::findText( const QRegExp &pattern, const QTextCursor &from, QTextDocument::FindFlags flags ) const
+{
+    int position = 0;
+    if ( !from.isNull() )
+        position = ( flags & QTextDocument::FindBackward ) ? from.selectionStart() : from.selectionEnd();
+    return findText( pattern, position, flags );
+}
+
+
+// Returns the offsets in plainText() at which lines were broken into
+// segments, in order (for use with documentPosition).
+//
+QVector<int> QeTextEdit::segmentBreaks() const
+{
+    QVector<int> breaks = segmentPositions();
+    for ( int i = 0; i < breaks.size(); i++ )
+        breaks[ i ] -= i;
+    return breaks;
+}
+
+
+// Insert text at the cursor, breaking any very long lines in it into segments
+// (as the editor itself does with pasted text).
+//
+void QeTextEdit::insertText( QTextCursor &cursor, const QString &text )
+{
+    int lineLength = cursor.positionInBlock();
+    if ( lineLength + text.size() > LONG_LINE_SEGMENT )
+        mayHaveSegments = true;
+    insertSegmented( cursor, text, lineLength );
+}
+
+
+// Returns the lowest document position at which the text has been changed
+// since the last clearChanges() (or since the document was set), or INT_MAX
+// if it hasn't been.  Everything before it is as it was then; segment breaks
+// added since don't count.
+//
+int QeTextEdit::firstChange() const
+{
+    return changedFrom;
+}
+
+
+// Record a change at the given position, as if an edit had been made there.
+//
+void QeTextEdit::markChanged( int position )
+{
+    if ( position < changedFrom )
+        changedFrom = position;
+}
+
+
+void QeTextEdit::clearChanges()
+{
+    changedFrom = INT_MAX;
+}
+
+
+// Turn textChange() reporting on or off.  The segment breaks are found once
+// here, and after that kept track of as the document changes, so that each
+// change costs in proportion to its own size.
+//
+void QeTextEdit::setTracking( bool track )
+{
+    tracking = track;
+    trackedBreaks.clear();
+    if ( tracking )
+        trackedBreaks = segmentPositions();
+}
+
+
+// Returns 'length' characters of plainText() from 'position'.
+//
+QString QeTextEdit::textAt( int position, int length ) const
+{
+    if ( !hasSegments() ) {
+        QTextCursor cursor( document() );
+        cursor.setPosition( position );
+        cursor.setPosition( position + length, QTextCursor::KeepAnchor );
+        return cursor.selectedText().replace( QChar::ParagraphSeparator, QLatin1Char('\n'));
+    }
+    QVector<int> breaks = segmentBreaks();
+    return joinedText( documentPosition( position, breaks ),
+                       documentPosition( position + length, breaks ));
+}
+
+
+// Returns the text selected by the given cursor, without any segment breaks
+// (and with other block separators as line ends).
+//
+QString QeTextEdit::selectionText( const QTextCursor &cursor ) const
+{
+    return joinedText( cursor.selectionStart(), cursor.selectionEnd() );
+}
+
+
+// ---------------------------------------------------------------------------
+// Static methods
+//
+
+bool QeTextEdit::isSegment( const QTextBlock &block )
+{
+    return block.blockFormat().boolProperty( SegmentProperty );
+}
+
+
+// Insert text at the cursor, starting a new segment wherever a line would grow
+// past LONG_LINE_SEGMENT characters.  lineLength is the length of the segment
+// before the cursor, and is updated to the length after the inserted text.
+// This is how QeOpenThread builds documents, a chunk of text at a time.
+//
+void QeTextEdit::insertSegmented( QTextCursor &cursor, const QString &text, int &lineLength )
+{
+    const QChar *data = text.constData();
+    int length = text.size();
+    int start  = 0;             // the first character not inserted yet
+    int end    = -1;            // the end of the current line
+    bool continuing = isSegment( cursor.block() );
+
+    int i = 0;
+    while ( i < length ) {
+        if ( end < i ) {
+            // (The same characters QTextCursor::insertText() takes as line ends)
+            for ( end = i; end < length; end++ ) {
+                ushort c = data[ end ].unicode();
+                if (( c == '\n') || ( c == '\r') || ( c == 0x2029 ))
+                    break;
+            }
+        }
+
+        if ( end - i <= LONG_LINE_SEGMENT - lineLength ) {
+            if ( end == length ) {
+                lineLength += end - i;
+                break;
+            }
+            int next = end + 1;
+            if (( data[ end ].unicode() == '\r') && ( next < length ) && ( data[ next ].unicode() == '\n'))
+                next++;
+            if ( continuing ) {
+                // A segmented line ends here; the next line mustn't inherit
+                // the segment's block format, as insertText() would have it.
+                if ( end > start )
+                    cursor.insertText( text.mid( start, end - start ));
+                insertLineBreak( cursor );
+                start = next;
+                continuing = false;
+            }
+            lineLength = 0;
+            i = next;
+            continue;
+        }
+
+        // This line is too long: end the segment, but not within a surrogate pair
+        int split = i + LONG_LINE_SEGMENT - lineLength;
+        if (( split > i ) && data[ split - 1 ].isHighSurrogate() )
+            split--;
+        if ( split > start )
+            cursor.insertText( text.mid( start, split - start ));
+        insertSegmentBreak( cursor );
+        start = i = split;
+        lineLength = 0;
+        continuing = true;
+    }
+
+    if ( start < length )
+        cursor.insertText( start ? text.mid( start ) : text );
+}
+
+
+// Convert a position in plainText() to the corresponding document position,
+// given the segmentBreaks() at the time.
+//
+int QeTextEdit::documentPosition( int textPosition, const QVector<int> &breaks )
+{
+    return textPosition + ( qLowerBound( breaks.constBegin(), breaks.constEnd(), textPosition ) -
+                            breaks.constBegin() );
+}
+
+
+// Start a new segment of the current line at the cursor.
+//
+void QeTextEdit::insertSegmentBreak( QTextCursor &cursor )
+{
+    QTextBlockFormat format = cursor.blockFormat();
+    format.setProperty( SegmentProperty, true );
+    cursor.insertBlock( format );
+}
+
+
+// Start a new line at the cursor.
+//
+void QeTextEdit::insertLineBreak( QTextCursor &cursor )
+{
+    QTextBlockFormat format = cursor.blockFormat();
+    format.clearProperty( SegmentProperty );
+    cursor.insertBlock( format );
+}
+
+
+// ---------------------------------------------------------------------------
+// Private methods
+//
+
+void QeTextEdit::connectDocument()
+{
+    segmentsValid = false;
+    segmentBlockCount = 0;
+    dirtyStart    = -1;
+    dirtyEnd      = -1;
+    changedFrom   = INT_MAX;
+    if ( tracking )
+        trackedBreaks = segmentPositions();
+    connect( document(), SIGNAL( contentsChange( int, int, int )), this, SLOT( documentChanged( int, int, int )));
+}
+
+
+// Report a change to the document (see setTracking()) in plainText() terms.
+// The breaks removed are the tracked ones in the range removed; those added
+// are found from the blocks in the range added.  A change that only adds a
+// break (as splitLongBlocks() does) isn't reported at all.
+//
+void QeTextEdit::trackChange( int position, int removed, int added )
+{
+    QTextDocument *doc = document();
+
+    // Qt can report a change as running on into the document's final separator
+    int excess = position + added - ( doc->characterCount() - 1 );
+    if ( excess > 0 ) {
+        added   -= excess;
+        removed  = qMax( 0, removed - excess );
+    }
+
+    QVector<int>::iterator first = qLowerBound( trackedBreaks.begin(), trackedBreaks.end(), position );
+    QVector<int>::iterator last  = qLowerBound( first, trackedBreaks.end(), position + removed );
+    int index        = first - trackedBreaks.begin();
+    int textPosition = position - index;
+    int textRemoved  = removed - ( last - first );
+    trackedBreaks.erase( first, last );
+    for ( int i = index; i < trackedBreaks.size(); i++ )
+        trackedBreaks[ i ] += added - removed;
+
+    QString text;
+    if ( added > 0 ) {
+        QVector<int> addedBreaks;
+        for ( QTextBlock block = doc->findBlock( position ).next();
+              block.isValid() && ( block.position() <= position + added );
+              block = block.next() )
+        {
+            if ( isSegment( block ))
+                addedBreaks.append( block.position() - 1 );
+        }
+        QTextCursor cursor( doc );
+        cursor.setPosition( position );
+        cursor.setPosition( position + added, QTextCursor::KeepAnchor );
+        text = cursor.selectedText();
+        for ( int i = addedBreaks.size() - 1; i >= 0; i-- )
+            text.remove( addedBreaks.at( i ) - position, 1 );
+        text.replace( QChar::ParagraphSeparator, QLatin1Char('\n'));
+        for ( int i = 0; i < addedBreaks.size(); i++ )
+            trackedBreaks.insert( index + i, addedBreaks.at( i ));
+    }
+    if ( textRemoved || !text.isEmpty() )
+        emit textChange( textPosition, textRemoved, text );
+}
+
+
+// Handle keys which would otherwise treat a segment break as a character:
+// moving the cursor over it, and deleting it.  Return in a segment also needs
+// to start a proper line.  Returns false for any other key.
+//
+bool QeTextEdit::stepOverBreak( QKeyEvent *event )
+{
+    QTextCursor cursor = textCursor();
+    QTextBlock block = cursor.block();
+    bool inSegment = isSegment( block );
+    bool atStart   = inSegment && cursor.atBlockStart();
+    bool atEnd     = cursor.atBlockEnd() && isSegment( block.next() );
+    bool editable  = !isReadOnly();
+    bool selected  = cursor.hasSelection();
+    if ( !inSegment && !atEnd )
+        return false;
+
+    if ( atEnd && event->matches( QKeySequence::MoveToNextChar ))
+        cursor.movePosition( QTextCursor::NextCharacter, QTextCursor::MoveAnchor, 2 );
+    else if ( atEnd && event->matches( QKeySequence::SelectNextChar ))
+        cursor.movePosition( QTextCursor::NextCharacter, QTextCursor::KeepAnchor, 2 );
+    else if ( atStart && event->matches( QKeySequence::MoveToPreviousChar ))
+        cursor.movePosition( QTextCursor::PreviousCharacter, QTextCursor::MoveAnchor, 2 );
+    else if ( atStart && event->matches( QKeySequence::SelectPreviousChar ))
+        cursor.movePosition( QTextCursor::PreviousCharacter, QTextCursor::KeepAnchor, 2 );
+    else if ( editable && !selected && atEnd && event->matches( QKeySequence::Delete )) {
+        cursor.movePosition( QTextCursor::NextCharacter );
+        cursor.deleteChar();
+    }
+    else if ( editable && !selected && atStart && ( event->key() == Qt::Key_Backspace ) &&
+              !( event->modifiers() & ~Qt::ShiftModifier )) {
+        cursor.movePosition( QTextCursor::PreviousCharacter );
+        cursor.deletePreviousChar();
+    }
+    else if ( editable && inSegment &&
+              (( event->key() == Qt::Key_Return ) || ( event->key() == Qt::Key_Enter )) &&
+              !( event->modifiers() & ~Qt::KeypadModifier )) {
+        cursor.beginEditBlock();
+        cursor.removeSelectedText();
+        insertLineBreak( cursor );
+        cursor.endEditBlock();
+    }
+    else
+        return false;
+
+    setTextCursor( cursor );
+    ensureCursorVisible();
+    return true;
+}
+
+
+// Returns true if the document has any segments.  Finding them means going
+// through every block, so this is only done once for each document (and not
+// at all for one which has never had any); after that, updateSegments() keeps
+// the list up to date.
+//
+bool QeTextEdit::hasSegments() const
+{
+    if ( !mayHaveSegments )
+        return false;
+    if ( !segmentsValid ) {
+        segmentBlocks.clear();
+        int number = 0;
+        for ( QTextBlock block = document()->begin(); block.isValid(); block = block.next(), number++ ) {
+            if ( isSegment( block ))
+                segmentBlocks.append( number );
+        }
+        segmentsValid = true;
+        segmentBlockCount = number;
+        // With no undo history, there's no way for any to come back either
+        if ( segmentBlocks.isEmpty() && !document()->isUndoAvailable() && !document()->isRedoAvailable() )
+            mayHaveSegments = false;
+    }
+    return !segmentBlocks.isEmpty();
+}
+
+
+// Bring the list of segment blocks up to date after a change to the document.
+// Only the blocks in the range changed are looked at; those after it just
+// move along by the number of blocks added or removed.
+//
+void QeTextEdit::updateSegments( int position, int added )
+{
+    QTextDocument *doc = document();
+    int end = qMin( position + added, doc->characterCount() - 1 );
+    QTextBlock block = doc->findBlock( position );
+    QTextBlock last  = doc->findBlock( end );
+    if ( !block.isValid() ) block = doc->lastBlock();
+    if ( !last.isValid() )  last  = doc->lastBlock();
+
+    int first   = block.blockNumber();
+    int lastNew = last.blockNumber();
+    int delta   = doc->blockCount() - segmentBlockCount;
+    int lastOld = lastNew - delta;      // the same block before the change
+    if (( lastOld < first - 1 ) || ( lastOld >= segmentBlockCount )) {
+        // Not a change we can make sense of; start over next time
+        segmentsValid = false;
+        return;
+    }
+
+    QVector<int>::iterator from = qLowerBound( segmentBlocks.begin(), segmentBlocks.end(), first );
+    QVector<int>::iterator to   = qUpperBound( from, segmentBlocks.end(), lastOld );
+    int index = from - segmentBlocks.begin();
+    segmentBlocks.erase( from, to );
+    for ( int i = index; i < segmentBlocks.size(); i++ )
+        segmentBlocks[ i ] += delta;
+
+    QVector<int> found;
+    for ( int number = first; number <= lastNew; number++, block = block.next() ) {
+        if ( isSegment( block ))
+            found.append( number );
+    }
+    if ( !found.isEmpty() ) {
+        segmentBlocks.insert( index, found.size(), 0 );
+        qCopy( found.constBegin(), found.constEnd(), segmentBlocks.begin() + index );
+    }
+    segmentBlockCount = doc->blockCount();
+}
+
+
+// Returns the document positions of the segment breaks (i.e. of the block
+// separators before each segment), in order.
+//
+QVector<int> QeTextEdit::segmentPositions() const
+{
+    QVector<int> positions;
+    if ( !hasSegments() )
+        return positions;
+    positions.reserve( segmentBlocks.size() );
+    for ( int i = 0; i < segmentBlocks.size(); i++ )
+        positions.append( document()->findBlockByNumber( segmentBlocks.at( i )).position() - 1 );
+    return positions;
+}
+
+
+// Returns the text between two document positions, without any segment
+// breaks, and with other block separators as line ends (like toPlainText).
+//
+QString QeTextEdit::joinedText( int start, int end ) const
+{
+    QTextCursor cursor( document() );
+    cursor.setPosition( start );
+    cursor.setPosition( end, QTextCursor::KeepAnchor );
+    QString text = cursor.selectedText();
+
+    QVector<int> breaks = segmentPositions();
+    QVector<int>::const_iterator next = qLowerBound( breaks.constBegin(), breaks.constEnd(), start );
+    QChar *data = text.data();
+    int length = text.size();
+    int out = 0;
+    for ( int i = 0; i < length; i++ ) {
+        if (( next != breaks.constEnd() ) && ( *next == start + i )) {
+            ++next;
+            continue;
+        }
+        switch ( data[ i ].unicode() ) {
+            case 0xFDD0:        // QTextBeginningOfFrame
+            case 0xFDD1:        // QTextEndOfFrame
+            case 0x2028:        // QChar::LineSeparator
+            case 0x2029:        // QChar::ParagraphSeparator
+                data[ out++ ] = QLatin1Char('\n');
+                break;
+            case 0x00A0:        // QChar::Nbsp
+                data[ out++ ] = QLatin1Char(' ');
+                break;
+            default:
+                data[ out++ ] = data[ i ];
+                break;
+        }
+    }
+    text.resize( out );
+    return text;
+}
+
+
+// Look for a match which spans a segment break, within SEGMENT_FIND_CONTEXT
+// characters either side of it.  Returns it if it comes before the match
+// 'found' within a single block (going in the direction of the search);
+// otherwise returns 'found'.
+//
+QTextCursor QeTextEdit::findAcross( const QRegExp &pattern, int from, QTextDocument::FindFlags flags,
+                                    const QTextCursor &found ) const
+{
+    QTextDocument *doc = document();
+    QRegExp expression( pattern );
+    bool backward  = ( flags & QTextDocument::FindBackward );
+    int foundStart = found.isNull() ? -1 : found.selectionStart();
+
+    // Going forward, a match must start at or after 'from', so it can only
+    // span a break after that; going back, it must start before 'from'
+    QVector<int> breaks = segmentPositions();
+    int count = breaks.size();
+    int i = backward ?
+            ( qLowerBound( breaks.constBegin(), breaks.constEnd(), from + SEGMENT_FIND_CONTEXT ) - breaks.constBegin() ) - 1 :
+            ( qUpperBound( breaks.constBegin(), breaks.constEnd(), from ) - breaks.constBegin() );
+
+    for ( ; ( i >= 0 ) && ( i < count ); i += backward ? -1 : 1 ) {
+        int separator = breaks.at( i );
+        if ( foundStart >= 0 ) {
+            // Nothing spanning this break (or any further one) could be nearer
+            if ( backward ? ( foundStart >= separator ) : ( foundStart < separator - SEGMENT_FIND_CONTEXT ))
+                break;
+        }
+
+        QTextBlock before = doc->findBlock( separator );
+        QTextBlock after  = before.next();
+        int start = qMax( before.position(), separator - SEGMENT_FIND_CONTEXT );
+        int end   = qMin( after.position() + after.length() - 1, separator + 1 + SEGMENT_FIND_CONTEXT );
+        QTextCursor cursor( doc );
+        cursor.setPosition( start );
+        cursor.setPosition( end, QTextCursor::KeepAnchor );
+        QString window = cursor.selectedText();
+        int boundary = separator - start;
+        window.remove( boundary, 1 );
+
+        int matchStart  = -1;
+        int matchLength = 0;
+        for ( int offset = 0; ; ) {
+            int index = expression.indexIn( window, offset );
+            if (( index < 0 ) || ( index >= boundary ))
+                break;
+            int length = expression.matchedLength();
+            if (( index + length > boundary ) && ( backward ? ( start + index < from ) : ( start + index >= from ))) {
+                matchStart  = index;
+                matchLength = length;
+                if ( !backward )
+                    break;
+            }
+            offset = index + 1;
+        }
+        if ( matchStart < 0 )
+            continue;
+
+        int position = start + matchStart;
+        if (( foundStart >= 0 ) && ( backward ? ( position < foundStart ) : ( position > foundStart )))
+            break;
+        QTextCursor match( doc );
+        match.setPosition( position );
+        match.setPosition( position + matchLength + 1, QTextCursor::KeepAnchor );
+        return match;
+    }
+    return found;
+}
+
+
 // ---------------------------------------------------------------------------
 // Slots
 //
@@ -166,4 +869,85 @@ void QeTextEdit::paste()
 }
 
 
+void QeTextEdit::documentChanged( int position, int removed, int added )
+{
+    if ( segmentsValid )
+        updateSegments( position, added );
+    if ( tracking )
+        trackChange( position, removed, added );
+    if ( splitting ) {
+        // A break added ahead of the first change moves it along
+        if (( position < changedFrom ) && ( changedFrom != INT_MAX ))
+            changedFrom += added - removed;
+        return;
+    }
+    if ( position < changedFrom )
+        changedFrom = position;
+    if (( dirtyStart < 0 ) || ( position < dirtyStart ))
+        dirtyStart = position;
+    if ( position + added > dirtyEnd )
+        dirtyEnd = position + added;
+    splitTimer->start();
+}
+
+
+// Split any block in the range edited since last time which has grown past
+// LONG_LINE_LIMIT (by typing, pasting, joining segments, or whatever) into
+// segments.  This becomes part of the edit that caused it, so undoing that
+// undoes this too; and after an undo or redo there's nothing left to split,
+// so the redo history is safe.
+//
+void QeTextEdit::splitLongBlocks()
+{
+    if ( dirtyStart < 0 )
+        return;
+    int start = dirtyStart,
+        end   = dirtyEnd;
+    dirtyStart = dirtyEnd = -1;
+
+    QTextDocument *doc = document();
+    QTextCursor cursor( doc );
+    bool editing = false,
+         restoreUndo = false;
+    splitting = true;
+    for ( QTextBlock block = doc->findBlock( start );
+          block.isValid() && ( block.position() <= end );
+          block = block.next() )
+    {
+        if ( block.length() - 1 <= LONG_LINE_LIMIT )
+            continue;
+        if ( !editing ) {
+            // With nothing to join (e.g. after setPlainText()), keep the split
+            // out of the undo history altogether
+            if ( !doc->isUndoAvailable() && !doc->isRedoAvailable() && doc->isUndoRedoEnabled() ) {
+                doc->setUndoRedoEnabled( false );
+                restoreUndo = true;
+            }
+            cursor.joinPreviousEditBlock();
+            editing = true;
+        }
+        int position = block.position();
+        int blockEnd = position + block.length() - 1;
+        while ( blockEnd - position > LONG_LINE_SEGMENT ) {
+            int split = position + LONG_LINE_SEGMENT;
+            if ( doc->characterAt( split - 1 ).isHighSurrogate() )
+                split--;
+            cursor.setPosition( split );
+            insertSegmentBreak( cursor );
+            position = split + 1;
+            blockEnd++;
+            end++;
+        }
+        block = doc->findBlock( position );
+    }
+    if ( editing ) {
+        cursor.endEditBlock();
+        mayHaveSegments = true;
+    }
+    if ( restoreUndo )
+        doc->setUndoRedoEnabled( true );
+    splitting = false;
+}
+
+
 
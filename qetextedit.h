@@ -23,27 +23,115 @@
 
 #include <QWidget>
 #include <QPlainTextEdit>
+#include <QTextBlock>
+#include <QVector>
+
+class QTimer;
+
+
+#define LONG_LINE_SEGMENT    0x10000                    // long lines are held in segments of this many characters
+#define LONG_LINE_LIMIT      ( 2 * LONG_LINE_SEGMENT )  // edited segments longer than this are split again
+#define SEGMENT_FIND_CONTEXT 0x400                      // characters searched either side of a segment break
+
+
+// QPlainTextEdit lays out every block (paragraph) in full whenever any of it
+// is shown or changed, which is unusable for lines of many megabytes.  So a
+// line longer than LONG_LINE_SEGMENT is held as a series of blocks of about
+// that length ("segments"), each after the first marked with SegmentProperty
+// in its block format.  Only the segments on screen are ever laid out, and an
+// edit only lays out the segment it touches.
+//
+// The segment breaks aren't part of the text: plainText() and copying leave
+// them out, cursor movement and deletion step over them, lineNumber() and
+// columnNumber() count whole lines, and findText() also finds matches that
+// span a break.  (Block formats are kept by the undo stack, so undo and redo
+// preserve them too.)
+//
+// With setTracking() on, every change to the document is also reported by
+// textChange() in plainText() terms: position, characters removed and the
+// text added, with any segment breaks left out (so that it can be replayed on
+// the plain text of a file; see QeEditJournal).
 
 class QeTextEdit : public QPlainTextEdit
 {
     Q_OBJECT
 
 public:
+    enum { SegmentProperty = QTextFormat::UserProperty + 1 };
+
     QeTextEdit( QWidget *parent = 0 );
     void mousePressEvent( QMouseEvent *event );
     void contextMenuEvent( QContextMenuEvent *event );
+    void swapDocument( QTextDocument *newDocument );
+
+    QString     plainText() const;
+    QString     snapshot( QVector<int> *breaks ) const;
+    int         lineNumber( const QTextBlock &block ) const;
+    int         columnNumber( const QTextCursor &cursor ) const;
+    QTextBlock  lineBlock( int line ) const;
+    QTextCursor findText( const QString &text, int from, QTextDocument::FindFlags flags ) const;
+    QTextCursor findText( const QRegExp &pattern, int from, QTextDocument::FindFlags flags ) const;
+    QTextCursor findText( const QString &text, const QTextCursor &from, QTextDocument::FindFlags flags ) const;
+    QTextCursor findText( const QRegExp &pattern, const QTextCursor &from, QTextDocument::FindFlags flags ) const;
+    QVector<int> segmentBreaks() const;
+    void        insertText( QTextCursor &cursor, const QString &text );
+    int         firstChange() const;
+    void        markChanged( int position );
+    void        clearChanges();
+    void        setTracking( bool track );
+    QString     textAt( int position, int length ) const;
+    QString     selectionText( const QTextCursor &cursor ) const;
+
+    static bool isSegment( const QTextBlock &block );
+    static void insertSegmented( QTextCursor &cursor, const QString &text, int &lineLength );
+    static int  documentPosition( int textPosition, const QVector<int> &breaks );
+
+signals:
+    void textChange( int position, int removed, const QString &added );
 
 protected:
     void dropEvent( QDropEvent *event );
+    void keyPressEvent( QKeyEvent *event );
+    void insertFromMimeData( const QMimeData *source );
+    QMimeData *createMimeDataFromSelection() const;
 
 private slots:
     void copy();
     void cut();
     void paste();
+    void documentChanged( int position, int removed, int added );
+    void splitLongBlocks();
 
 private:
+    void        connectDocument();
+    bool        stepOverBreak( QKeyEvent *event );
+    void        trackChange( int position, int removed, int added );
+    bool        hasSegments() const;
+    void        updateSegments( int position, int added );
+    QVector<int> segmentPositions() const;
+    QString     joinedText( int start, int end ) const;
+    QTextCursor findAcross( const QRegExp &pattern, int from, QTextDocument::FindFlags flags,
+                            const QTextCursor &found ) const;
+
+    static void insertSegmentBreak( QTextCursor &cursor );
+    static void insertLineBreak( QTextCursor &cursor );
+
     bool isChording;
 
+    mutable bool mayHaveSegments;   // set once any segment exists in this document
+    bool         splitting;         // splitLongBlocks() is making changes
+    int          dirtyStart;        // range edited since the last splitLongBlocks(),
+    int          dirtyEnd;          // or -1
+    QTimer      *splitTimer;
+    int          changedFrom;       // lowest position edited since clearChanges(),
+                                    // or INT_MAX
+    bool         tracking;          // see setTracking()
+    QVector<int> trackedBreaks;     // document positions of the segment breaks, kept
+                                    // up to date change by change while tracking
+
+    mutable bool         segmentsValid;
+    mutable QVector<int> segmentBlocks;     // numbers of the segment blocks, in order
+    mutable int          segmentBlockCount; // blocks in the document as of segmentBlocks
 };
 
 #endif
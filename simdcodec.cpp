@@ -0,0 +1,1073 @@
+/******************************************************************************
+** QE - simdcodec.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+#include <string.h>
+#include "simdcodec.h"
+
+#ifdef QE_SIMD_X86
+#include <immintrin.h>
+#define QE_TARGET( isa )    __attribute__(( target( isa )))
+#endif
+
+// Number of bytes (or UTF-16 units) handled one at a time after a vector block
+// turns out to contain something other than ASCII, before trying the vector
+// path again.  The run doubles each time the vector path fails straight away,
+// up to the maximum, so that mostly non-ASCII text isn't slowed down by it.
+#define SCALAR_RUN_LENGTH   32
+#define SCALAR_RUN_MAX      4096
+
+
+// ============================================================================
+// CPU detection
+//
+
+QeInstructionSet qeInstructionSet()
+{
+    // Worst case, two threads both do the check at once and get the same answer
+    static int isa = -1;
+    if ( isa < 0 ) {
+        int found = QE_ISA_GENERIC;
+#ifdef QE_SIMD_X86
+        __builtin_cpu_init();
+        if ( __builtin_cpu_supports("avx2"))
+            found = QE_ISA_AVX2;
+        else if ( __builtin_cpu_supports("sse2"))
+            found = QE_ISA_SSE2;
+#endif
+        isa = found;
+    }
+    return (QeInstructionSet) isa;
+}
+
+
+const char *qeInstructionSetName()
+{
+    switch ( qeInstructionSet() ) {
+        case QE_ISA_AVX2: return "AVX2";
+        case QE_ISA_SSE2: return "SSE2";
+        default:          return "generic";
+    }
+}
+
+
+
+// ============================================================================
+// Vector kernels
+//
+// Each of these handles as many whole vector blocks as it can, and returns
+// how many units it has done; the callers take care of whatever is left.
+//
+
+#ifdef QE_SIMD_X86
+
+// ----------------------------------------------------------------------------
+// Widen ASCII bytes to UTF-16, stopping at the first block with a byte >= 0x80
+//
+QE_TARGET("sse2")
+static int widenAsciiSSE2( const uchar *in, int length, ushort *out )
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i ));
+        if ( _mm_movemask_epi8( v ))
+            break;
+        _mm_storeu_si128( (__m128i *)( out + i ),     _mm_unpacklo_epi8( v, zero ));
+        _mm_storeu_si128( (__m128i *)( out + i + 8 ), _mm_unpackhi_epi8( v, zero ));
+    }
+    return i;
+}
+
+
+QE_TARGET("avx2")
+static int widenAsciiAVX2( const uchar *in, int length, ushort *out )
+{
+    int i = 0;
+    for ( ; i + 32 <= length; i += 32 ) {
+        __m256i v = _mm256_loadu_si256( (const __m256i *)( in + i ));
+        if ( _mm256_movemask_epi8( v ))
+            break;
+        _mm256_storeu_si256( (__m256i *)( out + i ),      _mm256_cvtepu8_epi16( _mm256_castsi256_si128( v )));
+        _mm256_storeu_si256( (__m256i *)( out + i + 16 ), _mm256_cvtepu8_epi16( _mm256_extracti128_si256( v, 1 )));
+    }
+    if ( i + 16 <= length ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i ));
+        if ( !_mm_movemask_epi8( v )) {
+            _mm256_storeu_si256( (__m256i *)( out + i ), _mm256_cvtepu8_epi16( v ));
+            i += 16;
+        }
+    }
+    return i;
+}
+
+
+// ----------------------------------------------------------------------------
+// Narrow UTF-16 to ASCII bytes, stopping at the first block with a unit >= 0x80
+//
+QE_TARGET("sse2")
+static int narrowAsciiSSE2( const ushort *in, int length, uchar *out )
+{
+    const __m128i mask = _mm_set1_epi16( (short) 0xFF80 );
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        __m128i a = _mm_loadu_si128( (const __m128i *)( in + i ));
+        __m128i b = _mm_loadu_si128( (const __m128i *)( in + i + 8 ));
+        __m128i high = _mm_and_si128( _mm_or_si128( a, b ), mask );
+        if ( _mm_movemask_epi8( _mm_cmpeq_epi16( high, zero )) != 0xFFFF )
+            break;
+        _mm_storeu_si128( (__m128i *)( out + i ), _mm_packus_epi16( a, b ));
+    }
+    return i;
+}
+
+
+QE_TARGET("avx2")
+static int narrowAsciiAVX2( const ushort *in, int length, uchar *out )
+{
+    const __m256i mask = _mm256_set1_epi16( (short) 0xFF80 );
+    int i = 0;
+    for ( ; i + 32 <= length; i += 32 ) {
+        __m256i a = _mm256_loadu_si256( (const __m256i *)( in + i ));
+        __m256i b = _mm256_loadu_si256( (const __m256i *)( in + i + 16 ));
+        if ( !_mm256_testz_si256( _mm256_or_si256( a, b ), mask ))
+            break;
+        // The pack works within each 128-bit lane, so put the quarters back in order
+        __m256i packed = _mm256_packus_epi16( a, b );
+        _mm256_storeu_si256( (__m256i *)( out + i ), _mm256_permute4x64_epi64( packed, 0xD8 ));
+    }
+    return i;
+}
+
+
+// ----------------------------------------------------------------------------
+// Widen bytes in the range 32-126 to UTF-16, stopping at the first block with
+// anything else.  (The single-byte codecs map all of 0-31 and 127 as well, so
+// only this range can be passed straight through.)
+//
+QE_TARGET("sse2")
+static int widenPlainSSE2( const uchar *in, int length, ushort *out )
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i low   = _mm_set1_epi8( 31 );
+    const __m128i high  = _mm_set1_epi8( 127 );
+    int i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i ));
+        // Signed compares, so bytes >= 0x80 fail the first test
+        __m128i plain = _mm_and_si128( _mm_cmpgt_epi8( v, low ), _mm_cmplt_epi8( v, high ));
+        if ( _mm_movemask_epi8( plain ) != 0xFFFF )
+            break;
+        _mm_storeu_si128( (__m128i *)( out + i ),     _mm_unpacklo_epi8( v, zero ));
+        _mm_storeu_si128( (__m128i *)( out + i + 8 ), _mm_unpackhi_epi8( v, zero ));
+    }
+    return i;
+}
+
+
+// ----------------------------------------------------------------------------
+// Map bytes to UTF-16 through a 256-entry table, 16 bytes at a time.  Blocks
+// in the 32-126 range are simply widened; any others are looked up with two
+// 8-way gathers.
+//
+QE_TARGET("avx2")
+static int decodeTableAVX2( const uchar *in, int length, ushort *out, const quint32 *table )
+{
+    const __m128i low  = _mm_set1_epi8( 31 );
+    const __m128i high = _mm_set1_epi8( 127 );
+    int i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i ));
+        __m128i plain = _mm_and_si128( _mm_cmpgt_epi8( v, low ), _mm_cmplt_epi8( v, high ));
+        if ( _mm_movemask_epi8( plain ) == 0xFFFF ) {
+            _mm256_storeu_si256( (__m256i *)( out + i ), _mm256_cvtepu8_epi16( v ));
+            continue;
+        }
+        __m256i first  = _mm256_i32gather_epi32( (const int *) table, _mm256_cvtepu8_epi32( v ), 4 );
+        __m256i second = _mm256_i32gather_epi32( (const int *) table, _mm256_cvtepu8_epi32( _mm_srli_si128( v, 8 )), 4 );
+        // As with the byte pack, put the 64-bit quarters back in order
+        __m256i packed = _mm256_packus_epi32( first, second );
+        _mm256_storeu_si256( (__m256i *)( out + i ), _mm256_permute4x64_epi64( packed, 0xD8 ));
+    }
+    return i;
+}
+
+
+// ----------------------------------------------------------------------------
+// Narrow UTF-16 units in the range 32-126 to bytes, stopping at the first block
+// with anything else.  If 'controls' is set, tab, LF and CR are also passed
+// through (for codepages which map them to themselves); otherwise every line
+// end would send us back to the slow path.
+//
+QE_TARGET("sse2")
+static int narrowPlainSSE2( const ushort *in, int length, uchar *out, bool controls )
+{
+    const __m128i low  = _mm_set1_epi16( 31 );
+    const __m128i high = _mm_set1_epi16( 127 );
+    const __m128i tab  = _mm_set1_epi16( 9 );
+    const __m128i lf   = _mm_set1_epi16( 10 );
+    const __m128i cr   = _mm_set1_epi16( 13 );
+    int i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        __m128i a = _mm_loadu_si128( (const __m128i *)( in + i ));
+        __m128i b = _mm_loadu_si128( (const __m128i *)( in + i + 8 ));
+        // Signed compares, so units >= 0x8000 fail the first test
+        __m128i plainA = _mm_and_si128( _mm_cmpgt_epi16( a, low ), _mm_cmplt_epi16( a, high ));
+        __m128i plainB = _mm_and_si128( _mm_cmpgt_epi16( b, low ), _mm_cmplt_epi16( b, high ));
+        if ( controls ) {
+            plainA = _mm_or_si128( plainA, _mm_or_si128( _mm_cmpeq_epi16( a, tab ),
+                                           _mm_or_si128( _mm_cmpeq_epi16( a, lf ), _mm_cmpeq_epi16( a, cr ))));
+            plainB = _mm_or_si128( plainB, _mm_or_si128( _mm_cmpeq_epi16( b, tab ),
+                                           _mm_or_si128( _mm_cmpeq_epi16( b, lf ), _mm_cmpeq_epi16( b, cr ))));
+        }
+        if ( _mm_movemask_epi8( _mm_and_si128( plainA, plainB )) != 0xFFFF )
+            break;
+        _mm_storeu_si128( (__m128i *)( out + i ), _mm_packus_epi16( a, b ));
+    }
+    return i;
+}
+
+
+QE_TARGET("avx2")
+static int narrowPlainAVX2( const ushort *in, int length, uchar *out, bool controls )
+{
+    const __m256i low  = _mm256_set1_epi16( 31 );
+    const __m256i high = _mm256_set1_epi16( 127 );
+    const __m256i tab  = _mm256_set1_epi16( 9 );
+    const __m256i lf   = _mm256_set1_epi16( 10 );
+    const __m256i cr   = _mm256_set1_epi16( 13 );
+    int i = 0;
+    for ( ; i + 32 <= length; i += 32 ) {
+        __m256i a = _mm256_loadu_si256( (const __m256i *)( in + i ));
+        __m256i b = _mm256_loadu_si256( (const __m256i *)( in + i + 16 ));
+        __m256i plainA = _mm256_and_si256( _mm256_cmpgt_epi16( a, low ), _mm256_cmpgt_epi16( high, a ));
+        __m256i plainB = _mm256_and_si256( _mm256_cmpgt_epi16( b, low ), _mm256_cmpgt_epi16( high, b ));
+        if ( controls ) {
+            plainA = _mm256_or_si256( plainA, _mm256_or_si256( _mm256_cmpeq_epi16( a, tab ),
+                                              _mm256_or_si256( _mm256_cmpeq_epi16( a, lf ), _mm256_cmpeq_epi16( a, cr ))));
+            plainB = _mm256_or_si256( plainB, _mm256_or_si256( _mm256_cmpeq_epi16( b, tab ),
+                                              _mm256_or_si256( _mm256_cmpeq_epi16( b, lf ), _mm256_cmpeq_epi16( b, cr ))));
+        }
+        if ( _mm256_movemask_epi8( _mm256_and_si256( plainA, plainB )) != -1 )
+            break;
+        __m256i packed = _mm256_packus_epi16( a, b );
+        _mm256_storeu_si256( (__m256i *)( out + i ), _mm256_permute4x64_epi64( packed, 0xD8 ));
+    }
+    return i;
+}
+
+
+// ----------------------------------------------------------------------------
+// Swap the bytes of each 16-bit unit
+//
+QE_TARGET("sse2")
+static int swapBytesSSE2( const uchar *in, int units, uchar *out )
+{
+    int i = 0;
+    for ( ; i + 8 <= units; i += 8 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i * 2 ));
+        v = _mm_or_si128( _mm_slli_epi16( v, 8 ), _mm_srli_epi16( v, 8 ));
+        _mm_storeu_si128( (__m128i *)( out + i * 2 ), v );
+    }
+    return i;
+}
+
+
+QE_TARGET("avx2")
+static int swapBytesAVX2( const uchar *in, int units, uchar *out )
+{
+    int i = 0;
+    for ( ; i + 16 <= units; i += 16 ) {
+        __m256i v = _mm256_loadu_si256( (const __m256i *)( in + i * 2 ));
+        v = _mm256_or_si256( _mm256_slli_epi16( v, 8 ), _mm256_srli_epi16( v, 8 ));
+        _mm256_storeu_si256( (__m256i *)( out + i * 2 ), v );
+    }
+    return i + swapBytesSSE2( in + i * 2, units - i, out + i * 2 );
+}
+
+
+// ----------------------------------------------------------------------------
+// Count the LFs in UTF-16 text, moving it down to 'out' (which may overlap it,
+// but never lies above it); stops at the first block containing a CR.
+//
+QE_TARGET("sse2")
+static int packLinesSSE2( const ushort *in, int length, ushort *out, int *lineFeeds )
+{
+    const __m128i cr = _mm_set1_epi16('\r');
+    const __m128i lf = _mm_set1_epi16('\n');
+    int bits = 0;
+    int i = 0;
+    for ( ; i + 8 <= length; i += 8 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i ));
+        if ( _mm_movemask_epi8( _mm_cmpeq_epi16( v, cr )))
+            break;
+        bits += __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi16( v, lf )));
+        if ( out != in )
+            _mm_storeu_si128( (__m128i *)( out + i ), v );
+    }
+    *lineFeeds += bits / 2;         // two mask bits per unit
+    return i;
+}
+
+
+QE_TARGET("avx2")
+static int packLinesAVX2( const ushort *in, int length, ushort *out, int *lineFeeds )
+{
+    const __m256i cr = _mm256_set1_epi16('\r');
+    const __m256i lf = _mm256_set1_epi16('\n');
+    int bits = 0;
+    int i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        __m256i v = _mm256_loadu_si256( (const __m256i *)( in + i ));
+        if ( _mm256_movemask_epi8( _mm256_cmpeq_epi16( v, cr )))
+            break;
+        bits += __builtin_popcount( (unsigned) _mm256_movemask_epi8( _mm256_cmpeq_epi16( v, lf )));
+        if ( out != in )
+            _mm256_storeu_si256( (__m256i *)( out + i ), v );
+    }
+    *lineFeeds += bits / 2;
+    return i;
+}
+
+
+// ----------------------------------------------------------------------------
+// Find the first LF in UTF-16 text; returns its position if it's in one of the
+// whole blocks looked at, otherwise the number of units looked at.
+//
+QE_TARGET("sse2")
+static int findLineFeedSSE2( const ushort *in, int length )
+{
+    const __m128i lf = _mm_set1_epi16('\n');
+    int i = 0;
+    for ( ; i + 8 <= length; i += 8 ) {
+        int mask = _mm_movemask_epi8( _mm_cmpeq_epi16( _mm_loadu_si128( (const __m128i *)( in + i )), lf ));
+        if ( mask )
+            return i + __builtin_ctz( mask ) / 2;
+    }
+    return i;
+}
+
+
+QE_TARGET("avx2")
+static int findLineFeedAVX2( const ushort *in, int length )
+{
+    const __m256i lf = _mm256_set1_epi16('\n');
+    int i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        unsigned mask = _mm256_movemask_epi8( _mm256_cmpeq_epi16( _mm256_loadu_si256( (const __m256i *)( in + i )), lf ));
+        if ( mask )
+            return i + __builtin_ctz( mask ) / 2;
+    }
+    return i;
+}
+
+#endif      // QE_SIMD_X86
+
+
+// ----------------------------------------------------------------------------
+// Dispatchers; these return 0 when there's no vector support at all.
+//
+
+static inline int widenAscii( QeInstructionSet isa, const uchar *in, int length, ushort *out )
+{
+#ifdef QE_SIMD_X86
+    if ( isa == QE_ISA_AVX2 ) return widenAsciiAVX2( in, length, out );
+    if ( isa == QE_ISA_SSE2 ) return widenAsciiSSE2( in, length, out );
+#else
+    Q_UNUSED( isa ); Q_UNUSED( in ); Q_UNUSED( length ); Q_UNUSED( out );
+#endif
+    return 0;
+}
+
+
+static inline int narrowAscii( QeInstructionSet isa, const ushort *in, int length, uchar *out )
+{
+#ifdef QE_SIMD_X86
+    if ( isa == QE_ISA_AVX2 ) return narrowAsciiAVX2( in, length, out );
+    if ( isa == QE_ISA_SSE2 ) return narrowAsciiSSE2( in, length, out );
+#else
+    Q_UNUSED( isa ); Q_UNUSED( in ); Q_UNUSED( length ); Q_UNUSED( out );
+#endif
+    return 0;
+}
+
+
+static inline int packLines( QeInstructionSet isa, const ushort *in, int length, ushort *out, int *lineFeeds )
+{
+#ifdef QE_SIMD_X86
+    if ( isa == QE_ISA_AVX2 ) return packLinesAVX2( in, length, out, lineFeeds );
+    if ( isa == QE_ISA_SSE2 ) return packLinesSSE2( in, length, out, lineFeeds );
+#else
+    Q_UNUSED( isa ); Q_UNUSED( in ); Q_UNUSED( length ); Q_UNUSED( out ); Q_UNUSED( lineFeeds );
+#endif
+    return 0;
+}
+
+
+static void swapBytes( const uchar *in, int units, uchar *out )
+{
+    int i = 0;
+#ifdef QE_SIMD_X86
+    QeInstructionSet isa = qeInstructionSet();
+    if ( isa == QE_ISA_AVX2 )
+        i = swapBytesAVX2( in, units, out );
+    else if ( isa == QE_ISA_SSE2 )
+        i = swapBytesSSE2( in, units, out );
+#endif
+    for ( ; i < units; i++ ) {
+        uchar first = in[ i * 2 ];
+        out[ i * 2 ]     = in[ i * 2 + 1 ];
+        out[ i * 2 + 1 ] = first;
+    }
+}
+
+
+
+// ============================================================================
+// Conversion routines
+//
+
+// ----------------------------------------------------------------------------
+// Decode UTF-8 to UTF-16.  Invalid input is replaced by U+FFFD, one for each
+// maximal ill-formed subsequence (as the Unicode standard recommends); this
+// covers overlong forms, surrogates and anything above U+10FFFF.  Returns the
+// number of UTF-16 units written.
+//
+int qeDecodeUtf8( const uchar *in, int length, ushort *out, int *used, int *invalid )
+{
+    QeInstructionSet isa = qeInstructionSet();
+    bool incomplete = false;
+    int  i = 0,
+         o = 0,
+         bad = 0,
+         run = SCALAR_RUN_LENGTH / 2;
+
+    while ( !incomplete && ( i < length )) {
+        int n = widenAscii( isa, in + i, length - i, out + o );
+        i += n;
+        o += n;
+        run = n ? SCALAR_RUN_LENGTH : qMin( run * 2, SCALAR_RUN_MAX );
+
+        int runEnd = qMin( i + run, length );
+        while ( i < runEnd ) {
+            uint c = in[ i ];
+            if ( c < 0x80 ) {
+                out[ o++ ] = c;
+                i++;
+                continue;
+            }
+
+            // Work out the sequence length and the valid range of the second
+            // byte, which is narrower than usual for some lead bytes.
+            int  need = 0;
+            uint cp   = 0,
+                 low  = 0x80,
+                 high = 0xBF;
+            if ( c < 0xC2 ) ;                   // stray continuation or overlong
+            else if ( c < 0xE0 ) {
+                need = 1;
+                cp = c & 0x1F;
+            }
+            else if ( c < 0xF0 ) {
+                need = 2;
+                cp = c & 0x0F;
+                if ( c == 0xE0 )      low  = 0xA0;
+                else if ( c == 0xED ) high = 0x9F;
+            }
+            else if ( c < 0xF5 ) {
+                need = 3;
+                cp = c & 0x07;
+                if ( c == 0xF0 )      low  = 0x90;
+                else if ( c == 0xF4 ) high = 0x8F;
+            }
+            if ( !need ) {
+                out[ o++ ] = 0xFFFD;
+                bad++;
+                i++;
+                continue;
+            }
+
+            int k = 1;
+            for ( ; k <= need; k++ ) {
+                if ( i + k >= length )
+                    break;
+                uint b = in[ i + k ];
+                if (( b < low ) || ( b > high ))
+                    break;
+                cp = ( cp << 6 ) | ( b & 0x3F );
+                low  = 0x80;
+                high = 0xBF;
+            }
+            if ( k <= need ) {
+                if ( i + k >= length ) {
+                    // Valid so far but cut off; leave it for next time
+                    incomplete = true;
+                    break;
+                }
+                out[ o++ ] = 0xFFFD;
+                bad++;
+                i += k;
+                continue;
+            }
+
+            if ( cp >= 0x10000 ) {
+                cp -= 0x10000;
+                out[ o++ ] = 0xD800 | ( cp >> 10 );
+                out[ o++ ] = 0xDC00 | ( cp & 0x3FF );
+            }
+            else
+                out[ o++ ] = cp;
+            i += need + 1;
+        }
+    }
+
+    if ( used )    *used = i;
+    if ( invalid ) *invalid = bad;
+    return o;
+}
+
+
+// ----------------------------------------------------------------------------
+// Encode UTF-16 as UTF-8.  Unpaired surrogates are written as '?' (as Qt's own
+// codec does).  A high surrogate at the very end of the input is left unused,
+// since its other half may follow in the next piece.  Returns the number of
+// bytes written.
+//
+int qeEncodeUtf8( const ushort *in, int length, uchar *out, int *used, int *invalid )
+{
+    QeInstructionSet isa = qeInstructionSet();
+    bool incomplete = false;
+    int  i = 0,
+         o = 0,
+         bad = 0,
+         run = SCALAR_RUN_LENGTH / 2;
+
+    while ( !incomplete && ( i < length )) {
+        int n = narrowAscii( isa, in + i, length - i, out + o );
+        i += n;
+        o += n;
+        run = n ? SCALAR_RUN_LENGTH : qMin( run * 2, SCALAR_RUN_MAX );
+
+        int runEnd = qMin( i + run, length );
+        while ( i < runEnd ) {
+            uint u = in[ i ];
+            if ( u < 0x80 ) {
+                out[ o++ ] = u;
+            }
+            else if ( u < 0x800 ) {
+                out[ o++ ] = 0xC0 | ( u >> 6 );
+                out[ o++ ] = 0x80 | ( u & 0x3F );
+            }
+            else if (( u >= 0xD800 ) && ( u <= 0xDBFF )) {
+                if ( i + 1 >= length ) {
+                    incomplete = true;
+                    break;
+                }
+                uint low = in[ i + 1 ];
+                if (( low >= 0xDC00 ) && ( low <= 0xDFFF )) {
+                    uint cp = 0x10000 + (( u - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+                    out[ o++ ] = 0xF0 | ( cp >> 18 );
+                    out[ o++ ] = 0x80 | (( cp >> 12 ) & 0x3F );
+                    out[ o++ ] = 0x80 | (( cp >> 6 ) & 0x3F );
+                    out[ o++ ] = 0x80 | ( cp & 0x3F );
+                    i++;
+                }
+                else {
+                    out[ o++ ] = '?';
+                    bad++;
+                }
+            }
+            else if (( u >= 0xDC00 ) && ( u <= 0xDFFF )) {
+                out[ o++ ] = '?';
+                bad++;
+            }
+            else {
+                out[ o++ ] = 0xE0 | ( u >> 12 );
+                out[ o++ ] = 0x80 | (( u >> 6 ) & 0x3F );
+                out[ o++ ] = 0x80 | ( u & 0x3F );
+            }
+            i++;
+        }
+    }
+
+    if ( used )    *used = i;
+    if ( invalid ) *invalid = bad;
+    return o;
+}
+
+
+// ----------------------------------------------------------------------------
+// Read UTF-16 units of the given byte order from an unaligned byte buffer.
+//
+void qeCopyUtf16( const uchar *in, int units, ushort *out, bool bigEndian )
+{
+    if ( bigEndian == ( Q_BYTE_ORDER == Q_BIG_ENDIAN ))
+        memcpy( out, in, units * 2 );
+    else
+        swapBytes( in, units, (uchar *) out );
+}
+
+
+// ----------------------------------------------------------------------------
+// Write UTF-16 units in the given byte order to an unaligned byte buffer.
+//
+void qeStoreUtf16( const ushort *in, int units, uchar *out, bool bigEndian )
+{
+    if ( bigEndian == ( Q_BYTE_ORDER == Q_BIG_ENDIAN ))
+        memcpy( out, in, units * 2 );
+    else
+        swapBytes( (const uchar *) in, units, out );
+}
+
+
+
+// ----------------------------------------------------------------------------
+// Decode a single-byte encoding through the given table of 256 Unicode values
+// (one for each byte value).  The entries are 32 bits wide so that the AVX2
+// kernel can gather them directly.
+//
+static void decodeTable( const uchar *in, int length, ushort *out, const quint32 *table )
+{
+    for ( int i = 0; i < length; i++ )
+        out[ i ] = table[ in[ i ]];
+}
+
+
+void qeDecodeSingleByte( const uchar *in, int length, ushort *out, const quint32 *table )
+{
+    int i = 0;
+#ifdef QE_SIMD_X86
+    QeInstructionSet isa = qeInstructionSet();
+    if ( isa == QE_ISA_AVX2 )
+        i = decodeTableAVX2( in, length, out, table );
+    else if ( isa == QE_ISA_SSE2 ) {
+        int run = SCALAR_RUN_LENGTH / 2;
+        while ( i < length ) {
+            int n = widenPlainSSE2( in + i, length - i, out + i );
+            i += n;
+            run = n ? SCALAR_RUN_LENGTH : qMin( run * 2, SCALAR_RUN_MAX );
+            n = qMin( run, length - i );
+            decodeTable( in + i, n, out + i, table );
+            i += n;
+        }
+    }
+#endif
+    decodeTable( in + i, length - i, out + i, table );
+}
+
+
+
+// ----------------------------------------------------------------------------
+// Encode UTF-16 to a single-byte encoding through the given two-level reverse
+// map: 'pageIndex' is indexed by the high byte of the Unicode value and gives
+// the page in 'pages' to index by the low byte.  A 0 there means the character
+// can't be encoded.  Units 32-126 are always passed through as themselves.
+//
+// Characters that can't be encoded are written as 'replacement'; if
+// 'invalidPositions' isn't NULL, their indexes in the input are added to it.
+// Returns the number of such characters.
+//
+int qeEncodeSingleByte( const ushort *in, int length, uchar *out,
+                        const uchar *pageIndex, const uchar (*pages)[ 256 ],
+                        uchar replacement, QVector<int> *invalidPositions )
+{
+    QeInstructionSet isa = qeInstructionSet();
+    const uchar *first = pages[ pageIndex[ 0 ]];
+    bool controls = ( first[ 9 ] == 9 ) && ( first[ 10 ] == 10 ) && ( first[ 13 ] == 13 );
+    int  i = 0,
+         bad = 0,
+         run = SCALAR_RUN_LENGTH / 2;
+
+    while ( i < length ) {
+        int n = 0;
+#ifdef QE_SIMD_X86
+        if ( isa == QE_ISA_AVX2 )
+            n = narrowPlainAVX2( in + i, length - i, out + i, controls );
+        else if ( isa == QE_ISA_SSE2 )
+            n = narrowPlainSSE2( in + i, length - i, out + i, controls );
+#else
+        Q_UNUSED( isa );
+        Q_UNUSED( controls );
+#endif
+        i += n;
+        run = n ? SCALAR_RUN_LENGTH : qMin( run * 2, SCALAR_RUN_MAX );
+
+        for ( int runEnd = qMin( i + run, length ); i < runEnd; i++ ) {
+            uint u = in[ i ];
+            if (( u > 31 ) && ( u < 127 )) {
+                out[ i ] = u;
+                continue;
+            }
+            uchar c = pages[ pageIndex[ u >> 8 ]][ u & 0xFF ];
+            if ( !c ) {
+                c = replacement;
+                bad++;
+                if ( invalidPositions )
+                    invalidPositions->append( i );
+            }
+            out[ i ] = c;
+        }
+    }
+    return bad;
+}
+
+
+
+// ----------------------------------------------------------------------------
+// Remove the CR from each CR+LF pair in UTF-16 text, in place, and count the
+// line ends: 'lineFeeds' is increased by the number of LFs, and 'crlfs' by the
+// number of those which had a CR removed.  A CR at the very end is left alone
+// (the caller can't yet know what follows it).  Returns the new length.
+//
+// Runs of text with no CR in them are counted (and moved down, once anything
+// has been removed) a vector block at a time.
+//
+int qeStripCarriageReturns( ushort *text, int length, int *lineFeeds, int *crlfs )
+{
+    QeInstructionSet isa = qeInstructionSet();
+    int lf = 0, removed = 0;
+    int in = 0, out = 0;
+    while ( in < length ) {
+        int n = packLines( isa, text + in, length - in, text + out, &lf );
+        in  += n;
+        out += n;
+        // Then (at least) the block with the CR in it, one unit at a time
+        int end = qMin( length, in + 16 );
+        for ( ; in < end; in++ ) {
+            ushort c = text[ in ];
+            if (( c == '\r') && ( in + 1 < length ) && ( text[ in + 1 ] == '\n')) {
+                removed++;
+                continue;
+            }
+            if ( c == '\n')
+                lf++;
+            text[ out++ ] = c;
+        }
+    }
+    *lineFeeds += lf;
+    *crlfs     += removed;
+    return out;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the position of the first LF in UTF-16 text, or -1 if there is none.
+//
+int qeFindLineFeed( const ushort *text, int length )
+{
+    int i = 0;
+#ifdef QE_SIMD_X86
+    QeInstructionSet isa = qeInstructionSet();
+    if ( isa == QE_ISA_AVX2 )
+        i = findLineFeedAVX2( text, length );
+    else if ( isa == QE_ISA_SSE2 )
+        i = findLineFeedSSE2( text, length );
+#endif
+    for ( ; i < length; i++ ) {
+        if ( text[ i ] == '\n')
+            return i;
+    }
+    return -1;
+}
+
+
+
+// ============================================================================
+// QeUnicodeConverter
+//
+
+// ----------------------------------------------------------------------------
+QeUnicodeConverter::QeUnicodeConverter( Format format )
+{
+    currentFormat = format;
+    writeCRLF     = false;
+    reset();
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the format corresponding to the given Qt codec, or Unsupported if
+// it isn't one we handle.
+//
+QeUnicodeConverter::Format QeUnicodeConverter::formatForCodec( const QTextCodec *codec )
+{
+    if ( !codec ) return Unsupported;
+    switch ( codec->mibEnum() ) {
+        case 106:   return Utf8;
+        case 1013:  return Utf16BE;
+        case 1014:  return Utf16LE;
+        // Plain "UTF-16" without a byte-order mark means native order to Qt
+        case 1015:  return ( Q_BYTE_ORDER == Q_BIG_ENDIAN ) ? Utf16BE : Utf16LE;
+        default:    return Unsupported;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+void QeUnicodeConverter::setFormat( Format format )
+{
+    currentFormat = format;
+    reset();
+}
+
+
+// ----------------------------------------------------------------------------
+QeUnicodeConverter::Format QeUnicodeConverter::format() const
+{
+    return currentFormat;
+}
+
+
+// ----------------------------------------------------------------------------
+void QeUnicodeConverter::reset()
+{
+    headerChecked    = false;
+    headerFound      = false;
+    pendingCount     = 0;
+    pendingSurrogate = 0;
+    invalid          = 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// Treat the next input as coming from the middle of a stream, so that a
+// byte-order mark at the start is just a character (U+FEFF).
+//
+void QeUnicodeConverter::ignoreHeader()
+{
+    headerChecked = true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set whether line ends are written as CR+LF rather than LF when encoding.
+// The text is still expected to have LF line ends only.
+//
+void QeUnicodeConverter::setCRLF( bool crlf )
+{
+    writeCRLF = crlf;
+}
+
+
+// ----------------------------------------------------------------------------
+// Decode the next piece of input.  A byte-order mark at the very start is
+// skipped (see hasByteOrderMark).
+//
+QString QeUnicodeConverter::toUnicode( const char *bytes, int length )
+{
+    QString text;
+    const uchar *in = (const uchar *) bytes;
+    if (( length <= 0 ) || ( currentFormat == Unsupported ))
+        return text;
+
+    if ( !headerChecked ) {
+        QByteArray header = byteOrderMark();
+        if (( length >= header.size() ) && !memcmp( in, header.constData(), header.size() )) {
+            in     += header.size();
+            length -= header.size();
+            headerFound = true;
+        }
+        headerChecked = true;
+    }
+
+    int used, bad, o = 0;
+    if ( currentFormat == Utf8 ) {
+        text.resize( pendingCount + length );
+        ushort *out = (ushort *) text.data();
+
+        if ( pendingCount ) {
+            // Finish off the sequence left over from last time
+            uchar joined[ 8 ];
+            int   take = qMin( length, 4 );
+            memcpy( joined, pendingBytes, pendingCount );
+            memcpy( joined + pendingCount, in, take );
+            o = qeDecodeUtf8( joined, pendingCount + take, out, &used, &bad );
+            invalid += bad;
+            if ( used < pendingCount ) {
+                // Still not enough input to complete it
+                memcpy( pendingBytes, joined, pendingCount + take );
+                pendingCount += take;
+                return QString();
+            }
+            in     += used - pendingCount;
+            length -= used - pendingCount;
+            pendingCount = 0;
+        }
+
+        o += qeDecodeUtf8( in, length, out + o, &used, &bad );
+        invalid += bad;
+        pendingCount = length - used;
+        memcpy( pendingBytes, in + used, pendingCount );
+        text.resize( o );
+    }
+    else {
+        bool bigEndian = ( currentFormat == Utf16BE );
+        text.resize(( pendingCount + length ) / 2 );
+        ushort *out = (ushort *) text.data();
+
+        if ( pendingCount && length ) {
+            uchar pair[ 2 ] = { pendingBytes[ 0 ], in[ 0 ] };
+            qeCopyUtf16( pair, 1, out, bigEndian );
+            o = 1;
+            in++;
+            length--;
+            pendingCount = 0;
+        }
+        qeCopyUtf16( in, length / 2, out + o, bigEndian );
+        if ( length & 1 ) {
+            pendingBytes[ 0 ] = in[ length - 1 ];
+            pendingCount = 1;
+        }
+    }
+    return text;
+}
+
+
+// ----------------------------------------------------------------------------
+// Call at the end of the input; returns a replacement character if it ended
+// part way through a sequence.
+//
+QString QeUnicodeConverter::finishDecoding()
+{
+    if ( !pendingCount )
+        return QString();
+    pendingCount = 0;
+    invalid++;
+    return QString( QChar( QChar::ReplacementCharacter ));
+}
+
+
+// ----------------------------------------------------------------------------
+// Encode the next piece of text.  No byte-order mark is written; callers who
+// want one should write byteOrderMark() themselves first.
+//
+QByteArray QeUnicodeConverter::fromUnicode( const QChar *chars, int length )
+{
+    QByteArray bytes;
+    const ushort *in = (const ushort *) chars;
+    if (( length <= 0 ) || ( currentFormat == Unsupported ))
+        return bytes;
+    if ( !writeCRLF ) {
+        encode( in, length, bytes );
+        return bytes;
+    }
+
+    // Encode a line at a time, each followed by CR+LF, rather than making an
+    // expanded copy of the text
+    static const ushort crlf[ 2 ] = { '\r', '\n' };
+    while ( length > 0 ) {
+        int n = qeFindLineFeed( in, length );
+        if ( n < 0 ) {
+            encode( in, length, bytes );
+            break;
+        }
+        encode( in, n, bytes );
+        encode( crlf, 2, bytes );
+        in     += n + 1;
+        length -= n + 1;
+    }
+    return bytes;
+}
+
+
+// ----------------------------------------------------------------------------
+// Encode a piece of text as it is, adding it to the end of 'bytes'.
+//
+void QeUnicodeConverter::encode( const ushort *in, int length, QByteArray &bytes )
+{
+    if ( length <= 0 )
+        return;
+    int start = bytes.size();
+
+    if ( currentFormat == Utf8 ) {
+        bytes.resize( start + ( length + 1 ) * 3 );
+        uchar *out = (uchar *) bytes.data() + start;
+        int used, bad, o = 0;
+
+        if ( pendingSurrogate ) {
+            ushort pair[ 2 ] = { pendingSurrogate, in[ 0 ] };
+            if ( QChar( in[ 0 ] ).isLowSurrogate() ) {
+                o = qeEncodeUtf8( pair, 2, out, &used, &bad );
+                in++;
+                length--;
+            }
+            else {
+                out[ o++ ] = '?';
+                invalid++;
+            }
+            pendingSurrogate = 0;
+        }
+
+        o += qeEncodeUtf8( in, length, out + o, &used, &bad );
+        invalid += bad;
+        if ( used < length )
+            pendingSurrogate = in[ used ];
+        bytes.resize( start + o );
+    }
+    else {
+        bytes.resize( start + length * 2 );
+        qeStoreUtf16( in, length, (uchar *) bytes.data() + start, currentFormat == Utf16BE );
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Call at the end of the text; returns a substitution character if it ended
+// with half a surrogate pair.
+//
+QByteArray QeUnicodeConverter::finishEncoding()
+{
+    if ( !pendingSurrogate )
+        return QByteArray();
+    pendingSurrogate = 0;
+    invalid++;
+    return QByteArray( 1, '?');
+}
+
+
+// ----------------------------------------------------------------------------
+QByteArray QeUnicodeConverter::byteOrderMark() const
+{
+    switch ( currentFormat ) {
+        case Utf8:    return QByteArray("\xEF\xBB\xBF", 3 );
+        case Utf16LE: return QByteArray("\xFF\xFE", 2 );
+        case Utf16BE: return QByteArray("\xFE\xFF", 2 );
+        default:      return QByteArray();
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if the input decoded so far started with a byte-order mark.
+//
+bool QeUnicodeConverter::hasByteOrderMark() const
+{
+    return headerFound;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the number of invalid sequences (or unencodable characters) found
+// since the last reset.
+//
+int QeUnicodeConverter::invalidCount() const
+{
+    return invalid;
+}
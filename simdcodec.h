@@ -0,0 +1,122 @@
+/******************************************************************************
+** QE - simdcodec.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+#ifndef QE_SIMDCODEC_H
+#define QE_SIMDCODEC_H
+
+#include <QString>
+#include <QByteArray>
+#include <QTextCodec>
+#include <QVector>
+
+
+// Vector kernels are only built for x86 with a GCC (or compatible) compiler
+// new enough to allow per-function instruction sets; everything else gets the
+// plain C++ versions.  The choice between them is made at run time, based on
+// what the CPU actually supports.
+#if ( defined( __i386__ ) || defined( __x86_64__ )) && \
+    ( defined( __clang__ ) || ( __GNUC__ > 4 ) || (( __GNUC__ == 4 ) && ( __GNUC_MINOR__ >= 9 )))
+#define QE_SIMD_X86
+#endif
+
+
+// ============================================================================
+// Low-level conversion routines.
+//
+// These work on plain buffers, which the caller must make large enough: one
+// UTF-16 unit per input byte when decoding UTF-8, and three bytes per UTF-16
+// unit when encoding it.  The decoders stop short of any incomplete sequence
+// at the end of the input, and report how much they used through 'used'.
+//
+
+enum QeInstructionSet {
+    QE_ISA_GENERIC = 0,
+    QE_ISA_SSE2,
+    QE_ISA_AVX2
+};
+
+QeInstructionSet qeInstructionSet();
+const char      *qeInstructionSetName();
+
+int qeDecodeUtf8( const uchar *in, int length, ushort *out, int *used, int *invalid );
+int qeEncodeUtf8( const ushort *in, int length, uchar *out, int *used, int *invalid );
+void qeCopyUtf16( const uchar *in, int units, ushort *out, bool bigEndian );
+void qeStoreUtf16( const ushort *in, int units, uchar *out, bool bigEndian );
+void qeDecodeSingleByte( const uchar *in, int length, ushort *out, const quint32 *table );
+int  qeEncodeSingleByte( const ushort *in, int length, uchar *out,
+                         const uchar *pageIndex, const uchar (*pages)[ 256 ],
+                         uchar replacement, QVector<int> *invalidPositions );
+int  qeStripCarriageReturns( ushort *text, int length, int *lineFeeds, int *crlfs );
+int  qeFindLineFeed( const ushort *text, int length );
+
+
+// ============================================================================
+// QeUnicodeConverter
+//
+// A stateful UTF-8/UTF-16 converter built on the routines above, which the
+// file I/O threads use in place of Qt's own codecs for the Unicode encodings.
+// Like QTextCodec with a ConverterState, it accepts its input in arbitrary
+// pieces; unlike it, it never writes a byte-order mark unless told to.  It
+// can also write CR+LF line ends while encoding (see setCRLF).
+//
+
+class QeUnicodeConverter
+{
+public:
+    enum Format {
+        Unsupported = 0,
+        Utf8,
+        Utf16LE,
+        Utf16BE
+    };
+
+    QeUnicodeConverter( Format format = Unsupported );
+
+    static Format formatForCodec( const QTextCodec *codec );
+
+    void        setFormat( Format format );
+    Format      format() const;
+    void        reset();
+    void        ignoreHeader();
+    void        setCRLF( bool crlf );
+
+    QString     toUnicode( const char *bytes, int length );
+    QString     finishDecoding();
+    QByteArray  fromUnicode( const QChar *chars, int length );
+    QByteArray  finishEncoding();
+    QByteArray  byteOrderMark() const;
+
+    bool        hasByteOrderMark() const;
+    int         invalidCount() const;
+
+private:
+    void        encode( const ushort *in, int length, QByteArray &bytes );
+
+    Format      currentFormat;
+    bool        writeCRLF;          // encode each LF as CR+LF
+    bool        headerChecked;
+    bool        headerFound;
+    uchar       pendingBytes[ 4 ];  // incomplete sequence from the last input
+    int         pendingCount;
+    ushort      pendingSurrogate;   // unpaired high surrogate from the last input
+    int         invalid;
+};
+
+#endif      // QE_SIMDCODEC_H
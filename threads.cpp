@@ -1,5 +1,24 @@
+#include <string.h>
+#include <limits.h>
+#include <QCoreApplication>
+#include <QTextBlock>
+#include <QElapsedTimer>
+#include <QTemporaryFile>
+#include <QFileInfo>
 #include "threads.h"
+#include "decodepipeline.h"
 #include "eastring.h"
+#include "qetextedit.h"
+#include "tracing.h"
+#if defined( Q_OS_WIN32 )
+#include <windows.h>
+#include <io.h>
+#elif defined( Q_OS_UNIX ) && !defined( __OS2__ )
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
 
 
 // ============================================================================
@@ -11,49 +30,533 @@ QeOpenThread::QeOpenThread()
 {
     inputFile     = NULL;
     inputEncoding = NULL;
+    inputDetector = NULL;
+    inputState    = NULL;
+    document      = NULL;
+    reloading     = false;
+    inputHasBOM   = false;
+    inputCompression = QeCompression::None;
+    inputRead     = 0;
+    lineFeeds     = 0;
+    crlfLineEnds  = 0;
     inputFileName = "";
 }
 
 
 // ----------------------------------------------------------------------------
+QeOpenThread::~QeOpenThread()
+{
+    delete document;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the most characters (UTF-16 units) that the given number of bytes
+// can decode to.  Nothing we support takes less than one byte per unit, and
+// UTF-16 and UTF-32 take at least two bytes per unit (a UTF-32 character
+// may need a surrogate pair).
+//
+static qint64 maxDecodedLength( QTextCodec *codec, qint64 bytes )
+{
+    switch ( codec->mibEnum() ) {
+        case 1013: case 1014: case 1015:        // UTF-16BE, UTF-16LE, UTF-16
+        case 1017: case 1018: case 1019:        // UTF-32BE, UTF-32LE, UTF-32
+            return bytes / 2;
+        default:
+            return bytes;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// The file contents are handed to the codec directly from a memory mapping of
+// the file where possible, so the only copy made is the decoded text itself.
+// Files which can't be mapped (pipes, devices and the like) are read through
+// a single reusable buffer instead.  Large files in encodings that allow it
+// are decoded on several threads at once (see readParallel).  Compressed
+// files are decompressed a block at a time on the way to the decoder (see
+// readCompressed).
+//
+// The decoded text goes straight into a new QTextDocument, which is built up
+// entirely in this thread.  Once finished, the document is moved over to the
+// GUI thread so that it can be attached to the editor (see takeDocument).
+// The start of the text is also sent on ahead (see previewAvailable) so that
+// the GUI has something to show in the meantime.
+//
+// When reloading (see setReloadText) the text is collected in a string
+// instead, and compared with the editor's; the result is a list of changes
+// to make to the existing document (see takeChanges).
+//
 void QeOpenThread::run()
 {
+    QeTraceSpan span("QeOpenThread::run");
+    stop = false;
 
-    fullText = "";
-    stop     = false;
+    delete document;
+    document = NULL;
+    reloadChanges.clear();
 
     if ( inputFile != NULL ) {
-        QTextStream in( inputFile );
-        qint64 progress = 0;
-        qint64 total    = inputFile->size();
-        if ( total )
-            fullText.reserve( total );
-        if ( inputEncoding != NULL )
-            in.setCodec( inputEncoding );
-
-        // Read the file in max-size chunks
-        if ( total > FILE_CHUNK_SIZE ) {
-            while ( !stop && !in.atEnd() ) {
-                fullText.append( in.read( FILE_CHUNK_SIZE ));
-                if (( progress + FILE_CHUNK_SIZE ) > total )
-                    progress = total;
-                else
-                    progress += FILE_CHUNK_SIZE;
-                setProgress( progress, total );
-            }
+        QTextCodec::ConverterState state;
+        qint64 total = inputFile->size();
+
+        // We handle line-end conversion ourselves (see convertLineEnds)
+        inputFile->setTextModeEnabled( false );
+
+        inputCompression = QeCompression::detect( inputFile->peek( COMPRESSION_HEADER_SIZE ));
+        if ( !QeCompression::isSupported( inputCompression ))
+            inputCompression = QeCompression::None;
+
+        if ( inputDetector != NULL )
+            detectEncoding();
+        if ( inputEncoding == NULL )
+            inputEncoding = QTextCodec::codecForLocale();
+        inputState    = &state;
+        headerChecked = false;
+        pendingCR     = false;
+        previewSent   = false;
+        inputHasBOM   = false;
+        inputRead     = 0;
+        lineFeeds     = 0;
+        crlfLineEnds  = 0;
+        unicodeDecoder.setFormat( QeUnicodeConverter::Unsupported );
+
+        if ( reloading ) {
+            // Reserve enough for the whole text if we can tell how much that
+            // is, so that it never has to be copied to grow
+            qint64 expected = reloadBase.size() + FILE_CHUNK_SIZE;
+            if ( inputCompression == QeCompression::None )
+                expected = qMin( expected, maxDecodedLength( inputEncoding, total ));
+            reloadText.clear();
+            reloadText.reserve( (int) qMin( expected, (qint64) INT_MAX ));
+        }
+        else {
+            // The document gets its layout from the GUI thread, as layout may
+            // involve fonts; until then nothing here should need one.
+            document = new QTextDocument();
+            document->setUndoRedoEnabled( false );
+            document->setDefaultFont( documentFont );
+            document->setDefaultTextOption( documentOption );
+            documentCursor = QTextCursor( document );
+            lineLength     = 0;
+        }
+
+        if ( inputCompression != QeCompression::None )
+            readCompressed( total );
+        else if ( !readParallel( total ) && !readMapped( total ))
+            readStreamed( 0, total );
+        if ( unicodeDecoder.format() != QeUnicodeConverter::Unsupported ) {
+            QString tail = unicodeDecoder.finishDecoding();
+            convertLineEnds( tail, pendingCR, &lineFeeds, &crlfLineEnds );
+            if ( !tail.isEmpty() )
+                appendText( tail );
+            inputHasBOM = unicodeDecoder.hasByteOrderMark();
+        }
+        if ( pendingCR )
+            appendText( QString( QLatin1Char('\r')));
+
+        if ( reloading ) {
+            if ( !stop )
+                reloadChanges = QeLineDiff::compare( reloadBase, reloadText );
+            reloadBase.clear();
+            reloadText.clear();
         }
         else {
-            fullText = in.readAll();
-            progress = total;
+            // Create each block's (empty) layout object now, so that the GUI
+            // thread doesn't have to when the document is attached to the editor.
+            QeTraceSpan layoutSpan("createLayouts");
+            layoutSpan.setCount("blocks", document->blockCount() );
+            for ( QTextBlock block = document->begin(); !stop && block.isValid(); block = block.next() )
+                block.layout();
+
+            documentCursor = QTextCursor();
+            if ( stop ) {
+                delete document;
+                document = NULL;
+            }
+            else
+                document->moveToThread( QCoreApplication::instance()->thread() );
         }
 
+        span.setCount("bytes", inputRead );
+        inputState = NULL;
         inputFile->close();
         delete inputFile;
     }
+}
+
+
+// ----------------------------------------------------------------------------
+// Run the encoding detector over samples of the input file, and use whatever
+// it comes up with if it is confident enough.  This only reads a few blocks,
+// so it costs little compared to the load itself.
+//
+void QeOpenThread::detectEncoding()
+{
+    QeTraceSpan span("detectEncoding");
+    int confidence = 0;
+    QTextCodec *codec;
+    QString name;
+    if ( inputCompression != QeCompression::None ) {
+        // Only the start of the text can be had without decompressing it all
+        QList<QByteArray> samples;
+        samples << readDecompressed( DETECT_SAMPLE_SIZE * 3 );
+        inputFile->seek( 0 );
+        name = inputDetector->detect( samples, &confidence, &codec );
+    }
+    else
+        name = inputDetector->detect( inputFile, &confidence, &codec );
+
+    span.setCount("confidence", name.isEmpty() ? 0 : confidence );
+    if ( name.isEmpty() || ( confidence < DETECT_MIN_CONFIDENCE ))
+        return;
+
+    inputEncoding = codec;
+    emit encodingDetected( name, confidence );
+}
+
+
+// ----------------------------------------------------------------------------
+// Decompress up to maxLength bytes from the start of the (compressed) file.
+// The file position is left wherever the input ran out.
+//
+QByteArray QeOpenThread::readDecompressed( int maxLength )
+{
+    QeDecompressor decompressor( inputCompression );
+    QByteArray output;
+    output.resize( maxLength );
+    int produced = 0;
+    bool ok = decompressor.isValid();
+
+    while ( ok && ( produced < maxLength )) {
+        QByteArray input = inputFile->read( FILE_CHUNK_SIZE / 16 );
+        int offset = 0;
+        do {
+            int used, length;
+            ok = decompressor.decompress( input.constData() + offset, input.size() - offset, &used,
+                                          output.data() + produced, maxLength - produced, &length,
+                                          input.isEmpty() );
+            if ( !ok )
+                break;
+            offset   += used;
+            produced += length;
+            if ( !used && !length )
+                break;
+        } while (( offset < input.size() ) && ( produced < maxLength ));
+        if ( input.isEmpty() || decompressor.atEnd() )
+            break;
+    }
+    output.resize( produced );
+    return output;
+}
+
+
+// ----------------------------------------------------------------------------
+// Decode a compressed file: it's read a block at a time, and each block is
+// decompressed through a fixed buffer straight into the decoder, so neither
+// the compressed nor the decompressed data is ever held in full.  Progress
+// is measured by how much of the file has been read.
+//
+// Returns false if the data turned out to be corrupt or incomplete; whatever
+// could be decompressed up to that point is still loaded.
+//
+bool QeOpenThread::readCompressed( qint64 total )
+{
+    QeDecompressor decompressor( inputCompression );
+    if ( !decompressor.isValid() ) {
+        qWarning("Could not start %s decompression", qPrintable( QeCompression::formatName( inputCompression )));
+        return false;
+    }
+
+    QByteArray input;
+    QByteArray output;
+    input.resize( FILE_CHUNK_SIZE );
+    output.resize( FILE_CHUNK_SIZE );
+
+    bool ok = true;
+    qint64 progress = 0;
+    while ( ok && !stop && !decompressor.atEnd() ) {
+        qint64 length = inputFile->read( input.data(), FILE_CHUNK_SIZE );
+        if ( length < 0 )
+            length = 0;
+        bool last = ( length == 0 );        // tells the decompressor to finish
+        const char *data = input.constData();
+        int left = (int) length;
+        int produced;
+        do {
+            int used;
+            if ( !decompressor.decompress( data, left, &used, output.data(), output.size(), &produced, last )) {
+                ok = false;
+                break;
+            }
+            if ( produced )
+                decodeBytes( output.constData(), produced );
+            data += used;
+            left -= used;
+            if ( !used && !produced )
+                break;
+        } while ( !stop && !decompressor.atEnd() && (( left > 0 ) || ( produced == output.size() )));
+
+        progress += length;
+        if ( total > 0 )
+            setProgress( qMin( progress, total ), total );
+        if ( last )
+            break;
+    }
+
+    if ( !ok )
+        qWarning("%s: %s data is corrupt", qPrintable( inputFileName ),
+                 qPrintable( QeCompression::formatName( inputCompression )));
+    else if ( !stop && !decompressor.atEnd() ) {
+        qWarning("%s: %s data is incomplete", qPrintable( inputFileName ),
+                 qPrintable( QeCompression::formatName( inputCompression )));
+        ok = false;
+    }
+    return ok;
+}
+
+
+// ----------------------------------------------------------------------------
+// Decode the file on as many threads as there are processors, through a
+// QeDecodePipeline: chunks are mapped (or failing that, read into the
+// pipeline's buffers) here, decoded in parallel, and the results added to the
+// document here in order.  Each chunk ends on a character boundary; whatever
+// is left over starts the next one.
+//
+// Returns false without reading anything if the file is too small to be worth
+// it, or its encoding can't be decoded in pieces (see isSplittable).
+//
+bool QeOpenThread::readParallel( qint64 total )
+{
+    int threads = QThread::idealThreadCount();
+    if (( threads < 2 ) || inputFile->isSequential() || ( total < FILE_PARALLEL_MIN ))
+        return false;
+
+    // Same byte-order-mark detection as decodeBytes() does
+    char header[ 4 ];
+    qint64 got = inputFile->peek( header, sizeof( header ));
+    inputEncoding = QTextCodec::codecForUtfText( QByteArray::fromRawData( header, (int) qMax( got, (qint64) 0 )),
+                                                 inputEncoding );
+    QeUnicodeConverter::Format format = QeUnicodeConverter::formatForCodec( inputEncoding );
+    if ( !QeDecodePipeline::isSplittable( inputEncoding, format ))
+        return false;
+    headerChecked = true;
+
+    QeDecodePipeline pipeline( inputEncoding, format, threads );
+    qint64 offset = 0;
+    while ( !stop && ( offset < total )) {
+        qint64 window = qMin( (qint64) FILE_MAP_SIZE, total - offset );
+        uchar *mapped = inputFile->map( offset, window );
+        if ( mapped == NULL )
+            break;
+        qint64 pos = 0;
+        while ( !stop && ( pos < window )) {
+            int length = (int) qMin( (qint64) FILE_CHUNK_SIZE, window - pos );
+            if ( offset + pos + length < total )
+                length = pipeline.splitPoint( (const char *)( mapped + pos ), length );
+            if ( length == 0 )
+                break;              // carry the partial character into the next window
+            if ( pipeline.pending() == pipeline.capacity() )
+                takeDecoded( pipeline );
+            pipeline.submit( (const char *)( mapped + pos ), length );
+            pos += length;
+            inputRead += length;
+            setProgress( offset + pos, total );
+        }
+        // The mapping has to stay until everything in it has been decoded
+        while ( pipeline.pending() )
+            takeDecoded( pipeline );
+        inputFile->unmap( mapped );
+        offset += pos;
+    }
+
+    // Read whatever couldn't be mapped
+    if ( !stop && ( offset < total ) && (( offset == 0 ) || inputFile->seek( offset ))) {
+        char carry[ 4 ];
+        int carried = 0;
+        while ( !stop ) {
+            if ( pipeline.pending() == pipeline.capacity() )
+                takeDecoded( pipeline );
+            char *buffer = pipeline.nextBuffer();
+            memcpy( buffer, carry, carried );
+            qint64 length = inputFile->read( buffer + carried, FILE_CHUNK_SIZE - carried );
+            if ( length < 0 )
+                length = 0;
+            int size = carried + (int) length;
+            bool atEnd = ( length == 0 ) || inputFile->atEnd();
+            int split = atEnd ? size : pipeline.splitPoint( buffer, size );
+            if ( split == 0 )
+                split = size;
+            carried = size - split;
+            memcpy( carry, buffer + split, carried );
+            if ( split )
+                pipeline.submit( buffer, split );
+            offset += length;
+            inputRead += length;
+            setProgress( qMin( offset, total ), total );
+            if ( atEnd )
+                break;
+        }
+    }
+    while ( pipeline.pending() )
+        takeDecoded( pipeline );
+
+    inputHasBOM = pipeline.hasByteOrderMark();
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Add the next chunk of text from the pipeline to the document.
+//
+void QeOpenThread::takeDecoded( QeDecodePipeline &pipeline )
+{
+    QString text = pipeline.take();
+    convertLineEnds( text, pendingCR, &lineFeeds, &crlfLineEnds );
+    if ( !text.isEmpty() )
+        appendText( text );
+}
+
+
+// ----------------------------------------------------------------------------
+// Decode the file from a series of read-only mappings of up to FILE_MAP_SIZE
+// bytes each.  Returns false if the file could not be mapped at all.
+//
+bool QeOpenThread::readMapped( qint64 total )
+{
+    if ( inputFile->isSequential() || ( total <= 0 ))
+        return false;
+
+    qint64 offset = 0;
+    while ( !stop && ( offset < total )) {
+        qint64 window = qMin( (qint64) FILE_MAP_SIZE, total - offset );
+        uchar *mapped = inputFile->map( offset, window );
+        if ( mapped == NULL ) {
+            if ( offset == 0 ) return false;
+            // Ran out of address space part way through; finish off by reading
+            readStreamed( offset, total );
+            return true;
+        }
+        for ( qint64 pos = 0; !stop && ( pos < window ); pos += FILE_CHUNK_SIZE ) {
+            int length = (int) qMin( (qint64) FILE_CHUNK_SIZE, window - pos );
+            decodeBytes( (const char *)( mapped + pos ), length );
+            setProgress( offset + pos + length, total );
+        }
+        inputFile->unmap( mapped );
+        offset += window;
+    }
+    return true;
+}
 
-    if ( stop ) {
-        fullText = "";
+
+// ----------------------------------------------------------------------------
+// Decode the file by reading it sequentially, starting from the given offset.
+// The total size is only used for reporting progress, and may be 0.
+//
+void QeOpenThread::readStreamed( qint64 offset, qint64 total )
+{
+    QByteArray buffer;
+    buffer.resize( FILE_CHUNK_SIZE );
+
+    if ( offset && !inputFile->seek( offset ))
+        return;
+
+    qint64 progress = offset;
+    while ( !stop ) {
+        qint64 length = inputFile->read( buffer.data(), FILE_CHUNK_SIZE );
+        if ( length <= 0 )
+            break;
+        decodeBytes( buffer.constData(), (int) length );
+        progress += length;
+        if ( total > 0 )
+            setProgress( qMin( progress, total ), total );
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Convert one block of raw file data and add it to the document.  Any partial
+// multi-byte sequence at the end of the block is held over in the converter
+// state and completed by the next call.
+//
+// UTF-8 and UTF-16 go through our own (vectorized) converter rather than the
+// Qt codec; see simdcodec.cpp.
+//
+void QeOpenThread::decodeBytes( const char *bytes, int length )
+{
+    if ( !headerChecked ) {
+        // Same Unicode byte-order-mark detection as QTextStream does by default
+        inputEncoding = QTextCodec::codecForUtfText( QByteArray::fromRawData( bytes, qMin( length, 4 )),
+                                                     inputEncoding );
+        unicodeDecoder.setFormat( QeUnicodeConverter::formatForCodec( inputEncoding ));
+        headerChecked = true;
+    }
+    inputRead += length;
+    QString text;
+    {
+        QeTraceSpan span("decode");
+        span.setCount("bytes", length );
+        if ( unicodeDecoder.format() != QeUnicodeConverter::Unsupported )
+            text = unicodeDecoder.toUnicode( bytes, length );
+        else
+            text = inputEncoding->toUnicode( bytes, length, inputState );
+    }
+    convertLineEnds( text, pendingCR, &lineFeeds, &crlfLineEnds );
+    if ( !text.isEmpty() )
+        appendText( text );
+}
+
+
+// ----------------------------------------------------------------------------
+// Convert CR+LF line endings to LF, in place.  A CR at the very end of the
+// block is held back (and pendingCR set) until we see whether the next block
+// starts with an LF.  If given, 'lineFeeds' and 'crlfs' are increased by the
+// number of line ends found, and how many of them were CR+LF; this is done in
+// the same (vectorized) pass over the text.
+//
+void QeOpenThread::convertLineEnds( QString &text, bool &pendingCR, qint64 *lineFeeds, qint64 *crlfs )
+{
+    int lf = 0, removed = 0;
+    if ( pendingCR ) {
+        if ( text.isEmpty() || ( text.at( 0 ) != QLatin1Char('\n')))
+            text.prepend( QLatin1Char('\r'));
+        else
+            removed++;
+    }
+    pendingCR = false;
+
+    int length = qeStripCarriageReturns( (ushort *) text.data(), text.size(), &lf, &removed );
+    if (( length > 0 ) && ( text.at( length - 1 ) == QLatin1Char('\r'))) {
+        pendingCR = true;
+        length--;
+    }
+    if ( length < text.size() )
+        text.resize( length );
+
+    if ( lineFeeds ) *lineFeeds += lf;
+    if ( crlfs )     *crlfs     += removed;
+}
+
+
+// ----------------------------------------------------------------------------
+// Add a block of decoded text to the end of the document.
+//
+void QeOpenThread::appendText( const QString &text )
+{
+    if ( reloading ) {
+        reloadText.append( text );
+        return;
     }
+    if ( !previewSent ) {
+        emit previewAvailable( text.left( LOAD_PREVIEW_SIZE ));
+        previewSent = true;
+    }
+    // Inside an edit block the cursor doesn't try to work out its position
+    // on screen (which would need a layout) after every paragraph.  Very long
+    // lines are broken into segments, which the editor can lay out.
+    documentCursor.beginEditBlock();
+    QeTextEdit::insertSegmented( documentCursor, text, lineLength );
+    documentCursor.endEditBlock();
 }
 
 
@@ -62,14 +565,117 @@ void QeOpenThread::setFile( QFile *file, QTextCodec *codec, QString fileName )
 {
     inputFile     = file;
     inputEncoding = codec;
+    inputDetector = NULL;
     inputFileName = fileName;
+    reloading     = false;
+    reloadBase.clear();
+}
+
+
+// ----------------------------------------------------------------------------
+// Have the encoding of the next file guessed by the given detector, replacing
+// the codec passed to setFile() if the guess is good enough.  (Must be called
+// after setFile.)
+//
+void QeOpenThread::setEncodingDetector( const QeEncodingDetector *detector )
+{
+    inputDetector = detector;
+}
+
+
+// ----------------------------------------------------------------------------
+// Reload the next file into an existing document with the given text, rather
+// than building a new one.  The only result is then the list of changes that
+// turn the text into the file's contents (see takeChanges).  (Must be called
+// after setFile.)
+//
+void QeOpenThread::setReloadText( const QString &text )
+{
+    reloading  = true;
+    reloadBase = text;
+}
+
+
+// ----------------------------------------------------------------------------
+bool QeOpenThread::isReload() const
+{
+    return reloading;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set the default font and text options for the document, which should match
+// the editor's (changing them afterwards would mean laying it out again).
+//
+void QeOpenThread::setDocumentDefaults( const QFont &font, const QTextOption &option )
+{
+    documentFont   = font;
+    documentOption = option;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the document built by the last run, which then belongs to the
+// caller; or NULL if there is none (e.g. because it was cancelled).
+//
+QTextDocument *QeOpenThread::takeDocument()
+{
+    QTextDocument *finished = document;
+    document = NULL;
+    return finished;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the changes found by the last reload, in order; they must be made
+// from last to first.
+//
+QList<QeTextChange> QeOpenThread::takeChanges()
+{
+    QList<QeTextChange> changes = reloadChanges;
+    reloadChanges.clear();
+    return changes;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if the file just loaded started with a Unicode byte-order mark
+// (which is not included in the text).
+//
+bool QeOpenThread::hasByteOrderMark() const
+{
+    return inputHasBOM;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the codec the file just loaded was decoded with.  If it started with
+// a byte-order mark, that decided the encoding rather than the codec passed
+// to setFile().
+//
+QTextCodec *QeOpenThread::codec() const
+{
+    return inputEncoding;
 }
 
 
 // ----------------------------------------------------------------------------
-QString QeOpenThread::getText()
+// Returns the compression format of the file just loaded (if any).
+//
+QeCompression::Format QeOpenThread::compression() const
+{
+    return inputCompression;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the number of bytes of the file that went into the last document.
+// (The file may have grown while it was being read.)  For a compressed file
+// this counts the decompressed data.
+//
+qint64 QeOpenThread::bytesRead() const
 {
-    return fullText;
+    return inputRead;
 }
 
 
@@ -83,6 +689,27 @@ void QeOpenThread::setProgress( qint64 progress, qint64 total )
 }
 
 
+// ----------------------------------------------------------------------------
+// Returns the line ends most used in the file loaded (EOL_LF or EOL_CRLF); or
+// the platform's own, if it had none.
+//
+int QeOpenThread::lineEnds() const
+{
+    if ( !lineFeeds )
+        return PLATFORM_NEWLINE;
+    return ( crlfLineEnds > lineFeeds - crlfLineEnds ) ? EOL_CRLF : EOL_LF;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns true if the file loaded had both LF and CR+LF line ends.
+//
+bool QeOpenThread::hasMixedLineEnds() const
+{
+    return ( crlfLineEnds > 0 ) && ( crlfLineEnds < lineFeeds );
+}
+
+
 // ----------------------------------------------------------------------------
 void QeOpenThread::cancel()
 {
@@ -96,6 +723,73 @@ void QeOpenThread::cancel()
 // QeSaveThread
 //
 
+// ----------------------------------------------------------------------------
+// Make sure everything written to the (still open) file has reached the disk,
+// as far as the policy asks.  Returns false if the OS reports an error.
+//
+static bool syncFile( QFile *file, QeSaveThread::SyncPolicy policy )
+{
+    if ( policy == QeSaveThread::SyncNever )
+        return true;
+#if defined( Q_OS_WIN32 )
+    // There's no data-only variant here
+    return FlushFileBuffers( (HANDLE) _get_osfhandle( file->handle() ));
+#elif defined( Q_OS_UNIX ) && !defined( __OS2__ )
+#if defined( _POSIX_SYNCHRONIZED_IO ) && ( _POSIX_SYNCHRONIZED_IO > 0 ) && !defined( Q_OS_MAC )
+    if ( policy == QeSaveThread::SyncData )
+        return ( fdatasync( file->handle() ) == 0 );
+#endif
+    return ( fsync( file->handle() ) == 0 );
+#else
+    Q_UNUSED( file );
+    return true;
+#endif
+}
+
+
+// ----------------------------------------------------------------------------
+// Replace the file 'target' with 'tempName', keeping the original's
+// permissions (and on Windows, its attributes and security).  The rename
+// is atomic, so a crash leaves one file or the other, never half of each.
+//
+static bool replaceFile( const QString &tempName, const QString &target, QeSaveThread::SyncPolicy policy )
+{
+    QFile::setPermissions( tempName, QFile::permissions( target ));
+#if defined( Q_OS_WIN32 )
+    Q_UNUSED( policy );
+    if ( ReplaceFileW( (LPCWSTR) target.utf16(), (LPCWSTR) tempName.utf16(), NULL,
+                       REPLACEFILE_IGNORE_MERGE_ERRORS, NULL, NULL ))
+        return true;
+    return MoveFileExW( (LPCWSTR) tempName.utf16(), (LPCWSTR) target.utf16(),
+                        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH );
+#else
+    QByteArray from = QFile::encodeName( tempName );
+    QByteArray to   = QFile::encodeName( target );
+#if defined( Q_OS_UNIX ) && !defined( __OS2__ )
+    // Keep the group too, if we're allowed to (the owner is already ours)
+    struct stat st;
+    if (( stat( to.constData(), &st ) == 0 ) && ( chown( from.constData(), (uid_t) -1, st.st_gid ) != 0 ))
+        qWarning("Could not keep the group of %s", to.constData() );
+#endif
+    if ( ::rename( from.constData(), to.constData() ) != 0 )
+        return false;
+#if defined( Q_OS_UNIX ) && !defined( __OS2__ )
+    // ...and the rename itself only sticks once the directory is written
+    if ( policy == QeSaveThread::SyncFull ) {
+        int dir = ::open( QFile::encodeName( QFileInfo( target ).absolutePath() ).constData(), O_RDONLY );
+        if ( dir != -1 ) {
+            fsync( dir );
+            ::close( dir );
+        }
+    }
+#else
+    Q_UNUSED( policy );
+#endif
+    return true;
+#endif
+}
+
+
 // ----------------------------------------------------------------------------
 QeSaveThread::QeSaveThread()
 {
@@ -103,50 +797,117 @@ QeSaveThread::QeSaveThread()
     outputEncoding = NULL;
     outputFileName = "";
     bExists        = FALSE;
+    bWriteBOM      = FALSE;
+    syncPolicy     = SyncData;
+    outputLineEnds = PLATFORM_NEWLINE;
+    tailPosition   = 0;
+    tailLine       = 0;
+    tailFileLines  = 0;
+    tailSafeFallback = false;
+    textStart      = 0;
+    rewriteOffset  = 0;
+    outputCompression = QeCompression::None;
+    compressor     = NULL;
+    fileBytes      = 0;
+    invalidChars   = 0;
 }
 
 
 // ----------------------------------------------------------------------------
+// The text is encoded a block at a time, and each block written out (through
+// the compressor, if the file is to be compressed) before the next; so the
+// only copies of the text made are one block's worth.
+//
 void QeSaveThread::run()
 {
+    QeTraceSpan span("QeSaveThread::run");
     stop = false;
     if ( outputFile != NULL ) {
-        QTextStream out( outputFile );
-
-        /* TODO
-        if platform_newline == DOS and requested_newline == UNIX:
-            fulltext.replace("\r\n", "\n");
-        else if platform_newline == UNIX and requested_newline == DOS:
-            fulltext.replace("\n", "\r\n");
-        */
-
-        qint64 total = fullText.size();
-        qint64 written = 0;
-        if ( outputEncoding != NULL )
-            out.setCodec( outputEncoding );
-
-        if ( total > FILE_CHUNK_SIZE ) {
-            qint64 offset = 0;
-            while ( !stop && ( offset < total )) {
-                out << fullText.mid( offset, FILE_CHUNK_SIZE );
-                out.flush();
-                written = out.pos();
-                offset += FILE_CHUNK_SIZE;
-                setProgress( written, total );
+        qint64 written;
+        invalidChars = 0;
+        invalidOffsets.clear();
+        fileBytes = 0;
+        if ( outputCompression != QeCompression::None )
+            compressor = new QeCompressor( outputCompression );
+
+        // For an incremental save, the text from the first changed line on is
+        // written over the end of the existing file; if that can't be done
+        // after all, the whole file is saved as usual (see setTail).
+        textStart     = 0;
+        rewriteOffset = 0;
+        if ( tailLine > 0 ) {
+            tailPosition -= qLowerBound( textBreaks.constBegin(), textBreaks.constEnd(), tailPosition ) -
+                            textBreaks.constBegin();
+            joinSegments();
+            qint64 offset = findTail( outputLineEnds == EOL_CRLF );
+            if (( offset > 0 ) && outputFile->seek( offset )) {
+                rewriteOffset = offset;
+                fileBytes     = offset;
             }
+            else {
+                textStart = 0;
+                QString target;
+                QFile *file = tailSafeFallback ? createTempFile( outputFileName, &target ) : NULL;
+                if ( file ) {
+                    outputFile->close();
+                    delete outputFile;
+                    outputFile    = file;
+                    replaceTarget = target;
+                }
+                else
+                    outputFile->seek( 0 );
+            }
+            span.setCount("rewriteOffset", rewriteOffset );
+            tailLine = 0;
         }
-        else {
-            out << fullText;
-            out.flush();
-            written = out.pos();
+        joinSegments();
+
+        QeUnicodeConverter::Format format = QeUnicodeConverter::formatForCodec( outputEncoding );
+        const QeOS2Codec *os2Codec = dynamic_cast<const QeOS2Codec *>( outputEncoding );
+        if ( format != QeUnicodeConverter::Unsupported )
+            written = writeUnicode( format );
+        else if ( os2Codec )
+            written = writeSingleByte( os2Codec );
+        else
+            written = writeEncoded();
+
+        if ( compressor ) {
+            compressed.clear();
+            if (( written != -1 ) && ( !compressor->finish( compressed ) ||
+                                       ( outputFile->write( compressed ) != compressed.size() )))
+                written = -1;
+            fileBytes += compressed.size();
+            compressed.clear();
+            delete compressor;
+            compressor = NULL;
         }
+        if ( written != -1 )
+            written = fileBytes;
+        span.setCount("bytes", fileBytes );
+
+        // The editor has its own copy; don't hold on to this one until the next save
+        fullText = QString();
 
         // In case an existing file is being shrunk, make sure it's resized to the new contents
         if ( written != -1 ) outputFile->resize( written );
 
         outputFile->flush();
+        if (( written != -1 ) && !syncFile( outputFile, syncPolicy ))
+            written = -1;
+        QString tempName = outputFile->fileName();
         outputFile->close();
         delete outputFile;
+        outputFile = NULL;
+
+        // If we wrote to a new file, it now takes the place of the old one;
+        // if anything went wrong, the old one is left as it was.
+        if ( !replaceTarget.isEmpty() ) {
+            if (( written == -1 ) || !replaceFile( tempName, replaceTarget, syncPolicy )) {
+                QFile::remove( tempName );
+                written = -1;
+            }
+            replaceTarget = QString();
+        }
 
         if ( !bExists ) {
 #ifdef __OS2__
@@ -168,37 +929,1030 @@ printf("Clearing default EAs\n");
 
 
 // ----------------------------------------------------------------------------
-void QeSaveThread::setFile( QFile *file, QTextCodec *codec, QString fileName, bool bExisting )
+// Returns the given (encoded) bytes with every LF byte turned into CR+LF.
+//
+static QByteArray expandLineFeeds( const QByteArray &bytes )
 {
-    outputFile     = file;
-    outputEncoding = codec;
-    outputFileName = fileName;
-    bExists        = bExisting;
+    const char *data = bytes.constData();
+    const char *end  = data + bytes.size();
+    const char *lf   = (const char *) memchr( data, '\n', bytes.size() );
+    if ( !lf )
+        return bytes;
+
+    QByteArray expanded;
+    expanded.resize( bytes.size() * 2 );
+    char *out = expanded.data();
+    while ( lf ) {
+        memcpy( out, data, lf - data );
+        out += lf - data;
+        *out++ = '\r';
+        *out++ = '\n';
+        data = lf + 1;
+        lf = (const char *) memchr( data, '\n', end - data );
+    }
+    memcpy( out, data, end - data );
+    out += end - data;
+    expanded.truncate( out - expanded.constData() );
+    return expanded;
 }
 
 
 // ----------------------------------------------------------------------------
-void QeSaveThread::setText( const QString &text )
+// Returns true if the codec encodes LF as the single byte 0x0A (so that line
+// ends can be expanded after encoding); true of nearly everything but UTF-16
+// and UTF-32 and the EBCDIC codepages.
+//
+static bool encodesLineFeedAsByte( QTextCodec *codec )
 {
-    fullText = text;
+    QTextCodec::ConverterState state( QTextCodec::IgnoreHeader );
+    QChar lf('\n');
+    return codec->fromUnicode( &lf, 1, &state ) == QByteArray( 1, '\n');
 }
 
 
 // ----------------------------------------------------------------------------
-void QeSaveThread::setProgress( qint64 progress, qint64 total )
+// Encode text with a Qt codec, writing CR+LF line ends if 'bCRLF' is set.
+// The text is encoded in one go where the line ends can be expanded after
+// encoding, or else a line at a time with a CR+LF pair after each.
+//
+static QByteArray encodeLines( QTextCodec *codec, const QChar *chars, int length,
+                               QTextCodec::ConverterState *state, bool bCRLF, bool lfIsByte )
 {
-    int percent = 0;
-    if ( progress && total )
-        percent = ( progress * 100 ) / total;
-    emit updateProgress( percent );
+    if ( !bCRLF )
+        return codec->fromUnicode( chars, length, state );
+    if ( lfIsByte )
+        return expandLineFeeds( codec->fromUnicode( chars, length, state ));
+
+    static const QChar crlf[ 2 ] = { QChar('\r'), QChar('\n') };
+    QByteArray bytes;
+    while ( length > 0 ) {
+        int n = qeFindLineFeed( (const ushort *) chars, length );
+        if ( n < 0 ) {
+            bytes += codec->fromUnicode( chars, length, state );
+            break;
+        }
+        bytes += codec->fromUnicode( chars, n, state );
+        bytes += codec->fromUnicode( crlf, 2, state );
+        chars  += n + 1;
+        length -= n + 1;
+    }
+    return bytes;
 }
 
 
 // ----------------------------------------------------------------------------
-void QeSaveThread::cancel()
+// Write the text using the selected Qt codec, a block at a time.  This does
+// what QTextStream would (no byte-order mark), but with the line ends chosen
+// by setLineEnds(), and the output goes through writeOutput() so that it can
+// be compressed.  Returns the number of bytes encoded (or -1 on error).
+//
+qint64 QeSaveThread::writeEncoded()
 {
-    stop = true;
+    QTextCodec *codec = outputEncoding ? outputEncoding : QTextCodec::codecForLocale();
+    QTextCodec::ConverterState state( QTextCodec::IgnoreHeader );
+    qint64 total = fullText.size();
+    QeTraceSpan span("encodeAndWrite");
+    span.setCount("characters", total );
+    qint64 written = 0;
+
+    // Line ends are converted here (see encodeLines), not by the device
+    bool bCRLF = ( outputLineEnds == EOL_CRLF );
+    bool lfIsByte = bCRLF && encodesLineFeedAsByte( codec );
+    outputFile->setTextModeEnabled( false );
+
+    for ( qint64 offset = textStart; !stop && ( offset < total ); offset += FILE_CHUNK_SIZE ) {
+        int length = (int) qMin( (qint64) FILE_CHUNK_SIZE, total - offset );
+        QByteArray bytes = encodeLines( codec, fullText.constData() + offset, length, &state, bCRLF, lfIsByte );
+
+        if ( !writeOutput( bytes ))
+            return -1;
+        written += bytes.size();
+        setProgress( offset + length - textStart, total - textStart );
+    }
+    return written;
 }
 
 
+// ----------------------------------------------------------------------------
+// Write the text as UTF-8 or UTF-16 using our own converter, which is a good
+// deal faster than QTextStream with the Qt codec.  Returns the number of
+// bytes written (or -1 on error).
+//
+qint64 QeSaveThread::writeUnicode( QeUnicodeConverter::Format format )
+{
+    QeUnicodeConverter encoder( format );
+    qint64 total = fullText.size();
+    QeTraceSpan span("encodeAndWrite");
+    span.setCount("characters", total );
+    qint64 written = 0;
+
+    // The converter writes the line ends itself, so the device mustn't
+    encoder.setCRLF( outputLineEnds == EOL_CRLF );
+    outputFile->setTextModeEnabled( false );
 
+    if ( bWriteBOM && !textStart ) {
+        QByteArray bom = encoder.byteOrderMark();
+        if ( !writeOutput( bom ))
+            return -1;
+        written += bom.size();
+    }
+
+    for ( qint64 offset = textStart; !stop && ( offset < total ); offset += FILE_CHUNK_SIZE ) {
+        int length = (int) qMin( (qint64) FILE_CHUNK_SIZE, total - offset );
+        QByteArray bytes = encoder.fromUnicode( fullText.constData() + offset, length );
+        if ( offset + length >= total )
+            bytes += encoder.finishEncoding();
+
+        if ( !writeOutput( bytes ))
+            return -1;
+        written += bytes.size();
+        setProgress( offset + length - textStart, total - textStart );
+    }
+    invalidChars = encoder.invalidCount();
+    return written;
+}
+
+
+// ----------------------------------------------------------------------------
+// Write the text in one of our own OS/2 codepages.  This calls the codec
+// directly, a block at a time, so that we can collect the positions of any
+// characters which it can't encode.  Returns the number of bytes written (or
+// -1 on error).
+//
+qint64 QeSaveThread::writeSingleByte( const QeOS2Codec *codec )
+{
+    QTextCodec::ConverterState state;
+    QVector<int> positions;
+    qint64 total = fullText.size();
+    QeTraceSpan span("encodeAndWrite");
+    span.setCount("characters", total );
+    qint64 written = 0;
+
+    // LF only ever encodes to byte 0x0A in these codepages, so line ends can
+    // be converted after encoding.
+    bool bCRLF = ( outputLineEnds == EOL_CRLF );
+    outputFile->setTextModeEnabled( false );
+
+    for ( qint64 offset = textStart; !stop && ( offset < total ); offset += FILE_CHUNK_SIZE ) {
+        int length = (int) qMin( (qint64) FILE_CHUNK_SIZE, total - offset );
+        positions.clear();
+        QByteArray bytes = codec->convertFromUnicode( fullText.constData() + offset, length, &state, &positions );
+        for ( int i = 0; ( i < positions.size() ) && ( invalidOffsets.size() < SAVE_MAX_INVALID ); i++ )
+            invalidOffsets.append( offset + positions.at( i ));
+        if ( bCRLF )
+            bytes = expandLineFeeds( bytes );
+
+        if ( !writeOutput( bytes ))
+            return -1;
+        written += bytes.size();
+        setProgress( offset + length - textStart, total - textStart );
+    }
+    invalidChars = state.invalidChars;
+    return written;
+}
+
+
+// ----------------------------------------------------------------------------
+// Write a block of encoded text to the file, compressing it first if need be.
+// Returns false on error.
+//
+bool QeSaveThread::writeOutput( const QByteArray &bytes )
+{
+    if ( !compressor ) {
+        if ( outputFile->write( bytes ) != bytes.size() )
+            return false;
+        fileBytes += bytes.size();
+        return true;
+    }
+
+    compressed.clear();
+    if ( !compressor->compress( bytes.constData(), bytes.size(), compressed ))
+        return false;
+    if ( outputFile->write( compressed ) != compressed.size() )
+        return false;
+    fileBytes += compressed.size();
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+void QeSaveThread::setFile( QFile *file, QTextCodec *codec, QString fileName, bool bExisting )
+{
+    outputFile     = file;
+    outputEncoding = codec;
+    outputFileName = fileName;
+    bExists        = bExisting;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set the file which the one passed to setFile() replaces once it's written
+// (see createTempFile()); an empty name means the file is written in place.
+//
+void QeSaveThread::setReplaceTarget( const QString &target )
+{
+    replaceTarget = target;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set how far to go in making sure the file is on disk before reporting it
+// saved.
+//
+void QeSaveThread::setSyncPolicy( SyncPolicy policy )
+{
+    syncPolicy = policy;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set the line ends to write, EOL_LF or EOL_CRLF.  (The text itself always has
+// LF only.)
+//
+void QeSaveThread::setLineEnds( int eol )
+{
+    outputLineEnds = eol;
+}
+
+
+// ----------------------------------------------------------------------------
+// Ask for only the end of the file to be rewritten: the text from the start
+// of line 'line' (which is at document position 'position') onwards, where
+// everything before that line is the same as when the file was last loaded
+// or saved, and the file (which then had 'fileLines' lines) hasn't changed
+// since.  The file passed to setFile() must be the existing file, opened
+// for reading and writing.  Applies to the next save only.
+//
+// Writing the tail in place is not atomic, but it only touches the end of the
+// file.  If the place to start can't be found, the whole text is written after
+// all: if 'safeFallback' is set, to a new file which replaces the existing one
+// (see createTempFile) where possible, or else over the existing file.
+//
+void QeSaveThread::setTail( int position, int line, int fileLines, bool safeFallback )
+{
+    tailPosition     = position;
+    tailLine         = line;
+    tailFileLines    = fileLines;
+    tailSafeFallback = safeFallback;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the file offset from which the last file saved was rewritten; 0 if
+// it was written in full.
+//
+qint64 QeSaveThread::tailOffset() const
+{
+    return rewriteOffset;
+}
+
+
+// ----------------------------------------------------------------------------
+// Create and open a new file alongside the existing file 'fileName', to save
+// to in its place.  'target' receives the file that should then be replaced
+// (with any symbolic links resolved, so that the links themselves survive).
+//
+// Returns NULL where the file should simply be written over instead: on OS/2
+// (writing in place is what keeps the EAs), for a file with other hard links
+// or belonging to another user, or if the directory isn't writable.
+//
+QFile *QeSaveThread::createTempFile( const QString &fileName, QString *target )
+{
+#ifdef __OS2__
+    Q_UNUSED( fileName );
+    Q_UNUSED( target );
+    return NULL;
+#else
+    QFileInfo info( fileName );
+    QString path = info.canonicalFilePath();
+    if ( path.isEmpty() || !info.isWritable() )
+        return NULL;
+#if defined( Q_OS_UNIX )
+    struct stat st;
+    if (( stat( QFile::encodeName( path ).constData(), &st ) != 0 ) ||
+        ( st.st_nlink > 1 ) || ( st.st_uid != geteuid() ))
+        return NULL;
+#endif
+    QTemporaryFile *file = new QTemporaryFile( path + SAVE_TEMP_SUFFIX );
+    file->setAutoRemove( false );
+    if ( !file->open() ) {
+        delete file;
+        return NULL;
+    }
+    file->setTextModeEnabled( true );
+    *target = path;
+    return file;
+#endif
+}
+
+
+// ----------------------------------------------------------------------------
+void QeSaveThread::setText( const QString &text )
+{
+    fullText = text;
+    textBreaks.clear();
+}
+
+
+// ----------------------------------------------------------------------------
+// Set the text from an editor snapshot (see QeTextEdit::snapshot()); the
+// segment breaks at the given positions are taken out before it's written.
+//
+void QeSaveThread::setText( const QString &text, const QVector<int> &breaks )
+{
+    fullText   = text;
+    textBreaks = breaks;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set whether a byte-order mark should be written at the start of the file;
+// only applies to UTF-8 and UTF-16.
+//
+void QeSaveThread::setByteOrderMark( bool bWrite )
+{
+    bWriteBOM = bWrite;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set the format to compress the next file in, or QeCompression::None.
+//
+void QeSaveThread::setCompression( QeCompression::Format format )
+{
+    outputCompression = format;
+}
+
+
+// ----------------------------------------------------------------------------
+QeCompression::Format QeSaveThread::compression() const
+{
+    return outputCompression;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the number of characters in the last file saved which could not be
+// represented in its encoding (if known; this is only counted for UTF-8/16 and
+// our own OS/2 codepages).
+//
+qint64 QeSaveThread::invalidCount() const
+{
+    return invalidChars;
+}
+
+
+// ----------------------------------------------------------------------------
+// Returns the text positions of the first few characters counted above, where
+// available (i.e. for the OS/2 codepages).
+//
+QVector<qint64> QeSaveThread::invalidPositions() const
+{
+    return invalidOffsets;
+}
+
+
+// ----------------------------------------------------------------------------
+// Find where in the existing file to start an incremental save (see setTail()),
+// by counting line ends back from the end of the file; so the time taken goes
+// with the amount of the file after the first change, not its size.  Then
+// make sure that the line before is still what the text has there, encoded.
+//
+// Returns that offset, having set textStart to the matching text position; or
+// -1 if the whole file has to be written after all (including for encodings
+// where a line end might be part of some other character).
+//
+qint64 QeSaveThread::findTail( bool bCRLF )
+{
+    QeUnicodeConverter::Format format = QeUnicodeConverter::formatForCodec( outputEncoding );
+    if (( tailPosition <= 0 ) || ( tailPosition > fullText.size() ) ||
+        ( fullText.at( tailPosition - 1 ) != QLatin1Char('\n')) ||
+        !QeDecodePipeline::isSplittable( outputEncoding, format ))
+        return -1;
+    int  unitSize  = ( format == QeUnicodeConverter::Utf16LE ) || ( format == QeUnicodeConverter::Utf16BE ) ? 2 : 1;
+    bool bigEndian = ( format == QeUnicodeConverter::Utf16BE );
+
+    bool bTextMode = outputFile->isTextModeEnabled();
+    outputFile->setTextModeEnabled( false );
+
+    // The line starts after the (fileLines - line)'th line end from the end
+    int wanted = tailFileLines - tailLine;
+    qint64 offset = -1;
+    qint64 end = outputFile->size();
+    QVector<int> found;
+    while (( wanted > 0 ) && ( end > 0 ) && !stop ) {
+        qint64 start = qMax( (qint64) 0, end - FILE_CHUNK_SIZE ) & ~(qint64) 1;
+        if ( !outputFile->seek( start ))
+            break;
+        QByteArray block = outputFile->read( end - start );
+        if ( block.size() != end - start )
+            break;
+        found.clear();
+        for ( int pos = 0; ; ) {
+            int n = QeIndexThread::findNewline( block.constData() + pos, block.size() - pos, unitSize, bigEndian );
+            if ( n < 0 )
+                break;
+            found.append( pos + n );
+            pos += n + unitSize;
+        }
+        if ( found.size() >= wanted ) {
+            offset = start + found.at( found.size() - wanted ) + unitSize;
+            break;
+        }
+        wanted -= found.size();
+        end = start;
+    }
+
+    // Compare (up to SAVE_VERIFY_SIZE characters of) the line before
+    if ( offset > 0 ) {
+        int limit = qMax( 0, tailPosition - SAVE_VERIFY_SIZE );
+        int from = tailPosition - 1;
+        while (( from > limit ) && ( fullText.at( from - 1 ) != QLatin1Char('\n')))
+            from--;
+        if ( fullText.at( from ).isLowSurrogate() )
+            from++;
+        QByteArray expected = encodeText( from, tailPosition - from, bCRLF );
+        if (( expected.size() > offset ) || !outputFile->seek( offset - expected.size() ) ||
+            ( outputFile->read( expected.size() ) != expected ))
+            offset = -1;
+    }
+
+    outputFile->setTextModeEnabled( bTextMode );
+    if ( offset > 0 )
+        textStart = tailPosition;
+    return offset;
+}
+
+
+// ----------------------------------------------------------------------------
+// Encode part of the text the same way the write methods do.
+//
+QByteArray QeSaveThread::encodeText( int start, int length, bool bCRLF ) const
+{
+    QeUnicodeConverter::Format format = QeUnicodeConverter::formatForCodec( outputEncoding );
+    if ( format != QeUnicodeConverter::Unsupported ) {
+        QeUnicodeConverter encoder( format );
+        encoder.setCRLF( bCRLF );
+        QByteArray bytes = encoder.fromUnicode( fullText.constData() + start, length );
+        return bytes + encoder.finishEncoding();
+    }
+    QTextCodec *codec = outputEncoding ? outputEncoding : QTextCodec::codecForLocale();
+    QTextCodec::ConverterState state( QTextCodec::IgnoreHeader );
+    return encodeLines( codec, fullText.constData() + start, length, &state,
+                        bCRLF, bCRLF && encodesLineFeedAsByte( codec ));
+}
+
+
+// ----------------------------------------------------------------------------
+// Remove the segment breaks from the text, closing up the gaps in place.
+//
+void QeSaveThread::joinSegments()
+{
+    if ( textBreaks.isEmpty() )
+        return;
+    QChar *data = fullText.data();
+    int length = fullText.size();
+    int out = textBreaks.first();
+    for ( int i = 0; i < textBreaks.size(); i++ ) {
+        int from = textBreaks.at( i ) + 1;
+        int to = ( i + 1 < textBreaks.size() ) ? textBreaks.at( i + 1 ) : length;
+        memmove( data + out, data + from, ( to - from ) * sizeof( QChar ));
+        out += to - from;
+    }
+    fullText.truncate( out );
+    textBreaks.clear();
+}
+
+
+// ----------------------------------------------------------------------------
+void QeSaveThread::setProgress( qint64 progress, qint64 total )
+{
+    int percent = 0;
+    if ( progress && total )
+        percent = ( progress * 100 ) / total;
+    emit updateProgress( percent );
+}
+
+
+// ----------------------------------------------------------------------------
+void QeSaveThread::cancel()
+{
+    stop = true;
+}
+
+
+
+// ============================================================================
+// QeIndexThread
+//
+
+QeIndexThread::QeIndexThread()
+{
+    startOffset      = 0;
+    newlineSize      = 1;
+    newlineBigEndian = false;
+    lines            = 1;
+    scanned          = 0;
+    total            = 0;
+    done             = false;
+    stop             = false;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set the file to index.  'start' is the offset of the first line, and the
+// line ends are either single bytes or (for UTF-16) 16-bit units in the given
+// byte order.
+//
+void QeIndexThread::setFile( const QString &fileName, qint64 start, int unitSize, bool bigEndian )
+{
+    QMutexLocker locker( &mutex );
+    indexFileName    = fileName;
+    startOffset      = start;
+    newlineSize      = unitSize;
+    newlineBigEndian = bigEndian;
+    entries.clear();
+    entries.append( start );
+    lines   = 1;
+    scanned = 0;
+    total   = 0;
+    done    = false;
+}
+
+
+// ----------------------------------------------------------------------------
+void QeIndexThread::run()
+{
+    stop = false;
+
+    QFile file( indexFileName );
+    if ( !file.open( QIODevice::ReadOnly ) || !file.seek( startOffset )) {
+        QMutexLocker locker( &mutex );
+        done = true;
+        locker.unlock();
+        emit indexUpdated();
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QVector<qint64> found;
+    qint64 newlines = 0;
+    qint64 pos = startOffset;
+    qint64 size = file.size();
+    {
+        QMutexLocker locker( &mutex );
+        total = size;
+    }
+
+    // (FILE_CHUNK_SIZE is even, so UTF-16 line ends never straddle a block)
+    QByteArray block;
+    while ( !stop && ( pos < size )) {
+        block = file.read( FILE_CHUNK_SIZE );
+        if ( block.isEmpty() )
+            break;
+        const char *data = block.constData();
+        int length = block.size();
+        int offset = 0;
+        for ( ;; ) {
+            int n = findNewline( data + offset, length - offset, newlineSize, newlineBigEndian );
+            if ( n < 0 )
+                break;
+            offset += n + newlineSize;
+            if ( !( ++newlines % INDEX_INTERVAL ))
+                found.append( pos + offset );
+        }
+        pos += length;
+
+        QMutexLocker locker( &mutex );
+        entries += found;
+        lines   = newlines + 1;
+        scanned = pos;
+        found.clear();
+        locker.unlock();
+
+        // Don't flood the GUI thread with updates
+        if ( timer.elapsed() > 100 ) {
+            emit indexUpdated();
+            timer.restart();
+        }
+    }
+    file.close();
+
+    QMutexLocker locker( &mutex );
+    done = !stop;
+    locker.unlock();
+    emit indexUpdated();
+}
+
+
+// ----------------------------------------------------------------------------
+// Copy any entries not yet in the given index into it, and return the number
+// of lines found so far.  'complete' is set once the whole file is indexed.
+//
+qint64 QeIndexThread::readIndex( QVector<qint64> &index, bool *complete ) const
+{
+    QMutexLocker locker( &mutex );
+    *complete = done;
+    for ( int i = index.size(); i < entries.size(); i++ )
+        index.append( entries.at( i ));
+    return lines;
+}
+
+
+// ----------------------------------------------------------------------------
+int QeIndexThread::progress() const
+{
+    QMutexLocker locker( &mutex );
+    if ( !total )
+        return 0;
+    return (int)(( scanned * 100 ) / total );
+}
+
+
+// ----------------------------------------------------------------------------
+void QeIndexThread::cancel()
+{
+    stop = true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Return the offset of the first line end in the given data, or -1 if there
+// is none.  For UTF-16, the data must start on a 16-bit boundary.
+//
+int QeIndexThread::findNewline( const char *data, int length, int unitSize, bool bigEndian )
+{
+    const char *p   = data,
+               *end = data + length;
+    while ( p < end ) {
+        const char *found = (const char *) memchr( p, '\n', end - p );
+        if ( !found )
+            return -1;
+        int offset = found - data;
+        if ( unitSize == 1 )
+            return offset;
+        if ( bigEndian ) {
+            if (( offset & 1 ) && !data[ offset - 1 ])
+                return offset - 1;
+        }
+        else if ( !( offset & 1 ) && ( offset + 1 < length ) && !data[ offset + 1 ] )
+            return offset;
+        p = found + 1;
+    }
+    return -1;
+}
+
+
+
+// ============================================================================
+// QeFindThread
+//
+
+QeFindThread::QeFindThread()
+{
+    findCodec        = NULL;
+    newlineSize      = 1;
+    newlineBigEndian = false;
+    searchId         = 0;
+    findBackwards    = false;
+    startLine        = 0;
+    startOffset      = 0;
+    startColumn      = 0;
+    blockStart       = -1;
+    found            = false;
+    foundLine        = 0;
+    foundOffset      = 0;
+    foundStart       = 0;
+    foundLength      = 0;
+    stop             = false;
+}
+
+
+// ----------------------------------------------------------------------------
+// Set the file to search, the codec to decode it with, and the size and byte
+// order of its line ends (as for QeIndexThread).
+//
+void QeFindThread::setFile( const QString &fileName, QTextCodec *codec, int unitSize, bool bigEndian )
+{
+    findFileName     = fileName;
+    findCodec        = codec;
+    newlineSize      = unitSize;
+    newlineBigEndian = bigEndian;
+    unicodeDecoder.setFormat( QeUnicodeConverter::formatForCodec( codec ));
+}
+
+
+// ----------------------------------------------------------------------------
+// Set up the next search.  Going forwards, it starts from 'column' in 'line',
+// which starts at 'offset'.  Going backwards, a match in 'line' must start
+// before 'column' (anywhere if it is -1), and the earlier lines are located
+// using 'index', the viewer's line index.  'id' is passed back by
+// searchDone(), so that the result of a search which has been superseded can
+// be told apart.
+//
+void QeFindThread::setSearch( int id, const QRegExp &pattern, bool backwards, qint64 line, qint64 offset, int column, const QVector<qint64> &index )
+{
+    searchId      = id;
+    findPattern   = pattern;
+    findBackwards = backwards;
+    startLine     = line;
+    startOffset   = offset;
+    startColumn   = column;
+    lineIndex     = index;
+
+    // A fixed, case-sensitive string can be looked for in the raw bytes
+    // first, so that only lines which might match get decoded.
+    needle.clear();
+    if (( pattern.patternSyntax() == QRegExp::FixedString ) &&
+        ( pattern.caseSensitivity() == Qt::CaseSensitive ))
+    {
+        QTextCodec::ConverterState state( QTextCodec::IgnoreHeader );
+        needle = findCodec->fromUnicode( pattern.pattern().constData(), pattern.pattern().size(), &state );
+        if ( state.invalidChars )
+            needle.clear();
+    }
+
+    QMutexLocker locker( &mutex );
+    found = false;
+}
+
+
+// ----------------------------------------------------------------------------
+void QeFindThread::run()
+{
+    stop = false;
+    block.clear();
+    blockStart = -1;
+
+    qint64 line   = -1,
+           offset = 0;
+    int    start  = -1,
+           length = 0;
+
+    file.setFileName( findFileName );
+    if ( file.open( QIODevice::ReadOnly )) {
+        QElapsedTimer timer;
+        timer.start();
+
+        if ( !findBackwards ) {
+            qint64 size = file.size();
+            qint64 i    = startLine,
+                   pos  = startOffset;
+            int from    = startColumn;
+            while ( !stop && ( pos >= 0 )) {
+                if ( timer.elapsed() > 100 ) {
+                    emit searchProgress( (int)((( pos - startOffset ) * 100 ) / qMax( size - startOffset, (qint64) 1 )));
+                    timer.restart();
+                }
+                qint64 next = searchLine( pos, from, -1, false, &start, &length );
+                if ( start >= 0 ) {
+                    line   = i;
+                    offset = pos;
+                    break;
+                }
+                from = 0;
+                pos  = next;
+                i++;
+            }
+        }
+        else {
+            // Each stretch of INDEX_INTERVAL lines is read forwards, keeping
+            // the last match before the starting point.
+            qint64 i    = startLine,
+                   top  = -1;           // where the first stretch starts
+            int before  = startColumn;
+            while ( !stop && ( i >= 0 ) && ( line < 0 )) {
+                qint64 first = ( i / INDEX_INTERVAL ) * INDEX_INTERVAL;
+                qint64 pos = lineOffset( first );
+                if ( top < 0 )
+                    top = pos;
+                if (( timer.elapsed() > 100 ) && ( top > 0 )) {
+                    emit searchProgress( (int)((( top - pos ) * 100 ) / top ));
+                    timer.restart();
+                }
+                for ( qint64 j = first; !stop && ( j <= i ) && ( pos >= 0 ); j++ ) {
+                    int limit = ( j < i ) ? -1 : before;
+                    if ( !limit )
+                        break;
+                    int s, l;
+                    qint64 next = searchLine( pos, 0, limit, true, &s, &l );
+                    if ( s >= 0 ) {
+                        line   = j;
+                        offset = pos;
+                        start  = s;
+                        length = l;
+                    }
+                    pos = next;
+                }
+                i = first - 1;
+                before = -1;
+            }
+        }
+        file.close();
+    }
+    block.clear();
+
+    QMutexLocker locker( &mutex );
+    found       = !stop && ( line >= 0 );
+    foundLine   = line;
+    foundOffset = offset;
+    foundStart  = start;
+    foundLength = length;
+    locker.unlock();
+    if ( !stop )
+        emit searchDone( searchId );
+}
+
+
+// ----------------------------------------------------------------------------
+// Return whether the last search found anything, and if so where: the line
+// number and offset of the line, and the column and length of the match.
+//
+bool QeFindThread::result( qint64 *line, qint64 *offset, int *start, int *length ) const
+{
+    QMutexLocker locker( &mutex );
+    *line   = foundLine;
+    *offset = foundOffset;
+    *start  = foundStart;
+    *length = foundLength;
+    return found;
+}
+
+
+// ----------------------------------------------------------------------------
+void QeFindThread::cancel()
+{
+    stop = true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Search the line which starts at 'pos' for a match starting at or after
+// column 'from' and, unless 'before' is -1, before column 'before'.  The first
+// such match is returned in 'start' and 'length', or the last one if 'last' is
+// set; 'start' is -1 if there is none.  Returns the offset of the next line,
+// or -1 if this is the last line or it wasn't read to the end (because a match
+// was found or none could be).
+//
+qint64 QeFindThread::searchLine( qint64 pos, int from, int before, bool last, int *start, int *length )
+{
+    *start  = -1;
+    *length = 0;
+
+    QTextCodec::ConverterState state;
+    unicodeDecoder.reset();
+    QString window;
+    int base = 0;           // column at which the window starts
+    qint64 next = -1;
+    bool lineEnd = false;
+
+    while ( !stop ) {
+        if ( !loadBlock( pos )) {
+            // End of file
+            window += decode( NULL, 0, &state, true );
+            lineEnd = true;
+        }
+        else {
+            // (the length is even, so UTF-16 line ends are always found)
+            int offset = (int)( pos - blockStart );
+            const char *data = block.constData() + offset;
+            int count = qMin( block.size() - offset, FIND_WINDOW_SIZE );
+            int n = QeIndexThread::findNewline( data, count, newlineSize, newlineBigEndian );
+            if ( n >= 0 ) {
+                count   = n;
+                lineEnd = true;
+                next    = pos + n + newlineSize;
+            }
+            if ( lineEnd && !base && window.isEmpty() && !needle.isEmpty() &&
+                 ( QByteArray::fromRawData( data, count ).indexOf( needle ) < 0 ))
+                return next;
+            window += decode( data, count, &state, lineEnd );
+            pos += count;
+        }
+        if ( lineEnd && window.endsWith( QLatin1Char('\r')))
+            window.chop( 1 );
+        if ( !lineEnd && ( window.size() < FIND_WINDOW_SIZE ))
+            continue;
+
+        // Matches must start in this window before the part which is searched
+        // again with the next one, so each start position is tried once with
+        // at least FIND_OVERLAP characters after it
+        int limit = lineEnd ? window.size() : window.size() - FIND_OVERLAP;
+        if ( before >= 0 )
+            limit = qMin( limit, before - base );
+        int i = qMax( from - base, 0 );
+        QRegExp::CaretMode caret = base ? QRegExp::CaretWontMatch : QRegExp::CaretAtZero;
+        if ( i < limit ) {
+            int match = last ? findPattern.lastIndexIn( window, limit - 1, caret ) :
+                               findPattern.indexIn( window, i, caret );
+            if (( match >= i ) && ( match < limit ) && findPattern.matchedLength() ) {
+                *start  = base + match;
+                *length = findPattern.matchedLength();
+                if ( !last )
+                    return -1;
+            }
+        }
+        if ( lineEnd )
+            return next;
+        if (( before >= 0 ) && ( base + limit >= before ))
+            return -1;
+
+        base  += window.size() - FIND_OVERLAP;
+        window = window.right( FIND_OVERLAP );
+    }
+    return -1;
+}
+
+
+// ----------------------------------------------------------------------------
+// Return the offset of the given line, or -1 if there is no such line.  This
+// reads forward from the nearest entry in the index.
+//
+qint64 QeFindThread::lineOffset( qint64 line )
+{
+    if ( lineIndex.isEmpty() || ( line < 0 ))
+        return -1;
+
+    qint64 entry = qMin( line / INDEX_INTERVAL, (qint64) lineIndex.size() - 1 );
+    qint64 known = entry * INDEX_INTERVAL;
+    qint64 pos   = lineIndex.at( entry );
+    while (( known < line ) && ( pos >= 0 ) && !stop ) {
+        pos = skipLine( pos );
+        known++;
+    }
+    return stop ? -1 : pos;
+}
+
+
+// ----------------------------------------------------------------------------
+// Return the offset of the line after the one which starts at 'pos', or -1 if
+// there is none.
+//
+qint64 QeFindThread::skipLine( qint64 pos )
+{
+    while ( loadBlock( pos )) {
+        int offset = (int)( pos - blockStart );
+        int n = QeIndexThread::findNewline( block.constData() + offset, block.size() - offset, newlineSize, newlineBigEndian );
+        if ( n >= 0 )
+            return pos + n + newlineSize;
+        pos += block.size() - offset;
+    }
+    return -1;
+}
+
+
+// ----------------------------------------------------------------------------
+// Make sure the block buffer contains the given offset.
+//
+bool QeFindThread::loadBlock( qint64 pos )
+{
+    if (( blockStart >= 0 ) && ( pos >= blockStart ) && ( pos < blockStart + block.size() ))
+        return true;
+
+    block.clear();
+    if ( file.seek( pos ))
+        block = file.read( FILE_CHUNK_SIZE );
+    blockStart = block.isEmpty() ? -1 : pos;
+    return ( blockStart >= 0 );
+}
+
+
+// ----------------------------------------------------------------------------
+// Decode the next part of a line, the same way as the viewer does.
+//
+QString QeFindThread::decode( const char *data, int length, QTextCodec::ConverterState *state, bool lineEnd )
+{
+    if ( unicodeDecoder.format() == QeUnicodeConverter::Unsupported )
+        return findCodec->toUnicode( data, length, state );
+
+    QString text = unicodeDecoder.toUnicode( data, length );
+    if ( lineEnd )
+        text += unicodeDecoder.finishDecoding();
+    return text;
+}
+
+
+
+// ============================================================================
+// QeFileCheckThread
+//
+
+QeFileCheckThread::QeFileCheckThread( const QStringList &files )
+    : fileNames( files )
+{
+}
+
+
+// ----------------------------------------------------------------------------
+void QeFileCheckThread::run()
+{
+    QStringList missing;
+    for ( int i = 0; i < fileNames.size(); i++ ) {
+        if ( !QFile::exists( fileNames.at( i )))
+            missing << fileNames.at( i );
+    }
+    if ( !missing.isEmpty() )
+        emit filesMissing( missing );
+}
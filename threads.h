@@ -25,9 +25,32 @@
 #include <QThread>
 #include <QFile>
 #include <QTextStream>
+#include <QTextCodec>
+#include <QTextDocument>
+#include <QTextCursor>
+#include <QTextOption>
+#include <QFont>
+#include <QMutex>
+#include <QRegExp>
+#include "simdcodec.h"
+#include "encodingdetector.h"
+#include "linediff.h"
+#include "compression.h"
+
+class QeDecodePipeline;
+#include "os2codec.h"
 
 
 #define FILE_CHUNK_SIZE  0x100000
+#define FILE_MAP_SIZE    0x4000000      // must be a multiple of FILE_CHUNK_SIZE
+#define FILE_PARALLEL_MIN ( 4 * FILE_CHUNK_SIZE )   // smaller files are decoded in one thread
+#define LOAD_PREVIEW_SIZE 0x10000       // characters to show before load completes
+#define SAVE_MAX_INVALID  1000          // max. positions of unencodable characters kept
+#define SAVE_TEMP_SUFFIX  ".qe-save-XXXXXX"     // appended to the name of a file being replaced
+#define SAVE_VERIFY_SIZE  0x10000       // max. characters compared before an incremental save
+#define INDEX_INTERVAL    1024          // lines between entries in a line index
+#define FIND_WINDOW_SIZE  0x10000       // characters of a long line searched at a time
+#define FIND_OVERLAP      0x1000        // ...of which this many are searched again with the next
 
 #define EOL_LF      0
 #define EOL_CRLF    1
@@ -49,23 +72,67 @@ class QeOpenThread : public QThread
 
 public:
     QeOpenThread();
+    ~QeOpenThread();
     void    setFile( QFile *file, QTextCodec *codec, QString fileName );
-    QString getText();
+    void    setDocumentDefaults( const QFont &font, const QTextOption &option );
+    void    setEncodingDetector( const QeEncodingDetector *detector );
+    void    setReloadText( const QString &text );
+    bool    isReload() const;
+    QTextDocument *takeDocument();
+    QList<QeTextChange> takeChanges();
+    bool    hasByteOrderMark() const;
+    QTextCodec *codec() const;
+    QeCompression::Format compression() const;
+    qint64  bytesRead() const;
+    int     lineEnds() const;
+    bool    hasMixedLineEnds() const;
     void    cancel();
 
+    static void convertLineEnds( QString &text, bool &pendingCR, qint64 *lineFeeds = NULL, qint64 *crlfs = NULL );
+
     QString inputFileName;
 
 signals:
     void updateProgress( int percentage );
+    void previewAvailable( const QString &text );
+    void encodingDetected( const QString &encoding, int confidence );
 
 protected:
     void run();
 
 private:
+    void        detectEncoding();
+    QByteArray  readDecompressed( int maxLength );
+    bool        readCompressed( qint64 total );
+    bool        readParallel( qint64 total );
+    void        takeDecoded( QeDecodePipeline &pipeline );
+    bool        readMapped( qint64 total );
+    void        readStreamed( qint64 offset, qint64 total );
+    void        decodeBytes( const char *bytes, int length );
+    void        appendText( const QString &text );
     void        setProgress( qint64 progress, qint64 total );
-    QString     fullText;
     QFile      *inputFile;
     QTextCodec *inputEncoding;
+    const QeEncodingDetector *inputDetector;  // if set, used to pick the encoding
+    QTextCodec::ConverterState *inputState;
+    QeUnicodeConverter unicodeDecoder;     // used instead of the codec for UTF-8/16
+    bool        inputHasBOM;
+    QeCompression::Format inputCompression;
+    qint64      inputRead;      // bytes of the file (decompressed) decoded so far
+    QTextDocument *document;
+    QTextCursor documentCursor;
+    int         lineLength;     // length of the document's last segment
+    bool        reloading;      // comparing with reloadBase instead of building a document
+    QString     reloadBase;
+    QString     reloadText;
+    QList<QeTextChange> reloadChanges;
+    QFont       documentFont;
+    QTextOption documentOption;
+    bool        headerChecked;
+    bool        pendingCR;
+    qint64      lineFeeds;      // line ends found so far
+    qint64      crlfLineEnds;   // ...and how many of them were CR+LF
+    bool        previewSent;
 
     bool        stop;
 };
@@ -81,10 +148,29 @@ class QeSaveThread : public QThread
     Q_OBJECT
 
 public:
+    enum SyncPolicy {
+        SyncNever = 0,      // leave writing the data out to the OS
+        SyncData,           // flush the file contents before replacing the old file
+        SyncFull            // ...plus its metadata, and the directory entry afterwards
+    };
+
     QeSaveThread();
     void    setFile( QFile *file, QTextCodec *codec, QString fileName, bool bExisting );
+    void    setReplaceTarget( const QString &target );
+    void    setSyncPolicy( SyncPolicy policy );
+    void    setLineEnds( int eol );
+    void    setTail( int position, int line, int fileLines, bool safeFallback );
+    qint64  tailOffset() const;
     void    setText( const QString &text );
+    void    setText( const QString &text, const QVector<int> &breaks );
+    void    setByteOrderMark( bool bWrite );
+    void    setCompression( QeCompression::Format format );
+    QeCompression::Format compression() const;
     void    cancel();
+    qint64  invalidCount() const;
+    QVector<qint64> invalidPositions() const;
+
+    static QFile *createTempFile( const QString &fileName, QString *target );
 
     QString outputFileName;
 
@@ -96,13 +182,179 @@ protected:
     void run();
 
 private:
+    qint64      writeEncoded();
+    qint64      writeUnicode( QeUnicodeConverter::Format format );
+    qint64      writeSingleByte( const QeOS2Codec *codec );
+    bool        writeOutput( const QByteArray &bytes );
     void        setProgress( qint64 progress, qint64 total );
+    void        joinSegments();
+    qint64      findTail( bool bCRLF );
+    QByteArray  encodeText( int start, int length, bool bCRLF ) const;
     QString     fullText;
+    QVector<int> textBreaks;        // segment breaks still in fullText
     QFile      *outputFile;
     QTextCodec *outputEncoding;
+    QString     replaceTarget;      // file the output replaces when done, if any
+    SyncPolicy  syncPolicy;
+    int         outputLineEnds;     // EOL_LF or EOL_CRLF
+    int         tailPosition;       // document position of the first line to write,
+    int         tailLine;           // its line number, or 0 to write the whole text
+    int         tailFileLines;      // lines in the existing file
+    bool        tailSafeFallback;   // write a new file if the tail can't be found
+    int         textStart;          // where in fullText writing starts
+    qint64      rewriteOffset;      // ...and in the file
 
     bool        stop;
     bool        bExists;
+    bool        bWriteBOM;
+    QeCompression::Format outputCompression;
+    QeCompressor *compressor;       // while saving, if compressing
+    QByteArray  compressed;         // compressor output waiting to be written
+    qint64      fileBytes;          // bytes actually written to the file
+    qint64      invalidChars;
+    QVector<qint64> invalidOffsets;     // the first SAVE_MAX_INVALID only
+};
+
+
+
+// ============================================================================
+// QeIndexThread
+//
+// Builds a sparse index of line positions in a file, for the large-file
+// viewer: the byte offset of every INDEX_INTERVAL'th line.  The file is read
+// sequentially a block at a time, so memory use depends only on the number of
+// lines (8 bytes per INDEX_INTERVAL of them).  The index can be collected
+// while it is still being built.
+//
+
+class QeIndexThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    QeIndexThread();
+    void    setFile( const QString &fileName, qint64 start, int unitSize, bool bigEndian );
+    qint64  readIndex( QVector<qint64> &index, bool *complete ) const;
+    int     progress() const;
+    void    cancel();
+
+    static int findNewline( const char *data, int length, int unitSize, bool bigEndian );
+
+signals:
+    void indexUpdated();
+
+protected:
+    void run();
+
+private:
+    QString     indexFileName;
+    qint64      startOffset;        // where the first line starts (after any BOM)
+    int         newlineSize;        // 1, or 2 for UTF-16
+    bool        newlineBigEndian;
+
+    mutable QMutex  mutex;          // protects the following
+    QVector<qint64> entries;
+    qint64      lines;
+    qint64      scanned;
+    qint64      total;
+    bool        done;
+
+    bool        stop;
+};
+
+
+
+// ============================================================================
+// QeFindThread
+//
+// Searches a file in the large-file viewer for the next (or previous) match
+// for a regular expression, so that the GUI stays responsive and the search
+// can be cancelled.  The file is read a line at a time, and lines of any
+// length are searched in windows of FIND_WINDOW_SIZE characters which overlap
+// by FIND_OVERLAP; so a match longer than that may be cut short at the end of
+// a window, but none are missed because a line is too long.  Matches never
+// span lines.
+//
+
+class QeFindThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    QeFindThread();
+    void    setFile( const QString &fileName, QTextCodec *codec, int unitSize, bool bigEndian );
+    void    setSearch( int id, const QRegExp &pattern, bool backwards, qint64 line, qint64 offset, int column, const QVector<qint64> &index );
+    bool    result( qint64 *line, qint64 *offset, int *start, int *length ) const;
+    void    cancel();
+
+signals:
+    void searchProgress( int percentage );
+    void searchDone( int id );
+
+protected:
+    void run();
+
+private:
+    qint64  searchLine( qint64 pos, int from, int before, bool last, int *start, int *length );
+    qint64  lineOffset( qint64 line );
+    qint64  skipLine( qint64 pos );
+    bool    loadBlock( qint64 pos );
+    QString decode( const char *data, int length, QTextCodec::ConverterState *state, bool lineEnd );
+
+    QString     findFileName;
+    QTextCodec *findCodec;
+    int         newlineSize;        // 1, or 2 for UTF-16
+    bool        newlineBigEndian;
+
+    int         searchId;           // passed back with searchDone()
+    QRegExp     findPattern;
+    QByteArray  needle;             // the encoded pattern, if it can be looked for as bytes
+    bool        findBackwards;
+    qint64      startLine;
+    qint64      startOffset;        // only needed going forwards
+    int         startColumn;        // where a match may start (or going back, must start before)
+    QVector<qint64> lineIndex;      // the viewer's index, as far as it goes
+
+    QFile       file;
+    QByteArray  block;              // the last block read from the file
+    qint64      blockStart;
+    QeUnicodeConverter unicodeDecoder;     // used instead of the codec for UTF-8/16
+
+    mutable QMutex  mutex;          // protects the following
+    bool        found;
+    qint64      foundLine;
+    qint64      foundOffset;
+    int         foundStart;
+    int         foundLength;
+
+    bool        stop;
+};
+
+
+
+// ============================================================================
+// QeFileCheckThread
+//
+// Finds out which of a list of files no longer exist.  QFile::exists() can
+// take a long time (e.g. on an unresponsive network drive), so this keeps it
+// off the GUI thread.
+//
+
+class QeFileCheckThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    QeFileCheckThread( const QStringList &files );
+
+signals:
+    void filesMissing( const QStringList &files );
+
+protected:
+    void run();
+
+private:
+    QStringList fileNames;
 };
 
 
@@ -0,0 +1,184 @@
+/******************************************************************************
+** QE - mkos2tables.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+// Generates os2codectables.h from the codepage data in os2codecdata.h.
+//
+// Usage:  mkos2tables > ../os2codectables.h
+//
+// For each codepage this writes:
+//
+//  - A forward table of 256 Unicode values, one per byte value.  (32-bit
+//    entries, so that the AVX2 decoder can gather them directly.)
+//
+//  - A two-level reverse map: a 256-entry page index, selected by the high
+//    byte of the Unicode value, giving the number of a 256-byte page which is
+//    indexed by the low byte.  Pages are shared between codepages wherever
+//    their contents are the same, and page 0 (all zeros) stands in for every
+//    page with no mappings at all.  A zero byte in a page means the character
+//    can't be encoded.
+//
+// The reverse map has exactly the same contents as the one QeOS2Codec used
+// to build at run time (including the quirks, such as U+0000 not being
+// encodable).
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "../os2codecdata.h"
+
+#define NUM_CODECS  ( sizeof( unicodevalues ) / sizeof( unicodevalues[ 0 ] ))
+
+
+struct Page {
+    unsigned char bytes[ 256 ];
+};
+
+
+// ----------------------------------------------------------------------------
+// Build the complete (flat) reverse map for one codepage.
+//
+static void buildReverseMap( int codec, unsigned char *map )
+{
+    const unsigned short *values = unicodevalues[ codec ].values;
+    int i;
+
+    // Characters beyond the highest one in use (other than U+FFFD and up)
+    // were never mapped
+    int m = 0;
+    for ( i = 0; i < 161; i++ ) {
+        if (( values[ i ] > m ) && ( values[ i ] < 0xFFFD ))
+            m = values[ i ];
+    }
+    m++;
+
+    memset( map, 0, 0x10000 );
+    for ( i = 32; ( i < 127 ) && ( i < m ); i++ )
+        map[ i ] = (unsigned char) i;
+    for ( i = 127; i < 256; i++ ) {
+        if ( values[ i - 127 ] < m )
+            map[ values[ i - 127 ]] = (unsigned char) i;
+    }
+    for ( i = 0; i < 32; i++ ) {
+        if ( values[ i + 129 ] < m )
+            map[ values[ i + 129 ]] = (unsigned char) i;
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Return the number of the given page in the pool, adding it if it's new.
+//
+static int findPage( std::vector<Page> &pool, const unsigned char *bytes )
+{
+    for ( size_t i = 0; i < pool.size(); i++ ) {
+        if ( !memcmp( pool[ i ].bytes, bytes, 256 ))
+            return (int) i;
+    }
+    Page page;
+    memcpy( page.bytes, bytes, 256 );
+    pool.push_back( page );
+    return (int)( pool.size() - 1 );
+}
+
+
+static void printRow( const char *format, const void *data, int size, int count )
+{
+    printf("    ");
+    for ( int i = 0; i < count; i++ ) {
+        unsigned int value = ( size == 4 ) ? ((const unsigned int *) data )[ i ] :
+                                             ((const unsigned char *) data )[ i ];
+        printf( format, value );
+        printf( i < count - 1 ? ", " : ",\n");
+    }
+}
+
+
+int main()
+{
+    static unsigned char map[ 0x10000 ];
+    unsigned char index[ NUM_CODECS ][ 256 ];
+    unsigned int  forward[ NUM_CODECS ][ 256 ];
+    std::vector<Page> pool;
+    size_t codec;
+    int i;
+
+    // The empty page always comes first
+    memset( map, 0, 256 );
+    findPage( pool, map );
+
+    for ( codec = 0; codec < NUM_CODECS; codec++ ) {
+        const unsigned short *values = unicodevalues[ codec ].values;
+        for ( i = 0; i < 256; i++ ) {
+            if ( i > 126 )
+                forward[ codec ][ i ] = values[ i - 127 ];
+            else if ( i < 32 )
+                forward[ codec ][ i ] = values[ i + 129 ];
+            else
+                forward[ codec ][ i ] = i;
+        }
+
+        buildReverseMap( codec, map );
+        for ( i = 0; i < 256; i++ ) {
+            int page = findPage( pool, map + ( i << 8 ));
+            if ( page > 255 ) {
+                fprintf( stderr, "Too many distinct pages\n");
+                return 1;
+            }
+            index[ codec ][ i ] = (unsigned char) page;
+        }
+    }
+
+    printf("// Generated by tools/mkos2tables from os2codecdata.h - do not edit.\n");
+    printf("\n#ifndef QE_OS2CODECTABLES_H\n#define QE_OS2CODECTABLES_H\n\n");
+    printf("#define OS2_CODEC_TABLES   %d\n", (int) NUM_CODECS );
+    printf("#define OS2_REVERSE_PAGES  %d\n\n", (int) pool.size() );
+
+    printf("static const unsigned int os2ForwardTables[ OS2_CODEC_TABLES ][ 256 ] = {\n");
+    for ( codec = 0; codec < NUM_CODECS; codec++ ) {
+        printf("  { // %s\n", unicodevalues[ codec ].mime );
+        for ( i = 0; i < 256; i += 8 )
+            printRow("0x%04X", forward[ codec ] + i, 4, 8 );
+        printf("  },\n");
+    }
+    printf("};\n\n");
+
+    printf("static const unsigned char os2ReverseIndex[ OS2_CODEC_TABLES ][ 256 ] = {\n");
+    for ( codec = 0; codec < NUM_CODECS; codec++ ) {
+        printf("  { // %s\n", unicodevalues[ codec ].mime );
+        for ( i = 0; i < 256; i += 16 )
+            printRow("%3u", index[ codec ] + i, 1, 16 );
+        printf("  },\n");
+    }
+    printf("};\n\n");
+
+    printf("static const unsigned char os2ReversePages[ OS2_REVERSE_PAGES ][ 256 ] = {\n");
+    for ( size_t page = 0; page < pool.size(); page++ ) {
+        printf("  { // %d\n", (int) page );
+        for ( i = 0; i < 256; i += 16 )
+            printRow("0x%02X", pool[ page ].bytes + i, 1, 16 );
+        printf("  },\n");
+    }
+    printf("};\n\n");
+
+    printf("#endif      // QE_OS2CODECTABLES_H\n");
+    return 0;
+}
@@ -0,0 +1,7 @@
+# Generator for os2codectables.h; not part of the normal build.
+# Run "mkos2tables > ../os2codectables.h" after changing os2codecdata.h.
+TEMPLATE = app
+TARGET = mkos2tables
+CONFIG += console
+CONFIG -= qt app_bundle
+SOURCES += mkos2tables.cpp
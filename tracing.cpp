@@ -0,0 +1,119 @@
+/******************************************************************************
+** QE - tracing.cpp
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#include <stdio.h>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QThread>
+#include "tracing.h"
+
+
+bool QeTrace::enabled = false;
+
+static FILE          *traceFile = NULL;
+static QMutex         traceMutex;
+static QElapsedTimer  traceClock;
+static QHash<Qt::HANDLE, int> traceThreads;   // small ids for the threads seen so far
+static qint64         tracePid  = 0;
+static const char    *traceSeparator = "";      // before the next event
+
+
+// ----------------------------------------------------------------------------
+// Start writing a trace to the given file (replacing it).
+//
+bool QeTrace::start( const QString &fileName )
+{
+    if ( enabled )
+        return true;
+    traceFile = fopen( QFile::encodeName( fileName ).constData(), "w");
+    if ( !traceFile ) {
+        qWarning("Could not create trace file %s", qPrintable( fileName ));
+        return false;
+    }
+    tracePid = QCoreApplication::applicationPid();
+    fputs("[", traceFile );
+    traceSeparator = "\n";
+    traceClock.start();
+    enabled = true;
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Stop tracing and close the file.  Any span still open is lost.
+//
+void QeTrace::finish()
+{
+    QMutexLocker lock( &traceMutex );
+    if ( !enabled )
+        return;
+    enabled = false;
+    fputs("\n]\n", traceFile );
+    fclose( traceFile );
+    traceFile = NULL;
+}
+
+
+// ----------------------------------------------------------------------------
+// Time since tracing started, in microseconds.
+//
+qint64 QeTrace::now()
+{
+    return traceClock.nsecsElapsed() / 1000;
+}
+
+
+// ----------------------------------------------------------------------------
+// Write one span.  The first event from each thread is preceded by one naming
+// the thread after its class (e.g. QeOpenThread).
+//
+void QeTrace::record( const char *name, qint64 start, const char *argName, qint64 argValue )
+{
+    qint64 end = now();
+    Qt::HANDLE handle = QThread::currentThreadId();
+
+    QMutexLocker lock( &traceMutex );
+    if ( !enabled )
+        return;
+
+    int tid = traceThreads.value( handle, 0 );
+    if ( !tid ) {
+        tid = traceThreads.size() + 1;
+        traceThreads.insert( handle, tid );
+        QThread *thread = QThread::currentThread();
+        const char *threadName = ( thread == QCoreApplication::instance()->thread() ) ?
+                                 "GUI" : thread->metaObject()->className();
+        fprintf( traceFile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lld,\"tid\":%d,"
+                            "\"args\":{\"name\":\"%s\"}}",
+                 traceSeparator, tracePid, tid, threadName );
+        traceSeparator = ",\n";
+    }
+    fprintf( traceFile, "%s{\"name\":\"%s\",\"cat\":\"qe\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                        "\"pid\":%lld,\"tid\":%d",
+             traceSeparator, name, start, end - start, tracePid, tid );
+    if ( argName )
+        fprintf( traceFile, ",\"args\":{\"%s\":%lld}", argName, argValue );
+    fputs("}", traceFile );
+    traceSeparator = ",\n";
+}
@@ -0,0 +1,84 @@
+/******************************************************************************
+** QE - tracing.h
+**
+**  Copyright (C) 2018 Alexander Taylor
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+******************************************************************************/
+
+
+#ifndef QE_TRACING_H
+#define QE_TRACING_H
+
+#include <QString>
+
+
+#define TRACE_ENV_VARIABLE  "QE_TRACE"      // names the trace file, if set
+#define TRACE_DEFAULT_FILE  "qe-trace.json"
+
+
+// ============================================================================
+// QeTrace
+//
+// Optional performance tracing.  When started (with the /trace switch or the
+// QE_TRACE environment variable), each QeTraceSpan records how long it took,
+// on which thread, and a count of whatever it processed.  The output is a
+// Chrome trace-event file ("complete" events in a JSON array), which can be
+// loaded into chrome://tracing or Perfetto as is.
+//
+// Events are written as they finish, and the viewers don't need the closing
+// bracket, so a trace is mostly readable even if QE never gets to finish().
+//
+
+class QeTrace
+{
+public:
+    static bool start( const QString &fileName );
+    static void finish();
+    static bool isEnabled() { return enabled; }
+
+    static qint64 now();
+    static void record( const char *name, qint64 start, const char *argName, qint64 argValue );
+
+private:
+    static bool enabled;
+};
+
+
+// ============================================================================
+// QeTraceSpan
+//
+// Records the time from its creation to its destruction, if tracing is on.
+// Otherwise it costs a test of one flag.
+//
+
+class QeTraceSpan
+{
+public:
+    QeTraceSpan( const char *spanName )
+        : name( spanName ), argName( 0 ), argValue( 0 ),
+          start( QeTrace::isEnabled() ? QeTrace::now() : -1 ) {}
+    ~QeTraceSpan() { if ( start >= 0 ) QeTrace::record( name, start, argName, argValue ); }
+
+    void setCount( const char *countName, qint64 count ) { argName = countName; argValue = count; }
+
+private:
+    const char *name;
+    const char *argName;
+    qint64      argValue;
+    qint64      start;          // microseconds, or -1 if not tracing
+};
+
+#endif      // QE_TRACING_H